@@ -0,0 +1,849 @@
+/**
+ * @file bench.cpp
+ * @brief FTagMgrLib benchmark utility source code
+ *
+ * Builds a synthetic database of N directories with M files each and K tags,
+ * tags every file with a few tags drawn from a Zipf distribution and times
+ * the library on it. Every result gets ops/s and p50/p99 latency, printed as
+ * a table and written as JSON so runs can be compared.
+ *
+ * Usage: bench [--dirs N] [--files M] [--tags K] [--tags-per-file T]
+ *              [--zipf S] [--calls C] [--seed X] [--search-tags S]
+ *              [--hierarchy-tags H] [--out FILE]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <random>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "ftagmgrlib.h"
+#include "ftagmgrasync.h"
+#include "ftagmgrbitmap.h"
+#include "ftagmgrexport.h"
+#include "ftagmgrhash.h"
+#include "ftagmgrcache.h"
+#include "ftagmgrcooccur.h"
+#include "ftagmgrindexer.h"
+#include "ftagmgrmetrics.h"
+#include "ftagmgrpool.h"
+#include "ftagmgrquery.h"
+#include "ftagmgrsearch.h"
+#include "ftagmgrsnapshot.h"
+#include "ftagmgrxattr.h"
+
+/**
+ * @brief Benchmark settings, set from the command line
+ */
+struct Config {
+    int dirs = 100;
+    int files = 1000;
+    int tags = 1000;
+    int tagsPerFile = 4;
+    double zipf = 1.0;
+    int calls = 20000;
+    unsigned int seed = 1;
+    // Extra tag names for the search benchmarks, word-like so trigrams spread
+    int searchTags = 1000000;
+    // Tags of the hierarchy benchmarks, six children per tag level by level
+    int hierarchyTags = 300000;
+    std::string out = "bench.json";
+};
+
+/**
+ * @brief Timings of one benchmark
+ */
+struct Result {
+    std::string group;
+    std::string name;
+    size_t threads;
+    size_t calls;
+    // Operations per call, more than 1 for batches
+    size_t items;
+    double seconds;
+    double p50Us;
+    double p99Us;
+};
+
+/**
+ * @brief Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s
+ */
+class Zipf {
+public:
+    Zipf(int n, double s) : cdf(n) {
+        double sum = 0;
+        for (int i = 0; i < n; i++) cdf[i] = sum += 1.0 / std::pow(i + 1, s);
+        for (double& value : cdf) value /= sum;
+    }
+
+    template<typename R>
+    int operator()(R& rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return (int)std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    }
+
+private:
+    std::vector<double> cdf;
+};
+
+/**
+ * @brief Runs and records the benchmarks
+ */
+class Suite {
+public:
+    /**
+     * @brief Time a function call by call
+     * @param group Benchmark group, e.g. lookup or import
+     * @param name Benchmark name
+     * @param calls How many times to call the function
+     * @param items Operations done by one call
+     * @param fn The function to time, gets the call index
+     */
+    template<typename F>
+    void measure(const char* group, const std::string& name, int calls, size_t items, F fn) {
+        std::vector<double> latencies(calls);
+        auto start = std::chrono::steady_clock::now();
+        auto last = start;
+        for (int i = 0; i < calls; i++) {
+            fn(i);
+            auto now = std::chrono::steady_clock::now();
+            latencies[i] = std::chrono::duration<double, std::micro>(now - last).count();
+            last = now;
+        }
+        add(group, name, 1, items, std::chrono::duration<double>(last - start).count(), latencies);
+    }
+
+    /**
+     * @brief Record a benchmark timed by the caller
+     * @param group Benchmark group
+     * @param name Benchmark name
+     * @param threads Threads the calls were spread over
+     * @param items Operations done by one call
+     * @param seconds Wall time of the whole run
+     * @param latencies Latency of every call in microseconds, from all threads
+     */
+    void add(const char* group, const std::string& name, int threads, size_t items, double seconds, std::vector<double>& latencies) {
+        std::sort(latencies.begin(), latencies.end());
+        Result result{group, name, (size_t)threads, latencies.size(), items, seconds, percentile(latencies, 0.5), percentile(latencies, 0.99)};
+        std::printf("%-8s %-36s %8zu calls %12.0f ops/s   p50 %10.2f us   p99 %10.2f us\n", group, name.c_str(),
+                    result.calls, result.calls * result.items / seconds, result.p50Us, result.p99Us);
+        std::fflush(stdout);
+        results.push_back(std::move(result));
+    }
+
+    /**
+     * @brief Write every result as JSON
+     * @param config The settings the results were measured with
+     * @retval true File written
+     * @retval false File couldn't be written
+     */
+    bool writeJson(const Config& config) const {
+        FILE* file = std::fopen(config.out.c_str(), "w");
+        if (!file) return false;
+        std::fprintf(file, "{\n  \"config\": {\"dirs\": %d, \"files\": %d, \"tags\": %d, \"tagsPerFile\": %d, \"zipf\": %g, \"calls\": %d, \"seed\": %u, \"searchTags\": %d, \"hierarchyTags\": %d},\n",
+                     config.dirs, config.files, config.tags, config.tagsPerFile, config.zipf, config.calls, config.seed, config.searchTags, config.hierarchyTags);
+        std::fprintf(file, "  \"results\": [\n");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            std::fprintf(file, "    {\"group\": \"%s\", \"name\": \"%s\", \"threads\": %zu, \"calls\": %zu, \"items\": %zu, \"seconds\": %.6f, "
+                               "\"opsPerSec\": %.1f, \"p50Us\": %.3f, \"p99Us\": %.3f}%s\n",
+                         r.group.c_str(), r.name.c_str(), r.threads, r.calls, r.items, r.seconds,
+                         r.calls * r.items / r.seconds, r.p50Us, r.p99Us, i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        return std::fclose(file) == 0;
+    }
+
+private:
+    static double percentile(const std::vector<double>& sorted, double p) {
+        if (sorted.empty()) return 0;
+        return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    }
+
+    std::vector<Result> results;
+};
+
+/**
+ * @brief Read the settings from the command line
+ * @param argc Argument count
+ * @param argv Arguments
+ * @param config Pointer to the return Config
+ * @retval true Settings read
+ * @retval false Unknown or incomplete option
+ */
+bool parseArgs(int argc, char** argv, Config* config) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) return false;
+        const char* option = argv[i];
+        const char* value = argv[++i];
+        if (!std::strcmp(option, "--dirs")) config->dirs = std::atoi(value);
+        else if (!std::strcmp(option, "--files")) config->files = std::atoi(value);
+        else if (!std::strcmp(option, "--tags")) config->tags = std::atoi(value);
+        else if (!std::strcmp(option, "--tags-per-file")) config->tagsPerFile = std::atoi(value);
+        else if (!std::strcmp(option, "--zipf")) config->zipf = std::atof(value);
+        else if (!std::strcmp(option, "--calls")) config->calls = std::atoi(value);
+        else if (!std::strcmp(option, "--seed")) config->seed = (unsigned int)std::atoi(value);
+        else if (!std::strcmp(option, "--search-tags")) config->searchTags = std::atoi(value);
+        else if (!std::strcmp(option, "--hierarchy-tags")) config->hierarchyTags = std::atoi(value);
+        else if (!std::strcmp(option, "--out")) config->out = value;
+        else return false;
+    }
+    return config->dirs > 0 && config->files > 0 && config->tags > 0 && config->calls > 0
+        && config->tagsPerFile > 0 && config->tagsPerFile <= config->tags && config->searchTags >= 0 && config->hierarchyTags >= 0;
+}
+
+/**
+ * @brief The main function
+ * @return int Exit code
+ */
+int main(int argc, char** argv) {
+    Config config;
+    if (!parseArgs(argc, argv, &config)) {
+        std::cout << "Usage: " << argv[0] << " [--dirs N] [--files M] [--tags K] [--tags-per-file T] [--zipf S] [--calls C] [--seed X] [--search-tags S] [--hierarchy-tags H] [--out FILE]" << std::endl;
+        return 1;
+    }
+    const char* path = "./bench.db";
+    std::remove(path);
+    std::remove("./bench.db-wal");
+    std::remove("./bench.db-shm");
+    ftagmgr::setDatabasePath(path);
+    ftagmgr::Database db(path);
+    if (!db.isOpen() || !db.createDatabase(nullptr)) {
+        std::cout << "Couldn't create benchmark database." << std::endl;
+        return 1;
+    }
+    Suite suite;
+    std::mt19937 rng(config.seed);
+    const int calls = config.calls;
+    // Opening a connection per call is slow, the free functions get fewer calls
+    const int freeCalls = std::max(1, calls / 20);
+
+    // Dataset
+    std::vector<std::string> dirs, files, tags;
+    // 32 directories per project, so deep paths share long prefixes
+    for (int i = 0; i < config.dirs; i++) dirs.push_back("/bench/projects/p" + std::to_string(i / 32) + "/src/d" + std::to_string(i));
+    for (int i = 0; i < config.files; i++) files.push_back("f" + std::to_string(i) + ".dat");
+    for (int i = 0; i < config.tags; i++) tags.push_back("t" + std::to_string(i));
+    const std::vector<std::string_view> fileViews(files.begin(), files.end());
+
+    // Import
+    std::vector<int> dirIds, tagIds, fileIds, ids;
+    suite.measure("import", "addDirs", 1, dirs.size(), [&](int) {
+        db.addDirs(std::vector<std::string_view>(dirs.begin(), dirs.end()), &dirIds, nullptr);
+    });
+    suite.measure("import", "addTags", 1, tags.size(), [&](int) {
+        db.addTags(std::vector<std::string_view>(tags.begin(), tags.end()), &tagIds, nullptr);
+    });
+    suite.measure("import", "addFiles", config.dirs, files.size(), [&](int i) {
+        db.addFiles(dirIds[i], fileViews, &ids, nullptr);
+        fileIds.insert(fileIds.end(), ids.begin(), ids.end());
+    });
+    Zipf zipf(config.tags, config.zipf);
+    std::vector<ftagmgr::FileTag> links;
+    std::vector<int> drawn;
+    for (int file : fileIds) {
+        drawn.clear();
+        while ((int)drawn.size() < config.tagsPerFile) {
+            int rank = zipf(rng);
+            if (std::find(drawn.begin(), drawn.end(), rank) == drawn.end()) drawn.push_back(rank);
+        }
+        for (int rank : drawn) links.push_back({(unsigned int)file, (unsigned int)tagIds[rank]});
+    }
+    const size_t linkBatch = 10000;
+    suite.measure("import", "tagFiles", (int)((links.size() + linkBatch - 1) / linkBatch), linkBatch, [&](int i) {
+        size_t begin = i * linkBatch;
+        db.tagFiles(std::vector<ftagmgr::FileTag>(links.begin() + begin, links.begin() + std::min(links.size(), begin + linkBatch)), nullptr);
+    });
+    ftagmgr::TagIndex index;
+    suite.measure("import", "TagIndex::build", 3, fileIds.size(), [&](int) { index.build(db, nullptr); });
+
+    // Random existing rows for the lookups
+    std::uniform_int_distribution<int> pickDir(0, config.dirs - 1), pickFile(0, config.files - 1), pickTag(0, config.tags - 1);
+    std::uniform_int_distribution<size_t> pickId(0, fileIds.size() - 1), pickLink(0, links.size() - 1);
+    std::vector<int> d(calls), f(calls), t(calls), id(calls);
+    std::vector<ftagmgr::FileTag> l(calls);
+    for (int i = 0; i < calls; i++) {
+        d[i] = pickDir(rng);
+        f[i] = pickFile(rng);
+        t[i] = pickTag(rng);
+        id[i] = fileIds[pickId(rng)];
+        l[i] = links[pickLink(rng)];
+    }
+    std::string str;
+    ftagmgr::IdCursor cursor;
+    int row = 0;
+
+    // Lookups through a session
+    suite.measure("lookup", "dirExists", calls, 1, [&](int i) { db.dirExists(dirs[d[i]].c_str(), nullptr); });
+    suite.measure("lookup", "getDir", calls, 1, [&](int i) { db.getDir(dirs[d[i]].c_str(), nullptr); });
+    suite.measure("lookup", "getDirPath", calls, 1, [&](int i) { db.getDirPath(dirIds[d[i]], &str, nullptr); });
+    suite.measure("lookup", "fileExists", calls, 1, [&](int i) { db.fileExists(dirIds[d[i]], files[f[i]].c_str(), nullptr); });
+    suite.measure("lookup", "getFile", calls, 1, [&](int i) { db.getFile(dirIds[d[i]], files[f[i]].c_str(), nullptr); });
+    suite.measure("lookup", "getFileName", calls, 1, [&](int i) { db.getFileName(id[i], &str, nullptr); });
+    suite.measure("lookup", "getFilePath", calls, 1, [&](int i) { db.getFilePath(id[i], &str, nullptr); });
+    suite.measure("lookup", "tagExists", calls, 1, [&](int i) { db.tagExists(tags[t[i]].c_str(), nullptr); });
+    suite.measure("lookup", "getTag", calls, 1, [&](int i) { db.getTag(tags[t[i]].c_str(), nullptr); });
+    suite.measure("lookup", "getTagValue", calls, 1, [&](int i) { db.getTagValue(tagIds[t[i]], &str, nullptr); });
+    suite.measure("lookup", "fileHasTag", calls, 1, [&](int i) { db.fileHasTag(l[i].file, l[i].tag, nullptr); });
+    suite.measure("lookup", "getTagFileCount", calls, 1, [&](int i) { db.getTagFileCount(tagIds[t[i]], nullptr); });
+    suite.measure("lookup", "listFileTags", calls, 1, [&](int i) {
+        if (db.listFileTags(id[i], &cursor, nullptr)) while (cursor.next(&row, nullptr) == 1) {}
+    });
+    suite.measure("lookup", "listDirFiles", std::max(1, calls / 100), 1, [&](int i) {
+        if (db.listDirFiles(dirIds[d[i]], &cursor, nullptr)) while (cursor.next(&row, nullptr) == 1) {}
+    });
+    // Tags from the uniform pick are mostly in the Zipf tail, so these listings stay short
+    suite.measure("lookup", "listTagFiles", calls, 1, [&](int i) {
+        if (db.listTagFiles(tagIds[t[i]], &cursor, nullptr)) while (cursor.next(&row, nullptr) == 1) {}
+    });
+    cursor.close();
+
+    // The same lookups with metrics attached, the plain ones above are the cost with them off
+    {
+        ftagmgr::Metrics metrics;
+        db.setMetrics(&metrics);
+        suite.measure("metrics", "getFile (metrics on)", calls, 1, [&](int i) { db.getFile(dirIds[d[i]], files[f[i]].c_str(), nullptr); });
+        suite.measure("metrics", "getTag (metrics on)", calls, 1, [&](int i) { db.getTag(tags[t[i]].c_str(), nullptr); });
+        suite.measure("metrics", "listFileTags (metrics on)", calls, 1, [&](int i) {
+            if (db.listFileTags(id[i], &cursor, nullptr)) while (cursor.next(&row, nullptr) == 1) {}
+        });
+        db.setMetrics(nullptr);
+        ftagmgr::MetricsSnapshot snapshot;
+        std::string text;
+        suite.measure("metrics", "snapshot + formatPrometheus", 100, 1, [&](int) {
+            metrics.snapshot(&snapshot);
+            ftagmgr::formatPrometheus(snapshot, &text);
+        });
+        std::cout << "Metrics: " << snapshot.statements.size() << " statements, " << text.size() << " bytes of Prometheus text" << std::endl;
+    }
+
+    // Names of whole directories kept by the caller, as strings or as views into an arena
+    std::vector<std::string> kept;
+    std::vector<std::string_view> views;
+    std::pmr::monotonic_buffer_resource arena;
+    ftagmgr::NameCursor names;
+    std::string_view name;
+    suite.measure("names", "listDirFiles + getFileName", std::max(1, calls / 100), 1, [&](int i) {
+        kept.clear();
+        if (db.listDirFiles(dirIds[d[i]], &cursor, nullptr)) {
+            while (cursor.next(&row, nullptr) == 1) {
+                db.getFileName(row, &str, nullptr);
+                kept.push_back(str);
+            }
+        }
+    });
+    suite.measure("names", "listDirFileNames + arena", std::max(1, calls / 100), 1, [&](int i) {
+        views.clear();
+        arena.release();
+        if (db.listDirFileNames(dirIds[d[i]], &names, nullptr)) {
+            while (names.next(&row, &name, nullptr) == 1) {
+                char* copy = (char*)arena.allocate(name.size(), 1);
+                std::memcpy(copy, name.data(), name.size());
+                views.emplace_back(copy, name.size());
+            }
+        }
+    });
+    suite.measure("names", "getFileName", calls, 1, [&](int i) { db.getFileName(id[i], &str, nullptr); });
+    suite.measure("names", "getFileName (arena)", calls, 1, [&](int i) {
+        if (i % 1000 == 0) arena.release();
+        db.getFileName(id[i], &arena, &name, nullptr);
+    });
+    suite.measure("names", "getFilePath (arena)", calls, 1, [&](int i) {
+        if (i % 1000 == 0) arena.release();
+        db.getFilePath(id[i], &arena, &name, nullptr);
+    });
+    arena.release();
+
+    // The same name lookups with a cache attached, warmed by the first round
+    ftagmgr::NameCache cache;
+    db.setCache(&cache);
+    suite.measure("cached", "dirExists", calls, 1, [&](int i) { db.dirExists(dirs[d[i]].c_str(), nullptr); });
+    suite.measure("cached", "getDir", calls, 1, [&](int i) { db.getDir(dirs[d[i]].c_str(), nullptr); });
+    suite.measure("cached", "getDirPath", calls, 1, [&](int i) { db.getDirPath(dirIds[d[i]], &str, nullptr); });
+    suite.measure("cached", "tagExists", calls, 1, [&](int i) { db.tagExists(tags[t[i]].c_str(), nullptr); });
+    suite.measure("cached", "getTag", calls, 1, [&](int i) { db.getTag(tags[t[i]].c_str(), nullptr); });
+    suite.measure("cached", "getTagValue", calls, 1, [&](int i) { db.getTagValue(tagIds[t[i]], &str, nullptr); });
+    db.setCache(nullptr);
+    ftagmgr::NameCache::Stats cacheStats = cache.stats();
+    std::cout << "Name cache: " << cacheStats.hits << " hits, " << cacheStats.misses << " misses, "
+              << cacheStats.entries << " entries in " << cacheStats.bytes << " bytes" << std::endl;
+
+    // Lookups through the free functions, each opening its own connection
+    suite.measure("free", "dirExists", freeCalls, 1, [&](int i) { ftagmgr::dirExists(dirs[d[i]].c_str(), nullptr); });
+    suite.measure("free", "getDir", freeCalls, 1, [&](int i) { ftagmgr::getDir(dirs[d[i]].c_str(), nullptr); });
+    suite.measure("free", "getDirPath", freeCalls, 1, [&](int i) { ftagmgr::getDirPath(dirIds[d[i]], &str, nullptr); });
+    suite.measure("free", "fileExists", freeCalls, 1, [&](int i) { ftagmgr::fileExists(dirIds[d[i]], files[f[i]].c_str(), nullptr); });
+    suite.measure("free", "getFile", freeCalls, 1, [&](int i) { ftagmgr::getFile(dirIds[d[i]], files[f[i]].c_str(), nullptr); });
+    suite.measure("free", "getFileName", freeCalls, 1, [&](int i) { ftagmgr::getFileName(id[i], &str, nullptr); });
+    suite.measure("free", "tagExists", freeCalls, 1, [&](int i) { ftagmgr::tagExists(tags[t[i]].c_str(), nullptr); });
+    suite.measure("free", "getTag", freeCalls, 1, [&](int i) { ftagmgr::getTag(tags[t[i]].c_str(), nullptr); });
+    suite.measure("free", "getTagValue", freeCalls, 1, [&](int i) { ftagmgr::getTagValue(tagIds[t[i]], &str, nullptr); });
+
+    // Single writes in autocommit mode, so every call is a transaction
+    const int writes = std::max(1, calls / 20);
+    std::vector<std::string> newDirs, newFiles, newTags;
+    for (int i = 0; i < writes; i++) {
+        newDirs.push_back("/bench/new" + std::to_string(i));
+        newFiles.push_back("new" + std::to_string(i) + ".dat");
+        newTags.push_back("new" + std::to_string(i));
+    }
+    suite.measure("write", "addDir", writes, 1, [&](int i) { db.addDir(newDirs[i].c_str(), nullptr); });
+    suite.measure("write", "addFile", writes, 1, [&](int i) { db.addFile(dirIds[0], newFiles[i].c_str(), nullptr); });
+    suite.measure("write", "addTag", writes, 1, [&](int i) { db.addTag(newTags[i].c_str(), nullptr); });
+    suite.measure("write", "untagFile", writes, 1, [&](int i) { db.untagFile(l[i].file, l[i].tag, nullptr); });
+    suite.measure("write", "tagFile", writes, 1, [&](int i) { db.tagFile(l[i].file, l[i].tag, nullptr); });
+    suite.measure("write", "moveFile", writes, 1, [&](int i) {
+        db.moveFile(id[i], dirIds[0], ("moved" + std::to_string(i)).c_str(), nullptr);
+    });
+    std::vector<int> newFileIds;
+    db.addFiles(dirIds[0], std::vector<std::string_view>(newFiles.begin(), newFiles.end()), &newFileIds, nullptr);
+    suite.measure("write", "removeFile", writes, 1, [&](int i) { db.removeFile(newFileIds[i], nullptr); });
+    suite.measure("write", "moveDir", writes, 1, [&](int i) {
+        db.moveDir(db.getDir(newDirs[i].c_str(), nullptr), ("/bench/renamed" + std::to_string(i)).c_str(), nullptr);
+    });
+    suite.measure("write", "untagFiles", 1, writes, [&](int) {
+        db.untagFiles(std::vector<ftagmgr::FileTag>(l.begin(), l.begin() + writes), nullptr);
+    });
+
+    // Queries over the most common tags, which have the longest postings
+    index.build(db, nullptr);
+    const char* queries[] = {"t0 t1", "t0 !t1", "t0 t1 t2 t3 !t4", "t10 | t100 | t500", "t0 t500", "!t0"};
+    for (const char* query : queries) {
+        for (bool useIndex : {false, true}) {
+            suite.measure(useIndex ? "bitmap" : "query", query, 20, 1, [&](int) {
+                ftagmgr::QueryResult result;
+                if (useIndex) ftagmgr::runQuery(db, index, query, &result, nullptr);
+                else ftagmgr::runQuery(db, query, &result, nullptr);
+                while (result.next(&row, nullptr) == 1) {}
+            });
+        }
+    }
+
+    // Tag suggestions for the tags a random file has, and the planner ordering intersections by pair counts
+    {
+        ftagmgr::TagCooccurrence cooccurrence;
+        suite.measure("cooccur", "TagCooccurrence::build", 3, links.size(), [&](int) { cooccurrence.build(db, nullptr); });
+        std::vector<ftagmgr::TagSuggestion> suggestions;
+        for (int given = 1; given <= 3; given++) {
+            suite.measure("cooccur", "suggest 10 for " + std::to_string(given) + " tag" + (given > 1 ? "s" : ""), calls, 1, [&](int i) {
+                size_t first = (size_t)(id[i] - fileIds.front()) * config.tagsPerFile;
+                std::vector<unsigned int> partial;
+                for (int j = 0; j < std::min(given, config.tagsPerFile); j++) partial.push_back(links[first + j].tag);
+                cooccurrence.suggest(partial, 10, &suggestions);
+            });
+        }
+        // The observer's share of tagging, the link is taken back right away
+        suite.measure("cooccur", "tagged + untagged", calls, 2, [&](int i) {
+            cooccurrence.tagged(l[i].file, tagIds[t[i]]);
+            cooccurrence.untagged(l[i].file, tagIds[t[i]]);
+        });
+        db.setCooccurrence(&cooccurrence);
+        for (const char* query : {"t0 t1 t2 t3 !t4", "t0 t500"}) {
+            suite.measure("cooccur", std::string(query) + " (pair estimates)", 20, 1, [&](int) {
+                ftagmgr::QueryResult result;
+                ftagmgr::runQuery(db, query, &result, nullptr);
+                while (result.next(&row, nullptr) == 1) {}
+            });
+        }
+        db.setCooccurrence(nullptr);
+        std::cout << "Co-occurrence statistics: " << cooccurrence.memoryUsage() << " bytes" << std::endl;
+    }
+
+    // Recursive queries, everything under one project
+    const int projects = (config.dirs + 31) / 32;
+    suite.measure("tree", "listSubtreeFiles", std::max(1, calls / 100), 1, [&](int i) {
+        int project = db.findDir(("/bench/projects/p" + std::to_string(i % projects)).c_str(), nullptr);
+        if (db.listSubtreeFiles(project, &cursor, nullptr)) while (cursor.next(&row, nullptr) == 1) {}
+    });
+    cursor.close();
+    for (bool useIndex : {false, true}) {
+        suite.measure("tree", useIndex ? "@project t0 (bitmap)" : "@project t0", std::max(1, calls / 100), 1, [&](int i) {
+            std::string query = "@/bench/projects/p" + std::to_string(i % projects) + " t0";
+            ftagmgr::QueryResult result;
+            if (useIndex) ftagmgr::runQuery(db, index, query.c_str(), &result, nullptr);
+            else ftagmgr::runQuery(db, query.c_str(), &result, nullptr);
+            while (result.next(&row, nullptr) == 1) {}
+        });
+    }
+
+    // Read QPS of a connection pool by thread count, with the writer committing all along
+    ftagmgr::ConnectionPool pool;
+    const unsigned int maxThreads = std::max(8u, std::thread::hardware_concurrency());
+    if (pool.open(path, maxThreads, ftagmgr::Tunables(), nullptr)) {
+        for (unsigned int threads = 1; threads <= maxThreads; threads *= 2) {
+            std::atomic<bool> reading(true);
+            std::thread writer([&]() {
+                ftagmgr::ConnectionPool::Lease session = pool.writer();
+                for (int i = 0; reading; i = (i + 1) % calls) {
+                    session->untagFile(l[i].file, l[i].tag, nullptr);
+                    session->tagFile(l[i].file, l[i].tag, nullptr);
+                }
+            });
+            std::vector<std::vector<double>> perThread(threads);
+            std::vector<std::thread> readers;
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned int r = 0; r < threads; r++) {
+                readers.emplace_back([&, r]() {
+                    ftagmgr::ConnectionPool::Lease session = pool.reader();
+                    std::vector<double>& latencies = perThread[r];
+                    latencies.reserve(calls);
+                    auto last = std::chrono::steady_clock::now();
+                    for (int i = 0; i < calls; i++) {
+                        int k = (i + (int)r * 7919) % calls;
+                        session->getFile(dirIds[d[k]], files[f[k]].c_str(), nullptr);
+                        auto now = std::chrono::steady_clock::now();
+                        latencies.push_back(std::chrono::duration<double, std::micro>(now - last).count());
+                        last = now;
+                    }
+                });
+            }
+            for (std::thread& reader : readers) reader.join();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            reading = false;
+            writer.join();
+            std::vector<double> latencies;
+            for (const std::vector<double>& part : perThread) latencies.insert(latencies.end(), part.begin(), part.end());
+            suite.add("pool", "getFile x" + std::to_string(threads) + " threads", (int)threads, 1, seconds, latencies);
+        }
+        pool.close();
+    }
+
+    // Four threads adding tags, each call its own transaction on a shared session, then through the async writer
+    for (int synchronous : {1, 2}) {
+        ftagmgr::Tunables tunables;
+        tunables.synchronous = synchronous;
+        const std::string mode = synchronous == 2 ? " (sync full)" : "";
+        const int producers = 4;
+        const int perProducer = std::max(1, calls / 20);
+        for (bool useAsync : {false, true}) {
+            ftagmgr::Database shared;
+            std::mutex sharedMutex;
+            ftagmgr::AsyncDatabase async;
+            ftagmgr::AsyncOptions options;
+            options.readers = 1;
+            options.tunables = tunables;
+            if (useAsync) async.open(path, options, nullptr);
+            else shared.open(path, tunables, nullptr);
+            std::vector<std::vector<double>> perThread(producers);
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            for (int p = 0; p < producers; p++) {
+                threads.emplace_back([&, p]() {
+                    std::vector<double>& latencies = perThread[p];
+                    latencies.resize(perProducer);
+                    std::vector<std::future<ftagmgr::AsyncResult>> pending;
+                    for (int i = 0; i < perProducer; i++) {
+                        std::string value = "producer" + std::to_string(synchronous * 2 + useAsync) + " " + std::to_string(p * perProducer + i);
+                        auto submitted = std::chrono::steady_clock::now();
+                        if (useAsync) {
+                            // Latency from submission to commit, taken in the callback on the writer thread
+                            pending.push_back(async.addTag(value, [&latencies, i, submitted](const ftagmgr::AsyncResult&) {
+                                latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - submitted).count();
+                            }));
+                        } else {
+                            std::lock_guard<std::mutex> lock(sharedMutex);
+                            shared.addTag(value.c_str(), nullptr);
+                            latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - submitted).count();
+                        }
+                    }
+                    for (auto& future : pending) future.wait();
+                });
+            }
+            for (std::thread& thread : threads) thread.join();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::vector<double> latencies;
+            for (const std::vector<double>& part : perThread) latencies.insert(latencies.end(), part.begin(), part.end());
+            suite.add("async", std::string(useAsync ? "AsyncDatabase::addTag" : "addTag, shared session") + " x4" + mode, producers, 1, seconds, latencies);
+        }
+    }
+
+    // Crawl a fresh tree of 100 x 10 directories with 100 files each
+    const char* tree = "./bench_tree";
+    std::filesystem::remove_all(tree);
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 10; j++) {
+            std::filesystem::path dir = std::filesystem::path(tree) / std::to_string(i) / std::to_string(j);
+            std::filesystem::create_directories(dir);
+            for (int k = 0; k < 100; k++) std::ofstream(dir / ("file" + std::to_string(k)));
+        }
+    }
+    suite.measure("import", "crawl", 1, 100000, [&](int) { ftagmgr::crawl(db, tree, ftagmgr::CrawlOptions(), nullptr, nullptr); });
+    std::filesystem::remove_all(tree);
+
+    // Hash speed in memory, items are MiB
+    {
+        std::vector<char> block(64 * 1024 * 1024);
+        for (size_t i = 0; i < block.size(); i++) block[i] = (char)(i * 2654435761u >> 13);
+        volatile uint64_t sink = 0;
+        suite.measure("hash", "hash64 (MiB)", 10, block.size() >> 20, [&](int) { sink = sink + ftagmgr::hash64(block.data(), block.size()); });
+    }
+
+    // Fingerprint a fresh tree of 20 directories with 500 files of 4 KiB each, rescan it unchanged, then after renames
+    const char* hashTreePath = "./bench_hash";
+    std::filesystem::remove_all(hashTreePath);
+    {
+        std::string content(4096, 'x');
+        for (int i = 0; i < 20; i++) {
+            std::filesystem::path dir = std::filesystem::path(hashTreePath) / std::to_string(i);
+            std::filesystem::create_directories(dir);
+            for (int k = 0; k < 500; k++) {
+                // Distinct content, except every tenth file duplicates another
+                std::string body = content + std::to_string(i * 500 + (k % 10 == 9 ? k - 1 : k));
+                std::ofstream(dir / ("file" + std::to_string(k))) << body;
+            }
+        }
+        ftagmgr::crawl(db, hashTreePath, ftagmgr::CrawlOptions(), nullptr, nullptr);
+        ftagmgr::HashStats hashStats;
+        suite.measure("hash", "hashTree (first pass)", 1, 10000, [&](int) { ftagmgr::hashTree(db, hashTreePath, ftagmgr::HashOptions(), &hashStats, nullptr); });
+        suite.measure("hash", "hashTree (unchanged)", 5, 10000, [&](int) { ftagmgr::hashTree(db, hashTreePath, ftagmgr::HashOptions(), &hashStats, nullptr); });
+        for (int k = 0; k < 500; k++) {
+            std::filesystem::path dir = std::filesystem::path(hashTreePath) / "0";
+            std::filesystem::rename(dir / ("file" + std::to_string(k)), std::filesystem::path(hashTreePath) / "1" / ("moved" + std::to_string(k)));
+        }
+        suite.measure("hash", "crawl + hashTree (500 renamed)", 1, 10000, [&](int) {
+            ftagmgr::crawl(db, hashTreePath, ftagmgr::CrawlOptions(), nullptr, nullptr);
+            ftagmgr::hashTree(db, hashTreePath, ftagmgr::HashOptions(), &hashStats, nullptr);
+        });
+        std::vector<ftagmgr::DuplicateGroup> groups;
+        int hashDir = db.findDir(std::filesystem::canonical(hashTreePath).c_str(), nullptr);
+        suite.measure("hash", "findDuplicates", 5, 10000, [&](int) { ftagmgr::findDuplicates(db, (unsigned int)hashDir, &groups, nullptr); });
+        std::cout << "Rescan moved " << hashStats.moved << " files, " << groups.size() << " duplicate groups" << std::endl;
+    }
+    std::filesystem::remove_all(hashTreePath);
+
+    // Tags of 10000 empty files mirrored into their attributes, read back one file at a time and crawled into an empty database
+    const char* xattrTreePath = "./bench_xattr";
+    std::filesystem::remove_all(xattrTreePath);
+    {
+        for (int i = 0; i < 20; i++) {
+            std::filesystem::path dir = std::filesystem::path(xattrTreePath) / std::to_string(i);
+            std::filesystem::create_directories(dir);
+            for (int k = 0; k < 500; k++) std::ofstream(dir / ("file" + std::to_string(k)));
+        }
+        ftagmgr::crawl(db, xattrTreePath, ftagmgr::CrawlOptions(), nullptr, nullptr);
+        std::string xattrRoot = std::filesystem::canonical(xattrTreePath).string();
+        int xattrDir = db.findDir(xattrRoot.c_str(), nullptr);
+        std::vector<unsigned int> xattrFiles;
+        if (db.listSubtreeFiles(xattrDir, &cursor, nullptr)) while (cursor.next(&row, nullptr) == 1) xattrFiles.push_back(row);
+        std::vector<ftagmgr::FileTag> xattrLinks;
+        for (size_t i = 0; i < xattrFiles.size(); i++) {
+            for (int k = 0; k < config.tagsPerFile; k++) xattrLinks.push_back({xattrFiles[i], (unsigned int)tagIds[t[(i * config.tagsPerFile + k) % calls]]});
+        }
+        db.tagFiles(xattrLinks, nullptr);
+        ftagmgr::XattrMirror mirror;
+        ftagmgr::MirrorStats mirrorStats;
+        suite.measure("xattr", "XattrMirror::mirrorDir", 1, xattrFiles.size(), [&](int) { mirror.mirrorDir(db, xattrDir, &mirrorStats, nullptr); });
+        std::vector<std::string> paths;
+        for (int i = 0; i < calls; i++) paths.push_back(xattrRoot + "/" + std::to_string(i % 20) + "/file" + std::to_string(i * 7 % 500));
+        std::vector<std::string> xattrNames;
+        suite.measure("xattr", "readTagXattr", calls, 1, [&](int i) { ftagmgr::readTagXattr(paths[i].c_str(), &xattrNames, nullptr); });
+        // The same answer from the database, a fresh session as a separate tool would open
+        ftagmgr::NameCursor tagNames;
+        std::string_view tagName;
+        suite.measure("xattr", "open + getDir + getFile + listFileTagNames", std::max(1, calls / 20), 1, [&](int i) {
+            ftagmgr::Database tool(path);
+            std::string& filePath = paths[i];
+            size_t slash = filePath.rfind('/');
+            int file = tool.getFile(tool.getDir(filePath.substr(0, slash).c_str(), nullptr), filePath.c_str() + slash + 1, nullptr);
+            xattrNames.clear();
+            if (tool.listFileTagNames(file, &tagNames, nullptr)) while (tagNames.next(&row, &tagName, nullptr) == 1) xattrNames.emplace_back(tagName);
+            tagNames.close();
+        });
+        suite.measure("xattr", "getDir + getFile + listFileTagNames", calls, 1, [&](int i) {
+            std::string& filePath = paths[i];
+            size_t slash = filePath.rfind('/');
+            int file = db.getFile(db.getDir(filePath.substr(0, slash).c_str(), nullptr), filePath.c_str() + slash + 1, nullptr);
+            xattrNames.clear();
+            if (db.listFileTagNames(file, &tagNames, nullptr)) while (tagNames.next(&row, &tagName, nullptr) == 1) xattrNames.emplace_back(tagName);
+        });
+        tagNames.close();
+        for (bool readTags : {false, true}) {
+            std::remove("./bench_xattr.db");
+            ftagmgr::Database rebuilt("./bench_xattr.db");
+            rebuilt.createDatabase(nullptr);
+            ftagmgr::CrawlOptions options;
+            options.readTags = readTags;
+            suite.measure("xattr", readTags ? "crawl (readTags)" : "crawl", 1, xattrFiles.size(), [&](int) { ftagmgr::crawl(rebuilt, xattrTreePath, options, nullptr, nullptr); });
+        }
+        std::remove("./bench_xattr.db");
+        std::cout << "Mirrored " << mirrorStats.written << " files, " << mirrorStats.skipped << " skipped" << std::endl;
+    }
+    std::filesystem::remove_all(xattrTreePath);
+
+    // Round trip through an export file into an empty database, items are file-tag links
+    const char* exportPath = "./bench.ftx";
+    const char* copyPath = "./bench_copy.db";
+    ftagmgr::TransferStats transfer;
+    // A first export counts the links
+    ftagmgr::exportDatabase(db, exportPath, ftagmgr::ExportOptions(), &transfer, nullptr);
+    const size_t linkCount = std::max<size_t>(1, transfer.links);
+    suite.measure("export", "exportDatabase", 1, linkCount, [&](int) {
+        ftagmgr::exportDatabase(db, exportPath, ftagmgr::ExportOptions(), &transfer, nullptr);
+    });
+    suite.measure("export", "importDatabase", 1, linkCount, [&](int) {
+        std::remove(copyPath);
+        ftagmgr::Database copy(copyPath);
+        copy.createDatabase(nullptr);
+        ftagmgr::importDatabase(copy, exportPath, ftagmgr::ImportOptions(), nullptr, nullptr);
+    });
+    std::cout << "Export size: " << transfer.bytes << " bytes for " << transfer.links << " links" << std::endl;
+    std::remove(exportPath);
+    for (const char* suffix : {"", "-wal", "-shm"}) std::remove((std::string(copyPath) + suffix).c_str());
+
+    // Read-only snapshot, opening it is the whole cold start
+    const char* snapshotPath = "./bench.snap";
+    suite.measure("snapshot", "compileSnapshot", 1, linkCount, [&](int) { ftagmgr::compileSnapshot(db, snapshotPath, nullptr); });
+    suite.measure("snapshot", "open", 100, 1, [&](int) {
+        ftagmgr::Snapshot cold;
+        cold.open(snapshotPath, nullptr);
+    });
+    ftagmgr::Snapshot snapshot;
+    snapshot.open(snapshotPath, nullptr);
+    std::string_view view;
+    suite.measure("snapshot", "getDir", calls, 1, [&](int i) { snapshot.getDir(dirs[d[i]].c_str()); });
+    suite.measure("snapshot", "getDirPath", calls, 1, [&](int i) { snapshot.getDirPath(dirIds[d[i]], &view); });
+    suite.measure("snapshot", "getFile", calls, 1, [&](int i) { snapshot.getFile(dirIds[d[i]], files[f[i]].c_str()); });
+    suite.measure("snapshot", "getFilePath", calls, 1, [&](int i) { snapshot.getFilePath(id[i], &str); });
+    suite.measure("snapshot", "getTag", calls, 1, [&](int i) { snapshot.getTag(tags[t[i]].c_str()); });
+    suite.measure("snapshot", "getTagValue", calls, 1, [&](int i) { snapshot.getTagValue(tagIds[t[i]], &view); });
+    suite.measure("snapshot", "listTagFiles", calls, 1, [&](int i) {
+        for (uint32_t file : snapshot.listTagFiles(tagIds[t[i]])) row = (int)file;
+    });
+    for (const char* query : queries) {
+        suite.measure("snapshot", query, 20, 1, [&](int) {
+            ftagmgr::QueryResult result;
+            ftagmgr::runQuery(snapshot, query, &result, nullptr);
+            while (result.next(&row, nullptr) == 1) {}
+        });
+    }
+    std::error_code error;
+    std::cout << "Snapshot size: " << std::filesystem::file_size(snapshotPath, error) << " bytes" << std::endl;
+    snapshot.close();
+    std::remove(snapshotPath);
+
+    // Autocompletion over many word-like tag names, typed one keystroke at a time
+    if (config.searchTags > 0) {
+        // About a thousand syllables, so names share trigrams roughly like words do
+        const char* onsets[] = {"b", "c", "d", "f", "g", "h", "k", "l", "m", "n", "p", "r", "s", "t", "v", "w", "st", "tr", "pl", "gr", "ch", "sh", "th", "br"};
+        const char* vowels[] = {"a", "e", "i", "o", "u", "ou", "ea"};
+        const char* codas[] = {"", "n", "r", "s", "l", "t"};
+        std::vector<std::string> syllables;
+        for (const char* onset : onsets) for (const char* vowel : vowels) for (const char* coda : codas) syllables.push_back(std::string(onset) + vowel + coda);
+        std::vector<std::string> names;
+        for (int i = 0; i < config.searchTags; i++) {
+            std::string name;
+            for (size_t n = i, parts = 0; parts < 3 || n > 0; n /= syllables.size(), parts++) name += syllables[(n + parts * 7) % syllables.size()];
+            names.push_back(name);
+        }
+        std::shuffle(names.begin(), names.end(), rng);
+        db.addTags(std::vector<std::string_view>(names.begin(), names.end()), &ids, nullptr);
+        ftagmgr::TagSearch search;
+        suite.measure("search", "TagSearch::build", 1, names.size(), [&](int) { search.build(db, nullptr); });
+        std::cout << "Tag search memory: " << search.memoryUsage() << " bytes for " << search.size() << " tags" << std::endl;
+        std::vector<ftagmgr::TagMatch> matches;
+        std::vector<std::string> typed, typos;
+        std::uniform_int_distribution<size_t> pickName(0, names.size() - 1);
+        while ((int)typed.size() < calls) {
+            const std::string& name = names[pickName(rng)];
+            for (size_t length = 1; length <= name.size() && (int)typed.size() < calls; length++) typed.push_back(name.substr(0, length));
+            std::string typo = name;
+            typo[typo.size() / 2] = 'x';
+            typos.push_back(typo);
+        }
+        suite.measure("search", "complete (keystroke)", calls, 1, [&](int i) { search.complete(typed[i], 10, &matches); });
+        suite.measure("search", "fuzzy (one typo)", (int)typos.size(), 1, [&](int i) { search.fuzzy(typos[i], 10, 0.3, &matches); });
+        db.addObserver(&search);
+        suite.measure("search", "addTag (indexed)", std::max(1, calls / 10), 1, [&](int i) { db.addTag(("newtag" + std::to_string(i)).c_str(), nullptr); });
+        db.removeObserver(&search);
+    }
+
+    // A deep tag hierarchy, every file tagged with one of its leaves and queried through the ancestors
+    if (config.hierarchyTags > 0) {
+        std::vector<std::string> names{"hier"};
+        std::vector<int> depths{0};
+        for (size_t parent = 0; (int)names.size() < config.hierarchyTags; parent++) {
+            for (int child = 0; child < 6 && (int)names.size() < config.hierarchyTags; child++) {
+                names.push_back(names[parent] + '/' + std::to_string(child));
+                depths.push_back(depths[parent] + 1);
+            }
+        }
+        std::vector<int> hierIds;
+        suite.measure("hier", "addTags (hierarchy)", 1, names.size(), [&](int) {
+            db.addTags(std::vector<std::string_view>(names.begin(), names.end()), &hierIds, nullptr);
+        });
+        // Files go to the tags of the deepest level
+        std::vector<size_t> leaves;
+        for (size_t i = 0; i < names.size(); i++) if (depths[i] == depths.back()) leaves.push_back(i);
+        std::uniform_int_distribution<size_t> pickLeaf(0, leaves.size() - 1);
+        std::vector<ftagmgr::FileTag> leafLinks;
+        for (int file : fileIds) leafLinks.push_back({(unsigned int)file, (unsigned int)hierIds[leaves[pickLeaf(rng)]]});
+        db.tagFiles(leafLinks, nullptr);
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db.handle(), "SELECT count(*) FROM tagtree;", -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+            std::cout << "Tag closure rows: " << sqlite3_column_int64(stmt, 0) << " for " << names.size() << " tags, depth " << depths.back() << std::endl;
+        }
+        sqlite3_finalize(stmt);
+        // One tag per level, from the root down to a leaf
+        std::vector<std::string> levels;
+        for (size_t i = 0; i < names.size(); i = i * 6 + 1) levels.push_back(names[i]);
+        ftagmgr::TagIndex hierIndex;
+        hierIndex.build(db, nullptr);
+        const char* hierSnapshotPath = "./bench-hier.snap";
+        ftagmgr::compileSnapshot(db, hierSnapshotPath, nullptr);
+        ftagmgr::Snapshot hierSnapshot;
+        hierSnapshot.open(hierSnapshotPath, nullptr);
+        for (const std::string& level : levels) {
+            std::string name = "depth " + std::to_string(std::count(level.begin(), level.end(), '/'));
+            suite.measure("hier", "query " + name, 20, 1, [&](int) {
+                ftagmgr::QueryResult result;
+                ftagmgr::runQuery(db, level.c_str(), &result, nullptr);
+                while (result.next(&row, nullptr) == 1) {}
+            });
+            suite.measure("hier", "query " + name + " (TagIndex)", 20, 1, [&](int) {
+                ftagmgr::QueryResult result;
+                ftagmgr::runQuery(db, hierIndex, level.c_str(), &result, nullptr);
+                while (result.next(&row, nullptr) == 1) {}
+            });
+            suite.measure("hier", "query " + name + " (snapshot)", 20, 1, [&](int) {
+                ftagmgr::QueryResult result;
+                ftagmgr::runQuery(hierSnapshot, level.c_str(), &result, nullptr);
+                while (result.next(&row, nullptr) == 1) {}
+            });
+        }
+        hierSnapshot.close();
+        std::remove(hierSnapshotPath);
+        // A depth 3 subtree, about 1500 tags at the default size, moved between two parents and back
+        if (levels.size() > 3) {
+            int third = db.getTag(levels[3].c_str(), nullptr);
+            int from = db.getTag(levels[2].c_str(), nullptr), to = db.getTag("hier/1", nullptr);
+            suite.measure("hier", "setTagParent (subtree)", 20, 1, [&](int i) { db.setTagParent(third, i % 2 ? from : to, nullptr); });
+        }
+        suite.measure("hier", "addTag (depth " + std::to_string(depths.back() + 1) + ")", std::max(1, calls / 10), 1, [&](int i) {
+            db.addTag((names[leaves[i % leaves.size()]] + "/new" + std::to_string(i)).c_str(), nullptr);
+        });
+    }
+
+    // Closing checkpoints the WAL, so the main file holds everything
+    db.close();
+    std::cout << "Database size: " << std::filesystem::file_size(path, error) << " bytes" << std::endl;
+    std::remove(path);
+    if (!suite.writeJson(config)) {
+        std::cout << "Couldn't write " << config.out << '.' << std::endl;
+        return 1;
+    }
+    std::cout << "Results written to " << config.out << '.' << std::endl;
+    return 0;
+}
@@ -0,0 +1,434 @@
+/**
+ * @file ftagmgrasync.cpp
+ * @brief FTagMgr asynchronous session source code
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ftagmgrasync.h"
+
+namespace ftagmgr {
+    /**
+     * @brief A queued request and where its result goes
+     */
+    struct AsyncDatabase::Request {
+        // Empty for a flush
+        Task task;
+        Callback done;
+        std::promise<AsyncResult> promise;
+    };
+
+    /**
+     * @brief Bounded queue from the submitting threads to the writer or the readers
+     *
+     * Submitters block when it is full, so a producer outrunning the disk
+     * is held back instead of letting requests pile up in memory.
+     */
+    class AsyncDatabase::RequestQueue {
+    public:
+        explicit RequestQueue(size_t capacity) : capacity(capacity) {}
+
+        /**
+         * @brief Accept requests again, after the queue was closed
+         * @param capacity Most requests queued at once
+         */
+        void reopen(size_t capacity) {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->capacity = capacity;
+            closed = false;
+        }
+
+        /**
+         * @brief Queue a request
+         * @param request The request, left untouched when it isn't queued
+         * @param wait Wait for room, otherwise a full queue refuses the request
+         * @param error Gets why the request was refused
+         * @retval true Queued
+         * @retval false The queue is closed, or full and not waited for
+         */
+        bool push(Request&& request, bool wait, const char** error) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (wait) notFull.wait(lock, [this] { return closed || requests.size() < capacity; });
+            if (closed) {
+                *error = "async session is closed";
+                return false;
+            }
+            if (requests.size() >= capacity) {
+                *error = "request queue is full";
+                return false;
+            }
+            requests.push_back(std::move(request));
+            notEmpty.notify_one();
+            return true;
+        }
+
+        /**
+         * @brief Queue a request without waiting for room, for the threads serving the queue
+         * @param request The request, left untouched when it isn't queued
+         * @param error Gets why the request was refused
+         * @retval true Queued
+         * @retval false The queue is closed
+         */
+        bool pushOver(Request&& request, const char** error) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed) {
+                *error = "async session is closed";
+                return false;
+            }
+            requests.push_back(std::move(request));
+            notEmpty.notify_one();
+            return true;
+        }
+
+        /**
+         * @brief Take queued requests, waiting for at least one
+         * @param out Gets the requests, replacing its contents
+         * @param max Most requests taken
+         * @retval true Requests returned
+         * @retval false Queue closed and drained
+         */
+        bool pop(std::vector<Request>* out, size_t max) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [this] { return closed || !requests.empty(); });
+            if (requests.empty()) return false;
+            out->clear();
+            while (!requests.empty() && out->size() < max) {
+                out->push_back(std::move(requests.front()));
+                requests.pop_front();
+            }
+            notFull.notify_all();
+            return true;
+        }
+
+        // Refuses new requests, the serving threads finish the queued ones and stop
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            notEmpty.notify_all();
+            notFull.notify_all();
+        }
+
+        bool isOpen() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return !closed;
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable notEmpty;
+        std::condition_variable notFull;
+        std::deque<Request> requests;
+        size_t capacity;
+        bool closed = true;
+    };
+
+    namespace {
+        // Queue served by the calling thread, its own submissions to it mustn't wait for room
+        thread_local const void* servedQueue = nullptr;
+
+        /**
+         * @brief Hand a result to its callback and its future
+         * @param done The callback, may be empty
+         * @param promise The future's promise
+         * @param result The result
+         */
+        void deliver(const AsyncDatabase::Callback& done, std::promise<AsyncResult>& promise, AsyncResult&& result) {
+            if (done) done(result);
+            promise.set_value(std::move(result));
+        }
+
+        /**
+         * @brief Take an SQLite error message into a result
+         * @param result The result, gets value -1 and the message
+         * @param errmsg The message, freed
+         */
+        void takeError(AsyncResult* result, char* errmsg) {
+            result->value = -1;
+            result->error = errmsg ? errmsg : "unknown error";
+            sqlite3_free(errmsg);
+        }
+    }
+
+    AsyncDatabase::AsyncDatabase() : writes(new RequestQueue(0)), reads(new RequestQueue(0)) {}
+
+    AsyncDatabase::~AsyncDatabase() {
+        close();
+    }
+
+    /**
+     * @brief Open the sessions and start their threads
+     * @param path Path to the database file, must have been created with createDatabase()
+     * @param options Settings
+     * @param errmsg SQLite3 error message char**
+     * @retval true Session ready
+     * @retval false A session could not be opened, the front-end is left closed
+     */
+    bool AsyncDatabase::open(const char* path, const AsyncOptions& options, char** errmsg) {
+        close();
+        if (!pool.open(path, options.readers, options.tunables, errmsg)) return false;
+        this->options = options;
+        if (this->options.queueCapacity == 0) this->options.queueCapacity = 1;
+        if (this->options.maxBatch == 0) this->options.maxBatch = 1;
+        writes->reopen(this->options.queueCapacity);
+        reads->reopen(this->options.queueCapacity);
+        ConnectionPool::Lease session = pool.writer();
+        session->setMetrics(options.metrics);
+        writer = std::thread(&AsyncDatabase::runWriter, this, std::move(session));
+        for (size_t i = 0; i < pool.readerCount(); i++) {
+            session = pool.reader();
+            session->setMetrics(options.metrics);
+            readers.emplace_back(&AsyncDatabase::runReader, this, std::move(session));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Finish every queued request, then stop the threads and close the sessions
+     */
+    void AsyncDatabase::close() {
+        writes->close();
+        reads->close();
+        if (writer.joinable()) writer.join();
+        for (std::thread& thread : readers) thread.join();
+        readers.clear();
+        pool.close();
+    }
+
+    /**
+     * @brief Check if the front-end is open
+     * @retval true Requests are accepted
+     * @retval false Closed, requests fail at once
+     */
+    bool AsyncDatabase::isOpen() const {
+        return writes->isOpen();
+    }
+
+    /**
+     * @brief Queue a write
+     * @param task The write, run with the writer session inside a transaction
+     * @param done Called with the result after the commit, may be empty
+     * @return Future of the result
+     */
+    std::future<AsyncResult> AsyncDatabase::write(Task task, Callback done) {
+        return submit(*writes, std::move(task), std::move(done));
+    }
+
+    /**
+     * @brief Queue a read
+     * @param task The read, run with one of the read-only sessions
+     * @param done Called with the result, may be empty
+     * @return Future of the result
+     */
+    std::future<AsyncResult> AsyncDatabase::read(Task task, Callback done) {
+        return submit(*reads, std::move(task), std::move(done));
+    }
+
+    /**
+     * @brief Wait for every write queued so far to be committed
+     * @param done Called once they are, may be empty
+     * @return Future of 1 once they are, -1 if the transaction holding the last of them failed
+     */
+    std::future<AsyncResult> AsyncDatabase::flush(Callback done) {
+        return submit(*writes, Task(), std::move(done));
+    }
+
+    /**
+     * @brief Add a directory, with its missing parents
+     * @param path Directory path
+     * @param done Called with the result, may be empty
+     * @return Future of the directory ID, also given for an existing directory
+     */
+    std::future<AsyncResult> AsyncDatabase::addDir(std::string path, Callback done) {
+        return write([path = std::move(path)](Database& db, char** errmsg) {
+            std::vector<int> ids;
+            if (!db.addDirs({path}, &ids, errmsg)) return -1;
+            return ids[0];
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Add a file
+     * @param dir Directory ID
+     * @param filename Name of the file
+     * @param done Called with the result, may be empty
+     * @return Future of the file ID, also given for an existing file
+     */
+    std::future<AsyncResult> AsyncDatabase::addFile(unsigned int dir, std::string filename, Callback done) {
+        return write([dir, filename = std::move(filename)](Database& db, char** errmsg) {
+            std::vector<int> ids;
+            if (!db.addFiles(dir, {filename}, &ids, errmsg)) return -1;
+            return ids[0];
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Add a tag, with its missing parents
+     * @param value Tag name
+     * @param done Called with the result, may be empty
+     * @return Future of the tag ID, also given for an existing tag
+     */
+    std::future<AsyncResult> AsyncDatabase::addTag(std::string value, Callback done) {
+        return write([value = std::move(value)](Database& db, char** errmsg) {
+            std::vector<int> ids;
+            if (!db.addTags({value}, &ids, errmsg)) return -1;
+            return ids[0];
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Tag a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param done Called with the result, may be empty
+     * @return Future of 1 if the file was tagged, 0 if it already had the tag
+     */
+    std::future<AsyncResult> AsyncDatabase::tagFile(unsigned int file, unsigned int tag, Callback done) {
+        return write([file, tag](Database& db, char** errmsg) {
+            return db.tagFile(file, tag, errmsg) ? 1 : 0;
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Untag a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param done Called with the result, may be empty
+     * @return Future of 1 if the tag was removed, 0 if the file didn't have it
+     */
+    std::future<AsyncResult> AsyncDatabase::untagFile(unsigned int file, unsigned int tag, Callback done) {
+        return write([file, tag](Database& db, char** errmsg) {
+            return db.untagFile(file, tag, errmsg) ? 1 : 0;
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Move or rename a file
+     * @param file File ID
+     * @param dir ID of the new directory
+     * @param filename New name of the file
+     * @param done Called with the result, may be empty
+     * @return Future of 1 if the file was moved, 0 if it doesn't exist or the name is taken
+     */
+    std::future<AsyncResult> AsyncDatabase::moveFile(unsigned int file, unsigned int dir, std::string filename, Callback done) {
+        return write([file, dir, filename = std::move(filename)](Database& db, char** errmsg) {
+            return db.moveFile(file, dir, filename.c_str(), errmsg) ? 1 : 0;
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Remove a file with its tags
+     * @param file File ID
+     * @param done Called with the result, may be empty
+     * @return Future of 1 if the file was removed, 0 if it doesn't exist
+     */
+    std::future<AsyncResult> AsyncDatabase::removeFile(unsigned int file, Callback done) {
+        return write([file](Database& db, char** errmsg) {
+            return db.removeFile(file, errmsg) ? 1 : 0;
+        }, std::move(done));
+    }
+
+    /**
+     * @brief Queue a request, or fail it at once
+     * @param queue The write or read queue
+     * @param task The request, empty for a flush
+     * @param done The callback, may be empty
+     * @return Future of the result
+     */
+    std::future<AsyncResult> AsyncDatabase::submit(RequestQueue& queue, Task&& task, Callback&& done) {
+        Request request{std::move(task), std::move(done), std::promise<AsyncResult>()};
+        std::future<AsyncResult> future = request.promise.get_future();
+        const char* error = nullptr;
+        // The writer waiting for room in its own queue would wait forever
+        bool queued = servedQueue == &queue ? queue.pushOver(std::move(request), &error)
+                                            : queue.push(std::move(request), !options.failWhenFull, &error);
+        if (!queued) {
+            AsyncResult result;
+            result.error = error;
+            deliver(request.done, request.promise, std::move(result));
+        }
+        return future;
+    }
+
+    /**
+     * @brief Writer thread, commits the queued writes in batches until the queue is closed
+     * @param session The writer session
+     */
+    void AsyncDatabase::runWriter(ConnectionPool::Lease session) {
+        servedQueue = writes.get();
+        Database& db = *session;
+        std::vector<Request> batch;
+        std::vector<AsyncResult> results;
+        // Whatever queued up during the last commit goes into the next one
+        while (writes->pop(&batch, options.maxBatch)) {
+            results.assign(batch.size(), AsyncResult());
+            char* errmsg = nullptr;
+            bool open = db.begin(&errmsg);
+            for (size_t i = 0; open && i < batch.size(); i++) {
+                AsyncResult& result = results[i];
+                if (!batch[i].task) {
+                    result.value = 1;
+                    continue;
+                }
+                // A savepoint per write, so a failing one takes nothing else down with it
+                if (!db.begin(&errmsg)) {
+                    takeError(&result, errmsg);
+                    errmsg = nullptr;
+                    continue;
+                }
+                result.value = batch[i].task(db, &errmsg);
+                if (errmsg) {
+                    takeError(&result, errmsg);
+                    errmsg = nullptr;
+                    db.rollback(nullptr);
+                } else if (!db.commit(&errmsg)) {
+                    takeError(&result, errmsg);
+                    errmsg = nullptr;
+                    db.rollback(nullptr);
+                }
+            }
+            if (open && !db.commit(&errmsg)) {
+                db.rollback(nullptr);
+                open = false;
+            }
+            if (!open) {
+                // Nothing of the batch was kept
+                std::string error = errmsg ? errmsg : "unknown error";
+                sqlite3_free(errmsg);
+                for (AsyncResult& result : results) {
+                    if (result.error.empty()) result.error = error;
+                    result.value = -1;
+                }
+            }
+            for (size_t i = 0; i < batch.size(); i++) deliver(batch[i].done, batch[i].promise, std::move(results[i]));
+        }
+        session->setMetrics(nullptr);
+    }
+
+    /**
+     * @brief Reader thread, runs queued reads one at a time until the queue is closed
+     * @param session The thread's read-only session
+     */
+    void AsyncDatabase::runReader(ConnectionPool::Lease session) {
+        servedQueue = reads.get();
+        Database& db = *session;
+        std::vector<Request> batch;
+        while (reads->pop(&batch, 1)) {
+            AsyncResult result;
+            char* errmsg = nullptr;
+            if (batch[0].task) result.value = batch[0].task(db, &errmsg);
+            if (errmsg) takeError(&result, errmsg);
+            deliver(batch[0].done, batch[0].promise, std::move(result));
+        }
+        session->setMetrics(nullptr);
+    }
+}
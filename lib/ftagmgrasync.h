@@ -0,0 +1,219 @@
+/**
+ * @file ftagmgrasync.h
+ * @brief FTagMgrLib asynchronous session header file
+ */
+
+#ifndef FTAGMGRASYNC_H
+#define FTAGMGRASYNC_H
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ftagmgrlib.h"
+#include "ftagmgrpool.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Outcome of an asynchronous request
+     */
+    struct AsyncResult {
+        // What the request returned, e.g. the new ID or 1/0 for true/false, -1 on error
+        int value = -1;
+        // Error message, empty on success
+        std::string error;
+    };
+
+    /**
+     * @brief Asynchronous session settings
+     */
+    struct AsyncOptions {
+        // Writes waiting for the writer thread, and reads for a reader thread, before submitting blocks
+        size_t queueCapacity = 4096;
+        // Most writes committed in one transaction
+        size_t maxBatch = 1024;
+        // Read-only sessions, each with its own thread, 0 for one per core
+        unsigned int readers = 0;
+        // Fail a request at once when its queue is full instead of waiting for room
+        bool failWhenFull = false;
+        // Connection settings of every session, readOnly is ignored
+        Tunables tunables;
+        // Metrics attached to every session, may be nullptr
+        Metrics* metrics = nullptr;
+    };
+
+    /**
+     * @brief Non-blocking front-end to a database, for threads that mustn't wait for the disk
+     *
+     * Writes go to a single writer thread. It takes every write queued
+     * while it was busy and commits them in one transaction, so concurrent
+     * producers share one sync to disk instead of paying one each. Every
+     * write runs in its own savepoint, a failing one is undone alone and
+     * doesn't affect the others of its transaction. Reads go to a set of
+     * read-only sessions, each served by its own thread, and see the last
+     * committed state; call flush() first to read your own writes.
+     *
+     * Every request returns a future, which becomes ready once a write
+     * is committed or a read has run. Requests may also take a callback,
+     * run on the writer or reader thread right before the future becomes
+     * ready. A callback may submit more requests but must not wait for
+     * one. Queues are bounded, a producer outrunning the disk is held
+     * back in submission, or fails there with failWhenFull.
+     *
+     * Thread-safe.
+     */
+    class AsyncDatabase {
+    public:
+        // A request, run with the writer or a reader session, returns AsyncResult::value and sets errmsg on error
+        using Task = std::function<int(Database& db, char** errmsg)>;
+        // Called with the result of a request, from the thread that ran it
+        using Callback = std::function<void(const AsyncResult& result)>;
+
+        AsyncDatabase();
+        ~AsyncDatabase();
+        AsyncDatabase(const AsyncDatabase&) = delete;
+        AsyncDatabase& operator=(const AsyncDatabase&) = delete;
+
+        /**
+         * @brief Open the sessions and start their threads
+         * @param path Path to the database file, must have been created with createDatabase()
+         * @param options Settings
+         * @param errmsg SQLite3 error message char**
+         * @retval true Session ready
+         * @retval false A session could not be opened, the front-end is left closed
+         */
+        bool open(const char* path, const AsyncOptions& options, char** errmsg);
+
+        /**
+         * @brief Finish every queued request, then stop the threads and close the sessions
+         */
+        void close();
+
+        /**
+         * @brief Check if the front-end is open
+         * @retval true Requests are accepted
+         * @retval false Closed, requests fail at once
+         */
+        bool isOpen() const;
+
+        /**
+         * @brief Queue a write
+         * @param task The write, run with the writer session inside a transaction
+         * @param done Called with the result after the commit, may be empty
+         * @return Future of the result
+         */
+        std::future<AsyncResult> write(Task task, Callback done = nullptr);
+
+        /**
+         * @brief Queue a read
+         * @param task The read, run with one of the read-only sessions
+         * @param done Called with the result, may be empty
+         * @return Future of the result
+         */
+        std::future<AsyncResult> read(Task task, Callback done = nullptr);
+
+        /**
+         * @brief Wait for every write queued so far to be committed
+         * @param done Called once they are, may be empty
+         * @return Future of 1 once they are, -1 if the transaction holding the last of them failed
+         */
+        std::future<AsyncResult> flush(Callback done = nullptr);
+
+        /**
+         * @brief Add a directory, with its missing parents
+         * @param path Directory path
+         * @param done Called with the result, may be empty
+         * @return Future of the directory ID, also given for an existing directory
+         */
+        std::future<AsyncResult> addDir(std::string path, Callback done = nullptr);
+
+        /**
+         * @brief Add a file
+         * @param dir Directory ID
+         * @param filename Name of the file
+         * @param done Called with the result, may be empty
+         * @return Future of the file ID, also given for an existing file
+         */
+        std::future<AsyncResult> addFile(unsigned int dir, std::string filename, Callback done = nullptr);
+
+        /**
+         * @brief Add a tag, with its missing parents
+         * @param value Tag name
+         * @param done Called with the result, may be empty
+         * @return Future of the tag ID, also given for an existing tag
+         */
+        std::future<AsyncResult> addTag(std::string value, Callback done = nullptr);
+
+        /**
+         * @brief Tag a file
+         * @param file File ID
+         * @param tag Tag ID
+         * @param done Called with the result, may be empty
+         * @return Future of 1 if the file was tagged, 0 if it already had the tag
+         */
+        std::future<AsyncResult> tagFile(unsigned int file, unsigned int tag, Callback done = nullptr);
+
+        /**
+         * @brief Untag a file
+         * @param file File ID
+         * @param tag Tag ID
+         * @param done Called with the result, may be empty
+         * @return Future of 1 if the tag was removed, 0 if the file didn't have it
+         */
+        std::future<AsyncResult> untagFile(unsigned int file, unsigned int tag, Callback done = nullptr);
+
+        /**
+         * @brief Move or rename a file
+         * @param file File ID
+         * @param dir ID of the new directory
+         * @param filename New name of the file
+         * @param done Called with the result, may be empty
+         * @return Future of 1 if the file was moved, 0 if it doesn't exist or the name is taken
+         */
+        std::future<AsyncResult> moveFile(unsigned int file, unsigned int dir, std::string filename, Callback done = nullptr);
+
+        /**
+         * @brief Remove a file with its tags
+         * @param file File ID
+         * @param done Called with the result, may be empty
+         * @return Future of 1 if the file was removed, 0 if it doesn't exist
+         */
+        std::future<AsyncResult> removeFile(unsigned int file, Callback done = nullptr);
+
+    private:
+        struct Request;
+        class RequestQueue;
+
+        /**
+         * @brief Queue a request, or fail it at once
+         * @param queue The write or read queue
+         * @param task The request, empty for a flush
+         * @param done The callback, may be empty
+         * @return Future of the result
+         */
+        std::future<AsyncResult> submit(RequestQueue& queue, Task&& task, Callback&& done);
+
+        /**
+         * @brief Writer thread, commits the queued writes in batches until the queue is closed
+         * @param session The writer session
+         */
+        void runWriter(ConnectionPool::Lease session);
+
+        /**
+         * @brief Reader thread, runs queued reads one at a time until the queue is closed
+         * @param session The thread's read-only session
+         */
+        void runReader(ConnectionPool::Lease session);
+
+        ConnectionPool pool;
+        AsyncOptions options;
+        std::unique_ptr<RequestQueue> writes;
+        std::unique_ptr<RequestQueue> reads;
+        std::thread writer;
+        std::vector<std::thread> readers;
+    };
+}
+
+#endif
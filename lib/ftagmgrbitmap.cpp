@@ -0,0 +1,480 @@
+/**
+ * @file ftagmgrbitmap.cpp
+ * @brief FTagMgr bitmap index source code
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <sqlite3.h>
+#include "ftagmgrbitmap.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Count the set bits of a bitmap container
+     * @param words bitmapWords words
+     * @return Number of set bits
+     */
+    static uint32_t popcount(const uint64_t* words) {
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < Bitmap::bitmapWords; i++) count += __builtin_popcountll(words[i]);
+        return count;
+    }
+
+    /**
+     * @brief Switch a container to whichever representation fits its cardinality
+     * @param container The container
+     */
+    void Bitmap::normalize(Container& container) {
+        if (container.isBitmap() && container.cardinality <= arrayLimit) {
+            container.array.clear();
+            container.array.reserve(container.cardinality);
+            for (uint32_t i = 0; i < bitmapWords; i++) {
+                uint64_t word = container.bits[i];
+                while (word) {
+                    container.array.push_back((uint16_t)(i * 64 + __builtin_ctzll(word)));
+                    word &= word - 1;
+                }
+            }
+            std::vector<uint64_t>().swap(container.bits);
+        } else if (!container.isBitmap() && container.cardinality > arrayLimit) {
+            container.bits.assign(bitmapWords, 0);
+            for (uint16_t low : container.array) container.bits[low >> 6] |= 1ULL << (low & 63);
+            std::vector<uint16_t>().swap(container.array);
+        }
+    }
+
+    /**
+     * @brief Find the container for a key
+     * @param key Upper 16 bits
+     * @return Index of the first container with a key not smaller than key
+     */
+    size_t Bitmap::find(uint16_t key) const {
+        // IDs mostly grow, so check the last container before searching
+        if (!containers.empty() && containers.back().key < key) return containers.size();
+        auto it = std::lower_bound(containers.begin(), containers.end(), key,
+            [](const Container& container, uint16_t k) { return container.key < k; });
+        return it - containers.begin();
+    }
+
+    /**
+     * @brief Add an ID
+     * @param value The ID
+     * @retval true ID added
+     * @retval false ID was already in the set
+     */
+    bool Bitmap::add(uint32_t value) {
+        uint16_t key = value >> 16, low = value & 0xFFFF;
+        size_t index = find(key);
+        if (index == containers.size() || containers[index].key != key) {
+            Container container;
+            container.key = key;
+            container.cardinality = 0;
+            containers.insert(containers.begin() + index, std::move(container));
+        }
+        Container& container = containers[index];
+        if (container.isBitmap()) {
+            uint64_t& word = container.bits[low >> 6];
+            uint64_t bit = 1ULL << (low & 63);
+            if (word & bit) return false;
+            word |= bit;
+        } else {
+            // Appending in order is the common case when loading
+            if (container.array.empty() || container.array.back() < low) container.array.push_back(low);
+            else {
+                auto it = std::lower_bound(container.array.begin(), container.array.end(), low);
+                if (*it == low) return false;
+                container.array.insert(it, low);
+            }
+        }
+        container.cardinality++;
+        normalize(container);
+        return true;
+    }
+
+    /**
+     * @brief Remove an ID
+     * @param value The ID
+     * @retval true ID removed
+     * @retval false ID wasn't in the set
+     */
+    bool Bitmap::remove(uint32_t value) {
+        uint16_t key = value >> 16, low = value & 0xFFFF;
+        size_t index = find(key);
+        if (index == containers.size() || containers[index].key != key) return false;
+        Container& container = containers[index];
+        if (container.isBitmap()) {
+            uint64_t& word = container.bits[low >> 6];
+            uint64_t bit = 1ULL << (low & 63);
+            if (!(word & bit)) return false;
+            word &= ~bit;
+        } else {
+            auto it = std::lower_bound(container.array.begin(), container.array.end(), low);
+            if (it == container.array.end() || *it != low) return false;
+            container.array.erase(it);
+        }
+        container.cardinality--;
+        if (container.cardinality == 0) containers.erase(containers.begin() + index);
+        else normalize(container);
+        return true;
+    }
+
+    /**
+     * @brief Check if an ID is in the set
+     * @param value The ID
+     * @retval true ID is in the set
+     * @retval false ID isn't in the set
+     */
+    bool Bitmap::contains(uint32_t value) const {
+        uint16_t key = value >> 16, low = value & 0xFFFF;
+        size_t index = find(key);
+        if (index == containers.size() || containers[index].key != key) return false;
+        const Container& container = containers[index];
+        if (container.isBitmap()) return container.bits[low >> 6] & (1ULL << (low & 63));
+        return std::binary_search(container.array.begin(), container.array.end(), low);
+    }
+
+    /**
+     * @brief Find the smallest ID not smaller than target
+     * @param target Smallest acceptable ID
+     * @param value Pointer to the return uint32_t
+     * @retval true ID found
+     * @retval false No such ID
+     */
+    bool Bitmap::nextFrom(uint32_t target, uint32_t* value) const {
+        uint16_t key = target >> 16;
+        uint32_t low = target & 0xFFFF;
+        for (size_t index = find(key); index < containers.size(); index++, low = 0) {
+            const Container& container = containers[index];
+            // Containers past the target's key match from their first ID
+            if (container.key != key) low = 0;
+            uint32_t base = (uint32_t)container.key << 16;
+            if (container.isBitmap()) {
+                uint32_t i = low >> 6;
+                uint64_t word = container.bits[i] & (~0ULL << (low & 63));
+                while (true) {
+                    if (word) {
+                        *value = base | (i * 64 + __builtin_ctzll(word));
+                        return true;
+                    }
+                    if (++i == bitmapWords) break;
+                    word = container.bits[i];
+                }
+            } else {
+                auto it = std::lower_bound(container.array.begin(), container.array.end(), low);
+                if (it != container.array.end()) {
+                    *value = base | *it;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Get the number of IDs in the set
+     * @return The number of IDs
+     */
+    uint64_t Bitmap::cardinality() const {
+        uint64_t count = 0;
+        for (const Container& container : containers) count += container.cardinality;
+        return count;
+    }
+
+    /**
+     * @brief Check if the set is empty
+     * @retval true Set is empty
+     * @retval false Set has IDs
+     */
+    bool Bitmap::empty() const {
+        return containers.empty();
+    }
+
+    /**
+     * @brief Get every ID in ascending order
+     * @return The IDs
+     */
+    std::vector<uint32_t> Bitmap::toVector() const {
+        std::vector<uint32_t> values;
+        values.reserve(cardinality());
+        for (const Container& container : containers) {
+            uint32_t base = (uint32_t)container.key << 16;
+            if (container.isBitmap()) {
+                for (uint32_t i = 0; i < bitmapWords; i++) {
+                    uint64_t word = container.bits[i];
+                    while (word) {
+                        values.push_back(base | (i * 64 + __builtin_ctzll(word)));
+                        word &= word - 1;
+                    }
+                }
+            } else for (uint16_t low : container.array) values.push_back(base | low);
+        }
+        return values;
+    }
+
+    /**
+     * @brief Get the approximate heap memory used by the set
+     * @return Memory use in bytes
+     */
+    size_t Bitmap::memoryUsage() const {
+        size_t bytes = containers.capacity() * sizeof(Container);
+        for (const Container& container : containers) {
+            bytes += container.array.capacity() * sizeof(uint16_t) + container.bits.capacity() * sizeof(uint64_t);
+        }
+        return bytes;
+    }
+
+    Bitmap::Container Bitmap::intersect(const Container& a, const Container& b) {
+        Container out;
+        out.key = a.key;
+        if (a.isBitmap() && b.isBitmap()) {
+            out.bits.resize(bitmapWords);
+            for (uint32_t i = 0; i < bitmapWords; i++) out.bits[i] = a.bits[i] & b.bits[i];
+            out.cardinality = popcount(out.bits.data());
+        } else if (a.isBitmap() || b.isBitmap()) {
+            const Container& array = a.isBitmap() ? b : a;
+            const Container& bitmap = a.isBitmap() ? a : b;
+            for (uint16_t low : array.array) {
+                if (bitmap.bits[low >> 6] & (1ULL << (low & 63))) out.array.push_back(low);
+            }
+            out.cardinality = out.array.size();
+        } else {
+            const std::vector<uint16_t>& small = a.array.size() <= b.array.size() ? a.array : b.array;
+            const std::vector<uint16_t>& large = a.array.size() <= b.array.size() ? b.array : a.array;
+            if (small.size() * 32 < large.size()) {
+                // Very different sizes, search the large array instead of walking it
+                auto from = large.begin();
+                for (uint16_t low : small) {
+                    from = std::lower_bound(from, large.end(), low);
+                    if (from == large.end()) break;
+                    if (*from == low) out.array.push_back(low);
+                }
+            } else {
+                std::set_intersection(small.begin(), small.end(), large.begin(), large.end(), std::back_inserter(out.array));
+            }
+            out.cardinality = out.array.size();
+        }
+        normalize(out);
+        return out;
+    }
+
+    Bitmap::Container Bitmap::unite(const Container& a, const Container& b) {
+        Container out;
+        out.key = a.key;
+        if (a.isBitmap() && b.isBitmap()) {
+            out.bits.resize(bitmapWords);
+            for (uint32_t i = 0; i < bitmapWords; i++) out.bits[i] = a.bits[i] | b.bits[i];
+            out.cardinality = popcount(out.bits.data());
+        } else if (a.isBitmap() || b.isBitmap()) {
+            const Container& array = a.isBitmap() ? b : a;
+            out.bits = a.isBitmap() ? a.bits : b.bits;
+            for (uint16_t low : array.array) out.bits[low >> 6] |= 1ULL << (low & 63);
+            out.cardinality = popcount(out.bits.data());
+        } else {
+            out.array.reserve(a.array.size() + b.array.size());
+            std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), std::back_inserter(out.array));
+            out.cardinality = out.array.size();
+        }
+        normalize(out);
+        return out;
+    }
+
+    Bitmap::Container Bitmap::subtract(const Container& a, const Container& b) {
+        Container out;
+        out.key = a.key;
+        if (a.isBitmap() && b.isBitmap()) {
+            out.bits.resize(bitmapWords);
+            for (uint32_t i = 0; i < bitmapWords; i++) out.bits[i] = a.bits[i] & ~b.bits[i];
+            out.cardinality = popcount(out.bits.data());
+        } else if (a.isBitmap()) {
+            out.bits = a.bits;
+            for (uint16_t low : b.array) out.bits[low >> 6] &= ~(1ULL << (low & 63));
+            out.cardinality = popcount(out.bits.data());
+        } else if (b.isBitmap()) {
+            for (uint16_t low : a.array) {
+                if (!(b.bits[low >> 6] & (1ULL << (low & 63)))) out.array.push_back(low);
+            }
+            out.cardinality = out.array.size();
+        } else {
+            std::set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), std::back_inserter(out.array));
+            out.cardinality = out.array.size();
+        }
+        normalize(out);
+        return out;
+    }
+
+    /**
+     * @brief IDs in both sets
+     * @param a First set
+     * @param b Second set
+     * @return The intersection
+     */
+    Bitmap Bitmap::intersect(const Bitmap& a, const Bitmap& b) {
+        Bitmap out;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() && j < b.containers.size()) {
+            if (a.containers[i].key < b.containers[j].key) i++;
+            else if (a.containers[i].key > b.containers[j].key) j++;
+            else {
+                Container container = intersect(a.containers[i++], b.containers[j++]);
+                if (container.cardinality) out.containers.push_back(std::move(container));
+            }
+        }
+        return out;
+    }
+
+    /**
+     * @brief IDs in either set
+     * @param a First set
+     * @param b Second set
+     * @return The union
+     */
+    Bitmap Bitmap::unite(const Bitmap& a, const Bitmap& b) {
+        Bitmap out;
+        out.containers.reserve(a.containers.size() + b.containers.size());
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() || j < b.containers.size()) {
+            if (j == b.containers.size() || (i < a.containers.size() && a.containers[i].key < b.containers[j].key)) {
+                out.containers.push_back(a.containers[i++]);
+            } else if (i == a.containers.size() || a.containers[i].key > b.containers[j].key) {
+                out.containers.push_back(b.containers[j++]);
+            } else out.containers.push_back(unite(a.containers[i++], b.containers[j++]));
+        }
+        return out;
+    }
+
+    /**
+     * @brief IDs in the first set but not in the second
+     * @param a First set
+     * @param b Second set
+     * @return The difference
+     */
+    Bitmap Bitmap::subtract(const Bitmap& a, const Bitmap& b) {
+        Bitmap out;
+        size_t j = 0;
+        for (const Container& container : a.containers) {
+            while (j < b.containers.size() && b.containers[j].key < container.key) j++;
+            if (j == b.containers.size() || b.containers[j].key != container.key) {
+                out.containers.push_back(container);
+                continue;
+            }
+            Container rest = subtract(container, b.containers[j]);
+            if (rest.cardinality) out.containers.push_back(std::move(rest));
+        }
+        return out;
+    }
+
+    /**
+     * @brief Load every file and file-tag link from the database
+     * @param db The session to read from
+     * @param errmsg SQLite3 error message char**
+     * @retval true Index loaded
+     * @retval false An error has occurred, the index was left unchanged
+     */
+    bool TagIndex::build(Database& db, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_BUILD_TAG_INDEX);
+        if (!db.isOpen()) return false;
+        std::unordered_map<unsigned int, Bitmap> loadedTags;
+        Bitmap loadedFiles;
+        sqlite3_stmt* stmt = nullptr;
+        // Both come out in ID order, so every add() appends
+        const char* queries[] = {
+            "SELECT id FROM file ORDER BY id;",
+            "SELECT tag, file FROM filetag INDEXED BY filetag_tag_file ORDER BY tag, file;"
+        };
+        for (int q = 0; q < 2; q++) {
+            if (sqlite3_prepare_v2(db.handle(), queries[q], -1, &stmt, nullptr) != SQLITE_OK) {
+                if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+                return false;
+            }
+            int ecode = 0;
+            Bitmap* current = nullptr;
+            unsigned int currentTag = 0;
+            while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (q == 0) {
+                    loadedFiles.add((uint32_t)sqlite3_column_int64(stmt, 0));
+                    continue;
+                }
+                unsigned int tag = (unsigned int)sqlite3_column_int64(stmt, 0);
+                if (!current || tag != currentTag) {
+                    current = &loadedTags[tag];
+                    currentTag = tag;
+                }
+                current->add((uint32_t)sqlite3_column_int64(stmt, 1));
+            }
+            if (ecode != SQLITE_DONE) {
+                if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+                sqlite3_finalize(stmt);
+                return false;
+            }
+            sqlite3_finalize(stmt);
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        tags.swap(loadedTags);
+        files = std::move(loadedFiles);
+        return true;
+    }
+
+    void TagIndex::fileAdded(unsigned int file) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        files.add(file);
+    }
+
+    void TagIndex::tagged(unsigned int file, unsigned int tag) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        tags[tag].add(file);
+    }
+
+    void TagIndex::untagged(unsigned int file, unsigned int tag) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = tags.find(tag);
+        if (it == tags.end()) return;
+        it->second.remove(file);
+        if (it->second.empty()) tags.erase(it);
+    }
+
+    void TagIndex::fileRemoved(unsigned int file) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        files.remove(file);
+    }
+
+    /**
+     * @brief Lock the index for reading
+     * @return The lock, hold it while using tagFiles() and allFiles()
+     */
+    std::shared_lock<std::shared_mutex> TagIndex::readLock() const {
+        return std::shared_lock<std::shared_mutex>(mutex);
+    }
+
+    /**
+     * @brief Get the files with a tag, needs readLock()
+     * @param tag Tag ID
+     * @return The set of file IDs, nullptr if no file has the tag
+     */
+    const Bitmap* TagIndex::tagFiles(unsigned int tag) const {
+        auto it = tags.find(tag);
+        return it == tags.end() ? nullptr : &it->second;
+    }
+
+    /**
+     * @brief Get every file, needs readLock()
+     * @return The set of file IDs
+     */
+    const Bitmap& TagIndex::allFiles() const {
+        return files;
+    }
+
+    /**
+     * @brief Get the approximate heap memory used by the index
+     * @return Memory use in bytes
+     */
+    size_t TagIndex::memoryUsage() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        size_t bytes = files.memoryUsage() + tags.bucket_count() * sizeof(void*);
+        for (const auto& tag : tags) bytes += sizeof(tag) + tag.second.memoryUsage();
+        return bytes;
+    }
+}
@@ -0,0 +1,209 @@
+/**
+ * @file ftagmgrbitmap.h
+ * @brief FTagMgrLib bitmap index header file
+ */
+
+#ifndef FTAGMGRBITMAP_H
+#define FTAGMGRBITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Compressed set of 32-bit IDs, Roaring style
+     *
+     * IDs are split by their upper 16 bits into containers. A container
+     * holds its lower 16 bits as a sorted array while it has at most 4096
+     * of them, and as a 65536-bit bitmap once it has more, so sparse and
+     * dense ranges both stay small. Bitmap-bitmap operations are plain
+     * word loops the compiler vectorizes.
+     */
+    class Bitmap {
+    public:
+        /**
+         * @brief Add an ID
+         * @param value The ID
+         * @retval true ID added
+         * @retval false ID was already in the set
+         */
+        bool add(uint32_t value);
+
+        /**
+         * @brief Remove an ID
+         * @param value The ID
+         * @retval true ID removed
+         * @retval false ID wasn't in the set
+         */
+        bool remove(uint32_t value);
+
+        /**
+         * @brief Check if an ID is in the set
+         * @param value The ID
+         * @retval true ID is in the set
+         * @retval false ID isn't in the set
+         */
+        bool contains(uint32_t value) const;
+
+        /**
+         * @brief Find the smallest ID not smaller than target
+         * @param target Smallest acceptable ID
+         * @param value Pointer to the return uint32_t
+         * @retval true ID found
+         * @retval false No such ID
+         */
+        bool nextFrom(uint32_t target, uint32_t* value) const;
+
+        /**
+         * @brief Get the number of IDs in the set
+         * @return The number of IDs
+         */
+        uint64_t cardinality() const;
+
+        /**
+         * @brief Check if the set is empty
+         * @retval true Set is empty
+         * @retval false Set has IDs
+         */
+        bool empty() const;
+
+        /**
+         * @brief Get every ID in ascending order
+         * @return The IDs
+         */
+        std::vector<uint32_t> toVector() const;
+
+        /**
+         * @brief Get the approximate heap memory used by the set
+         * @return Memory use in bytes
+         */
+        size_t memoryUsage() const;
+
+        /**
+         * @brief IDs in both sets
+         * @param a First set
+         * @param b Second set
+         * @return The intersection
+         */
+        static Bitmap intersect(const Bitmap& a, const Bitmap& b);
+
+        /**
+         * @brief IDs in either set
+         * @param a First set
+         * @param b Second set
+         * @return The union
+         */
+        static Bitmap unite(const Bitmap& a, const Bitmap& b);
+
+        /**
+         * @brief IDs in the first set but not in the second
+         * @param a First set
+         * @param b Second set
+         * @return The difference
+         */
+        static Bitmap subtract(const Bitmap& a, const Bitmap& b);
+
+        // Containers switch from array to bitmap above this many IDs
+        static const uint32_t arrayLimit = 4096;
+        // 64-bit words in a bitmap container
+        static const uint32_t bitmapWords = 1024;
+
+    private:
+        struct Container {
+            uint16_t key;
+            uint32_t cardinality;
+            // Sorted lower 16 bits, used while bits is empty
+            std::vector<uint16_t> array;
+            // bitmapWords words once the container is a bitmap
+            std::vector<uint64_t> bits;
+
+            bool isBitmap() const {
+                return !bits.empty();
+            }
+        };
+
+        /**
+         * @brief Switch a container to whichever representation fits its cardinality
+         * @param container The container
+         */
+        static void normalize(Container& container);
+
+        /**
+         * @brief Find the container for a key
+         * @param key Upper 16 bits
+         * @return Index of the first container with a key not smaller than key
+         */
+        size_t find(uint16_t key) const;
+
+        static Container intersect(const Container& a, const Container& b);
+        static Container unite(const Container& a, const Container& b);
+        static Container subtract(const Container& a, const Container& b);
+
+        // Sorted by key
+        std::vector<Container> containers;
+    };
+
+    /**
+     * @brief In-memory tag to files index, kept next to the SQLite store
+     *
+     * Holds a Bitmap of file IDs for every tag. build() loads it from the
+     * database. Registered as an observer of a Database session, it follows
+     * the tag changes made through that session incrementally. Changes
+     * made through other sessions or processes need another build().
+     *
+     * Thread-safe: one session can update it while other threads read it.
+     */
+    class TagIndex : public Observer {
+    public:
+        /**
+         * @brief Load every file and file-tag link from the database
+         * @param db The session to read from
+         * @param errmsg SQLite3 error message char**
+         * @retval true Index loaded
+         * @retval false An error has occurred, the index was left unchanged
+         */
+        bool build(Database& db, char** errmsg);
+
+        void fileAdded(unsigned int file) override;
+        void tagged(unsigned int file, unsigned int tag) override;
+        void untagged(unsigned int file, unsigned int tag) override;
+        void fileRemoved(unsigned int file) override;
+
+        /**
+         * @brief Lock the index for reading
+         * @return The lock, hold it while using tagFiles() and allFiles()
+         */
+        std::shared_lock<std::shared_mutex> readLock() const;
+
+        /**
+         * @brief Get the files with a tag, needs readLock()
+         * @param tag Tag ID
+         * @return The set of file IDs, nullptr if no file has the tag
+         */
+        const Bitmap* tagFiles(unsigned int tag) const;
+
+        /**
+         * @brief Get every file, needs readLock()
+         * @return The set of file IDs
+         */
+        const Bitmap& allFiles() const;
+
+        /**
+         * @brief Get the approximate heap memory used by the index
+         * @return Memory use in bytes
+         */
+        size_t memoryUsage() const;
+
+    private:
+        mutable std::shared_mutex mutex;
+        std::unordered_map<unsigned int, Bitmap> tags;
+        Bitmap files;
+    };
+}
+
+#endif
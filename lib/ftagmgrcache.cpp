@@ -0,0 +1,313 @@
+/**
+ * @file ftagmgrcache.cpp
+ * @brief FTagMgr name cache source code
+ */
+
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "ftagmgrcache.h"
+
+namespace ftagmgr {
+    namespace {
+        const char dirKind = 'd';
+        const char tagKind = 't';
+
+        struct Node {
+            // Kind, then the name or the ID's bytes
+            std::string key;
+            // Name, for the by-ID direction
+            std::string name;
+            // ID, for the by-name direction
+            unsigned int id;
+        };
+
+        /**
+         * @brief Approximate heap use of a node with its list and index entries
+         * @param node The node
+         * @return Bytes
+         */
+        size_t footprint(const Node& node) {
+            return sizeof(Node) + 2 * sizeof(void*) + 48 + node.key.size() + node.name.size();
+        }
+
+        /**
+         * @brief Build a lookup key in a per-thread buffer, so lookups don't allocate
+         * @param kind dirKind or tagKind
+         * @param name The name
+         * @return The key, valid until the next call on this thread
+         */
+        std::string_view nameKey(char kind, std::string_view name) {
+            thread_local std::string key;
+            key.assign(1, kind);
+            key.append(name);
+            return key;
+        }
+
+        std::string_view idKey(char kind, unsigned int id) {
+            thread_local std::string key;
+            key.assign(1, kind);
+            key.append((const char*)&id, sizeof(id));
+            return key;
+        }
+    }
+
+    /**
+     * @brief One lock, one LRU list and one share of the budget
+     */
+    class NameCache::Shard {
+    public:
+        /**
+         * @brief Find an entry and mark it as recently used
+         * @param key The key
+         * @return The node, nullptr if missing; only valid while mutex is held
+         */
+        const Node* find(std::string_view key) {
+            auto it = index.find(key);
+            if (it == index.end()) return nullptr;
+            lru.splice(lru.begin(), lru, it->second);
+            return &*it->second;
+        }
+
+        /**
+         * @brief Add or replace an entry, evicting the least recently used ones over budget
+         * @param node The entry
+         * @return Number of evicted entries
+         */
+        uint64_t insert(Node&& node) {
+            erase(node.key);
+            lru.push_front(std::move(node));
+            index.emplace(lru.front().key, lru.begin());
+            bytes += footprint(lru.front());
+            uint64_t evicted = 0;
+            while (bytes > budget && lru.size() > 1) {
+                erase(lru.back().key);
+                evicted++;
+            }
+            return evicted;
+        }
+
+        /**
+         * @brief Remove an entry
+         * @param key The key
+         */
+        void erase(std::string_view key) {
+            auto it = index.find(key);
+            if (it == index.end()) return;
+            auto node = it->second;
+            bytes -= footprint(*node);
+            // The index key points into the node, drop it first
+            index.erase(it);
+            lru.erase(node);
+        }
+
+        void clear() {
+            index.clear();
+            lru.clear();
+            bytes = 0;
+        }
+
+        std::mutex mutex;
+        // Most recently used first
+        std::list<Node> lru;
+        // Keys point into the nodes, list nodes never move
+        std::unordered_map<std::string_view, std::list<Node>::iterator> index;
+        size_t bytes = 0;
+        size_t budget = 0;
+    };
+
+    /**
+     * @brief Create an empty cache
+     * @param budgetBytes Approximate memory the cache may use, entries included
+     * @param shards Number of shards per direction, more means less lock contention
+     */
+    NameCache::NameCache(size_t budgetBytes, unsigned int shards)
+        : shardCount(shards ? shards : 1), byName(new Shard[shardCount]), byId(new Shard[shardCount]),
+          hits(0), misses(0), evictions(0) {
+        for (unsigned int i = 0; i < shardCount; i++) {
+            byName[i].budget = budgetBytes / 2 / shardCount;
+            byId[i].budget = budgetBytes / 2 / shardCount;
+        }
+    }
+
+    NameCache::~NameCache() = default;
+
+    /**
+     * @brief Pick the shard of a key
+     * @param shards Shards of one direction
+     * @param key The key
+     * @return The shard
+     */
+    NameCache::Shard& NameCache::shardOf(std::unique_ptr<Shard[]>& shards, std::string_view key) {
+        return shards[std::hash<std::string_view>()(key) % shardCount];
+    }
+
+    int NameCache::getId(char kind, std::string_view name) {
+        std::string_view key = nameKey(kind, name);
+        Shard& shard = shardOf(byName, key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const Node* node = shard.find(key);
+        if (!node) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return (int)node->id;
+    }
+
+    bool NameCache::getName(char kind, unsigned int id, std::string* name) {
+        std::string_view key = idKey(kind, id);
+        Shard& shard = shardOf(byId, key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const Node* node = shard.find(key);
+        if (!node) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        *name = node->name;
+        return true;
+    }
+
+    void NameCache::put(char kind, unsigned int id, std::string_view name) {
+        uint64_t evicted = 0;
+        {
+            std::string_view key = nameKey(kind, name);
+            Shard& shard = shardOf(byName, key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            evicted += shard.insert(Node{std::string(key), std::string(), id});
+        }
+        {
+            std::string_view key = idKey(kind, id);
+            Shard& shard = shardOf(byId, key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            evicted += shard.insert(Node{std::string(key), std::string(name), id});
+        }
+        if (evicted) evictions.fetch_add(evicted, std::memory_order_relaxed);
+    }
+
+    void NameCache::erase(char kind, unsigned int id, std::string_view name) {
+        {
+            std::string_view key = nameKey(kind, name);
+            Shard& shard = shardOf(byName, key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.erase(key);
+        }
+        {
+            std::string_view key = idKey(kind, id);
+            Shard& shard = shardOf(byId, key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.erase(key);
+        }
+    }
+
+    /**
+     * @brief Look up a directory ID
+     * @param path Directory path
+     * @retval -1 Not cached
+     * @return The directory ID
+     */
+    int NameCache::getDir(std::string_view path) {
+        return getId(dirKind, path);
+    }
+
+    /**
+     * @brief Look up a directory path
+     * @param id Directory ID
+     * @param path Pointer to the return std::string, left untouched if not cached
+     * @retval true Path returned
+     * @retval false Not cached
+     */
+    bool NameCache::getDirPath(unsigned int id, std::string* path) {
+        return getName(dirKind, id, path);
+    }
+
+    /**
+     * @brief Look up a tag ID
+     * @param value Tag name
+     * @retval -1 Not cached
+     * @return The tag ID
+     */
+    int NameCache::getTag(std::string_view value) {
+        return getId(tagKind, value);
+    }
+
+    /**
+     * @brief Look up a tag name
+     * @param id Tag ID
+     * @param value Pointer to the return std::string, left untouched if not cached
+     * @retval true Name returned
+     * @retval false Not cached
+     */
+    bool NameCache::getTagValue(unsigned int id, std::string* value) {
+        return getName(tagKind, id, value);
+    }
+
+    /**
+     * @brief Remember a directory, both ways
+     * @param id Directory ID
+     * @param path Directory path
+     */
+    void NameCache::putDir(unsigned int id, std::string_view path) {
+        put(dirKind, id, path);
+    }
+
+    /**
+     * @brief Remember a tag, both ways
+     * @param id Tag ID
+     * @param value Tag name
+     */
+    void NameCache::putTag(unsigned int id, std::string_view value) {
+        put(tagKind, id, value);
+    }
+
+    /**
+     * @brief Forget a directory, both ways
+     * @param id Directory ID
+     * @param path Directory path
+     */
+    void NameCache::eraseDir(unsigned int id, std::string_view path) {
+        erase(dirKind, id, path);
+    }
+
+    /**
+     * @brief Forget a tag, both ways
+     * @param id Tag ID
+     * @param value Tag name
+     */
+    void NameCache::eraseTag(unsigned int id, std::string_view value) {
+        erase(tagKind, id, value);
+    }
+
+    /**
+     * @brief Forget everything, the counters are kept
+     */
+    void NameCache::clear() {
+        for (unsigned int i = 0; i < shardCount; i++) {
+            for (Shard* shard : {&byName[i], &byId[i]}) {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->clear();
+            }
+        }
+    }
+
+    /**
+     * @brief Get the counters and current size
+     * @return The stats
+     */
+    NameCache::Stats NameCache::stats() const {
+        Stats stats{hits.load(), misses.load(), evictions.load(), 0, 0};
+        for (unsigned int i = 0; i < shardCount; i++) {
+            for (Shard* shard : {&byName[i], &byId[i]}) {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                stats.entries += shard->lru.size();
+                stats.bytes += shard->bytes;
+            }
+        }
+        return stats;
+    }
+}
@@ -0,0 +1,153 @@
+/**
+ * @file ftagmgrcache.h
+ * @brief FTagMgrLib name cache header file
+ */
+
+#ifndef FTAGMGRCACHE_H
+#define FTAGMGRCACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace ftagmgr {
+    /**
+     * @brief Bounded cache of directory path and tag name to ID mappings, both ways
+     *
+     * Split into shards with their own lock and LRU list, so threads
+     * looking up different names rarely wait for each other. Each
+     * direction has its own shards and its own share of the memory budget.
+     * Attached to sessions with Database::setCache(), it is filled by their
+     * lookups and inserts and invalidated by their moves and removals.
+     * Changes made by sessions without the cache, or by other processes,
+     * are not seen.
+     *
+     * Thread-safe, one cache can serve any number of sessions.
+     */
+    class NameCache {
+    public:
+        /**
+         * @brief Hit and miss counters and current size
+         */
+        struct Stats {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            size_t entries;
+            size_t bytes;
+        };
+
+        /**
+         * @brief Create an empty cache
+         * @param budgetBytes Approximate memory the cache may use, entries included
+         * @param shards Number of shards per direction, more means less lock contention
+         */
+        explicit NameCache(size_t budgetBytes = 16 * 1024 * 1024, unsigned int shards = 16);
+        ~NameCache();
+        NameCache(const NameCache&) = delete;
+        NameCache& operator=(const NameCache&) = delete;
+
+        /**
+         * @brief Look up a directory ID
+         * @param path Directory path
+         * @retval -1 Not cached
+         * @return The directory ID
+         */
+        int getDir(std::string_view path);
+
+        /**
+         * @brief Look up a directory path
+         * @param id Directory ID
+         * @param path Pointer to the return std::string, left untouched if not cached
+         * @retval true Path returned
+         * @retval false Not cached
+         */
+        bool getDirPath(unsigned int id, std::string* path);
+
+        /**
+         * @brief Look up a tag ID
+         * @param value Tag name
+         * @retval -1 Not cached
+         * @return The tag ID
+         */
+        int getTag(std::string_view value);
+
+        /**
+         * @brief Look up a tag name
+         * @param id Tag ID
+         * @param value Pointer to the return std::string, left untouched if not cached
+         * @retval true Name returned
+         * @retval false Not cached
+         */
+        bool getTagValue(unsigned int id, std::string* value);
+
+        /**
+         * @brief Remember a directory, both ways
+         * @param id Directory ID
+         * @param path Directory path
+         */
+        void putDir(unsigned int id, std::string_view path);
+
+        /**
+         * @brief Remember a tag, both ways
+         * @param id Tag ID
+         * @param value Tag name
+         */
+        void putTag(unsigned int id, std::string_view value);
+
+        /**
+         * @brief Forget a directory, both ways
+         * @param id Directory ID
+         * @param path Directory path
+         */
+        void eraseDir(unsigned int id, std::string_view path);
+
+        /**
+         * @brief Forget a tag, both ways
+         * @param id Tag ID
+         * @param value Tag name
+         */
+        void eraseTag(unsigned int id, std::string_view value);
+
+        /**
+         * @brief Forget everything, the counters are kept
+         */
+        void clear();
+
+        /**
+         * @brief Get the counters and current size
+         * @return The stats
+         */
+        Stats stats() const;
+
+    private:
+        class Shard;
+
+        /**
+         * @brief Pick the shard of a key
+         * @param shards Shards of one direction
+         * @param key The key
+         * @return The shard
+         */
+        Shard& shardOf(std::unique_ptr<Shard[]>& shards, std::string_view key);
+
+        int getId(char kind, std::string_view name);
+        bool getName(char kind, unsigned int id, std::string* name);
+        void put(char kind, unsigned int id, std::string_view name);
+        void erase(char kind, unsigned int id, std::string_view name);
+
+        unsigned int shardCount;
+        // Keyed by kind and name, hold IDs
+        std::unique_ptr<Shard[]> byName;
+        // Keyed by kind and ID, hold names
+        std::unique_ptr<Shard[]> byId;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> evictions;
+    };
+}
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * @file ftagmgrcooccur.cpp
+ * @brief FTagMgrLib tag co-occurrence statistics source code
+ */
+
+#include <algorithm>
+#include <sqlite3.h>
+#include "ftagmgrcooccur.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        /**
+         * @brief Get the key of a tag pair, the same in either order
+         */
+        uint64_t pairKey(unsigned int first, unsigned int second) {
+            if (first > second) std::swap(first, second);
+            return (uint64_t)first << 32 | second;
+        }
+    }
+
+    /**
+     * @param partners Partners kept per tag, suggestions come from these
+     */
+    TagCooccurrence::TagCooccurrence(size_t partners) : partners(std::max<size_t>(partners, 1)) {}
+
+    /**
+     * @brief Load every file-tag link from the database and count them
+     * @param db The session to read from
+     * @param errmsg SQLite3 error message char**
+     * @retval true Statistics loaded
+     * @retval false An error has occurred, the statistics were left unchanged
+     */
+    bool TagCooccurrence::build(Database& db, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_BUILD_COOCCURRENCE);
+        if (!db.isOpen()) return false;
+        std::unordered_map<unsigned int, std::vector<unsigned int>> loadedFiles;
+        std::unordered_map<unsigned int, TagStats> loadedTags;
+        std::unordered_map<uint64_t, uint32_t> loadedPairs;
+        sqlite3_stmt* stmt = nullptr;
+        // The primary key order, every file's tags come together and sorted
+        if (sqlite3_prepare_v2(db.handle(), "SELECT file, tag FROM filetag ORDER BY file, tag;", -1, &stmt, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            return false;
+        }
+        int ecode = 0;
+        std::vector<unsigned int>* current = nullptr;
+        unsigned int currentFile = 0;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+            unsigned int file = (unsigned int)sqlite3_column_int64(stmt, 0);
+            unsigned int tag = (unsigned int)sqlite3_column_int64(stmt, 1);
+            if (!current || file != currentFile) {
+                current = &loadedFiles[file];
+                currentFile = file;
+            }
+            for (unsigned int other : *current) loadedPairs[pairKey(other, tag)]++;
+            current->push_back(tag);
+            loadedTags[tag].files++;
+        }
+        if (ecode != SQLITE_DONE) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        sqlite3_finalize(stmt);
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        fileTags = std::move(loadedFiles);
+        tags = std::move(loadedTags);
+        pairs = std::move(loadedPairs);
+        // Final counts offered in any order leave exactly the top partners
+        for (const auto& [key, together] : pairs) {
+            unsigned int first = (unsigned int)(key >> 32);
+            unsigned int second = (unsigned int)key;
+            offer(tags[first], second, together);
+            offer(tags[second], first, together);
+        }
+        return true;
+    }
+
+    void TagCooccurrence::tagged(unsigned int file, unsigned int tag) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::vector<unsigned int>& fileTagList = fileTags[file];
+        auto it = std::lower_bound(fileTagList.begin(), fileTagList.end(), tag);
+        if (it != fileTagList.end() && *it == tag) return;
+        fileTagList.insert(it, tag);
+        tags[tag].files++;
+        for (unsigned int other : fileTagList) if (other != tag) count(other, tag, true);
+    }
+
+    void TagCooccurrence::untagged(unsigned int file, unsigned int tag) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto found = fileTags.find(file);
+        if (found == fileTags.end()) return;
+        std::vector<unsigned int>& fileTagList = found->second;
+        auto it = std::lower_bound(fileTagList.begin(), fileTagList.end(), tag);
+        if (it == fileTagList.end() || *it != tag) return;
+        fileTagList.erase(it);
+        for (unsigned int other : fileTagList) count(other, tag, false);
+        if (fileTagList.empty()) fileTags.erase(found);
+        auto stats = tags.find(tag);
+        if (stats != tags.end() && --stats->second.files == 0) tags.erase(stats);
+    }
+
+    /**
+     * @brief Get the number of files with a tag
+     * @param tag Tag ID
+     * @return The number of files
+     */
+    uint32_t TagCooccurrence::tagCount(unsigned int tag) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = tags.find(tag);
+        return it == tags.end() ? 0 : it->second.files;
+    }
+
+    /**
+     * @brief Get the number of files with both of two tags
+     * @param first Tag ID
+     * @param second Tag ID
+     * @return The number of files, that of the tag if both are the same
+     */
+    uint32_t TagCooccurrence::pairCount(unsigned int first, unsigned int second) const {
+        if (first == second) return tagCount(first);
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return lookup(first, second);
+    }
+
+    /**
+     * @brief Get how much more often two tags are found together than if they were independent
+     * @param first Tag ID
+     * @param second Tag ID
+     * @return Files with both times tagged files over the product of their file counts,
+     * 1 for independent tags, 0 if either has no files
+     */
+    double TagCooccurrence::lift(unsigned int first, unsigned int second) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto a = tags.find(first);
+        auto b = tags.find(second);
+        if (a == tags.end() || b == tags.end()) return 0;
+        uint32_t together = first == second ? a->second.files : lookup(first, second);
+        return (double)together * fileTags.size() / ((double)a->second.files * b->second.files);
+    }
+
+    /**
+     * @brief Suggest tags for a file that has some tags already
+     * @param tags Tag IDs the file has, unknown ones are ignored
+     * @param count Number of suggestions wanted
+     * @param suggestions Pointer to the return vector, best first, none of the given tags
+     */
+    void TagCooccurrence::suggest(const std::vector<unsigned int>& tags, size_t count, std::vector<TagSuggestion>* suggestions) const {
+        suggestions->clear();
+        if (count == 0) return;
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::vector<std::pair<unsigned int, uint32_t>> given;
+        std::vector<unsigned int> candidates;
+        for (unsigned int tag : tags) {
+            auto it = this->tags.find(tag);
+            if (it == this->tags.end()) continue;
+            given.emplace_back(tag, it->second.files);
+            for (const Partner& partner : it->second.top) candidates.push_back(partner.tag);
+        }
+        if (given.empty()) return;
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        for (unsigned int candidate : candidates) {
+            if (std::find(tags.begin(), tags.end(), candidate) != tags.end()) continue;
+            // Partners missing from a list still count with their exact pair
+            double score = 0;
+            for (const auto& [tag, files] : given) score += (double)lookup(tag, candidate) / files;
+            suggestions->push_back({candidate, score / given.size()});
+        }
+        auto better = [](const TagSuggestion& a, const TagSuggestion& b) { return a.score != b.score ? a.score > b.score : a.tag < b.tag; };
+        if (suggestions->size() > count) {
+            std::partial_sort(suggestions->begin(), suggestions->begin() + count, suggestions->end(), better);
+            suggestions->resize(count);
+        } else std::sort(suggestions->begin(), suggestions->end(), better);
+    }
+
+    /**
+     * @brief Get the approximate heap memory used by the statistics
+     * @return Memory use in bytes
+     */
+    size_t TagCooccurrence::memoryUsage() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        // Buckets plus a node per entry
+        size_t bytes = (fileTags.bucket_count() + tags.bucket_count() + pairs.bucket_count()) * sizeof(void*);
+        bytes += pairs.size() * (sizeof(void*) + sizeof(std::pair<uint64_t, uint32_t>));
+        for (const auto& file : fileTags) bytes += sizeof(void*) + sizeof(file) + file.second.capacity() * sizeof(unsigned int);
+        for (const auto& tag : tags) bytes += sizeof(void*) + sizeof(tag) + tag.second.top.capacity() * sizeof(Partner);
+        return bytes;
+    }
+
+    /**
+     * @brief Change the count of a pair and the partner lists of both tags
+     * @param first Tag ID
+     * @param second Tag ID, not first
+     * @param increment Add a file if true, take one away if false
+     */
+    void TagCooccurrence::count(unsigned int first, unsigned int second, bool increment) {
+        uint64_t key = pairKey(first, second);
+        uint32_t together = 0;
+        if (increment) together = ++pairs[key];
+        else {
+            auto it = pairs.find(key);
+            if (it == pairs.end()) return;
+            together = --it->second;
+            if (together == 0) pairs.erase(it);
+        }
+        for (auto [tag, partner] : {std::make_pair(first, second), std::make_pair(second, first)}) {
+            TagStats& stats = tags[tag];
+            if (increment) {
+                offer(stats, partner, together);
+                continue;
+            }
+            auto it = std::find_if(stats.top.begin(), stats.top.end(), [partner = partner](const Partner& p) { return p.tag == partner; });
+            if (it == stats.top.end()) continue;
+            // Whoever overtakes it shows up on its next increment
+            if (together) it->count = together;
+            else stats.top.erase(it);
+        }
+    }
+
+    /**
+     * @brief Put a partner with its new count into a tag's list, if it ranks there
+     * @param stats The tag
+     * @param partner Partner tag ID
+     * @param count Files with both
+     */
+    void TagCooccurrence::offer(TagStats& stats, unsigned int partner, uint32_t count) {
+        Partner* smallest = nullptr;
+        for (Partner& p : stats.top) {
+            if (p.tag == partner) {
+                p.count = count;
+                return;
+            }
+            if (!smallest || p.count < smallest->count) smallest = &p;
+        }
+        if (stats.top.size() < partners) stats.top.push_back({partner, count});
+        else if (count > smallest->count) *smallest = {partner, count};
+    }
+
+    /**
+     * @brief Get the count of a pair, needs the lock held
+     */
+    uint32_t TagCooccurrence::lookup(unsigned int first, unsigned int second) const {
+        auto it = pairs.find(pairKey(first, second));
+        return it == pairs.end() ? 0 : it->second;
+    }
+}
@@ -0,0 +1,145 @@
+/**
+ * @file ftagmgrcooccur.h
+ * @brief FTagMgrLib tag co-occurrence statistics header file
+ */
+
+#ifndef FTAGMGRCOOCCUR_H
+#define FTAGMGRCOOCCUR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief A tag suggested for a set of tags
+     */
+    struct TagSuggestion {
+        unsigned int tag;
+        // Mean share of the files of each given tag that also have this one, 0 to 1
+        double score;
+    };
+
+    /**
+     * @brief How often tags are found together on a file, kept next to the SQLite store
+     *
+     * Counts the files of every tag and of every pair of tags found
+     * together, only the pairs that occur are stored. Every tag also keeps
+     * its most frequent partners, which is all suggest() looks at, so
+     * suggestions cost the same however many links there are. The lists
+     * are exact after build(); tagging keeps them exact, untagging can
+     * leave a partner out of a list until that pair is counted again.
+     *
+     * build() loads it from the database. Registered as an observer of a
+     * Database session, it follows the tag changes made through that
+     * session incrementally; attached with Database::setCooccurrence(), the
+     * query planner orders intersections by it. Tagging a file costs a
+     * count update per tag the file already has.
+     *
+     * Thread-safe: one session can update it while other threads read it.
+     */
+    class TagCooccurrence : public Observer {
+    public:
+        /**
+         * @param partners Partners kept per tag, suggestions come from these
+         */
+        explicit TagCooccurrence(size_t partners = 32);
+
+        /**
+         * @brief Load every file-tag link from the database and count them
+         * @param db The session to read from
+         * @param errmsg SQLite3 error message char**
+         * @retval true Statistics loaded
+         * @retval false An error has occurred, the statistics were left unchanged
+         */
+        bool build(Database& db, char** errmsg);
+
+        void tagged(unsigned int file, unsigned int tag) override;
+        void untagged(unsigned int file, unsigned int tag) override;
+
+        /**
+         * @brief Get the number of files with a tag
+         * @param tag Tag ID
+         * @return The number of files
+         */
+        uint32_t tagCount(unsigned int tag) const;
+
+        /**
+         * @brief Get the number of files with both of two tags
+         * @param first Tag ID
+         * @param second Tag ID
+         * @return The number of files, that of the tag if both are the same
+         */
+        uint32_t pairCount(unsigned int first, unsigned int second) const;
+
+        /**
+         * @brief Get how much more often two tags are found together than if they were independent
+         * @param first Tag ID
+         * @param second Tag ID
+         * @return Files with both times tagged files over the product of their file counts,
+         * 1 for independent tags, 0 if either has no files
+         */
+        double lift(unsigned int first, unsigned int second) const;
+
+        /**
+         * @brief Suggest tags for a file that has some tags already
+         * @param tags Tag IDs the file has, unknown ones are ignored
+         * @param count Number of suggestions wanted
+         * @param suggestions Pointer to the return vector, best first, none of the given tags
+         */
+        void suggest(const std::vector<unsigned int>& tags, size_t count, std::vector<TagSuggestion>* suggestions) const;
+
+        /**
+         * @brief Get the approximate heap memory used by the statistics
+         * @return Memory use in bytes
+         */
+        size_t memoryUsage() const;
+
+    private:
+        struct Partner {
+            unsigned int tag;
+            uint32_t count;
+        };
+
+        struct TagStats {
+            uint32_t files = 0;
+            // Most frequent partners, unordered, at most partners long
+            std::vector<Partner> top;
+        };
+
+        /**
+         * @brief Change the count of a pair and the partner lists of both tags
+         * @param first Tag ID
+         * @param second Tag ID, not first
+         * @param increment Add a file if true, take one away if false
+         */
+        void count(unsigned int first, unsigned int second, bool increment);
+
+        /**
+         * @brief Put a partner with its new count into a tag's list, if it ranks there
+         * @param stats The tag
+         * @param partner Partner tag ID
+         * @param count Files with both
+         */
+        void offer(TagStats& stats, unsigned int partner, uint32_t count);
+
+        /**
+         * @brief Get the count of a pair, needs the lock held
+         */
+        uint32_t lookup(unsigned int first, unsigned int second) const;
+
+        mutable std::shared_mutex mutex;
+        size_t partners;
+        // Sorted tags of every tagged file, the pairs a new link makes
+        std::unordered_map<unsigned int, std::vector<unsigned int>> fileTags;
+        std::unordered_map<unsigned int, TagStats> tags;
+        // Keyed by the smaller tag ID in the upper and the larger in the lower half
+        std::unordered_map<uint64_t, uint32_t> pairs;
+    };
+}
+
+#endif
@@ -0,0 +1,798 @@
+/**
+ * @file ftagmgrexport.cpp
+ * @brief FTagMgr export and import source code
+ */
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sqlite3.h>
+#ifdef FTAGMGR_ZSTD
+#include <zstd.h>
+#endif
+#include "ftagmgrexport.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        const char magic[8] = {'F', 'T', 'A', 'G', 'M', 'G', 'R', 'X'};
+        const unsigned char formatVersion = 2;
+        // Header flag, blocks may be zstd compressed
+        const unsigned char flagZstd = 1;
+        // Raw bytes gathered before a block is written
+        const size_t blockSize = 1024 * 1024;
+        // Largest block a reader accepts, so a corrupt size can't make it allocate gigabytes
+        const uint64_t maxBlockSize = 64 * 1024 * 1024;
+        // Largest ID the database hands out, IDs past it can only come from a corrupt file
+        const int64_t maxId = 0x7fffffff;
+
+        enum RecordType : unsigned char {
+            RECORD_END, RECORD_TAG, RECORD_DIR, RECORD_FILE, RECORD_LINKS, RECORD_TAG_PARENT
+        };
+
+        /**
+         * @brief Get the name of the parent a tag gets from its own name, as Database does
+         * @param value Tag name
+         * @param parent Pointer to the return std::string_view
+         * @retval true Tag has a parent
+         * @retval false Tag is top level
+         */
+        bool parentTag(std::string_view value, std::string_view* parent) {
+            size_t slash = value.rfind('/');
+            if (slash == std::string_view::npos || slash == 0 || slash + 1 == value.size()) return false;
+            *parent = value.substr(0, slash);
+            return true;
+        }
+
+        /**
+         * @brief Append an unsigned LEB128 varint
+         * @param out The buffer
+         * @param value The value
+         */
+        void putVarint(std::string* out, uint64_t value) {
+            while (value >= 0x80) {
+                out->push_back((char)(value | 0x80));
+                value >>= 7;
+            }
+            out->push_back((char)value);
+        }
+
+        /**
+         * @brief Take an unsigned LEB128 varint off the front of a buffer
+         * @param in The buffer, advanced past the varint
+         * @param value Pointer to the return value
+         * @retval true Varint read
+         * @retval false The buffer ended inside the varint or it is too long
+         */
+        bool getVarint(std::string_view* in, uint64_t* value) {
+            uint64_t result = 0;
+            for (int shift = 0; shift < 64 && !in->empty(); shift += 7) {
+                unsigned char byte = (unsigned char)in->front();
+                in->remove_prefix(1);
+                result |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    *value = result;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Signed deltas interleave as 0, -1, 1, -2, ... so small ones of either sign stay short
+        uint64_t zigzag(int64_t value) {
+            return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+        }
+
+        int64_t unzigzag(uint64_t value) {
+            return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        }
+
+        void setCorrupt(const char* what, char** errmsg) {
+            if (errmsg) *errmsg = sqlite3_mprintf("corrupt export file: %s", what);
+        }
+
+        /**
+         * @brief Gathers records into blocks and writes them out
+         */
+        class StreamWriter {
+        public:
+            StreamWriter(FILE* file, const ExportOptions& options) : file(file), options(options), bytes(0) {
+#ifdef FTAGMGR_ZSTD
+                ctx = options.compress ? ZSTD_createCCtx() : nullptr;
+#endif
+            }
+
+            ~StreamWriter() {
+#ifdef FTAGMGR_ZSTD
+                ZSTD_freeCCtx(ctx);
+#endif
+            }
+
+            /**
+             * @brief Write the file header
+             * @param errmsg SQLite3 error message char**
+             * @retval true Header written
+             * @retval false The file couldn't be written
+             */
+            bool start(char** errmsg) {
+                std::string header(magic, sizeof(magic));
+                header.push_back((char)formatVersion);
+                header.push_back((char)(options.compress ? flagZstd : 0));
+                return write(header, errmsg);
+            }
+
+            /**
+             * @brief Add a record, writing a block once enough gathered
+             * @param type Record type
+             * @param payload Record payload
+             * @param errmsg SQLite3 error message char**
+             * @retval true Record added
+             * @retval false A block couldn't be compressed or written
+             */
+            bool record(RecordType type, std::string_view payload, char** errmsg) {
+                raw.push_back((char)type);
+                putVarint(&raw, payload.size());
+                raw.append(payload);
+                return raw.size() < blockSize || flush(errmsg);
+            }
+
+            /**
+             * @brief Add the end record and the end marker, then flush the file
+             * @param errmsg SQLite3 error message char**
+             * @retval true File complete
+             * @retval false The file couldn't be written
+             */
+            bool finish(char** errmsg) {
+                if (!record(RECORD_END, std::string_view(), errmsg) || !flush(errmsg)) return false;
+                std::string end;
+                putVarint(&end, 0);
+                if (!write(end, errmsg)) return false;
+                if (fflush(file) != 0) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("cannot write export file: %s", strerror(errno));
+                    return false;
+                }
+                return true;
+            }
+
+            size_t written() const {
+                return bytes;
+            }
+
+        private:
+            /**
+             * @brief Write the gathered records as one block
+             * @param errmsg SQLite3 error message char**
+             * @retval true Block written
+             * @retval false The block couldn't be compressed or written
+             */
+            bool flush(char** errmsg) {
+                if (raw.empty()) return true;
+                std::string_view stored = raw;
+#ifdef FTAGMGR_ZSTD
+                if (ctx) {
+                    compressed.resize(ZSTD_compressBound(raw.size()));
+                    size_t size = ZSTD_compressCCtx(ctx, compressed.data(), compressed.size(), raw.data(), raw.size(), options.level);
+                    if (ZSTD_isError(size)) {
+                        if (errmsg) *errmsg = sqlite3_mprintf("cannot compress export block: %s", ZSTD_getErrorName(size));
+                        return false;
+                    }
+                    // Blocks that don't shrink are stored as they are, readers tell by the sizes
+                    if (size < raw.size()) stored = std::string_view(compressed.data(), size);
+                }
+#endif
+                header.clear();
+                putVarint(&header, raw.size());
+                putVarint(&header, stored.size());
+                if (!write(header, errmsg) || !write(stored, errmsg)) return false;
+                raw.clear();
+                return true;
+            }
+
+            bool write(std::string_view data, char** errmsg) {
+                if (fwrite(data.data(), 1, data.size(), file) != data.size()) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("cannot write export file: %s", strerror(errno));
+                    return false;
+                }
+                bytes += data.size();
+                return true;
+            }
+
+            FILE* file;
+            const ExportOptions& options;
+            size_t bytes;
+            std::string raw;
+            std::string header;
+#ifdef FTAGMGR_ZSTD
+            std::string compressed;
+            ZSTD_CCtx* ctx;
+#endif
+        };
+
+        /**
+         * @brief Reads blocks and splits them into records
+         */
+        class StreamReader {
+        public:
+            explicit StreamReader(FILE* file) : file(file), pos(0), compressed(false) {}
+
+            /**
+             * @brief Read and check the file header
+             * @param errmsg SQLite3 error message char**
+             * @retval true Header fine
+             * @retval false Not an export file, a newer version or compressed without zstd support
+             */
+            bool start(char** errmsg) {
+                char header[sizeof(magic) + 2];
+                if (fread(header, 1, sizeof(header), file) != sizeof(header) || std::memcmp(header, magic, sizeof(magic)) != 0) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("not an export file");
+                    return false;
+                }
+                // Version 1 only lacks the tag parent records
+                if ((unsigned char)header[sizeof(magic)] == 0 || (unsigned char)header[sizeof(magic)] > formatVersion) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("unsupported export format version %d", (unsigned char)header[sizeof(magic)]);
+                    return false;
+                }
+                compressed = (header[sizeof(magic) + 1] & flagZstd) != 0;
+#ifndef FTAGMGR_ZSTD
+                if (compressed) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("export file is compressed, the library is built without zstd");
+                    return false;
+                }
+#endif
+                return true;
+            }
+
+            /**
+             * @brief Get the next record
+             * @param type Pointer to the return type
+             * @param payload Pointer to the return payload, valid until the next call
+             * @param errmsg SQLite3 error message char**
+             * @retval -1 The file couldn't be read or is corrupt
+             * @retval 0 End record reached
+             * @retval 1 Record returned
+             */
+            short next(unsigned char* type, std::string_view* payload, char** errmsg) {
+                if (!fill(1, errmsg)) return -1;
+                *type = (unsigned char)data[pos++];
+                uint64_t length = 0;
+                for (int shift = 0;; shift += 7) {
+                    if (shift >= 64) {
+                        setCorrupt("bad record length", errmsg);
+                        return -1;
+                    }
+                    if (!fill(1, errmsg)) return -1;
+                    unsigned char byte = (unsigned char)data[pos++];
+                    length |= (uint64_t)(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) break;
+                }
+                if (length > maxBlockSize) {
+                    setCorrupt("bad record length", errmsg);
+                    return -1;
+                }
+                if (!fill(length, errmsg)) return -1;
+                *payload = std::string_view(data.data() + pos, length);
+                pos += length;
+                return *type == RECORD_END ? 0 : 1;
+            }
+
+        private:
+            /**
+             * @brief Read blocks until enough bytes are buffered
+             * @param size Bytes needed past the current position
+             * @param errmsg SQLite3 error message char**
+             * @retval true Bytes buffered
+             * @retval false The file ended, couldn't be read or is corrupt
+             */
+            bool fill(size_t size, char** errmsg) {
+                while (data.size() - pos < size) {
+                    // Drop what was consumed, so the buffer stays about one block long
+                    data.erase(0, pos);
+                    pos = 0;
+                    uint64_t rawSize = 0, storedSize = 0;
+                    if (!readVarint(&rawSize, errmsg)) return false;
+                    if (rawSize == 0) {
+                        setCorrupt("ends before its last record", errmsg);
+                        return false;
+                    }
+                    if (!readVarint(&storedSize, errmsg)) return false;
+                    if (rawSize > maxBlockSize || storedSize > rawSize || (storedSize < rawSize && !compressed)) {
+                        setCorrupt("bad block size", errmsg);
+                        return false;
+                    }
+                    size_t end = data.size();
+                    if (storedSize == rawSize) {
+                        data.resize(end + rawSize);
+                        if (!read(&data[end], rawSize, errmsg)) return false;
+                        continue;
+                    }
+#ifdef FTAGMGR_ZSTD
+                    block.resize(storedSize);
+                    if (!read(&block[0], storedSize, errmsg)) return false;
+                    data.resize(end + rawSize);
+                    size_t size = ZSTD_decompress(&data[end], rawSize, block.data(), storedSize);
+                    if (ZSTD_isError(size) || size != rawSize) {
+                        setCorrupt("bad compressed block", errmsg);
+                        return false;
+                    }
+#endif
+                }
+                return true;
+            }
+
+            bool read(char* out, size_t size, char** errmsg) {
+                if (fread(out, 1, size, file) == size) return true;
+                if (ferror(file)) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("cannot read export file: %s", strerror(errno));
+                } else setCorrupt("truncated", errmsg);
+                return false;
+            }
+
+            bool readVarint(uint64_t* value, char** errmsg) {
+                *value = 0;
+                for (int shift = 0; shift < 64; shift += 7) {
+                    char byte;
+                    if (!read(&byte, 1, errmsg)) return false;
+                    *value |= (uint64_t)(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) return true;
+                }
+                setCorrupt("bad block size", errmsg);
+                return false;
+            }
+
+            FILE* file;
+            // Decompressed bytes not yet consumed start at pos
+            std::string data;
+            size_t pos;
+            bool compressed;
+#ifdef FTAGMGR_ZSTD
+            std::string block;
+#endif
+        };
+
+        /**
+         * @brief Run a query and hand every row to a function
+         * @param db The session
+         * @param sql The query
+         * @param fn Called with the statement on every row, returns false to stop with an error
+         * @param errmsg SQLite3 error message char**, left to fn when it fails
+         * @retval true Every row handled
+         * @retval false An error has occurred
+         */
+        template<typename F>
+        bool forEachRow(Database& db, const char* sql, F fn, char** errmsg) {
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(db.handle(), sql, -1, &stmt, nullptr) != SQLITE_OK) {
+                if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+                return false;
+            }
+            int ecode;
+            while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (!fn(stmt)) {
+                    sqlite3_finalize(stmt);
+                    return false;
+                }
+            }
+            if (ecode != SQLITE_DONE && errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            return ecode == SQLITE_DONE;
+        }
+
+        std::string_view columnText(sqlite3_stmt* stmt, int column) {
+            const char* text = (const char*)sqlite3_column_text(stmt, column);
+            return std::string_view(text ? text : "", (size_t)sqlite3_column_bytes(stmt, column));
+        }
+
+        /**
+         * @brief Write every table as records
+         * @param db The session, in a transaction
+         * @param writer The output
+         * @param stats Pointer to the counters
+         * @param errmsg SQLite3 error message char**
+         * @retval true Everything written
+         * @retval false An error has occurred
+         */
+        bool writeRecords(Database& db, StreamWriter& writer, TransferStats* stats, char** errmsg) {
+            std::string payload;
+            int64_t previous = 0;
+            // Parents the names don't imply and aliases as (tag, parent, alias), written once every tag they refer to is
+            std::vector<std::array<int64_t, 3>> relations;
+            bool ok = forEachRow(db, "SELECT tag.id, tag.tag, tag.parent, tag.alias, parent.tag FROM tag "
+                                     "LEFT JOIN tag AS parent ON parent.id = tag.parent ORDER BY tag.id;", [&](sqlite3_stmt* stmt) {
+                int64_t id = sqlite3_column_int64(stmt, 0), parent = sqlite3_column_int64(stmt, 2), alias = sqlite3_column_int64(stmt, 3);
+                std::string_view value = columnText(stmt, 1), implied;
+                if (alias != 0 || (parentTag(value, &implied) ? columnText(stmt, 4) != implied : parent != 0)) {
+                    relations.push_back({id, parent, alias});
+                }
+                payload.clear();
+                putVarint(&payload, (uint64_t)(id - previous));
+                payload.append(value);
+                previous = id;
+                stats->tags++;
+                return writer.record(RECORD_TAG, payload, errmsg);
+            }, errmsg);
+            if (!ok) return false;
+            previous = 0;
+            for (const auto& [id, parent, alias] : relations) {
+                payload.clear();
+                putVarint(&payload, (uint64_t)(id - previous));
+                putVarint(&payload, (uint64_t)parent);
+                putVarint(&payload, (uint64_t)alias);
+                previous = id;
+                if (!writer.record(RECORD_TAG_PARENT, payload, errmsg)) return false;
+            }
+            // Paths built top-down, so parents come first and siblings share their prefix with the path before
+            // Implicit directories are only needed when files are in them
+            previous = 0;
+            std::string previousPath;
+            ok = forEachRow(db, "WITH RECURSIVE sub(id, path, implicit) AS ("
+                                "SELECT id, CASE WHEN name = '' THEN '/' ELSE name END, implicit FROM dir WHERE parent = 0 UNION ALL "
+                                "SELECT dir.id, CASE WHEN sub.path = '/' THEN '/' ELSE sub.path || '/' END || dir.name, dir.implicit "
+                                "FROM dir JOIN sub ON dir.parent = sub.id) "
+                                "SELECT id, path FROM sub WHERE implicit = 0 OR EXISTS (SELECT 1 FROM file WHERE file.dir = sub.id);",
+                            [&](sqlite3_stmt* stmt) {
+                int64_t id = sqlite3_column_int64(stmt, 0);
+                std::string_view path = columnText(stmt, 1);
+                size_t shared = 0;
+                while (shared < path.size() && shared < previousPath.size() && path[shared] == previousPath[shared]) shared++;
+                payload.clear();
+                putVarint(&payload, zigzag(id - previous));
+                putVarint(&payload, shared);
+                payload.append(path.substr(shared));
+                previous = id;
+                previousPath.assign(path);
+                stats->dirs++;
+                return writer.record(RECORD_DIR, payload, errmsg);
+            }, errmsg);
+            if (!ok) return false;
+            // Walks the (dir, name) index, no sorting
+            previous = 0;
+            int64_t previousDir = 0;
+            ok = forEachRow(db, "SELECT id, dir, name FROM file ORDER BY dir, name;", [&](sqlite3_stmt* stmt) {
+                int64_t id = sqlite3_column_int64(stmt, 0), dir = sqlite3_column_int64(stmt, 1);
+                payload.clear();
+                putVarint(&payload, zigzag(id - previous));
+                putVarint(&payload, (uint64_t)(dir - previousDir));
+                payload.append(columnText(stmt, 2));
+                previous = id;
+                previousDir = dir;
+                stats->files++;
+                return writer.record(RECORD_FILE, payload, errmsg);
+            }, errmsg);
+            if (!ok) return false;
+            // One record per file with its tags, in primary key order
+            previous = 0;
+            int64_t file = -1, previousTag = 0;
+            ok = forEachRow(db, "SELECT file, tag FROM filetag ORDER BY file, tag;", [&](sqlite3_stmt* stmt) {
+                int64_t rowFile = sqlite3_column_int64(stmt, 0), tag = sqlite3_column_int64(stmt, 1);
+                if (rowFile != file) {
+                    if (file >= 0 && !writer.record(RECORD_LINKS, payload, errmsg)) return false;
+                    payload.clear();
+                    putVarint(&payload, (uint64_t)(rowFile - previous));
+                    previous = file = rowFile;
+                    previousTag = 0;
+                }
+                putVarint(&payload, (uint64_t)(tag - previousTag));
+                previousTag = tag;
+                stats->links++;
+                return true;
+            }, errmsg);
+            if (!ok) return false;
+            return file < 0 || writer.record(RECORD_LINKS, payload, errmsg);
+        }
+
+        /**
+         * @brief Export IDs to database IDs, indexed by export ID
+         *
+         * The array only grows to about twice the IDs set, so a file with
+         * a few huge IDs can't make it allocate gigabytes; IDs past that
+         * go in a hash map.
+         */
+        class IdMap {
+        public:
+            void set(uint64_t source, int target) {
+                if (source < ids.size() || source <= 2 * count + 1024) {
+                    if (source >= ids.size()) ids.resize(source + 1, -1);
+                    ids[source] = target;
+                } else sparse[source] = target;
+                count++;
+            }
+
+            int get(uint64_t source) const {
+                if (source < ids.size() && ids[source] >= 0) return ids[source];
+                if (sparse.empty()) return -1;
+                auto it = sparse.find(source);
+                return it == sparse.end() ? -1 : it->second;
+            }
+
+        private:
+            std::vector<int> ids;
+            std::unordered_map<uint64_t, int> sparse;
+            uint64_t count = 0;
+        };
+
+        /**
+         * @brief Named records waiting to be written by one batch call
+         */
+        struct Pending {
+            std::vector<uint64_t> sources;
+            // Names back to back, names[ends[i - 1]..ends[i]) is the i-th one
+            std::string names;
+            std::vector<size_t> ends;
+            std::vector<std::string_view> views;
+
+            void add(uint64_t source, std::string_view name) {
+                sources.push_back(source);
+                names.append(name);
+                ends.push_back(names.size());
+            }
+
+            /**
+             * @brief Get views of the names, valid until the next add() or clear()
+             * @return The names
+             */
+            const std::vector<std::string_view>& list() {
+                views.clear();
+                size_t start = 0;
+                for (size_t end : ends) {
+                    views.emplace_back(names.data() + start, end - start);
+                    start = end;
+                }
+                return views;
+            }
+
+            void clear() {
+                sources.clear();
+                names.clear();
+                ends.clear();
+            }
+        };
+
+        /**
+         * @brief Writes records to the database in batches
+         */
+        class Importer {
+        public:
+            Importer(Database& db, TransferStats* stats)
+                : db(db), stats(stats), previousTag(0), previousRelation(0), previousDir(0), previousFile(0), previousFileDir(0),
+                  previousLinkFile(0), fileDir(-1) {}
+
+            /**
+             * @brief Decode a record and queue it
+             * @param type Record type
+             * @param payload Record payload
+             * @param errmsg SQLite3 error message char**
+             * @retval true Record queued
+             * @retval false The record is corrupt or a batch couldn't be written
+             */
+            bool record(unsigned char type, std::string_view payload, char** errmsg) {
+                uint64_t value = 0;
+                switch (type) {
+                    case RECORD_TAG:
+                        if (!getVarint(&payload, &value)) break;
+                        previousTag += value;
+                        if (previousTag > (uint64_t)maxId) break;
+                        if (!links.empty() && !flush(errmsg)) return false;
+                        tags.add(previousTag, payload);
+                        stats->tags++;
+                        return true;
+                    case RECORD_TAG_PARENT: {
+                        uint64_t parent = 0, alias = 0;
+                        if (!getVarint(&payload, &value) || !getVarint(&payload, &parent) || !getVarint(&payload, &alias)) break;
+                        previousRelation += value;
+                        if (!tags.sources.empty() && !flush(errmsg)) return false;
+                        int tag = tagMap.get(previousRelation);
+                        int target = tagMap.get(alias ? alias : parent);
+                        if (tag < 0 || ((alias || parent) && target < 0)) break;
+                        // A merge can meet a hierarchy that contradicts it, the database's own is kept then
+                        char* error = nullptr;
+                        bool set = alias ? db.setTagAlias(tag, target, &error) : db.setTagParent(tag, parent ? target : 0, &error);
+                        if (!set && error) {
+                            if (errmsg) *errmsg = error;
+                            else sqlite3_free(error);
+                            return false;
+                        }
+                        return true;
+                    }
+                    case RECORD_DIR: {
+                        uint64_t shared = 0;
+                        if (!getVarint(&payload, &value) || !getVarint(&payload, &shared) || shared > previousPath.size()) break;
+                        previousDir += unzigzag(value);
+                        if (previousDir < 0 || previousDir > maxId) break;
+                        previousPath.resize(shared);
+                        previousPath.append(payload);
+                        dirs.add((uint64_t)previousDir, previousPath);
+                        stats->dirs++;
+                        return true;
+                    }
+                    case RECORD_FILE: {
+                        uint64_t dirDelta = 0;
+                        if (!getVarint(&payload, &value) || !getVarint(&payload, &dirDelta)) break;
+                        previousFile += unzigzag(value);
+                        if (previousFile < 0 || previousFile > maxId) break;
+                        previousFileDir += dirDelta;
+                        // Files of one directory go in one batch call, the directories they need first
+                        if (!dirs.sources.empty() && !flush(errmsg)) return false;
+                        int dir = dirMap.get(previousFileDir);
+                        if (dir < 0) break;
+                        if (dir != fileDir && !flushFiles(errmsg)) return false;
+                        fileDir = dir;
+                        files.add((uint64_t)previousFile, payload);
+                        stats->files++;
+                        return true;
+                    }
+                    case RECORD_LINKS: {
+                        if (!getVarint(&payload, &value)) break;
+                        previousLinkFile += value;
+                        if ((!tags.sources.empty() || !files.sources.empty()) && !flush(errmsg)) return false;
+                        int file = fileMap.get(previousLinkFile);
+                        if (file < 0) break;
+                        uint64_t tag = 0;
+                        bool ok = true;
+                        while (!payload.empty()) {
+                            ok = getVarint(&payload, &value);
+                            tag += value;
+                            int target = tagMap.get(tag);
+                            if (!ok || target < 0) {
+                                ok = false;
+                                break;
+                            }
+                            links.push_back(FileTag{(unsigned int)file, (unsigned int)target});
+                            stats->links++;
+                        }
+                        if (!ok) break;
+                        return true;
+                    }
+                    default:
+                        setCorrupt("unknown record type", errmsg);
+                        return false;
+                }
+                setCorrupt("bad record", errmsg);
+                return false;
+            }
+
+            /**
+             * @brief Write everything queued
+             * @param errmsg SQLite3 error message char**
+             * @retval true Queue written
+             * @retval false A batch couldn't be written
+             */
+            bool flush(char** errmsg) {
+                if (!tags.sources.empty()) {
+                    if (!db.addTags(tags.list(), &ids, errmsg)) return false;
+                    for (size_t i = 0; i < ids.size(); i++) tagMap.set(tags.sources[i], ids[i]);
+                    tags.clear();
+                }
+                if (!dirs.sources.empty()) {
+                    if (!db.addDirs(dirs.list(), &ids, errmsg)) return false;
+                    for (size_t i = 0; i < ids.size(); i++) dirMap.set(dirs.sources[i], ids[i]);
+                    dirs.clear();
+                }
+                if (!flushFiles(errmsg)) return false;
+                if (!links.empty()) {
+                    if (!db.tagFiles(links, errmsg)) return false;
+                    links.clear();
+                }
+                return true;
+            }
+
+        private:
+            bool flushFiles(char** errmsg) {
+                if (files.sources.empty()) return true;
+                if (!db.addFiles(fileDir, files.list(), &ids, errmsg)) return false;
+                for (size_t i = 0; i < ids.size(); i++) fileMap.set(files.sources[i], ids[i]);
+                files.clear();
+                return true;
+            }
+
+            Database& db;
+            TransferStats* stats;
+            // Decoding state, every ID is a delta against the record before
+            uint64_t previousTag;
+            uint64_t previousRelation;
+            int64_t previousDir;
+            std::string previousPath;
+            int64_t previousFile;
+            uint64_t previousFileDir;
+            uint64_t previousLinkFile;
+            IdMap tagMap, dirMap, fileMap;
+            Pending tags, dirs, files;
+            // Database ID of the directory the queued files are in
+            int fileDir;
+            std::vector<FileTag> links;
+            std::vector<int> ids;
+        };
+    }
+
+    /**
+     * @brief Write every directory, file, tag and file-tag link to an export file
+     * @param db The session to read with
+     * @param path Path of the export file, overwritten if it exists
+     * @param options Export settings
+     * @param stats Pointer to the return TransferStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Database exported
+     * @retval false The file couldn't be written, compression isn't available or a database error has occurred
+     */
+    bool exportDatabase(Database& db, const char* path, const ExportOptions& options, TransferStats* stats, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_EXPORT_DATABASE);
+#ifndef FTAGMGR_ZSTD
+        if (options.compress) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot compress export, the library is built without zstd");
+            return false;
+        }
+#endif
+        FILE* file = fopen(path, "wb");
+        if (!file) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
+        TransferStats counts;
+        bool ok;
+        {
+            StreamWriter writer(file, options);
+            // One read transaction, so every table comes from the same snapshot
+            ok = db.begin(errmsg);
+            if (ok) {
+                ok = writer.start(errmsg) && writeRecords(db, writer, &counts, errmsg) && writer.finish(errmsg);
+                db.commit(nullptr);
+            }
+            counts.bytes = writer.written();
+        }
+        if (fclose(file) != 0 && ok) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot write %s: %s", path, strerror(errno));
+            ok = false;
+        }
+        // A partial export would only fail later, on import
+        if (!ok) std::remove(path);
+        else if (stats) *stats = counts;
+        return ok;
+    }
+
+    /**
+     * @brief Add everything in an export file to a database
+     * @param db The session to write with
+     * @param path Path of the export file
+     * @param options Import settings
+     * @param stats Pointer to the return TransferStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Everything imported
+     * @retval false The file couldn't be read or is corrupt, or a database error has occurred; batches already committed are kept
+     */
+    bool importDatabase(Database& db, const char* path, const ImportOptions& options, TransferStats* stats, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_IMPORT_DATABASE);
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
+        TransferStats counts;
+        StreamReader reader(file);
+        Importer importer(db, &counts);
+        bool ok = reader.start(errmsg) && db.begin(errmsg);
+        if (ok) {
+            unsigned char type = 0;
+            std::string_view payload;
+            size_t batched = 0;
+            short res = -1;
+            while (ok && (res = reader.next(&type, &payload, errmsg)) == 1) {
+                ok = importer.record(type, payload, errmsg);
+                // The batch functions nest in this transaction, it's committed every batchSize records
+                if (ok && ++batched >= options.batchSize) {
+                    ok = importer.flush(errmsg) && db.commit(errmsg) && db.begin(errmsg);
+                    batched = 0;
+                }
+            }
+            ok = ok && res == 0 && importer.flush(errmsg) && db.commit(errmsg);
+            if (!ok) db.rollback(nullptr);
+        }
+        fclose(file);
+        if (stats) *stats = counts;
+        return ok;
+    }
+}
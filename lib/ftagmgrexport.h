@@ -0,0 +1,91 @@
+/**
+ * @file ftagmgrexport.h
+ * @brief FTagMgrLib export and import header file
+ */
+
+#ifndef FTAGMGREXPORT_H
+#define FTAGMGREXPORT_H
+
+#include <cstddef>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Export settings
+     */
+    struct ExportOptions {
+        // Compress the stream in zstd frames, needs the library built with ZSTD=1
+        bool compress = false;
+        // zstd compression level
+        int level = 3;
+    };
+
+    /**
+     * @brief Import settings
+     */
+    struct ImportOptions {
+        // Records written per transaction
+        size_t batchSize = 50000;
+    };
+
+    /**
+     * @brief What an export wrote or an import read
+     */
+    struct TransferStats {
+        size_t dirs = 0;
+        size_t files = 0;
+        size_t tags = 0;
+        size_t links = 0;
+        // Size of the export file
+        size_t bytes = 0;
+    };
+
+    /**
+     * @brief Write every directory, file, tag and file-tag link to an export file
+     *
+     * The file is an 8-byte magic, a version and a flags byte, then blocks
+     * of at most about 1 MiB, each one a varint raw size, a varint stored
+     * size and the bytes, zstd compressed when the stored size is the
+     * smaller one. A zero raw size ends the file. The blocks carry records
+     * back to back: a type byte, a varint payload length and the payload.
+     * Tags come first in ID order, then the tag parents their names don't
+     * imply and the aliases, then directories parents first with
+     * front-coded paths, then files by directory and name, then each file's
+     * tags. IDs are varints, delta-encoded against the previous record.
+     *
+     * The database is read in one pass from a single snapshot, memory use
+     * doesn't grow with its size. Directories that were only added
+     * implicitly are written when they hold files, and come back as added.
+     *
+     * @param db The session to read with
+     * @param path Path of the export file, overwritten if it exists
+     * @param options Export settings
+     * @param stats Pointer to the return TransferStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Database exported
+     * @retval false The file couldn't be written, compression isn't available or a database error has occurred
+     */
+    bool exportDatabase(Database& db, const char* path, const ExportOptions& options, TransferStats* stats, char** errmsg);
+
+    /**
+     * @brief Add everything in an export file to a database
+     *
+     * Records are read in one pass and written through the batch functions
+     * of db in transactions of options.batchSize records, so observers see
+     * the import like any other change. Existing directories, files, tags
+     * and links are kept, so importing into a non-empty database merges.
+     * Memory use is a few bytes per directory, file and tag of the export,
+     * to map their IDs, and doesn't grow with the number of links.
+     *
+     * @param db The session to write with
+     * @param path Path of the export file
+     * @param options Import settings
+     * @param stats Pointer to the return TransferStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Everything imported
+     * @retval false The file couldn't be read or is corrupt, or a database error has occurred; batches already committed are kept
+     */
+    bool importDatabase(Database& db, const char* path, const ImportOptions& options, TransferStats* stats, char** errmsg);
+}
+
+#endif
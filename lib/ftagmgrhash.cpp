@@ -0,0 +1,575 @@
+/**
+ * @file ftagmgrhash.cpp
+ * @brief FTagMgr content hashing source code
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ftagmgrhash.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+        const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+        const uint64_t prime3 = 0x165667B19E3779F9ULL;
+        const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+        const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+        // Read size per hashing thread, large enough that the syscalls don't show
+        const size_t readBufferSize = 1024 * 1024;
+
+        inline uint64_t rotl(uint64_t x, int r) {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        // Unaligned little endian loads, compiled to plain moves on x86
+        inline uint64_t read64(const unsigned char* p) {
+            uint64_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint32_t read32(const unsigned char* p) {
+            uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint64_t round(uint64_t acc, uint64_t input) {
+            acc += input * prime2;
+            acc = rotl(acc, 31);
+            return acc * prime1;
+        }
+
+        inline uint64_t mergeRound(uint64_t acc, uint64_t lane) {
+            acc ^= round(0, lane);
+            return acc * prime1 + prime4;
+        }
+
+        /**
+         * @brief Hash whole 32 byte stripes into the lanes
+         * @param lanes The four lanes
+         * @param p First byte
+         * @param stripes Number of stripes
+         */
+        inline void consume(uint64_t* lanes, const unsigned char* p, size_t stripes) {
+            uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+            for (size_t i = 0; i < stripes; i++, p += 32) {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            lanes[0] = v1;
+            lanes[1] = v2;
+            lanes[2] = v3;
+            lanes[3] = v4;
+        }
+
+        /**
+         * @brief Finish a hash with the bytes after the last stripe
+         * @param h The hash so far, with the total length added
+         * @param p First remaining byte
+         * @param length Number of remaining bytes, below 32
+         * @return The hash
+         */
+        uint64_t finish(uint64_t h, const unsigned char* p, size_t length) {
+            for (; length >= 8; length -= 8, p += 8) h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+            if (length >= 4) {
+                h = rotl(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+                length -= 4;
+                p += 4;
+            }
+            for (; length > 0; length--, p++) h = rotl(h ^ (*p * prime5), 11) * prime1;
+            h ^= h >> 33;
+            h *= prime2;
+            h ^= h >> 29;
+            h *= prime3;
+            h ^= h >> 32;
+            return h;
+        }
+
+        inline long long mtimeOf(const struct stat& st) {
+            return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        }
+
+        /**
+         * @brief Hash a file with a caller provided buffer
+         * @param path Path of the file
+         * @param buffer readBufferSize bytes
+         * @param fingerprint Pointer to the return Fingerprint
+         * @return 0, or the errno of the failure
+         */
+        int readAndHash(const char* path, char* buffer, Fingerprint* fingerprint) {
+            // Not following links, a link and its target would otherwise look like duplicates
+            int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NOATIME);
+            // O_NOATIME is only allowed on our own files
+            if (fd < 0 && errno == EPERM) fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (fd < 0) return errno;
+            struct stat before;
+            if (fstat(fd, &before) != 0) {
+                int error = errno;
+                close(fd);
+                return error;
+            }
+            if (!S_ISREG(before.st_mode)) {
+                close(fd);
+                return EINVAL;
+            }
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            Hasher hasher;
+            int error = 0;
+            while (true) {
+                ssize_t bytes = read(fd, buffer, readBufferSize);
+                if (bytes == 0) break;
+                if (bytes < 0) {
+                    if (errno == EINTR) continue;
+                    error = errno;
+                    break;
+                }
+                hasher.update(buffer, (size_t)bytes);
+            }
+            // A file written to while it was read has no single content to fingerprint
+            struct stat after;
+            if (!error && (fstat(fd, &after) != 0 || after.st_size != before.st_size || mtimeOf(after) != mtimeOf(before))) error = EAGAIN;
+            close(fd);
+            if (error) return error;
+            fingerprint->size = before.st_size;
+            fingerprint->mtime = mtimeOf(before);
+            fingerprint->inode = (long long)before.st_ino;
+            fingerprint->hash = hasher.digest();
+            return 0;
+        }
+
+        /**
+         * @brief Run a job for every index on a pool of threads
+         * @param threads Number of threads
+         * @param count Number of indices
+         * @param job Called with an index and the thread's readBufferSize buffer, from any thread
+         */
+        void runParallel(unsigned int threads, size_t count, const std::function<void(size_t, char*)>& job) {
+            std::atomic<size_t> next{0};
+            auto worker = [&]() {
+                std::unique_ptr<char[]> buffer(new char[readBufferSize]);
+                // One index at a time keeps the threads balanced when a few files are much larger than the rest
+                for (size_t i = next++; i < count; i = next++) job(i, buffer.get());
+            };
+            if (threads > count) threads = count > 0 ? (unsigned int)count : 1;
+            std::vector<std::thread> pool;
+            for (unsigned int i = 1; i < threads; i++) pool.emplace_back(worker);
+            worker();
+            for (std::thread& thread : pool) thread.join();
+        }
+
+        /**
+         * @brief A registered file under the hashed tree
+         */
+        struct Entry {
+            enum State {
+                // Fingerprint current
+                UNCHANGED,
+                // Needs hashing
+                CHANGED,
+                // Hashed, current holds the new fingerprint
+                HASHED,
+                // Gone from the disk
+                MISSING,
+                // Same inode as a missing file, current is its fingerprint under the new path
+                RENAMED,
+                // Unreadable or not a regular file
+                SKIPPED
+            };
+            unsigned int id;
+            unsigned int dir;
+            std::string path;
+            // Where the file name starts in path
+            size_t nameOffset;
+            bool fingerprinted;
+            Fingerprint stored;
+            Fingerprint current;
+            State state;
+            // Index of the missing entry a renamed file used to be
+            size_t origin;
+            // Missing entry already matched with its new path
+            bool claimed;
+        };
+
+        /**
+         * @brief Give an old file row the path of a new one, which is removed
+         * @param db The session to write with
+         * @param old ID of the old file, gone from the disk
+         * @param entry The new file
+         * @param errmsg SQLite3 error message char**
+         * @retval true Old file moved, the new one's tags added to it
+         * @retval false An error has occurred
+         */
+        bool reattach(Database& db, unsigned int old, const Entry& entry, char** errmsg) {
+            IdCursor cursor;
+            if (!db.listFileTags(entry.id, &cursor, errmsg)) return false;
+            std::vector<FileTag> links;
+            int tag;
+            short res;
+            while ((res = cursor.next(&tag, errmsg)) == 1) links.push_back({old, (unsigned int)tag});
+            if (res < 0) return false;
+            return db.removeFile(entry.id, errmsg)
+                && db.moveFile(old, entry.dir, entry.path.c_str() + entry.nameOffset, errmsg)
+                && (links.empty() || db.tagFiles(links, errmsg))
+                && db.setFileFingerprint(old, entry.current, errmsg);
+        }
+    }
+
+    /**
+     * @brief Start a hash
+     * @param seed Seed, 0 for the standard XXH64
+     */
+    Hasher::Hasher(uint64_t seed) : seed(seed), total(0), buffered(0) {
+        lanes[0] = seed + prime1 + prime2;
+        lanes[1] = seed + prime2;
+        lanes[2] = seed;
+        lanes[3] = seed - prime1;
+    }
+
+    /**
+     * @brief Hash more bytes
+     * @param data The bytes
+     * @param length Number of bytes
+     */
+    void Hasher::update(const void* data, size_t length) {
+        const unsigned char* p = (const unsigned char*)data;
+        total += length;
+        if (buffered > 0) {
+            size_t take = std::min(length, sizeof(buffer) - buffered);
+            std::memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            length -= take;
+            if (buffered < sizeof(buffer)) return;
+            consume(lanes, buffer, 1);
+            buffered = 0;
+        }
+        consume(lanes, p, length / 32);
+        p += length / 32 * 32;
+        buffered = length % 32;
+        std::memcpy(buffer, p, buffered);
+    }
+
+    /**
+     * @brief Get the hash of everything so far, more bytes may still follow
+     * @return The hash
+     */
+    uint64_t Hasher::digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+            for (int i = 0; i < 4; i++) h = mergeRound(h, lanes[i]);
+        } else {
+            h = seed + prime5;
+        }
+        return finish(h + total, buffer, buffered);
+    }
+
+    /**
+     * @brief Hash a block of memory with XXH64
+     * @param data The bytes
+     * @param length Number of bytes
+     * @param seed Seed, 0 for the standard XXH64
+     * @return The hash
+     */
+    uint64_t hash64(const void* data, size_t length, uint64_t seed) {
+        Hasher hasher(seed);
+        hasher.update(data, length);
+        return hasher.digest();
+    }
+
+    /**
+     * @brief Hash a file and read the stat fields of its fingerprint
+     * @param path Path of the file
+     * @param fingerprint Pointer to the return Fingerprint
+     * @param errmsg SQLite3 error message char**
+     * @retval true File hashed
+     * @retval false File couldn't be read or isn't a regular file
+     */
+    bool hashFile(const char* path, Fingerprint* fingerprint, char** errmsg) {
+        std::unique_ptr<char[]> buffer(new char[readBufferSize]);
+        int error = readAndHash(path, buffer.get(), fingerprint);
+        if (error && errmsg) *errmsg = sqlite3_mprintf("cannot hash file %s: %s", path, strerror(error));
+        return error == 0;
+    }
+
+    /**
+     * @brief Fingerprint the files of a directory tree and follow files moved behind the database's back
+     * @param db The session to write with, only used by the calling thread
+     * @param root Path of the directory, must be registered
+     * @param options Hashing settings
+     * @param stats Pointer to the return HashStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tree fingerprinted, unreadable files are counted in stats
+     * @retval false root isn't registered or a database error has occurred
+     */
+    bool hashTree(Database& db, const char* root, const HashOptions& options, HashStats* stats, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_HASH_TREE);
+        char* resolved = realpath(root, nullptr);
+        char* findError = nullptr;
+        int dir = db.findDir(resolved ? resolved : root, &findError);
+        free(resolved);
+        if (dir < 0) {
+            if (!findError) findError = sqlite3_mprintf("directory %s is not registered", root);
+            if (errmsg) *errmsg = findError;
+            else sqlite3_free(findError);
+            return false;
+        }
+
+        // Every registered file under root, grouped by directory so each path is built once
+        std::vector<Entry> entries;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db.handle(), "SELECT file.id, file.dir, file.name, file.size, file.mtime, file.inode, file.hash "
+                                            "FROM dirtree JOIN file ON file.dir = dirtree.descendant "
+                                            "WHERE dirtree.ancestor = ?1 ORDER BY file.dir, file.id;", -1, &stmt, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            return false;
+        }
+        sqlite3_bind_int64(stmt, 1, dir);
+        std::string dirPath;
+        unsigned int lastDir = 0;
+        int ecode;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+            Entry entry{};
+            entry.id = (unsigned int)sqlite3_column_int64(stmt, 0);
+            entry.dir = (unsigned int)sqlite3_column_int64(stmt, 1);
+            if (entry.dir != lastDir || entries.empty()) {
+                dirPath.clear();
+                if (!db.getDirPath(entry.dir, &dirPath, errmsg)) {
+                    sqlite3_finalize(stmt);
+                    return false;
+                }
+                if (dirPath != "/") dirPath += '/';
+                lastDir = entry.dir;
+            }
+            entry.path = dirPath;
+            entry.nameOffset = dirPath.size();
+            entry.path.append((const char*)sqlite3_column_text(stmt, 2), (size_t)sqlite3_column_bytes(stmt, 2));
+            entry.fingerprinted = sqlite3_column_type(stmt, 6) != SQLITE_NULL;
+            if (entry.fingerprinted) {
+                entry.stored.size = sqlite3_column_int64(stmt, 3);
+                entry.stored.mtime = sqlite3_column_int64(stmt, 4);
+                entry.stored.inode = sqlite3_column_int64(stmt, 5);
+                entry.stored.hash = (uint64_t)sqlite3_column_int64(stmt, 6);
+            }
+            entries.push_back(std::move(entry));
+        }
+        if (ecode != SQLITE_DONE) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        sqlite3_finalize(stmt);
+
+        unsigned int threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+        // A stat per file, in parallel since a cold inode cache makes each one a disk read
+        runParallel(threads, entries.size(), [&](size_t i, char*) {
+            Entry& entry = entries[i];
+            struct stat st;
+            if (lstat(entry.path.c_str(), &st) != 0) {
+                entry.state = errno == ENOENT || errno == ENOTDIR ? Entry::MISSING : Entry::SKIPPED;
+                return;
+            }
+            if (!S_ISREG(st.st_mode)) {
+                entry.state = Entry::SKIPPED;
+                return;
+            }
+            entry.current.size = st.st_size;
+            entry.current.mtime = mtimeOf(st);
+            entry.current.inode = (long long)st.st_ino;
+            bool same = entry.fingerprinted && entry.stored.size == entry.current.size
+                        && entry.stored.mtime == entry.current.mtime && entry.stored.inode == entry.current.inode;
+            entry.state = same && !options.verify ? Entry::UNCHANGED : Entry::CHANGED;
+        });
+
+        // A new file with the inode, size and mtime of a missing one was renamed, no need to read it
+        std::unordered_map<long long, size_t> missingByInode;
+        std::unordered_map<unsigned int, size_t> byId;
+        for (size_t i = 0; i < entries.size(); i++) {
+            byId.emplace(entries[i].id, i);
+            if (entries[i].state == Entry::MISSING && entries[i].fingerprinted) missingByInode.emplace(entries[i].stored.inode, i);
+        }
+        std::vector<size_t> toHash;
+        for (size_t i = 0; i < entries.size(); i++) {
+            Entry& entry = entries[i];
+            if (entry.state != Entry::CHANGED) continue;
+            auto found = entry.fingerprinted ? missingByInode.end() : missingByInode.find(entry.current.inode);
+            if (found != missingByInode.end() && !entries[found->second].claimed) {
+                Entry& origin = entries[found->second];
+                if (origin.stored.size == entry.current.size && origin.stored.mtime == entry.current.mtime) {
+                    entry.state = Entry::RENAMED;
+                    entry.origin = found->second;
+                    entry.current.hash = origin.stored.hash;
+                    origin.claimed = true;
+                    continue;
+                }
+            }
+            toHash.push_back(i);
+        }
+
+        runParallel(threads, toHash.size(), [&](size_t i, char* buffer) {
+            Entry& entry = entries[toHash[i]];
+            entry.state = readAndHash(entry.path.c_str(), buffer, &entry.current) == 0 ? Entry::HASHED : Entry::SKIPPED;
+        });
+
+        HashStats counted;
+        counted.files = entries.size();
+        bool ok = true;
+        bool open = false;
+        size_t uncommitted = 0;
+        // Missing files outside the tree that were matched already
+        std::unordered_set<unsigned int> claimedOutside;
+        std::vector<unsigned int> candidates;
+        std::string candidatePath;
+        for (size_t i = 0; i < entries.size() && ok; i++) {
+            Entry& entry = entries[i];
+            if (entry.state == Entry::UNCHANGED) counted.unchanged++;
+            if (entry.state == Entry::SKIPPED) counted.skipped++;
+            if (entry.state == Entry::HASHED) {
+                counted.hashed++;
+                counted.bytes += (unsigned long long)entry.current.size;
+            }
+            if (entry.state != Entry::HASHED && entry.state != Entry::RENAMED) continue;
+            if (!open) {
+                if (!db.begin(errmsg)) {
+                    ok = false;
+                    break;
+                }
+                open = true;
+            }
+            long long origin = -1;
+            if (entry.state == Entry::RENAMED) {
+                origin = entries[entry.origin].id;
+            } else if (!entry.fingerprinted) {
+                // A new file with the content of a file that is gone, inside the tree or anywhere else
+                IdCursor cursor;
+                candidates.clear();
+                int id;
+                short res = 0;
+                if (db.listHashFiles(entry.current.hash, &cursor, errmsg)) {
+                    while ((res = cursor.next(&id, errmsg)) == 1) if ((unsigned int)id != entry.id) candidates.push_back((unsigned int)id);
+                }
+                ok = res == 0;
+                for (size_t c = 0; c < candidates.size() && ok && origin < 0; c++) {
+                    auto inTree = byId.find(candidates[c]);
+                    if (inTree != byId.end()) {
+                        Entry& other = entries[inTree->second];
+                        if (other.state == Entry::MISSING && !other.claimed && other.stored.size == entry.current.size) {
+                            other.claimed = true;
+                            origin = other.id;
+                        }
+                        continue;
+                    }
+                    if (claimedOutside.count(candidates[c])) continue;
+                    Fingerprint other;
+                    short found = db.getFileFingerprint(candidates[c], &other, errmsg);
+                    candidatePath.clear();
+                    ok = found >= 0 && db.getFilePath(candidates[c], &candidatePath, errmsg);
+                    struct stat st;
+                    if (ok && found == 1 && other.size == entry.current.size && !candidatePath.empty()
+                        && lstat(candidatePath.c_str(), &st) != 0 && (errno == ENOENT || errno == ENOTDIR)) {
+                        claimedOutside.insert(candidates[c]);
+                        origin = candidates[c];
+                    }
+                }
+            }
+            if (!ok) break;
+            if (origin >= 0) {
+                ok = reattach(db, (unsigned int)origin, entry, errmsg);
+                if (ok) counted.moved++;
+            } else {
+                ok = db.setFileFingerprint(entry.id, entry.current, errmsg);
+            }
+            if (ok && ++uncommitted >= options.batchSize) {
+                ok = db.commit(errmsg);
+                open = !ok;
+                uncommitted = 0;
+            }
+        }
+        for (size_t i = 0; i < entries.size() && ok; i++) {
+            Entry& entry = entries[i];
+            if (entry.state != Entry::MISSING || entry.claimed) continue;
+            counted.missing++;
+            if (!options.removeMissing) continue;
+            if (!open) {
+                if (!db.begin(errmsg)) {
+                    ok = false;
+                    break;
+                }
+                open = true;
+            }
+            ok = db.removeFile(entry.id, errmsg);
+        }
+        if (!ok) {
+            if (open) db.rollback(nullptr);
+        } else if (open) {
+            ok = db.commit(errmsg);
+            if (!ok) db.rollback(nullptr);
+        }
+        if (stats) *stats = counted;
+        return ok;
+    }
+
+    /**
+     * @brief Find the files with the same content in a directory tree
+     * @param db The session to read from
+     * @param dir Directory ID, e.g. from findDir()
+     * @param groups Pointer to the return vector, in ascending hash order
+     * @param errmsg SQLite3 error message char**
+     * @retval true Duplicates returned
+     * @retval false An error has occurred
+     */
+    bool findDuplicates(Database& db, unsigned int dir, std::vector<DuplicateGroup>* groups, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_FIND_DUPLICATES);
+        groups->clear();
+        sqlite3_stmt* stmt = nullptr;
+        // Hashes seen more than once come from the index alone, only their files are read
+        if (sqlite3_prepare_v2(db.handle(), "SELECT file.hash, file.size, file.id FROM dirtree JOIN file ON file.dir = dirtree.descendant "
+                                            "WHERE dirtree.ancestor = ?1 AND file.hash IN "
+                                            "(SELECT hash FROM file WHERE hash IS NOT NULL GROUP BY hash HAVING count(*) > 1) "
+                                            "ORDER BY file.hash, file.size, file.id;", -1, &stmt, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            return false;
+        }
+        sqlite3_bind_int64(stmt, 1, dir);
+        int ecode;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+            uint64_t hash = (uint64_t)sqlite3_column_int64(stmt, 0);
+            long long size = sqlite3_column_int64(stmt, 1);
+            // The size is compared too, a hash collision alone doesn't make two files the same
+            if (groups->empty() || groups->back().hash != hash || groups->back().size != size) {
+                if (!groups->empty() && groups->back().files.size() < 2) groups->pop_back();
+                groups->push_back({hash, size, {}});
+            }
+            groups->back().files.push_back((unsigned int)sqlite3_column_int64(stmt, 2));
+        }
+        if (!groups->empty() && groups->back().files.size() < 2) groups->pop_back();
+        if (ecode != SQLITE_DONE) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            groups->clear();
+            return false;
+        }
+        sqlite3_finalize(stmt);
+        return true;
+    }
+}
@@ -0,0 +1,155 @@
+/**
+ * @file ftagmgrhash.h
+ * @brief FTagMgrLib content hashing header file
+ */
+
+#ifndef FTAGMGRHASH_H
+#define FTAGMGRHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Streaming XXH64 hash
+     *
+     * Four independent lanes over 32 byte stripes, so the multiplies of
+     * one stripe overlap and a single core hashes at several GB/s, faster
+     * than files come off the disk. Output matches the reference XXH64.
+     */
+    class Hasher {
+    public:
+        /**
+         * @brief Start a hash
+         * @param seed Seed, 0 for the standard XXH64
+         */
+        explicit Hasher(uint64_t seed = 0);
+
+        /**
+         * @brief Hash more bytes
+         * @param data The bytes
+         * @param length Number of bytes
+         */
+        void update(const void* data, size_t length);
+
+        /**
+         * @brief Get the hash of everything so far, more bytes may still follow
+         * @return The hash
+         */
+        uint64_t digest() const;
+
+    private:
+        uint64_t lanes[4];
+        uint64_t seed;
+        uint64_t total;
+        // Bytes of a stripe not hashed yet
+        unsigned char buffer[32];
+        size_t buffered;
+    };
+
+    /**
+     * @brief Hash a block of memory with XXH64
+     * @param data The bytes
+     * @param length Number of bytes
+     * @param seed Seed, 0 for the standard XXH64
+     * @return The hash
+     */
+    uint64_t hash64(const void* data, size_t length, uint64_t seed = 0);
+
+    /**
+     * @brief Hash a file and read the stat fields of its fingerprint
+     *
+     * Reads sequentially in 1 MiB blocks, with the kernel told to read
+     * ahead aggressively. The access time isn't updated where allowed.
+     *
+     * @param path Path of the file
+     * @param fingerprint Pointer to the return Fingerprint
+     * @param errmsg SQLite3 error message char**
+     * @retval true File hashed
+     * @retval false File couldn't be read or isn't a regular file
+     */
+    bool hashFile(const char* path, Fingerprint* fingerprint, char** errmsg);
+
+    /**
+     * @brief Hashing settings
+     */
+    struct HashOptions {
+        // Hashing threads, 0 for one per core
+        unsigned int threads = 0;
+        // Fingerprints written per transaction
+        size_t batchSize = 20000;
+        // Read every file again, even those whose size, mtime and inode didn't change
+        bool verify = false;
+        // Remove files that are gone from the disk and weren't found elsewhere
+        bool removeMissing = false;
+    };
+
+    /**
+     * @brief What a hashing pass did
+     */
+    struct HashStats {
+        size_t files = 0;
+        // Fingerprint still current, only stat'ed
+        size_t unchanged = 0;
+        // Files read and hashed
+        size_t hashed = 0;
+        unsigned long long bytes = 0;
+        // Files found at a new path, their old row got the new path and kept its tags
+        size_t moved = 0;
+        // Files gone from the disk and not found elsewhere
+        size_t missing = 0;
+        // Files that couldn't be read, and entries that aren't regular files
+        size_t skipped = 0;
+    };
+
+    /**
+     * @brief Files with the same content
+     */
+    struct DuplicateGroup {
+        uint64_t hash;
+        long long size;
+        // File IDs in ascending order, at least two
+        std::vector<unsigned int> files;
+    };
+
+    /**
+     * @brief Fingerprint the files of a directory tree and follow files moved behind the database's back
+     *
+     * Meant to run after crawl(), which registers a moved file at its new
+     * path as a new file. Every file registered under root is stat'ed;
+     * files whose size, mtime and inode match their stored fingerprint
+     * cost nothing more. The others are hashed by a pool of threads. A
+     * new file is then matched with a registered file that is gone from
+     * the disk, first by inode (a rename within the filesystem doesn't
+     * even need reading) and then by content. The old row takes the new
+     * path and keeps its ID and tags, the new row's tags are added to it
+     * and the new row is removed. The calling thread is the only writer.
+     *
+     * @param db The session to write with, only used by the calling thread
+     * @param root Path of the directory, must be registered
+     * @param options Hashing settings
+     * @param stats Pointer to the return HashStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tree fingerprinted, unreadable files are counted in stats
+     * @retval false root isn't registered or a database error has occurred
+     */
+    bool hashTree(Database& db, const char* root, const HashOptions& options, HashStats* stats, char** errmsg);
+
+    /**
+     * @brief Find the files with the same content in a directory tree
+     *
+     * Only fingerprinted files are compared, run hashTree() first.
+     *
+     * @param db The session to read from
+     * @param dir Directory ID, e.g. from findDir()
+     * @param groups Pointer to the return vector, in ascending hash order
+     * @param errmsg SQLite3 error message char**
+     * @retval true Duplicates returned
+     * @retval false An error has occurred
+     */
+    bool findDuplicates(Database& db, unsigned int dir, std::vector<DuplicateGroup>* groups, char** errmsg);
+}
+
+#endif
@@ -0,0 +1,451 @@
+/**
+ * @file ftagmgrindexer.cpp
+ * @brief FTagMgr filesystem indexer source code
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "ftagmgrindexer.h"
+#include "ftagmgrmetrics.h"
+#include "ftagmgrxattr.h"
+
+namespace ftagmgr {
+    namespace {
+        // Record layout returned by getdents64, glibc doesn't declare it
+        struct LinuxDirent64 {
+            uint64_t d_ino;
+            int64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+
+        // getdents64 buffer per reading thread
+        const size_t direntBufferSize = 64 * 1024;
+
+        /**
+         * @brief A read directory on its way to the writer
+         */
+        struct DirBatch {
+            std::string path;
+            // File names back to back, names[ends[i - 1]..ends[i]) is the i-th one
+            std::string names;
+            std::vector<uint32_t> ends;
+            // With readTags, the tag names of every file back to back the same way, in tags and tagEnds
+            std::string tags;
+            std::vector<uint32_t> tagEnds;
+            // Where the names of each file end in tagEnds, fileTagEnds[i - 1]..fileTagEnds[i] for the i-th file
+            std::vector<uint32_t> fileTagEnds;
+        };
+
+        /**
+         * @brief Bounded queue from the reading threads to the writer
+         *
+         * Readers block when it is full, so a slow database holds the crawl
+         * back instead of letting read directories pile up in memory.
+         */
+        class Channel {
+        public:
+            explicit Channel(size_t capacity) : capacity(capacity) {}
+
+            /**
+             * @brief Queue a directory, waiting for room
+             * @param batch The directory
+             * @retval true Queued
+             * @retval false The crawl was aborted
+             */
+            bool push(DirBatch&& batch) {
+                std::unique_lock<std::mutex> lock(mutex);
+                notFull.wait(lock, [this] { return aborted || batches.size() < capacity; });
+                if (aborted) return false;
+                batches.push_back(std::move(batch));
+                notEmpty.notify_one();
+                return true;
+            }
+
+            /**
+             * @brief Take every queued directory, waiting for at least one
+             * @param out Gets the directories, replacing its contents
+             * @retval true Directories returned
+             * @retval false Channel closed and drained
+             */
+            bool popAll(std::deque<DirBatch>* out) {
+                std::unique_lock<std::mutex> lock(mutex);
+                notEmpty.wait(lock, [this] { return closed || !batches.empty(); });
+                if (batches.empty()) return false;
+                out->clear();
+                out->swap(batches);
+                notFull.notify_all();
+                return true;
+            }
+
+            /**
+             * @brief Check if nothing is queued right now
+             * @retval true Queue is empty
+             * @retval false Directories are waiting
+             */
+            bool idle() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return batches.empty();
+            }
+
+            // Called once the last reader is done
+            void close() {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                notEmpty.notify_all();
+            }
+
+            // Called by the writer on a database error, releases blocked readers
+            void abort() {
+                std::lock_guard<std::mutex> lock(mutex);
+                aborted = true;
+                notFull.notify_all();
+            }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable notEmpty;
+            std::condition_variable notFull;
+            std::deque<DirBatch> batches;
+            size_t capacity;
+            bool closed = false;
+            bool aborted = false;
+        };
+
+        /**
+         * @brief Directory paths waiting to be read by one thread
+         *
+         * The owner pushes and pops at the back, so it goes depth first
+         * and stays in recently read parts of the tree. Idle threads steal
+         * from the front, which holds the shallowest, largest subtrees.
+         */
+        struct WorkQueue {
+            std::mutex mutex;
+            std::deque<std::string> paths;
+        };
+
+        /**
+         * @brief State shared by the reading threads of one crawl
+         */
+        class Crawler {
+        public:
+            Crawler(const CrawlOptions& options, unsigned int threads, dev_t rootDevice)
+                : channel(threads * 256), options(options), queues(threads), rootDevice(rootDevice) {}
+
+            /**
+             * @brief Read directories until the whole tree is done or the crawl is stopped
+             * @param self Index of the calling thread's queue
+             */
+            void run(unsigned int self) {
+                std::unique_ptr<char[]> buffer(new char[direntBufferSize]);
+                std::string path;
+                // Once stopped, what is still queued is left unread
+                while (!stopped.load()) {
+                    if (!pop(self, &path) && !steal(self, &path)) {
+                        if (pending.load() == 0 || stopped.load()) break;
+                        std::unique_lock<std::mutex> lock(idleMutex);
+                        idle.wait_for(lock, std::chrono::milliseconds(1), [this] { return pending.load() == 0 || stopped.load() || available.load() > 0; });
+                        continue;
+                    }
+                    readDir(self, path, buffer.get());
+                    // Last directory of the tree wakes up everyone waiting for work
+                    if (pending.fetch_sub(1) == 1) idle.notify_all();
+                }
+                if (running.fetch_sub(1) == 1) channel.close();
+            }
+
+            /**
+             * @brief Queue the first directory, before the threads start
+             * @param path The directory
+             */
+            void seed(std::string path) {
+                pending = 1;
+                available = 1;
+                queues[0].paths.push_back(std::move(path));
+                running = (unsigned int)queues.size();
+            }
+
+            // Stop reading after a database error
+            void stop() {
+                stopped = true;
+                channel.abort();
+                idle.notify_all();
+            }
+
+            Channel channel;
+            std::atomic<size_t> unreadable{0};
+
+        private:
+            bool pop(unsigned int self, std::string* path) {
+                WorkQueue& queue = queues[self];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.paths.empty()) return false;
+                *path = std::move(queue.paths.back());
+                queue.paths.pop_back();
+                available--;
+                return true;
+            }
+
+            bool steal(unsigned int self, std::string* path) {
+                if (available.load() <= 0) return false;
+                for (size_t i = 1; i < queues.size(); i++) {
+                    WorkQueue& queue = queues[(self + i) % queues.size()];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (queue.paths.empty()) continue;
+                    *path = std::move(queue.paths.front());
+                    queue.paths.pop_front();
+                    available--;
+                    return true;
+                }
+                return false;
+            }
+
+            /**
+             * @brief List one directory, queue its subdirectories and send its files to the writer
+             * @param self Index of the calling thread's queue
+             * @param path The directory
+             * @param buffer direntBufferSize bytes for getdents64
+             */
+            void readDir(unsigned int self, const std::string& path, char* buffer) {
+                int fd = openat(AT_FDCWD, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOATIME);
+                // O_NOATIME is only allowed on our own files
+                if (fd < 0 && errno == EPERM) fd = openat(AT_FDCWD, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0) {
+                    unreadable++;
+                    return;
+                }
+                if (options.oneFileSystem) {
+                    struct stat st;
+                    if (fstat(fd, &st) != 0 || st.st_dev != rootDevice) {
+                        close(fd);
+                        return;
+                    }
+                }
+                DirBatch batch;
+                batch.path = path;
+                std::vector<std::string> subdirs;
+                std::string filePath;
+                std::vector<std::string> tags;
+                bool failed = false;
+                while (true) {
+                    long bytes = syscall(SYS_getdents64, fd, buffer, direntBufferSize);
+                    if (bytes == 0) break;
+                    if (bytes < 0) {
+                        failed = true;
+                        break;
+                    }
+                    for (long offset = 0; offset < bytes;) {
+                        LinuxDirent64* entry = (LinuxDirent64*)(buffer + offset);
+                        offset += entry->d_reclen;
+                        const char* name = entry->d_name;
+                        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+                        if (options.skipHidden && name[0] == '.') continue;
+                        unsigned char type = entry->d_type;
+                        if (type == DT_UNKNOWN) {
+                            // Filesystem doesn't fill in d_type, only now is a stat needed
+                            struct stat st;
+                            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+                        }
+                        if (type == DT_DIR) {
+                            std::string child = path;
+                            if (child.back() != '/') child += '/';
+                            child += name;
+                            subdirs.push_back(std::move(child));
+                        } else {
+                            batch.names += name;
+                            batch.ends.push_back((uint32_t)batch.names.size());
+                            if (options.readTags) {
+                                // Symbolic links can't carry user attributes, skip the syscall
+                                if (type == DT_REG) {
+                                    filePath.assign(path);
+                                    if (filePath.back() != '/') filePath += '/';
+                                    filePath += name;
+                                    if (readTagXattr(filePath.c_str(), &tags, nullptr) == 1) {
+                                        for (const std::string& tag : tags) {
+                                            batch.tags += tag;
+                                            batch.tagEnds.push_back((uint32_t)batch.tags.size());
+                                        }
+                                    }
+                                }
+                                batch.fileTagEnds.push_back((uint32_t)batch.tagEnds.size());
+                            }
+                        }
+                    }
+                }
+                close(fd);
+                if (failed) {
+                    unreadable++;
+                    return;
+                }
+                // Nobody is going to read the children or take the batch
+                if (stopped.load()) return;
+                if (!subdirs.empty()) {
+                    pending += subdirs.size();
+                    WorkQueue& queue = queues[self];
+                    {
+                        std::lock_guard<std::mutex> lock(queue.mutex);
+                        for (std::string& child : subdirs) queue.paths.push_back(std::move(child));
+                    }
+                    available += (long)subdirs.size();
+                    if (subdirs.size() > 1) idle.notify_all();
+                }
+                if (!channel.push(std::move(batch))) stopped = true;
+            }
+
+            const CrawlOptions& options;
+            std::vector<WorkQueue> queues;
+            dev_t rootDevice;
+            // Directories queued or being read, the crawl is done when it drops to 0
+            std::atomic<size_t> pending{0};
+            // Directories queued and not taken yet
+            std::atomic<long> available{0};
+            // Reading threads still running, the last one closes the channel
+            std::atomic<unsigned int> running{0};
+            std::atomic<bool> stopped{false};
+            std::mutex idleMutex;
+            std::condition_variable idle;
+        };
+    }
+
+    /**
+     * @brief Register a directory tree in the database
+     * @param db The session to write with, only used by the calling thread
+     * @param root Path of the directory to crawl
+     * @param options Crawl settings
+     * @param stats Pointer to the return CrawlStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tree registered, unreadable directories are counted in stats
+     * @retval false root couldn't be read or a database error has occurred
+     */
+    bool crawl(Database& db, const char* root, const CrawlOptions& options, CrawlStats* stats, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_CRAWL);
+        char* resolved = realpath(root, nullptr);
+        struct stat st;
+        if (!resolved || stat(resolved, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot read directory %s: %s", root, strerror(resolved ? ENOTDIR : errno));
+            free(resolved);
+            return false;
+        }
+        std::string rootPath = resolved;
+        free(resolved);
+
+        unsigned int threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+        Crawler crawler(options, threads, st.st_dev);
+        crawler.seed(rootPath);
+        std::vector<std::thread> readers;
+        readers.reserve(threads);
+        for (unsigned int i = 0; i < threads; i++) readers.emplace_back(&Crawler::run, &crawler, i);
+
+        CrawlStats counted;
+        bool ok = true;
+        bool open = false;
+        size_t uncommitted = 0;
+        std::deque<DirBatch> batches;
+        std::vector<std::string_view> paths;
+        std::vector<std::string_view> names;
+        std::vector<int> dirIds;
+        std::vector<int> fileIds;
+        // Tags read from the attributes: IDs of the names seen so far, and the links of the current batches
+        std::map<std::string, int, std::less<>> tagIds;
+        std::vector<std::string_view> newTags;
+        std::vector<int> newTagIds;
+        std::vector<std::pair<int, std::string_view>> tagLinks;
+        std::vector<FileTag> links;
+        while (ok && crawler.channel.popAll(&batches)) {
+            if (!open) {
+                if (!db.begin(errmsg)) {
+                    ok = false;
+                    break;
+                }
+                open = true;
+            }
+            paths.clear();
+            for (const DirBatch& batch : batches) paths.push_back(batch.path);
+            if (!db.addDirs(paths, &dirIds, errmsg)) {
+                ok = false;
+                break;
+            }
+            counted.dirs += batches.size();
+            for (size_t i = 0; i < batches.size() && ok; i++) {
+                const DirBatch& batch = batches[i];
+                if (batch.ends.empty()) continue;
+                names.clear();
+                uint32_t start = 0;
+                for (uint32_t end : batch.ends) {
+                    names.emplace_back(batch.names.data() + start, end - start);
+                    start = end;
+                }
+                ok = db.addFiles(dirIds[i], names, &fileIds, errmsg);
+                uncommitted += names.size();
+                counted.files += names.size();
+                if (!ok || batch.fileTagEnds.empty()) continue;
+                uint32_t first = 0;
+                for (size_t j = 0; j < fileIds.size(); j++) {
+                    uint32_t last = batch.fileTagEnds[j];
+                    if (last > first) counted.tagged++;
+                    for (; first < last; first++) {
+                        uint32_t begin = first ? batch.tagEnds[first - 1] : 0;
+                        std::string_view tag(batch.tags.data() + begin, batch.tagEnds[first] - begin);
+                        tagLinks.emplace_back(fileIds[j], tag);
+                        if (tagIds.find(tag) == tagIds.end()) {
+                            tagIds.emplace(tag, 0);
+                            newTags.push_back(tag);
+                        }
+                    }
+                }
+            }
+            // One addTags() and one tagFiles() for all the tags of these directories
+            if (ok && !tagLinks.empty()) {
+                if (!newTags.empty()) {
+                    ok = db.addTags(newTags, &newTagIds, errmsg);
+                    for (size_t i = 0; ok && i < newTags.size(); i++) tagIds.find(newTags[i])->second = newTagIds[i];
+                    newTags.clear();
+                }
+                links.clear();
+                for (const auto& [file, tag] : tagLinks) links.push_back(FileTag{(unsigned int)file, (unsigned int)tagIds.find(tag)->second});
+                tagLinks.clear();
+                if (ok) ok = db.tagFiles(links, errmsg);
+            }
+            // Commit once the batch is full, or early while the readers are behind anyway
+            if (ok && (uncommitted >= options.batchSize || crawler.channel.idle())) {
+                ok = db.commit(errmsg);
+                open = !ok;
+                uncommitted = 0;
+            }
+        }
+        if (!ok) {
+            crawler.stop();
+            if (open) db.rollback(nullptr);
+        } else if (open) {
+            ok = db.commit(errmsg);
+            if (!ok) db.rollback(nullptr);
+        }
+        for (std::thread& reader : readers) reader.join();
+        counted.unreadable = crawler.unreadable.load();
+        if (stats) *stats = counted;
+        return ok;
+    }
+}
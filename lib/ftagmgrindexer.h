@@ -0,0 +1,65 @@
+/**
+ * @file ftagmgrindexer.h
+ * @brief FTagMgrLib filesystem indexer header file
+ */
+
+#ifndef FTAGMGRINDEXER_H
+#define FTAGMGRINDEXER_H
+
+#include <cstddef>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Crawl settings
+     */
+    struct CrawlOptions {
+        // Directory reading threads, 0 for one per core
+        unsigned int threads = 0;
+        // Files written per transaction
+        size_t batchSize = 20000;
+        // Skip entries whose name starts with '.'
+        bool skipHidden = false;
+        // Don't descend into directories on other filesystems
+        bool oneFileSystem = false;
+        // Tag every file with the names in its tag attribute, as written by XattrMirror
+        bool readTags = false;
+    };
+
+    /**
+     * @brief What a crawl registered
+     */
+    struct CrawlStats {
+        size_t dirs = 0;
+        size_t files = 0;
+        // Directories that couldn't be read, e.g. for lack of permission
+        size_t unreadable = 0;
+        // Files tagged from their tag attribute, with readTags
+        size_t tagged = 0;
+    };
+
+    /**
+     * @brief Register a directory tree in the database
+     *
+     * Directories are read in parallel by a pool of threads with
+     * work stealing. Entry types come from getdents64, so entries are only
+     * stat'ed on filesystems that don't report them. The calling thread is
+     * the only writer: it registers every directory and its files through
+     * db in batched transactions. Symbolic links are registered as files
+     * and not followed. Directories and files already in the database are
+     * kept as they are. With readTags the reading threads also read the
+     * tag attribute of every regular file, so the tags of a tree mirrored
+     * with XattrMirror come back into an empty database in the same pass.
+     *
+     * @param db The session to write with, only used by the calling thread
+     * @param root Path of the directory to crawl
+     * @param options Crawl settings
+     * @param stats Pointer to the return CrawlStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tree registered, unreadable directories are counted in stats
+     * @retval false root couldn't be read or a database error has occurred
+     */
+    bool crawl(Database& db, const char* root, const CrawlOptions& options, CrawlStats* stats, char** errmsg);
+}
+
+#endif
@@ -3,112 +3,2626 @@
  * @brief FTagMgr library source code
  */
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory_resource>
 #include <string>
 #include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
 #include <sys/stat.h>
 #include <sqlite3.h>
+#include "ftagmgrlib.h"
+#include "ftagmgrmetrics.h"
 
 namespace ftagmgr {
+    // Path used by the free functions, guarded by databasePathMutex
     std::string databasePath;
-    // What to do when callback is called
-    enum enum_callback { CALLBACK_NULL, CALLBACK_DIRCHECK, CALLBACK_GETID, CALLBACK_GETDIRPATH };
-    enum_callback callbackAction = CALLBACK_NULL;
-    // Used for callback
-    void* sharedVar = nullptr;
+    std::mutex databasePathMutex;
+
+    // How long a connection waits for a lock held by another connection
+    const int busyTimeoutMs = 5000;
+
+    // SQL for every Database::Statement, same order as the enum
+    const char* statementSql[] = {
+        "SELECT id, implicit FROM dir WHERE parent = ?1 AND name = ?2;",
+        "SELECT parent, name, implicit FROM dir WHERE id = ?1;",
+        // A NULL ?4 takes the next automatic ID
+        "INSERT INTO dir(id, parent, name, implicit) VALUES(?4, ?1, ?2, ?3);",
+        "SELECT id FROM file WHERE dir = ?1 AND name = ?2;",
+        "SELECT name FROM file WHERE id = ?1;",
+        "INSERT INTO file(dir, name) VALUES(?1, ?2);",
+        "SELECT id FROM tag WHERE tag = ?1;",
+        "SELECT tag FROM tag WHERE id = ?1;",
+        "INSERT OR IGNORE INTO file(dir, name) VALUES(?1, ?2);",
+        "INSERT OR IGNORE INTO tag(tag, parent) VALUES(?1, ?2);",
+        "INSERT OR IGNORE INTO filetag(file, tag) VALUES(?1, ?2);",
+        "DELETE FROM filetag WHERE file = ?1 AND tag = ?2;",
+        "SELECT 1 FROM filetag WHERE file = ?1 AND tag = ?2;",
+        "SELECT dir, name FROM file WHERE id = ?1;",
+        "SELECT files FROM tagstat WHERE tag = ?1;",
+        "UPDATE file SET dir = ?2, name = ?3 WHERE id = ?1;",
+        "DELETE FROM filetag WHERE file = ?1;",
+        "DELETE FROM file WHERE id = ?1;",
+        "SELECT tag FROM filetag WHERE file = ?1;",
+        "SELECT id FROM file WHERE dir = ?1;",
+        // A directory with ?2 as its path and everything under it, parents before children
+        "WITH RECURSIVE sub(id, path) AS (SELECT ?1, ?2 UNION ALL "
+        "SELECT dir.id, CASE WHEN sub.path = '/' THEN '/' ELSE sub.path || '/' END || dir.name FROM dir JOIN sub ON dir.parent = sub.id) "
+        "SELECT id, path FROM sub;",
+        "UPDATE dir SET parent = ?2, name = ?3 WHERE id = ?1;",
+        "DELETE FROM filetag WHERE file IN (SELECT id FROM file WHERE dir = ?1);",
+        "DELETE FROM file WHERE dir = ?1;",
+        "DELETE FROM dir WHERE id = ?1;",
+        // Links a new directory to itself and to every ancestor
+        "WITH RECURSIVE up(id) AS (SELECT ?1 UNION ALL SELECT dir.parent FROM dir JOIN up ON dir.id = up.id) "
+        "INSERT INTO dirtree(ancestor, descendant) SELECT id, ?1 FROM up WHERE id <> 0;",
+        // Unlinks a subtree from the ancestors above its top, before it moves or goes away
+        "WITH RECURSIVE up(id) AS (SELECT parent FROM dir WHERE id = ?1 UNION ALL SELECT dir.parent FROM dir JOIN up ON dir.id = up.id) "
+        "DELETE FROM dirtree WHERE ancestor IN (SELECT id FROM up WHERE id <> 0) "
+        "AND descendant IN (SELECT descendant FROM dirtree WHERE ancestor = ?1);",
+        // Links a subtree to the ancestors above its top, after it moved
+        "WITH RECURSIVE up(id) AS (SELECT parent FROM dir WHERE id = ?1 UNION ALL SELECT dir.parent FROM dir JOIN up ON dir.id = up.id) "
+        "INSERT INTO dirtree(ancestor, descendant) SELECT up.id, tree.descendant FROM up, dirtree AS tree "
+        "WHERE up.id <> 0 AND tree.ancestor = ?1;",
+        "DELETE FROM dirtree WHERE ancestor = ?1;",
+        "SELECT 1 FROM dirtree WHERE ancestor = ?1 AND descendant = ?2;",
+        "UPDATE dir SET implicit = 0 WHERE id = ?1;",
+        "PRAGMA data_version;",
+        "SELECT parent, alias FROM tag WHERE id = ?1;",
+        "INSERT INTO tagtree(ancestor, descendant) VALUES(?1, ?1);",
+        // Links a new tag to itself and to every ancestor
+        "WITH RECURSIVE up(id) AS (SELECT ?1 UNION ALL SELECT tag.parent FROM tag JOIN up ON tag.id = up.id) "
+        "INSERT INTO tagtree(ancestor, descendant) SELECT id, ?1 FROM up WHERE id <> 0;",
+        "SELECT 1 FROM tagtree WHERE ancestor = ?1 AND descendant = ?2;",
+        // Unlinks a subtree from the ancestors above its top, before it moves
+        "WITH RECURSIVE up(id) AS (SELECT parent FROM tag WHERE id = ?1 UNION ALL SELECT tag.parent FROM tag JOIN up ON tag.id = up.id) "
+        "DELETE FROM tagtree WHERE ancestor IN (SELECT id FROM up WHERE id <> 0) "
+        "AND descendant IN (SELECT descendant FROM tagtree WHERE ancestor = ?1);",
+        // Links a subtree to its new parent ?2 and the ancestors above it
+        "WITH RECURSIVE up(id) AS (SELECT ?2 UNION ALL SELECT tag.parent FROM tag JOIN up ON tag.id = up.id) "
+        "INSERT INTO tagtree(ancestor, descendant) SELECT up.id, tree.descendant FROM up, tagtree AS tree "
+        "WHERE up.id <> 0 AND tree.ancestor = ?1;",
+        "UPDATE tag SET parent = ?2, alias = ?3 WHERE id = ?1;",
+        // Aliases of ?1 sit right under it, so they're found in its subtree without an index on alias
+        "UPDATE tag SET alias = ?2 WHERE id IN (SELECT descendant FROM tagtree WHERE ancestor = ?1) AND alias = ?1;",
+        "SELECT size, mtime, inode, hash FROM file WHERE id = ?1 AND hash IS NOT NULL;",
+        "UPDATE file SET size = ?2, mtime = ?3, inode = ?4, hash = ?5 WHERE id = ?1;",
+        // The last directory ID handed out, deleted ones included
+        "SELECT max(coalesce((SELECT seq FROM sqlite_sequence WHERE name = 'dir'), 0), coalesce((SELECT max(id) FROM dir), 0));"
+    };
+
+    /**
+     * @brief Normalize a directory path, dropping repeated and trailing slashes
+     * @param path The path
+     * @param out Pointer to the return std::string
+     * @retval true Path normalized
+     * @retval false Path is empty
+     */
+    static bool normalizePath(std::string_view path, std::string* out) {
+        out->clear();
+        for (size_t i = 0; i < path.size(); i++) {
+            if (path[i] == '/' && i > 0 && path[i - 1] == '/') continue;
+            out->push_back(path[i]);
+        }
+        if (out->size() > 1 && out->back() == '/') out->pop_back();
+        return !out->empty();
+    }
+
+    /**
+     * @brief Split a normalized path into its parent's path and its own name
+     * @param path The normalized path
+     * @param parent Pointer to the return std::string_view, empty for top level directories
+     * @param name Pointer to the return std::string_view, empty for the root
+     */
+    static void splitPath(std::string_view path, std::string_view* parent, std::string_view* name) {
+        size_t slash = path.rfind('/');
+        if (slash == std::string_view::npos || path == "/") {
+            // Relative top level, or the root itself
+            *parent = std::string_view();
+            *name = path == "/" ? path.substr(1) : path;
+        } else {
+            *parent = slash == 0 ? path.substr(0, 1) : path.substr(0, slash);
+            *name = path.substr(slash + 1);
+        }
+    }
+
+    /**
+     * @brief Get one component of a normalized path
+     * @param path The normalized path
+     * @param start Offset of the component, the next one starts one past its end
+     * @param name Pointer to the return std::string_view, empty for the root
+     * @retval true It's the last component
+     * @retval false More components follow
+     */
+    static bool pathComponent(std::string_view path, size_t start, std::string_view* name) {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos) end = path.size();
+        *name = path.substr(start, end - start);
+        return end + 1 >= path.size();
+    }
+
+    /**
+     * @brief Get the name of the parent a tag gets from its own name, everything before the last slash
+     * @param value Tag name
+     * @param parent Pointer to the return std::string_view
+     * @retval true Tag has a parent
+     * @retval false Tag is top level, it has no slash or only a leading or trailing one
+     */
+    static bool parentTag(std::string_view value, std::string_view* parent) {
+        size_t slash = value.rfind('/');
+        if (slash == std::string_view::npos || slash == 0 || slash + 1 == value.size()) return false;
+        *parent = value.substr(0, slash);
+        return true;
+    }
+
+    /**
+     * @brief Copy text into an arena
+     * @param arena Memory to copy into
+     * @param text The text
+     * @return View of the copy
+     */
+    static std::string_view arenaCopy(std::pmr::memory_resource* arena, std::string_view text) {
+        if (text.empty()) return std::string_view();
+        char* out = (char*)arena->allocate(text.size(), 1);
+        std::memcpy(out, text.data(), text.size());
+        return std::string_view(out, text.size());
+    }
+
+    /**
+     * @brief Keep one file per directory and name, then make (dir, name) unique
+     *
+     * The oldest row is kept and gets the tags of the others. Databases this
+     * old may not have the filetag table yet.
+     *
+     * @param db Connection
+     * @param errmsg SQLite3 error message char**
+     * @retval true Duplicates merged
+     * @retval false An error has occurred
+     */
+    static bool mergeDuplicateFiles(sqlite3* db, char** errmsg) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'filetag';", -1, &stmt, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return false;
+        }
+        int ecode = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (ecode != SQLITE_ROW && ecode != SQLITE_DONE) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return false;
+        }
+        if (ecode == SQLITE_ROW && sqlite3_exec(db, "INSERT OR IGNORE INTO filetag(file, tag) SELECT keep.id, filetag.tag FROM filetag "
+                                                    "JOIN file dup ON dup.id = filetag.file "
+                                                    "JOIN (SELECT min(id) AS id, dir, name FROM file GROUP BY dir, name) keep "
+                                                    "ON keep.dir = dup.dir AND keep.name = dup.name WHERE keep.id <> dup.id;"
+                                                    "DELETE FROM filetag WHERE file NOT IN (SELECT min(id) FROM file GROUP BY dir, name);",
+                                                    nullptr, nullptr, errmsg) != SQLITE_OK) {
+            return false;
+        }
+        return sqlite3_exec(db, "DELETE FROM file WHERE id NOT IN (SELECT min(id) FROM file GROUP BY dir, name);"
+                                "CREATE UNIQUE INDEX IF NOT EXISTS file_dir_name ON file(dir, name);",
+                                nullptr, nullptr, errmsg) == SQLITE_OK;
+    }
+
+    /**
+     * @brief Turn the flat dir table into a tree, keeping the directory IDs
+     *
+     * Ancestors that weren't registered get new IDs and are marked implicit.
+     * Paths that only differed by slashes are merged into the first one,
+     * files of the same name in both become one with the tags of both.
+     *
+     * @param db Connection
+     * @param errmsg SQLite3 error message char**
+     * @retval true Table converted
+     * @retval false An error has occurred
+     */
+    static bool convertDirTree(sqlite3* db, char** errmsg) {
+        std::vector<std::pair<std::string, int>> flat;
+        sqlite3_stmt* select = nullptr;
+        sqlite3_stmt* insert = nullptr;
+        auto fail = [&]() {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            sqlite3_finalize(select);
+            sqlite3_finalize(insert);
+            return false;
+        };
+        if (sqlite3_prepare_v2(db, "SELECT id, path FROM dir;", -1, &select, nullptr) != SQLITE_OK) return fail();
+        int next = 0;
+        std::string path;
+        int ecode;
+        while ((ecode = sqlite3_step(select)) == SQLITE_ROW) {
+            int id = sqlite3_column_int(select, 0);
+            const char* text = (const char*)sqlite3_column_text(select, 1);
+            if (!normalizePath(text ? text : "", &path)) path = ".";
+            flat.emplace_back(path, id);
+            next = std::max(next, id);
+        }
+        if (ecode != SQLITE_DONE) return fail();
+        // Ancestors sort before their descendants, so they get registered first
+        std::sort(flat.begin(), flat.end());
+        if (sqlite3_prepare_v2(db, "INSERT INTO dir_new(id, parent, name, implicit) VALUES(?1, ?2, ?3, ?4);", -1, &insert, nullptr) != SQLITE_OK) return fail();
+        std::unordered_map<std::string, int> ids;
+        // Registers a path and its missing ancestors, id -1 for a new ID
+        std::function<int(std::string_view, int)> add = [&](std::string_view dir, int id) {
+            auto it = ids.find(std::string(dir));
+            if (it != ids.end()) return it->second;
+            std::string_view parentPath, name;
+            splitPath(dir, &parentPath, &name);
+            int parent = parentPath.empty() ? 0 : add(parentPath, -1);
+            if (parent < 0) return -1;
+            sqlite3_bind_int(insert, 4, id < 0);
+            if (id < 0) id = ++next;
+            sqlite3_bind_int64(insert, 1, id);
+            sqlite3_bind_int64(insert, 2, parent);
+            sqlite3_bind_text(insert, 3, name.data(), (int)name.size(), SQLITE_TRANSIENT);
+            ecode = sqlite3_step(insert);
+            sqlite3_reset(insert);
+            if (ecode != SQLITE_DONE) return -1;
+            ids.emplace(std::string(dir), id);
+            return id;
+        };
+        for (const auto& [dir, id] : flat) {
+            auto it = ids.find(dir);
+            if (it == ids.end()) {
+                if (add(dir, id) < 0) return fail();
+                continue;
+            }
+            // Same directory twice, move the files over; the ones it already has give their tags to its file of that name
+            char* merge = sqlite3_mprintf("UPDATE OR IGNORE file SET dir = %d WHERE dir = %d;"
+                                          "INSERT OR IGNORE INTO filetag(file, tag) SELECT keep.id, filetag.tag FROM filetag "
+                                          "JOIN file dup ON dup.id = filetag.file JOIN file keep ON keep.dir = %d AND keep.name = dup.name "
+                                          "WHERE dup.dir = %d;"
+                                          "DELETE FROM filetag WHERE file IN (SELECT id FROM file WHERE dir = %d);"
+                                          "DELETE FROM file WHERE dir = %d;", it->second, id, it->second, id, id, id);
+            ecode = sqlite3_exec(db, merge, nullptr, nullptr, nullptr);
+            sqlite3_free(merge);
+            if (ecode != SQLITE_OK) return fail();
+        }
+        sqlite3_finalize(select);
+        sqlite3_finalize(insert);
+        return sqlite3_exec(db, "DROP TABLE dir;"
+                                "ALTER TABLE dir_new RENAME TO dir;"
+                                "CREATE UNIQUE INDEX dir_parent_name ON dir(parent, name);"
+                                "WITH RECURSIVE up(ancestor, descendant) AS (SELECT id, id FROM dir UNION ALL "
+                                "SELECT dir.parent, up.descendant FROM up JOIN dir ON dir.id = up.ancestor WHERE dir.parent <> 0) "
+                                "INSERT INTO dirtree(ancestor, descendant) SELECT ancestor, descendant FROM up;",
+                                nullptr, nullptr, errmsg) == SQLITE_OK;
+    }
+
+    /**
+     * @brief Give the existing tags the parents their names imply and fill the tag closure table
+     *
+     * Parents nobody added, like "photo" for "photo/2024", are added as
+     * tags of their own.
+     *
+     * @param db Connection
+     * @param errmsg SQLite3 error message char**
+     * @retval true Hierarchy built
+     * @retval false An error has occurred
+     */
+    static bool convertTagTree(sqlite3* db, char** errmsg) {
+        std::unordered_map<std::string, int> ids;
+        sqlite3_stmt* select = nullptr;
+        sqlite3_stmt* insert = nullptr;
+        sqlite3_stmt* update = nullptr;
+        auto fail = [&]() {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            sqlite3_finalize(select);
+            sqlite3_finalize(insert);
+            sqlite3_finalize(update);
+            return false;
+        };
+        if (sqlite3_prepare_v2(db, "SELECT id, tag FROM tag;", -1, &select, nullptr) != SQLITE_OK) return fail();
+        int ecode;
+        while ((ecode = sqlite3_step(select)) == SQLITE_ROW) {
+            const char* text = (const char*)sqlite3_column_text(select, 1);
+            ids.emplace(std::string(text ? text : "", (size_t)sqlite3_column_bytes(select, 1)), sqlite3_column_int(select, 0));
+        }
+        if (ecode != SQLITE_DONE) return fail();
+        if (sqlite3_prepare_v2(db, "INSERT INTO tag(tag, parent) VALUES(?1, ?2);", -1, &insert, nullptr) != SQLITE_OK) return fail();
+        if (sqlite3_prepare_v2(db, "UPDATE tag SET parent = ?2 WHERE id = ?1;", -1, &update, nullptr) != SQLITE_OK) return fail();
+        // Gets the ID of a tag, adding it and its missing ancestors if needed
+        std::function<int(std::string_view)> add = [&](std::string_view value) {
+            auto it = ids.find(std::string(value));
+            if (it != ids.end()) return it->second;
+            std::string_view parentValue;
+            int parent = parentTag(value, &parentValue) ? add(parentValue) : 0;
+            if (parent < 0) return -1;
+            sqlite3_bind_text(insert, 1, value.data(), (int)value.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int64(insert, 2, parent);
+            ecode = sqlite3_step(insert);
+            sqlite3_reset(insert);
+            if (ecode != SQLITE_DONE) return -1;
+            int id = (int)sqlite3_last_insert_rowid(db);
+            ids.emplace(std::string(value), id);
+            return id;
+        };
+        std::vector<std::pair<std::string, int>> named;
+        for (const auto& [value, id] : ids) if (value.find('/') != std::string::npos) named.emplace_back(value, id);
+        for (const auto& [value, id] : named) {
+            std::string_view parentValue;
+            if (!parentTag(value, &parentValue)) continue;
+            int parent = add(parentValue);
+            if (parent < 0) return fail();
+            sqlite3_bind_int64(update, 1, id);
+            sqlite3_bind_int64(update, 2, parent);
+            ecode = sqlite3_step(update);
+            sqlite3_reset(update);
+            if (ecode != SQLITE_DONE) return fail();
+        }
+        sqlite3_finalize(select);
+        sqlite3_finalize(insert);
+        sqlite3_finalize(update);
+        return sqlite3_exec(db, "WITH RECURSIVE up(ancestor, descendant) AS (SELECT id, id FROM tag UNION ALL "
+                                "SELECT tag.parent, up.descendant FROM up JOIN tag ON tag.id = up.ancestor WHERE tag.parent <> 0) "
+                                "INSERT INTO tagtree(ancestor, descendant) SELECT ancestor, descendant FROM up;",
+                                nullptr, nullptr, errmsg) == SQLITE_OK;
+    }
+
+    /**
+     * @brief One schema upgrade step
+     */
+    struct Migration {
+        const char* sql;
+        // Runs after sql, for changes SQL alone can't make; nullptr if none
+        bool (*convert)(sqlite3* db, char** errmsg);
+    };
+
+    // Schema upgrades, migrations[i] takes a database from version i to i + 1
+    // Each runs in one transaction with its user_version bump, after the version is read again under the write lock,
+    // so no step runs twice; steps 4-6 create and alter tables without IF NOT EXISTS and rely on that
+    const Migration migrations[] = {
+        // 1: one name per directory, makes (dir, name) lookups an index search instead of a table scan
+        // Duplicates could only come from racing writers, the oldest row is kept with the tags of all
+        {"", mergeDuplicateFiles},
+        // 2: table filetag, links files and tags N:N
+        // No rowid, the (file, tag) key is the table itself
+        // Reverse index for files by tag, covers the whole row so listings never touch the table
+        {"CREATE TABLE IF NOT EXISTS filetag("
+         "file INTEGER NOT NULL, "
+         "tag INTEGER NOT NULL, "
+         "PRIMARY KEY (file, tag), "
+         "FOREIGN KEY (file) REFERENCES file(id), "
+         "FOREIGN KEY (tag) REFERENCES tag(id)) WITHOUT ROWID;"
+         "CREATE INDEX IF NOT EXISTS filetag_tag_file ON filetag(tag, file);", nullptr},
+        // 3: table tagstat, number of files per tag kept up to date by triggers
+        // Used by the query planner, counting filetag rows for a popular tag is too slow
+        {"CREATE TABLE IF NOT EXISTS tagstat("
+         "tag INTEGER PRIMARY KEY, "
+         "files INTEGER NOT NULL DEFAULT 0, "
+         "FOREIGN KEY (tag) REFERENCES tag(id));"
+         "INSERT OR REPLACE INTO tagstat(tag, files) SELECT tag, count(*) FROM filetag GROUP BY tag;"
+         "CREATE TRIGGER IF NOT EXISTS filetag_insert AFTER INSERT ON filetag BEGIN "
+         "INSERT INTO tagstat(tag, files) VALUES(NEW.tag, 1) "
+         "ON CONFLICT(tag) DO UPDATE SET files = files + 1; END;"
+         "CREATE TRIGGER IF NOT EXISTS filetag_delete AFTER DELETE ON filetag BEGIN "
+         "UPDATE tagstat SET files = files - 1 WHERE tag = OLD.tag; END;", nullptr},
+        // 4: directories as a tree of (parent, name) rows, each component stored once
+        // Table dirtree links every directory to itself and its ancestors, so a subtree is one range of its key
+        // The root "/" is the top level directory with an empty name, relative paths start at the top level too
+        // Ancestors nobody added are kept as implicit rows, the API treats them as missing
+        {"CREATE TABLE dir_new("
+         "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+         "parent INTEGER NOT NULL, "
+         "name VARCHAR(256) NOT NULL, "
+         "implicit INTEGER NOT NULL DEFAULT 0);"
+         "CREATE TABLE IF NOT EXISTS dirtree("
+         "ancestor INTEGER NOT NULL, "
+         "descendant INTEGER NOT NULL, "
+         "PRIMARY KEY (ancestor, descendant)) WITHOUT ROWID;", convertDirTree},
+        // 5: tags as a hierarchy, "photo/2024" is under "photo" and a query for photo matches both
+        // Table tagtree links every tag to itself and its ancestors like dirtree, kept up to date on every change
+        // An alias sits under the tag it stands for, which queries for the alias are redirected to
+        {"ALTER TABLE tag ADD COLUMN parent INTEGER NOT NULL DEFAULT 0;"
+         "ALTER TABLE tag ADD COLUMN alias INTEGER NOT NULL DEFAULT 0;"
+         "CREATE TABLE IF NOT EXISTS tagtree("
+         "ancestor INTEGER NOT NULL, "
+         "descendant INTEGER NOT NULL, "
+         "PRIMARY KEY (ancestor, descendant)) WITHOUT ROWID;", convertTagTree},
+        // 6: content fingerprints next to the file rows, NULL until the file is hashed
+        // size, mtime and inode tell if the hash is still current without reading the file
+        // Partial index, files that were never hashed don't take room in it or cost anything on insert
+        {"ALTER TABLE file ADD COLUMN size INTEGER;"
+         "ALTER TABLE file ADD COLUMN mtime INTEGER;"
+         "ALTER TABLE file ADD COLUMN inode INTEGER;"
+         "ALTER TABLE file ADD COLUMN hash INTEGER;"
+         "CREATE INDEX IF NOT EXISTS file_hash ON file(hash) WHERE hash IS NOT NULL;", nullptr}
+    };
+    static_assert(sizeof(migrations) / sizeof(migrations[0]) == schemaVersion, "one migration per schema version");
+    
+    /**
+     * @brief Set the database path string
+     * @param path Path to the database file
+     */
+    void setDatabasePath(const char* path) {
+        std::lock_guard<std::mutex> lock(databasePathMutex);
+        databasePath = path;
+    }
+
+    /**
+     * @brief Check database file existence
+     * @retval true File exists
+     * @retval false File does not exist
+     */
+    bool checkDatabaseExistence() {
+        struct stat fileStat;
+        std::lock_guard<std::mutex> lock(databasePathMutex);
+        if (stat(databasePath.c_str(), &fileStat) == 0) return true;
+        else return false;
+    }
+
+    /**
+     * @brief Busy handler of sessions with metrics, waits like sqlite3_busy_timeout() and counts the waits
+     * @param context The Metrics
+     * @param count Times the handler was called for this lock
+     * @retval 0 Give up, the call fails with SQLITE_BUSY
+     * @retval 1 Try the lock again
+     */
+    static int countingBusyHandler(void* context, int count) {
+        // SQLite's own back-off in ms, the last step repeats until the timeout
+        static const int delays[] = {1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100};
+        static const int totals[] = {0, 1, 3, 8, 18, 33, 53, 78, 103, 128, 178, 228};
+        const int steps = (int)(sizeof(delays) / sizeof(delays[0]));
+        Metrics* metrics = (Metrics*)context;
+        int delay = delays[std::min(count, steps - 1)];
+        int waited = count < steps ? totals[count] : totals[steps - 1] + (count - (steps - 1)) * delay;
+        if (waited + delay > busyTimeoutMs) delay = busyTimeoutMs - waited;
+        if (delay <= 0) {
+            metrics->countLockWait(0, count == 0, true);
+            return 0;
+        }
+        auto start = std::chrono::steady_clock::now();
+        sqlite3_sleep(delay);
+        metrics->countLockWait((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), count == 0, false);
+        return 1;
+    }
+
+    /**
+     * @brief Resets a cached statement when leaving scope, so it can be reused
+     */
+    struct StatementReset {
+        sqlite3_stmt* stmt;
+        ~StatementReset() {
+            if (!stmt) return;
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    };
+
+    // Observers only override what they need
+    void Observer::fileAdded(unsigned int) {}
+    void Observer::tagged(unsigned int, unsigned int) {}
+    void Observer::untagged(unsigned int, unsigned int) {}
+    void Observer::fileRemoved(unsigned int) {}
+    void Observer::fileMoved(unsigned int) {}
+    void Observer::dirMoved(unsigned int) {}
+    void Observer::dirRemoved(unsigned int) {}
+    void Observer::tagAdded(unsigned int, std::string_view) {}
+
+    IdCursor::IdCursor() : stmt(nullptr) {}
+
+    IdCursor::~IdCursor() {
+        close();
+    }
+
+    IdCursor::IdCursor(IdCursor&& other) noexcept : stmt(other.stmt) {
+        other.stmt = nullptr;
+    }
+
+    IdCursor& IdCursor::operator=(IdCursor&& other) noexcept {
+        if (this != &other) {
+            close();
+            stmt = other.stmt;
+            other.stmt = nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Get the next ID
+     * @param id Pointer to the return int
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 No more IDs
+     * @retval 1 ID returned
+     */
+    short IdCursor::next(int* id, char** errmsg) {
+        short res = step(errmsg);
+        if (res == 1) *id = sqlite3_column_int(stmt, 0);
+        return res;
+    }
+
+    /**
+     * @brief Stop the listing and release its statement
+     */
+    void IdCursor::close() {
+        sqlite3_finalize(stmt);
+        stmt = nullptr;
+    }
+
+    /**
+     * @brief Move to the next row
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred, the cursor is closed
+     * @retval 0 No more rows, the cursor is closed
+     * @retval 1 On a row
+     */
+    short IdCursor::step(char** errmsg) {
+        if (!stmt) return 0;
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_ROW) return 1;
+        if (ecode == SQLITE_DONE) {
+            close();
+            return 0;
+        }
+        if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        close();
+        return -1;
+    }
+
+    /**
+     * @brief Get the next ID and name
+     * @param id Pointer to the return int
+     * @param name Pointer to the return view, valid until the next call on the cursor
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 No more rows
+     * @retval 1 ID and name returned
+     */
+    short NameCursor::next(int* id, std::string_view* name, char** errmsg) {
+        short res = step(errmsg);
+        if (res != 1) return res;
+        *id = sqlite3_column_int(stmt, 0);
+        // Text first, bytes after, so the length is that of the converted text
+        const char* text = (const char*)sqlite3_column_text(stmt, 1);
+        *name = std::string_view(text ? text : "", (size_t)sqlite3_column_bytes(stmt, 1));
+        return 1;
+    }
+
+    Database::Database() : db(nullptr), statements(), transactionDepth(0), ownsTransaction(false), cache(nullptr), sessionCacheBytes(Tunables().nameCacheKiB * 1024LL), sessionCacheVersion(-1), metrics(nullptr), cooccurrence(nullptr) {}
+
+    Database::Database(const char* path) : db(nullptr), statements(), transactionDepth(0), ownsTransaction(false), cache(nullptr), sessionCacheBytes(Tunables().nameCacheKiB * 1024LL), sessionCacheVersion(-1), metrics(nullptr), cooccurrence(nullptr) {
+        open(path, nullptr);
+    }
+
+    /**
+     * @brief Open a session on a database file with custom settings
+     * @param path Path to the database file
+     * @param tunables Connection settings
+     * @note Check isOpen() to see if opening succeeded
+     */
+    Database::Database(const char* path, const Tunables& tunables) : db(nullptr), statements(), transactionDepth(0), ownsTransaction(false), cache(nullptr), sessionCacheBytes(Tunables().nameCacheKiB * 1024LL), sessionCacheVersion(-1), metrics(nullptr), cooccurrence(nullptr) {
+        open(path, tunables, nullptr);
+    }
+
+    Database::~Database() {
+        close();
+    }
+
+    Database::Database(Database&& other) noexcept
+        : db(other.db), transactionDepth(other.transactionDepth), ownsTransaction(other.ownsTransaction),
+          observers(std::move(other.observers)), cache(other.cache), sessionCache(std::move(other.sessionCache)),
+          sessionCacheBytes(other.sessionCacheBytes), sessionCacheVersion(other.sessionCacheVersion), metrics(other.metrics), cooccurrence(other.cooccurrence) {
+        for (int i = 0; i < STMT_COUNT; i++) {
+            statements[i] = other.statements[i];
+            other.statements[i] = nullptr;
+        }
+        other.db = nullptr;
+        other.transactionDepth = 0;
+        other.ownsTransaction = false;
+        other.cache = nullptr;
+    }
+
+    Database& Database::operator=(Database&& other) noexcept {
+        if (this != &other) {
+            close();
+            db = other.db;
+            other.db = nullptr;
+            for (int i = 0; i < STMT_COUNT; i++) {
+                statements[i] = other.statements[i];
+                other.statements[i] = nullptr;
+            }
+            transactionDepth = other.transactionDepth;
+            ownsTransaction = other.ownsTransaction;
+            observers = std::move(other.observers);
+            cache = other.cache;
+            sessionCache = std::move(other.sessionCache);
+            sessionCacheBytes = other.sessionCacheBytes;
+            sessionCacheVersion = other.sessionCacheVersion;
+            metrics = other.metrics;
+            cooccurrence = other.cooccurrence;
+            other.transactionDepth = 0;
+            other.ownsTransaction = false;
+            other.cache = nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Open the database file, closing the current connection first
+     * @param path Path to the database file
+     * @param errmsg SQLite3 error message char**
+     * @retval true Database opened
+     * @retval false Database could not be opened
+     */
+    bool Database::open(const char* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_OPEN);
+        return open(path, Tunables(), errmsg);
+    }
+
+    /**
+     * @brief Open the database file with custom settings, closing the current connection first
+     * @param path Path to the database file
+     * @param tunables Connection settings
+     * @param errmsg SQLite3 error message char**
+     * @retval true Database opened and configured
+     * @retval false Database could not be opened or configured
+     */
+    bool Database::open(const char* path, const Tunables& tunables, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_OPEN);
+        close();
+        // A session is only ever used by one thread, so SQLite doesn't need to lock the connection
+        int flags = tunables.readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+        int ecode = sqlite3_open_v2(path, &db, flags | SQLITE_OPEN_NOMUTEX, nullptr);
+        if (ecode != SQLITE_OK) {
+            // sqlite3_open may still hand us a connection to report the error with
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", db ? sqlite3_errmsg(db) : sqlite3_errstr(ecode));
+            close();
+            return false;
+        }
+        // Wait for other connections' locks instead of failing with SQLITE_BUSY
+        sqlite3_busy_timeout(db, busyTimeoutMs);
+        hookMetrics();
+        sessionCacheBytes = tunables.nameCacheKiB > 0 ? tunables.nameCacheKiB * 1024LL : 0;
+        char* pragmas = sqlite3_mprintf("%sPRAGMA synchronous = %d; PRAGMA mmap_size = %lld; PRAGMA cache_size = -%d;",
+                                        tunables.wal && !tunables.readOnly ? "PRAGMA journal_mode = WAL; " : "",
+                                        tunables.synchronous, tunables.mmapSize, tunables.cacheSizeKiB);
+        ecode = sqlite3_exec(db, pragmas, nullptr, nullptr, errmsg);
+        sqlite3_free(pragmas);
+        if (ecode != SQLITE_OK) {
+            close();
+            return false;
+        }
+        if (tunables.readOnly) return true;
+        // Upgrade databases made by older versions, files without tables are left to createDatabase()
+        int version = getSchemaVersion(errmsg);
+        if (version == schemaVersion) return true;
+        sqlite3_stmt* stmt = nullptr;
+        bool hasTables = false;
+        if (version >= 0 && sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'file';", -1, &stmt, nullptr) == SQLITE_OK) {
+            hasTables = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        sqlite3_finalize(stmt);
+        if (version < 0 || (hasTables && !migrate(errmsg))) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Close the connection
+     */
+    void Database::close() {
+        for (int i = 0; i < STMT_COUNT; i++) {
+            // Finalizing nullptr is a no-op
+            sqlite3_finalize(statements[i]);
+            statements[i] = nullptr;
+        }
+        // Closing rolls back anything left open, close_v2 waits for open cursors to be finalized
+        if (db) sqlite3_close_v2(db);
+        db = nullptr;
+        transactionDepth = 0;
+        ownsTransaction = false;
+        // Names of one file mean nothing in the next one
+        sessionCache.reset();
+        sessionCacheVersion = -1;
+    }
+
+    /**
+     * @brief Check if the session has an open connection
+     * @retval true Connection is open
+     * @retval false Connection is closed
+     */
+    bool Database::isOpen() const {
+        return db != nullptr;
+    }
+
+    /**
+     * @brief Get the underlying SQLite3 connection
+     * @return The connection handle, nullptr if closed
+     */
+    sqlite3* Database::handle() const {
+        return db;
+    }
+
+    /**
+     * @brief Copy the connection error message into errmsg
+     * @param errmsg SQLite3 error message char**, may be nullptr
+     */
+    void Database::setError(char** errmsg) {
+        if (metrics) metrics->countError();
+        if (errmsg && db) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+
+    /**
+     * @brief Get the name cache in use, the attached one or the session's own
+     * @param validate Drop the session's own cache first if another connection committed since
+     * @return The cache, nullptr if there is none or it could not be validated
+     */
+    NameCache* Database::nameCache(bool validate) {
+        if (cache) return cache;
+        if (!sessionCacheBytes || !db) return nullptr;
+        if (!validate) return sessionCache.get();
+        // data_version only moves for other connections' commits, this session's own writes keep the cache current
+        sqlite3_stmt* stmt = statement(STMT_DATA_VERSION, nullptr);
+        if (!stmt) return nullptr;
+        bool ok = sqlite3_step(stmt) == SQLITE_ROW;
+        long long version = ok ? sqlite3_column_int64(stmt, 0) : -1;
+        sqlite3_reset(stmt);
+        if (!ok) return nullptr;
+        if (!sessionCache) sessionCache.reset(new NameCache(sessionCacheBytes, 1));
+        else if (version != sessionCacheVersion) sessionCache->clear();
+        sessionCacheVersion = version;
+        return sessionCache.get();
+    }
+
+    /**
+     * @brief Get a cached prepared statement, preparing it on first use
+     * @param which The query shape
+     * @param errmsg SQLite3 error message char**
+     * @return The statement, nullptr on error
+     */
+    sqlite3_stmt* Database::statement(Statement which, char** errmsg) {
+        if (!db) return nullptr;
+        if (!statements[which]) {
+            // Persistent, these live as long as the connection
+            int ecode = sqlite3_prepare_v3(db, statementSql[which], -1, SQLITE_PREPARE_PERSISTENT, &statements[which], nullptr);
+            if (ecode != SQLITE_OK) {
+                setError(errmsg);
+                statements[which] = nullptr;
+                return nullptr;
+            }
+        }
+        return statements[which];
+    }
+
+    /**
+     * @brief Run a statement that returns at most one integer
+     * @param stmt Statement with its parameters bound
+     * @param errmsg SQLite3 error message char**
+     * @retval -2 An error has occurred
+     * @retval -1 No row returned
+     * @return The integer in the first column
+     */
+    int Database::stepInt(sqlite3_stmt* stmt, char** errmsg) {
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_ROW) return sqlite3_column_int(stmt, 0);
+        if (ecode == SQLITE_DONE) return -1;
+        setError(errmsg);
+        return -2;
+    }
+
+    /**
+     * @brief Run a statement that returns at most one string
+     * @param stmt Statement with its parameters bound
+     * @param out Pointer to the return std::string, left untouched if no row is returned
+     * @param errmsg SQLite3 error message char**
+     * @retval true Statement ran successfully
+     * @retval false An error has occurred
+     */
+    bool Database::stepString(sqlite3_stmt* stmt, std::string* out, char** errmsg) {
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_ROW) {
+            // assign() reuses the capacity out already has
+            const char* text = (const char*)sqlite3_column_text(stmt, 0);
+            out->assign(text ? text : "", sqlite3_column_bytes(stmt, 0));
+            return true;
+        }
+        if (ecode == SQLITE_DONE) return true;
+        setError(errmsg);
+        return false;
+    }
+
+    /**
+     * @brief Run a statement that returns no rows
+     * @param stmt Statement with its parameters bound
+     * @param errmsg SQLite3 error message char**
+     * @retval true Statement ran successfully
+     * @retval false An error has occurred
+     */
+    bool Database::stepDone(sqlite3_stmt* stmt, char** errmsg) {
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_DONE || ecode == SQLITE_ROW) return true;
+        setError(errmsg);
+        return false;
+    }
+
+    /**
+     * @brief Run a statement that returns a column of IDs
+     * @param stmt Statement with its parameters bound
+     * @param ids Pointer to the std::vector to append the IDs to
+     * @param errmsg SQLite3 error message char**
+     * @retval true Statement ran successfully
+     * @retval false An error has occurred
+     */
+    bool Database::stepIds(sqlite3_stmt* stmt, std::vector<unsigned int>* ids, char** errmsg) {
+        int ecode;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) ids->push_back((unsigned int)sqlite3_column_int64(stmt, 0));
+        if (ecode == SQLITE_DONE) return true;
+        setError(errmsg);
+        return false;
+    }
+
+    /**
+     * @brief Run a statement that returns IDs with their names
+     * @param stmt Statement with its parameters bound
+     * @param ids Pointer to the std::vector to append the IDs to
+     * @param names Pointer to the std::vector to append the names to
+     * @param errmsg SQLite3 error message char**
+     * @retval true Statement ran successfully
+     * @retval false An error has occurred
+     */
+    bool Database::stepIdNames(sqlite3_stmt* stmt, std::vector<unsigned int>* ids, std::vector<std::string>* names, char** errmsg) {
+        int ecode;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+            ids->push_back((unsigned int)sqlite3_column_int64(stmt, 0));
+            names->emplace_back((const char*)sqlite3_column_text(stmt, 1), (size_t)sqlite3_column_bytes(stmt, 1));
+        }
+        if (ecode == SQLITE_DONE) return true;
+        setError(errmsg);
+        return false;
+    }
+
+    /**
+     * @brief Create the database tables
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tables were created successfully
+     * @retval false Table creation failed - check if the database already has tables
+     */
+    bool Database::createDatabase(char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_CREATE_DATABASE);
+        if (!db) return false;
+        int ecode = 0; //Exit code
+        // Create table dir
+        ecode = sqlite3_exec(db, "CREATE TABLE dir("
+                                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                 "path VARCHAR(256) UNIQUE NOT NULL);", nullptr, nullptr, errmsg);
+        if (ecode != SQLITE_OK) return false;
+        // Create table file
+        ecode = sqlite3_exec(db, "CREATE TABLE file("
+                                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                 "dir INTEGER NOT NULL, "
+                                 "name VARCHAR(64) NOT NULL, "
+                                 "FOREIGN KEY (dir) REFERENCES dir(id));", nullptr, nullptr, errmsg);
+        if (ecode != SQLITE_OK) return false;
+        // Create table tag
+        ecode = sqlite3_exec(db, "CREATE TABLE tag("
+                                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                 "tag VARCHAR(64) UNIQUE NOT NULL);", nullptr, nullptr, errmsg);
+        if (ecode != SQLITE_OK) return false;
+        // Everything added since the first version comes from the migrations
+        return migrate(errmsg);
+    }
+
+    /**
+     * @brief Get the schema version of the database
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @return The version, 0 for databases created before versioning
+     */
+    int Database::getSchemaVersion(char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_SCHEMA_VERSION);
+        if (!db) return -1;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) != SQLITE_OK) {
+            setError(errmsg);
+            return -1;
+        }
+        int res = stepInt(stmt, errmsg);
+        sqlite3_finalize(stmt);
+        return res < 0 ? -1 : res;
+    }
+
+    /**
+     * @brief Upgrade the schema to schemaVersion one step at a time
+     * @param errmsg SQLite3 error message char**
+     * @retval true Schema is up to date
+     * @retval false A step failed and was rolled back, or the database is newer than the library
+     */
+    bool Database::migrate(char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_MIGRATE);
+        int version = getSchemaVersion(errmsg);
+        if (version < 0) return false;
+        if (version > schemaVersion) {
+            if (errmsg) *errmsg = sqlite3_mprintf("database schema version %d is newer than this library's %d", version, schemaVersion);
+            return false;
+        }
+        while (version < schemaVersion) {
+            if (!begin(errmsg)) return false;
+            // Another connection may have upgraded while we waited for the write lock
+            int current = getSchemaVersion(errmsg);
+            if (current < 0) {
+                rollback(nullptr);
+                return false;
+            }
+            if (current == version) {
+                char* bump = sqlite3_mprintf("PRAGMA user_version = %d;", version + 1);
+                int ecode = sqlite3_exec(db, migrations[version].sql, nullptr, nullptr, errmsg);
+                if (ecode == SQLITE_OK && migrations[version].convert && !migrations[version].convert(db, errmsg)) ecode = SQLITE_ERROR;
+                if (ecode == SQLITE_OK) ecode = sqlite3_exec(db, bump, nullptr, nullptr, errmsg);
+                sqlite3_free(bump);
+                if (ecode != SQLITE_OK) {
+                    rollback(nullptr);
+                    return false;
+                }
+                current = version + 1;
+            }
+            if (!commit(errmsg)) {
+                rollback(nullptr);
+                return false;
+            }
+            version = current;
+        }
+        // Statements prepared against the old schema would be re-prepared anyway, start clean
+        for (int i = 0; i < STMT_COUNT; i++) {
+            sqlite3_finalize(statements[i]);
+            statements[i] = nullptr;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Checks the existence of a directory in the database
+     * @param path Path of the directory to check
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 Directory does not exist
+     * @retval 1 Directory does exist
+     */
+    short Database::dirExists(const char* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_DIR_EXISTS);
+        std::string normalized;
+        if (!normalizePath(path, &normalized)) return 0;
+        int res = resolveDir(normalized, false, false, nullptr, errmsg);
+        if (res == -2) return -1;
+        return res == -1 ? 0 : 1;
+    }
+
+    /**
+     * @brief Adds a directory to the database
+     * @param path The path of the directory
+     * @param errmsg SQLite3 error message char**
+     * @retval true Directory added
+     * @retval false Directory could not be added
+     * @note Ancestors that aren't in the database yet are added along with it
+     */
+    bool Database::addDir(const char* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ADD_DIR);
+        std::string normalized;
+        if (!normalizePath(path, &normalized)) return false;
+        // Missing ancestors are added along with it
+        if (!begin(errmsg)) return false;
+        bool inserted = false;
+        if (resolveDir(normalized, true, false, &inserted, errmsg) < 0 || !commit(errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        return inserted;
+    }
+
+    /**
+     * @brief Get directory ID by path
+     * @param path The directory path to search for
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 Error or directory doesn't exist
+     * @return The ID of the directory
+     */
+    int Database::getDir(const char* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_DIR);
+        std::string normalized;
+        if (!normalizePath(path, &normalized)) return -1;
+        int res = resolveDir(normalized, false, false, nullptr, errmsg);
+        return res < 0 ? -1 : res;
+    }
+
+    /**
+     * @brief Find a directory by its normalized path, optionally adding it and its missing ancestors
+     * @param path Normalized path
+     * @param create Whether to add the directory if it's missing, needs an open transaction
+     * @param implicit Whether implicit directories are wanted, e.g. to be a parent, or added if missing
+     * @param inserted Pointer to the return bool, set to true if the directory was added; may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval -2 An error has occurred
+     * @retval -1 Directory doesn't exist and create is false
+     * @return The ID of the directory
+     */
+    int Database::resolveDir(std::string_view path, bool create, bool implicit, bool* inserted, char** errmsg) {
+        sqlite3_stmt* child = statement(STMT_DIR_CHILD, errmsg);
+        if (!child) return -2;
+        NameCache* names = nameCache();
+        int id = 0;
+        size_t start = 0;
+        if (names) {
+            int cached = names->getDir(path);
+            if (metrics) metrics->countCache(cached >= 0);
+            if (cached >= 0) return cached;
+            // Only added directories are cached, any of them is a valid place to start walking from
+            for (size_t end = path.rfind('/'); end != std::string_view::npos && end > 0; end = path.rfind('/', end - 1)) {
+                cached = names->getDir(path.substr(0, end));
+                if (cached >= 0) {
+                    id = cached;
+                    start = end + 1;
+                    break;
+                }
+            }
+        }
+        // One index search on (parent, name) per component, the root being the top level directory with no name
+        std::string_view name;
+        bool last = false;
+        bool found = true;
+        bool isImplicit = false;
+        while (found) {
+            last = pathComponent(path, start, &name);
+            StatementReset reset{child};
+            sqlite3_bind_int64(child, 1, id);
+            sqlite3_bind_text(child, 2, name.data(), (int)name.size(), SQLITE_STATIC);
+            int ecode = sqlite3_step(child);
+            if (ecode == SQLITE_ROW) {
+                id = sqlite3_column_int(child, 0);
+                isImplicit = sqlite3_column_int(child, 1) != 0;
+                if (last) break;
+                start += name.size() + 1;
+            } else if (ecode == SQLITE_DONE) found = false;
+            else {
+                setError(errmsg);
+                return -2;
+            }
+        }
+        if (found && (!isImplicit || implicit)) {
+            if (names && !isImplicit) names->putDir(id, path);
+            return id;
+        }
+        if (!create) return -1;
+        if (found) {
+            // An implicit directory being added for real
+            sqlite3_stmt* stmt = statement(STMT_REGISTER_DIR, errmsg);
+            if (!stmt) return -2;
+            StatementReset reset{stmt};
+            sqlite3_bind_int64(stmt, 1, id);
+            if (!stepDone(stmt, errmsg)) return -2;
+        } else {
+            // Add the missing components, every one but the last as an implicit ancestor
+            sqlite3_stmt* insert = statement(STMT_ADD_DIR, errmsg);
+            sqlite3_stmt* link = statement(STMT_ADD_DIR_LINKS, errmsg);
+            if (!insert || !link) return -2;
+            // The directory asked for gets the first new ID and its ancestors the ones after it,
+            // so IDs follow the order directories were added in
+            int missing = 1;
+            for (size_t i = start; i < path.size(); i++) missing += path[i] == '/';
+            if (!path.empty() && path.back() == '/') missing--;
+            int base = -1;
+            int ancestors = 0;
+            if (missing > 1) {
+                sqlite3_stmt* lastId = statement(STMT_DIR_LAST_ID, errmsg);
+                if (!lastId) return -2;
+                StatementReset reset{lastId};
+                base = stepInt(lastId, errmsg);
+                if (base < 0) return -2;
+            }
+            while (true) {
+                last = pathComponent(path, start, &name);
+                StatementReset resetInsert{insert};
+                StatementReset resetLink{link};
+                sqlite3_bind_int64(insert, 1, id);
+                sqlite3_bind_text(insert, 2, name.data(), (int)name.size(), SQLITE_STATIC);
+                sqlite3_bind_int(insert, 3, last ? implicit : true);
+                if (base < 0) sqlite3_bind_null(insert, 4);
+                else sqlite3_bind_int(insert, 4, last ? base + 1 : base + 1 + ++ancestors);
+                if (!stepDone(insert, errmsg)) return -2;
+                id = (int)sqlite3_last_insert_rowid(db);
+                sqlite3_bind_int64(link, 1, id);
+                if (!stepDone(link, errmsg)) return -2;
+                if (last) break;
+                start += name.size() + 1;
+            }
+        }
+        if (inserted) *inserted = true;
+        if (names && !implicit) names->putDir(id, path);
+        return id;
+    }
+
+    /**
+     * @brief Build the path of a directory by walking up to the top
+     * @param id Directory ID
+     * @param path Pointer to the return std::string, left untouched if the directory doesn't exist
+     * @param isImplicit Pointer to the return bool, set to whether the directory is implicit
+     * @param errmsg SQLite3 error message char**
+     * @retval true Walk finished
+     * @retval false An error has occurred
+     */
+    bool Database::buildDirPath(unsigned int id, std::string* path, bool* isImplicit, char** errmsg) {
+        sqlite3_stmt* stmt = statement(STMT_DIR_NODE, errmsg);
+        if (!stmt) return false;
+        // Callers have validated the cache already
+        NameCache* known = nameCache(false);
+        // Names from the directory up, until the top or the first ancestor with a cached path
+        std::vector<std::string> names;
+        std::string out;
+        bool top = false;
+        unsigned int current = id;
+        while (!top) {
+            if (current != id && known && known->getDirPath(current, &out)) break;
+            StatementReset reset{stmt};
+            sqlite3_bind_int64(stmt, 1, current);
+            int ecode = sqlite3_step(stmt);
+            if (ecode == SQLITE_DONE) return true;
+            if (ecode != SQLITE_ROW) {
+                setError(errmsg);
+                return false;
+            }
+            if (current == id) *isImplicit = sqlite3_column_int(stmt, 2) != 0;
+            current = (unsigned int)sqlite3_column_int64(stmt, 0);
+            names.emplace_back((const char*)sqlite3_column_text(stmt, 1), (size_t)sqlite3_column_bytes(stmt, 1));
+            top = current == 0;
+        }
+        size_t i = names.size();
+        // The root's empty name turns into the leading '/'
+        if (top) out = names[--i];
+        while (i > 0) {
+            if (out != "/") out += '/';
+            out += names[--i];
+        }
+        *path = out.empty() ? "/" : std::move(out);
+        return true;
+    }
+
+    /**
+     * @brief Get the path of any directory row by ID, implicit ones included, through the name cache
+     * @param id Directory ID
+     * @param path Pointer to the return std::string, left untouched if the directory doesn't exist
+     * @param isImplicit Pointer to the return bool, set to whether the directory is implicit
+     * @param errmsg SQLite3 error message char**
+     * @retval true Lookup finished
+     * @retval false An error has occurred
+     */
+    bool Database::lookupDirPath(unsigned int id, std::string* path, bool* isImplicit, char** errmsg) {
+        NameCache* names = nameCache();
+        // Only added directories are cached
+        bool hit = names && names->getDirPath(id, path);
+        if (names && metrics) metrics->countCache(hit);
+        *isImplicit = false;
+        if (hit) return true;
+        // Paths are never empty, so an empty result means no row
+        std::string found;
+        if (!buildDirPath(id, &found, isImplicit, errmsg)) return false;
+        if (found.empty()) return true;
+        if (names && !*isImplicit) names->putDir(id, found);
+        *path = std::move(found);
+        return true;
+    }
+
+    /**
+     * @brief Get directory path by ID
+     * @param id The directory ID to search for
+     * @param path Pointer to the return std::string; left untouched if not found or only added implicitly
+     * @param errmsg SQLite3 error message char**
+     * @retval true Directory found, name returned
+     * @retval false An error has occurred
+     */
+    bool Database::getDirPath(unsigned int id, std::string* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_DIR_PATH);
+        std::string found;
+        bool isImplicit = false;
+        if (!lookupDirPath(id, &found, &isImplicit, errmsg)) return false;
+        // Implicit directories are missing, as in getDir()
+        if (!found.empty() && !isImplicit) *path = std::move(found);
+        return true;
+    }
+
+    /**
+     * @brief Get directory path by ID, copied into an arena
+     * @param id The directory ID to search for
+     * @param arena Memory the path is copied into, e.g. a std::pmr::monotonic_buffer_resource
+     * @param path Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+     * @param errmsg SQLite3 error message char**
+     * @retval true Directory found, path returned
+     * @retval false An error has occurred
+     */
+    bool Database::getDirPath(unsigned int id, std::pmr::memory_resource* arena, std::string_view* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_DIR_PATH);
+        scratch.clear();
+        if (!getDirPath(id, &scratch, errmsg)) return false;
+        if (!scratch.empty()) *path = arenaCopy(arena, scratch);
+        return true;
+    }
+
+    /**
+     * @brief Check the existence of a file in the database
+     * @param dir Directory ID
+     * @param filename Name of the file to check
+     * @param errmsg SQLite error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 File does not exist
+     * @retval 1 File does exist
+     */
+    short Database::fileExists(unsigned int dir, const char* filename, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_FILE_EXISTS);
+        sqlite3_stmt* stmt = statement(STMT_FILE_BY_NAME, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, dir);
+        sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+        int res = stepInt(stmt, errmsg);
+        if (res == -2) return -1;
+        return res == -1 ? 0 : 1;
+    }
+
+    /**
+     * @brief Adds a file to the database
+     * @param dir Directory ID
+     * @param filename Name of the file to add
+     * @param errmsg SQLite error message char**
+     * @retval true File added successfully
+     * @retval false File could not be added
+     */
+    bool Database::addFile(unsigned int dir, const char* filename, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ADD_FILE);
+        // The unique (dir, name) index does the existence check
+        sqlite3_stmt* stmt = statement(STMT_ADD_FILE_IGNORE, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, dir);
+        sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+        if (!stepDone(stmt, errmsg)) return false;
+        if (sqlite3_changes(db) != 1) return false;
+        unsigned int id = (unsigned int)sqlite3_last_insert_rowid(db);
+        for (Observer* observer : observers) observer->fileAdded(id);
+        return true;
+    }
+
+    /**
+     * @brief Get file ID by dir and filename
+     * @param dir Directory ID
+     * @param filename Name of the file
+     * @param errmsg SQLite error message char**
+     * @retval -1 Error or file doesn't exist
+     * @return The ID of the file
+     */
+    int Database::getFile(unsigned int dir, const char* filename, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_FILE);
+        sqlite3_stmt* stmt = statement(STMT_FILE_BY_NAME, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, dir);
+        sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+        int res = stepInt(stmt, errmsg);
+        return res < 0 ? -1 : res;
+    }
+
+    /**
+     * @brief Get filename by ID
+     * @param id File ID
+     * @param filename Pointer to the return std::string
+     * @param errmsg SQLite error message char**
+     * @retval true File found, filename returned
+     * @retval false An error has occurred
+     */
+    bool Database::getFileName(unsigned int id, std::string* filename, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_FILE_NAME);
+        sqlite3_stmt* stmt = statement(STMT_FILE_NAME, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, id);
+        return stepString(stmt, filename, errmsg);
+    }
+
+    /**
+     * @brief Get filename by ID, copied into an arena
+     * @param id File ID
+     * @param arena Memory the filename is copied into, e.g. a std::pmr::monotonic_buffer_resource
+     * @param filename Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+     * @param errmsg SQLite error message char**
+     * @retval true File found, filename returned
+     * @retval false An error has occurred
+     */
+    bool Database::getFileName(unsigned int id, std::pmr::memory_resource* arena, std::string_view* filename, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_FILE_NAME);
+        sqlite3_stmt* stmt = statement(STMT_FILE_NAME, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, id);
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_DONE) return true;
+        if (ecode != SQLITE_ROW) {
+            setError(errmsg);
+            return false;
+        }
+        // Copied straight from the row, no std::string in between
+        *filename = arenaCopy(arena, std::string_view((const char*)sqlite3_column_text(stmt, 0), (size_t)sqlite3_column_bytes(stmt, 0)));
+        return true;
+    }
+
+    /**
+     * @brief Get the full path of a file by ID
+     * @param id File ID
+     * @param path Pointer to the return std::string, directory path and filename joined with '/'
+     * @param errmsg SQLite error message char**
+     * @retval true File found, path returned
+     * @retval false An error has occurred
+     */
+    bool Database::getFilePath(unsigned int id, std::string* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_FILE_PATH);
+        sqlite3_stmt* stmt = statement(STMT_FILE_NODE, errmsg);
+        if (!stmt) return false;
+        unsigned int dir;
+        std::string name;
+        {
+            StatementReset reset{stmt};
+            sqlite3_bind_int64(stmt, 1, id);
+            int ecode = sqlite3_step(stmt);
+            if (ecode == SQLITE_DONE) return true;
+            if (ecode != SQLITE_ROW) {
+                setError(errmsg);
+                return false;
+            }
+            dir = (unsigned int)sqlite3_column_int64(stmt, 0);
+            name.assign((const char*)sqlite3_column_text(stmt, 1), (size_t)sqlite3_column_bytes(stmt, 1));
+        }
+        // A file's directory has a path even if it was only added implicitly
+        std::string dirPath;
+        bool isImplicit = false;
+        if (!lookupDirPath(dir, &dirPath, &isImplicit, errmsg)) return false;
+        if (dirPath != "/") dirPath += '/';
+        *path = dirPath + name;
+        return true;
+    }
+
+    /**
+     * @brief Get the full path of a file by ID, copied into an arena
+     * @param id File ID
+     * @param arena Memory the path is copied into, e.g. a std::pmr::monotonic_buffer_resource
+     * @param path Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+     * @param errmsg SQLite error message char**
+     * @retval true File found, path returned
+     * @retval false An error has occurred
+     */
+    bool Database::getFilePath(unsigned int id, std::pmr::memory_resource* arena, std::string_view* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_FILE_PATH);
+        sqlite3_stmt* stmt = statement(STMT_FILE_NODE, errmsg);
+        if (!stmt) return false;
+        // The row stays current, and its name valid, while the directory path is looked up
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, id);
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_DONE) return true;
+        if (ecode != SQLITE_ROW) {
+            setError(errmsg);
+            return false;
+        }
+        unsigned int dir = (unsigned int)sqlite3_column_int64(stmt, 0);
+        std::string_view name((const char*)sqlite3_column_text(stmt, 1), (size_t)sqlite3_column_bytes(stmt, 1));
+        scratch.clear();
+        bool isImplicit = false;
+        if (!lookupDirPath(dir, &scratch, &isImplicit, errmsg)) return false;
+        if (scratch != "/") scratch += '/';
+        size_t size = scratch.size() + name.size();
+        char* out = (char*)arena->allocate(size, 1);
+        std::memcpy(out, scratch.data(), scratch.size());
+        std::memcpy(out + scratch.size(), name.data(), name.size());
+        *path = std::string_view(out, size);
+        return true;
+    }
+
+    /**
+     * @brief Check the existence of a tag in the database
+     * @param value Tag name
+     * @param errmsg SQLite error message char**
+     * @retval -1 Error
+     * @retval 0 Tag does not exist
+     * @retval 1 Tag exists
+     */
+    short Database::tagExists(const char* value, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_TAG_EXISTS);
+        NameCache* names = nameCache();
+        bool hit = names && names->getTag(value) >= 0;
+        if (names && metrics) metrics->countCache(hit);
+        if (hit) return 1;
+        sqlite3_stmt* stmt = statement(STMT_TAG_BY_VALUE, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
+        int res = stepInt(stmt, errmsg);
+        if (res == -2) return -1;
+        if (res == -1) return 0;
+        if (names) names->putTag(res, value);
+        return 1;
+    }
+
+    /**
+     * @brief Add a tag into the database
+     * @param value Tag name
+     * @param errmsg SQLite error message char**
+     * @retval false Error or tag already exists
+     * @retval true Added successfully
+     * @note The parent named by the part before the last slash is added along with it, and so on up
+     */
+    bool Database::addTag(const char* value, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ADD_TAG);
+        if (!begin(errmsg)) return false;
+        std::vector<std::pair<unsigned int, std::string>> added;
+        if (insertTag(value, &added, errmsg) < 0) {
+            rollback(nullptr);
+            return false;
+        }
+        // Nothing changed, releasing the savepoint keeps the name cache a rollback would clear
+        if (added.empty()) {
+            if (!commit(errmsg)) rollback(nullptr);
+            return false;
+        }
+        if (!commit(errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        NameCache* names = nameCache();
+        if (names) for (const auto& [id, name] : added) names->putTag(id, name);
+        for (Observer* observer : observers) for (const auto& [id, name] : added) observer->tagAdded(id, name);
+        return true;
+    }
+
+    /**
+     * @brief Find a tag by name, adding it and its missing ancestors if needed
+     * @param value Tag name
+     * @param added Pointer to the return vector, gets the tags added, parents first
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @return The ID of the tag
+     */
+    int Database::insertTag(std::string_view value, std::vector<std::pair<unsigned int, std::string>>* added, char** errmsg) {
+        sqlite3_stmt* insert = statement(STMT_ADD_TAG_IGNORE, errmsg);
+        sqlite3_stmt* select = statement(STMT_TAG_BY_VALUE, errmsg);
+        if (!insert || !select) return -1;
+        // Siblings share their parent, it's looked up in the cache before the database
+        // Tags are never renamed or removed, a cached one is still there without checking for other writers
+        std::string_view parentValue;
+        int parent = 0;
+        if (parentTag(value, &parentValue)) {
+            NameCache* names = nameCache(false);
+            parent = names ? names->getTag(parentValue) : -1;
+            if (names && metrics) metrics->countCache(parent >= 0);
+            if (parent < 0) parent = insertTag(parentValue, added, errmsg);
+            if (parent < 0) return -1;
+        }
+        sqlite3_bind_text(insert, 1, value.data(), (int)value.size(), SQLITE_STATIC);
+        sqlite3_bind_int64(insert, 2, parent);
+        sqlite3_bind_text(select, 1, value.data(), (int)value.size(), SQLITE_STATIC);
+        bool inserted = false;
+        int id = insertOrGet(insert, select, &inserted, errmsg);
+        if (id < 0 || !inserted) return id;
+        // Top level tags only link to themselves, no need to walk up
+        sqlite3_stmt* link = statement(parent > 0 ? STMT_ADD_TAG_LINKS : STMT_ADD_TAG_ROOT, errmsg);
+        if (!link) return -1;
+        StatementReset reset{link};
+        sqlite3_bind_int64(link, 1, id);
+        if (!stepDone(link, errmsg)) return -1;
+        added->emplace_back(id, std::string(value));
+        return id;
+    }
     
     /**
-     * @brief Set the database path string
-     * @param path Path to the database file
+     * @brief Gets tag ID by tag name
+     * @param value Tag name
+     * @param errmsg SQLite error message char**
+     * @retval -1 Error or tag does not exist
+     * @return Tag ID
+     */
+    int Database::getTag(const char* value, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_TAG);
+        NameCache* names = nameCache();
+        if (names) {
+            int id = names->getTag(value);
+            if (metrics) metrics->countCache(id >= 0);
+            if (id >= 0) return id;
+        }
+        sqlite3_stmt* stmt = statement(STMT_TAG_BY_VALUE, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
+        int res = stepInt(stmt, errmsg);
+        if (res < 0) return -1;
+        if (names) names->putTag(res, value);
+        return res;
+    }
+
+    /**
+     * @brief Get tag value by ID
+     * @param id Tag ID
+     * @param value Pointer to the return std::string
+     * @param errmsg SQLite error message char**
+     * @retval true Value returned
+     * @retval false Error
+     */
+    bool Database::getTagValue(unsigned int id, std::string* value, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_TAG_VALUE);
+        NameCache* names = nameCache();
+        bool hit = names && names->getTagValue(id, value);
+        if (names && metrics) metrics->countCache(hit);
+        if (hit) return true;
+        sqlite3_stmt* stmt = statement(STMT_TAG_VALUE, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, id);
+        if (!names) return stepString(stmt, value, errmsg);
+        // Tag names are never empty, so an empty result means no row
+        std::string found;
+        if (!stepString(stmt, &found, errmsg)) return false;
+        if (found.empty()) return true;
+        names->putTag(id, found);
+        *value = std::move(found);
+        return true;
+    }
+
+    /**
+     * @brief Get tag value by ID, copied into an arena
+     * @param id Tag ID
+     * @param arena Memory the value is copied into, e.g. a std::pmr::monotonic_buffer_resource
+     * @param value Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+     * @param errmsg SQLite error message char**
+     * @retval true Value returned
+     * @retval false Error
+     */
+    bool Database::getTagValue(unsigned int id, std::pmr::memory_resource* arena, std::string_view* value, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_TAG_VALUE);
+        scratch.clear();
+        if (!getTagValue(id, &scratch, errmsg)) return false;
+        if (!scratch.empty()) *value = arenaCopy(arena, scratch);
+        return true;
+    }
+
+    /**
+     * @brief Insert one row with INSERT OR IGNORE and get its ID
+     * @param insert Insert statement with its parameters bound
+     * @param select Lookup statement with the same parameters bound, used if the row already existed
+     * @param inserted Pointer to the return bool, set to whether the row is new
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @return The ID of the new or existing row
+     */
+    int Database::insertOrGet(sqlite3_stmt* insert, sqlite3_stmt* select, bool* inserted, char** errmsg) {
+        StatementReset resetInsert{insert};
+        if (!stepDone(insert, errmsg)) return -1;
+        *inserted = sqlite3_changes(db) == 1;
+        if (*inserted) return (int)sqlite3_last_insert_rowid(db);
+        // Row was already there
+        StatementReset resetSelect{select};
+        int res = stepInt(select, errmsg);
+        return res < 0 ? -1 : res;
+    }
+
+    /**
+     * @brief Add many directories in one transaction
+     * @param paths Directory paths, already existing ones are skipped
+     * @param ids Pointer to the return std::vector, gets the ID of every path in input order
+     * @param errmsg SQLite3 error message char**
+     * @retval true All directories added or already present
+     * @retval false An error has occurred, nothing was added
+     */
+    bool Database::addDirs(const std::vector<std::string_view>& paths, std::vector<int>* ids, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ADD_DIRS);
+        if (!begin(errmsg)) return false;
+        std::string normalized;
+        ids->resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            (*ids)[i] = normalizePath(paths[i], &normalized) ? resolveDir(normalized, true, false, nullptr, errmsg) : -2;
+            if ((*ids)[i] < 0) {
+                rollback(nullptr);
+                ids->clear();
+                return false;
+            }
+        }
+        if (!commit(errmsg)) {
+            rollback(nullptr);
+            ids->clear();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Add many files of one directory in one transaction
+     * @param dir Directory ID
+     * @param filenames Names of the files, already existing ones are skipped
+     * @param ids Pointer to the return std::vector, gets the ID of every file in input order
+     * @param errmsg SQLite3 error message char**
+     * @retval true All files added or already present
+     * @retval false An error has occurred, nothing was added
+     */
+    bool Database::addFiles(unsigned int dir, const std::vector<std::string_view>& filenames, std::vector<int>* ids, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ADD_FILES);
+        sqlite3_stmt* insert = statement(STMT_ADD_FILE_IGNORE, errmsg);
+        sqlite3_stmt* select = statement(STMT_FILE_BY_NAME, errmsg);
+        if (!insert || !select) return false;
+        // New files, told to the observers after commit
+        std::vector<unsigned int> added;
+        if (!begin(errmsg)) return false;
+        bool inserted = false;
+        ids->resize(filenames.size());
+        for (size_t i = 0; i < filenames.size(); i++) {
+            sqlite3_bind_int64(insert, 1, dir);
+            sqlite3_bind_text(insert, 2, filenames[i].data(), (int)filenames[i].size(), SQLITE_STATIC);
+            sqlite3_bind_int64(select, 1, dir);
+            sqlite3_bind_text(select, 2, filenames[i].data(), (int)filenames[i].size(), SQLITE_STATIC);
+            (*ids)[i] = insertOrGet(insert, select, &inserted, errmsg);
+            if ((*ids)[i] == -1) {
+                rollback(nullptr);
+                ids->clear();
+                return false;
+            }
+            if (inserted && !observers.empty()) added.push_back((*ids)[i]);
+        }
+        if (!commit(errmsg)) {
+            rollback(nullptr);
+            ids->clear();
+            return false;
+        }
+        for (Observer* observer : observers) for (unsigned int id : added) observer->fileAdded(id);
+        return true;
+    }
+
+    /**
+     * @brief Add many tags in one transaction
+     * @param values Tag names, already existing ones are skipped
+     * @param ids Pointer to the return std::vector, gets the ID of every tag in input order
+     * @param errmsg SQLite3 error message char**
+     * @retval true All tags added or already present
+     * @retval false An error has occurred, nothing was added
+     */
+    bool Database::addTags(const std::vector<std::string_view>& values, std::vector<int>* ids, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ADD_TAGS);
+        // New tags and their new parents, told to the observers after commit
+        std::vector<std::pair<unsigned int, std::string>> added;
+        // Tags that were already there, the new ones get cached from added
+        std::vector<bool> existing(values.size());
+        if (!begin(errmsg)) return false;
+        ids->resize(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            size_t before = added.size();
+            (*ids)[i] = insertTag(values[i], &added, errmsg);
+            if ((*ids)[i] == -1) {
+                rollback(nullptr);
+                ids->clear();
+                return false;
+            }
+            existing[i] = added.size() == before;
+        }
+        if (!commit(errmsg)) {
+            rollback(nullptr);
+            ids->clear();
+            return false;
+        }
+        NameCache* names = nameCache();
+        if (names) {
+            for (size_t i = 0; i < values.size(); i++) if (!existing[i]) names->putTag((*ids)[i], values[i]);
+            for (const auto& [id, value] : added) names->putTag(id, value);
+        }
+        for (Observer* observer : observers) for (const auto& [id, value] : added) observer->tagAdded(id, value);
+        return true;
+    }
+
+    /**
+     * @brief Start a write transaction
+     * @param errmsg SQLite3 error message char**
+     * @retval true Transaction started
+     * @retval false An error has occurred
+     * @note Nests: inside an open transaction this opens a savepoint instead
+     */
+    bool Database::begin(char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_BEGIN);
+        if (!db) return false;
+        // IMMEDIATE takes the write lock up front, so we never fail halfway through upgrading a read lock
+        bool outermost = transactionDepth == 0 && sqlite3_get_autocommit(db);
+        int ecode = sqlite3_exec(db, outermost ? "BEGIN IMMEDIATE;" : "SAVEPOINT ftagmgr;", nullptr, nullptr, errmsg);
+        if (ecode != SQLITE_OK) return false;
+        if (transactionDepth == 0) ownsTransaction = outermost;
+        transactionDepth++;
+        return true;
+    }
+
+    /**
+     * @brief Commit the innermost transaction started with begin()
+     * @param errmsg SQLite3 error message char**
+     * @retval true Committed
+     * @retval false An error has occurred, the transaction is still open
+     */
+    bool Database::commit(char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_COMMIT);
+        if (!db || transactionDepth == 0) return false;
+        bool outermost = transactionDepth == 1 && ownsTransaction;
+        int ecode = sqlite3_exec(db, outermost ? "COMMIT;" : "RELEASE ftagmgr;", nullptr, nullptr, errmsg);
+        if (ecode != SQLITE_OK) return false;
+        transactionDepth--;
+        return true;
+    }
+
+    /**
+     * @brief Roll back the innermost transaction started with begin()
+     * @param errmsg SQLite3 error message char**
+     * @retval true Rolled back
+     * @retval false An error has occurred
+     */
+    bool Database::rollback(char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_ROLLBACK);
+        if (!db || transactionDepth == 0) return false;
+        bool outermost = transactionDepth == 1 && ownsTransaction;
+        transactionDepth--;
+        int ecode = sqlite3_exec(db, outermost ? "ROLLBACK;" : "ROLLBACK TO ftagmgr; RELEASE ftagmgr;", nullptr, nullptr, errmsg);
+        // Names added in the undone transaction may be cached, their IDs can be handed out again
+        NameCache* names = nameCache(false);
+        if (names) names->clear();
+        return ecode == SQLITE_OK;
+    }
+
+    /**
+     * @brief Tag a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite3 error message char**
+     * @retval true File tagged
+     * @retval false File already has the tag or an error has occurred
+     */
+    bool Database::tagFile(unsigned int file, unsigned int tag, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_TAG_FILE);
+        sqlite3_stmt* stmt = statement(STMT_TAG_FILE, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, file);
+        sqlite3_bind_int64(stmt, 2, tag);
+        if (!stepDone(stmt, errmsg)) return false;
+        if (sqlite3_changes(db) != 1) return false;
+        for (Observer* observer : observers) observer->tagged(file, tag);
+        return true;
+    }
+
+    /**
+     * @brief Remove a tag from a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tag removed
+     * @retval false File didn't have the tag or an error has occurred
+     */
+    bool Database::untagFile(unsigned int file, unsigned int tag, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_UNTAG_FILE);
+        sqlite3_stmt* stmt = statement(STMT_UNTAG_FILE, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, file);
+        sqlite3_bind_int64(stmt, 2, tag);
+        if (!stepDone(stmt, errmsg)) return false;
+        if (sqlite3_changes(db) != 1) return false;
+        for (Observer* observer : observers) observer->untagged(file, tag);
+        return true;
+    }
+
+    /**
+     * @brief Check if a file has a tag
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 File doesn't have the tag
+     * @retval 1 File has the tag
+     */
+    short Database::fileHasTag(unsigned int file, unsigned int tag, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_FILE_HAS_TAG);
+        sqlite3_stmt* stmt = statement(STMT_FILE_HAS_TAG, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, file);
+        sqlite3_bind_int64(stmt, 2, tag);
+        int res = stepInt(stmt, errmsg);
+        if (res == -2) return -1;
+        return res == -1 ? 0 : 1;
+    }
+
+    /**
+     * @brief Run one cached link statement for every link, in one transaction
+     * @param which Link statement taking the file as ?1 and the tag as ?2
+     * @param links The links
+     * @param errmsg SQLite3 error message char**
+     * @retval true Statement ran for every link
+     * @retval false An error has occurred, the transaction was rolled back
+     */
+    bool Database::runLinks(Statement which, const std::vector<FileTag>& links, char** errmsg) {
+        sqlite3_stmt* stmt = statement(which, errmsg);
+        if (!stmt) return false;
+        if (!begin(errmsg)) return false;
+        // Links that actually changed, told to the observers after commit
+        std::vector<FileTag> changed;
+        for (const FileTag& link : links) {
+            StatementReset reset{stmt};
+            sqlite3_bind_int64(stmt, 1, link.file);
+            sqlite3_bind_int64(stmt, 2, link.tag);
+            if (!stepDone(stmt, errmsg)) {
+                rollback(nullptr);
+                return false;
+            }
+            if (!observers.empty() && sqlite3_changes(db) == 1) changed.push_back(link);
+        }
+        if (!commit(errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        notifyLinks(changed, which == STMT_TAG_FILE);
+        return true;
+    }
+
+    /**
+     * @brief Tell the observers about file-tag link changes
+     * @param links The links that changed
+     * @param added true if the links were added, false if removed
+     */
+    void Database::notifyLinks(const std::vector<FileTag>& links, bool added) {
+        for (Observer* observer : observers) {
+            for (const FileTag& link : links) {
+                if (added) observer->tagged(link.file, link.tag);
+                else observer->untagged(link.file, link.tag);
+            }
+        }
+    }
+
+    /**
+     * @brief Add many file-tag links in one transaction
+     * @param links The links to add, already existing ones are skipped
+     * @param errmsg SQLite3 error message char**
+     * @retval true All links present
+     * @retval false An error has occurred, nothing was added
+     */
+    bool Database::tagFiles(const std::vector<FileTag>& links, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_TAG_FILES);
+        return runLinks(STMT_TAG_FILE, links, errmsg);
+    }
+
+    /**
+     * @brief Remove many file-tag links in one transaction
+     * @param links The links to remove, missing ones are skipped
+     * @param errmsg SQLite3 error message char**
+     * @retval true No link left
+     * @retval false An error has occurred, nothing was removed
+     */
+    bool Database::untagFiles(const std::vector<FileTag>& links, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_UNTAG_FILES);
+        return runLinks(STMT_UNTAG_FILE, links, errmsg);
+    }
+
+    /**
+     * @brief Rename a file or move it to another directory, keeping its ID and tags
+     * @param file File ID
+     * @param dir ID of the new directory
+     * @param filename New name of the file
+     * @param errmsg SQLite3 error message char**
+     * @retval true File moved
+     * @retval false File doesn't exist, the new name is taken or an error has occurred
+     */
+    bool Database::moveFile(unsigned int file, unsigned int dir, const char* filename, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_MOVE_FILE);
+        sqlite3_stmt* stmt = statement(STMT_MOVE_FILE, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, file);
+        sqlite3_bind_int64(stmt, 2, dir);
+        sqlite3_bind_text(stmt, 3, filename, -1, SQLITE_STATIC);
+        if (!stepDone(stmt, errmsg)) return false;
+        if (sqlite3_changes(db) != 1) return false;
+        for (Observer* observer : observers) observer->fileMoved(file);
+        return true;
+    }
+
+    /**
+     * @brief Collect the links of files about to be removed, for the observers
+     * @param files File IDs
+     * @param links Pointer to the std::vector to append the links to
+     * @param errmsg SQLite3 error message char**
+     * @retval true Links collected
+     * @retval false An error has occurred
+     */
+    bool Database::collectLinks(const std::vector<unsigned int>& files, std::vector<FileTag>* links, char** errmsg) {
+        sqlite3_stmt* stmt = statement(STMT_FILE_TAGS, errmsg);
+        if (!stmt) return false;
+        std::vector<unsigned int> tags;
+        for (unsigned int file : files) {
+            StatementReset reset{stmt};
+            sqlite3_bind_int64(stmt, 1, file);
+            tags.clear();
+            if (!stepIds(stmt, &tags, errmsg)) return false;
+            for (unsigned int tag : tags) links->push_back({file, tag});
+        }
+        return true;
+    }
+
+    /**
+     * @brief Remove a file and its tags
+     * @param file File ID
+     * @param errmsg SQLite3 error message char**
+     * @retval true File removed
+     * @retval false File doesn't exist or an error has occurred
+     */
+    bool Database::removeFile(unsigned int file, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_REMOVE_FILE);
+        sqlite3_stmt* untag = statement(STMT_REMOVE_FILE_TAGS, errmsg);
+        sqlite3_stmt* remove = statement(STMT_REMOVE_FILE, errmsg);
+        if (!untag || !remove) return false;
+        if (!begin(errmsg)) return false;
+        std::vector<FileTag> links;
+        if (!observers.empty() && !collectLinks({file}, &links, errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        StatementReset resetUntag{untag};
+        StatementReset resetRemove{remove};
+        sqlite3_bind_int64(untag, 1, file);
+        sqlite3_bind_int64(remove, 1, file);
+        if (!stepDone(untag, errmsg) || !stepDone(remove, errmsg) || sqlite3_changes(db) != 1) {
+            rollback(nullptr);
+            return false;
+        }
+        if (!commit(errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        notifyLinks(links, false);
+        for (Observer* observer : observers) observer->fileRemoved(file);
+        return true;
+    }
+
+    /**
+     * @brief Change the path of a directory and of all its subdirectories
+     * @param dir Directory ID
+     * @param path New path of the directory, missing ancestors are added
+     * @param errmsg SQLite3 error message char**
+     * @retval true Directory moved, its files keep their IDs and tags
+     * @retval false Directory doesn't exist, the new path is taken or inside the directory, or an error has occurred
+     */
+    bool Database::moveDir(unsigned int dir, const char* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_MOVE_DIR);
+        sqlite3_stmt* tree = statement(STMT_DIR_TREE, errmsg);
+        sqlite3_stmt* inTree = statement(STMT_DIR_IN_TREE, errmsg);
+        sqlite3_stmt* unlink = statement(STMT_UNLINK_DIR_TREE, errmsg);
+        sqlite3_stmt* move = statement(STMT_MOVE_DIR, errmsg);
+        sqlite3_stmt* link = statement(STMT_LINK_DIR_TREE, errmsg);
+        if (!tree || !inTree || !unlink || !move || !link) return false;
+        std::string old, normalized;
+        if (!normalizePath(path, &normalized)) return false;
+        if (!getDirPath(dir, &old, errmsg) || old.empty()) return false;
+        std::string_view parentPath, name;
+        splitPath(normalized, &parentPath, &name);
+        if (!begin(errmsg)) return false;
+        // Moved directories with their old paths, told to the observers and the cache after commit
+        std::vector<unsigned int> moved;
+        std::vector<std::string> oldPaths;
+        NameCache* names = nameCache(false);
+        // The new parent is added if missing, and must not be inside the moved tree
+        int parent = parentPath.empty() ? 0 : resolveDir(parentPath, true, true, nullptr, errmsg);
+        bool ok = parent >= 0;
+        if (ok && parent > 0) {
+            StatementReset reset{inTree};
+            sqlite3_bind_int64(inTree, 1, dir);
+            sqlite3_bind_int64(inTree, 2, parent);
+            ok = stepInt(inTree, errmsg) == -1;
+        }
+        if (ok && (!observers.empty() || names)) {
+            StatementReset reset{tree};
+            sqlite3_bind_int64(tree, 1, dir);
+            sqlite3_bind_text(tree, 2, old.c_str(), (int)old.size(), SQLITE_STATIC);
+            ok = stepIdNames(tree, &moved, &oldPaths, errmsg);
+        }
+        // Only the top row changes, everything under it follows through the parent links
+        for (sqlite3_stmt* stmt : {unlink, move, link}) {
+            if (!ok) break;
+            StatementReset reset{stmt};
+            sqlite3_bind_int64(stmt, 1, dir);
+            if (stmt == move) {
+                sqlite3_bind_int64(stmt, 2, parent);
+                sqlite3_bind_text(stmt, 3, name.data(), (int)name.size(), SQLITE_STATIC);
+            }
+            ok = stepDone(stmt, errmsg);
+        }
+        if (!ok || !commit(errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        if (names) for (size_t i = 0; i < moved.size(); i++) names->eraseDir(moved[i], oldPaths[i]);
+        for (Observer* observer : observers) for (unsigned int id : moved) observer->dirMoved(id);
+        return true;
+    }
+
+    /**
+     * @brief Remove a directory with its subdirectories, their files and their tags
+     * @param dir Directory ID
+     * @param errmsg SQLite3 error message char**
+     * @retval true Directory removed
+     * @retval false Directory doesn't exist or an error has occurred
+     */
+    bool Database::removeDir(unsigned int dir, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_REMOVE_DIR);
+        sqlite3_stmt* tree = statement(STMT_DIR_TREE, errmsg);
+        sqlite3_stmt* files = statement(STMT_DIR_FILES, errmsg);
+        sqlite3_stmt* untag = statement(STMT_REMOVE_DIR_TAGS, errmsg);
+        sqlite3_stmt* removeFiles = statement(STMT_REMOVE_DIR_FILES, errmsg);
+        sqlite3_stmt* unlink = statement(STMT_UNLINK_DIR_TREE, errmsg);
+        sqlite3_stmt* removeLinks = statement(STMT_REMOVE_DIR_LINKS, errmsg);
+        sqlite3_stmt* remove = statement(STMT_REMOVE_DIR, errmsg);
+        if (!tree || !files || !untag || !removeFiles || !unlink || !removeLinks || !remove) return false;
+        std::string path;
+        if (!getDirPath(dir, &path, errmsg) || path.empty()) return false;
+        if (!begin(errmsg)) return false;
+        std::vector<unsigned int> dirs;
+        std::vector<std::string> paths;
+        // Removed files and links, told to the observers after commit
+        std::vector<unsigned int> removed;
+        std::vector<FileTag> links;
+        bool ok;
+        {
+            StatementReset reset{tree};
+            sqlite3_bind_int64(tree, 1, dir);
+            sqlite3_bind_text(tree, 2, path.c_str(), (int)path.size(), SQLITE_STATIC);
+            ok = stepIdNames(tree, &dirs, &paths, errmsg);
+        }
+        if (ok) {
+            StatementReset reset{unlink};
+            sqlite3_bind_int64(unlink, 1, dir);
+            ok = stepDone(unlink, errmsg);
+        }
+        std::vector<unsigned int> dirFiles;
+        for (size_t i = 0; ok && i < dirs.size(); i++) {
+            if (!observers.empty()) {
+                StatementReset reset{files};
+                sqlite3_bind_int64(files, 1, dirs[i]);
+                dirFiles.clear();
+                ok = stepIds(files, &dirFiles, errmsg) && collectLinks(dirFiles, &links, errmsg);
+                removed.insert(removed.end(), dirFiles.begin(), dirFiles.end());
+            }
+            for (sqlite3_stmt* stmt : {untag, removeFiles, removeLinks, remove}) {
+                if (!ok) break;
+                StatementReset reset{stmt};
+                sqlite3_bind_int64(stmt, 1, dirs[i]);
+                ok = stepDone(stmt, errmsg);
+            }
+        }
+        if (!ok || !commit(errmsg)) {
+            rollback(nullptr);
+            return false;
+        }
+        NameCache* names = nameCache(false);
+        if (names) for (size_t i = 0; i < dirs.size(); i++) names->eraseDir(dirs[i], paths[i]);
+        notifyLinks(links, false);
+        for (Observer* observer : observers) {
+            for (unsigned int file : removed) observer->fileRemoved(file);
+            for (unsigned int id : dirs) observer->dirRemoved(id);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Prepare a statement for a cursor, one that isn't cached
+     * @param sql The query, with ?1 as its only parameter
+     * @param id Value for ?1
+     * @param cursor Pointer to the cursor to hand the statement to
+     * @param errmsg SQLite3 error message char**
+     * @retval true Cursor ready
+     * @retval false An error has occurred
+     */
+    bool Database::openCursor(const char* sql, sqlite3_int64 id, IdCursor* cursor, char** errmsg) {
+        cursor->close();
+        if (!db) return false;
+        // Every cursor gets its own statement, so several listings can be open at once
+        if (sqlite3_prepare_v2(db, sql, -1, &cursor->stmt, nullptr) != SQLITE_OK) {
+            setError(errmsg);
+            cursor->close();
+            return false;
+        }
+        sqlite3_bind_int64(cursor->stmt, 1, id);
+        return true;
+    }
+
+    /**
+     * @brief List the tags of a file, in ascending ID order
+     * @param file File ID
+     * @param cursor Pointer to the cursor to stream the tag IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listFileTags(unsigned int file, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_FILE_TAGS);
+        return openCursor("SELECT tag FROM filetag WHERE file = ?1 ORDER BY tag;", file, cursor, errmsg);
+    }
+
+    /**
+     * @brief List the files with a tag, in ascending ID order
+     * @param tag Tag ID
+     * @param cursor Pointer to the cursor to stream the file IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
      */
-    void setDatabasePath(const char* path) {
-        databasePath = path;
+    bool Database::listTagFiles(unsigned int tag, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_TAG_FILES);
+        return openCursor("SELECT file FROM filetag WHERE tag = ?1 ORDER BY file;", tag, cursor, errmsg);
     }
 
     /**
-     * @brief Check database file existence
-     * @retval true File exists
-     * @retval false File does not exist
+     * @brief List the files of a directory, in ascending ID order
+     * @param dir Directory ID
+     * @param cursor Pointer to the cursor to stream the file IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
      */
-    bool checkDatabaseExistence() {
-        struct stat fileStat;
-        if (stat(databasePath.c_str(), &fileStat) == 0) return true;
-        else return false;
+    bool Database::listDirFiles(unsigned int dir, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_DIR_FILES);
+        return openCursor("SELECT id FROM file WHERE dir = ?1 ORDER BY id;", dir, cursor, errmsg);
+    }
+
+    /**
+     * @brief List the tags of a file with their values, in ascending ID order
+     * @param file File ID
+     * @param cursor Pointer to the cursor to stream the tag IDs and values with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listFileTagNames(unsigned int file, NameCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_FILE_TAG_NAMES);
+        return openCursor("SELECT tag.id, tag.tag FROM filetag JOIN tag ON tag.id = filetag.tag "
+                          "WHERE filetag.file = ?1 ORDER BY filetag.tag;", file, cursor, errmsg);
+    }
+
+    /**
+     * @brief List the files with a tag with their filenames, in ascending ID order
+     * @param tag Tag ID
+     * @param cursor Pointer to the cursor to stream the file IDs and filenames with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listTagFileNames(unsigned int tag, NameCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_TAG_FILE_NAMES);
+        return openCursor("SELECT file.id, file.name FROM filetag JOIN file ON file.id = filetag.file "
+                          "WHERE filetag.tag = ?1 ORDER BY filetag.file;", tag, cursor, errmsg);
+    }
+
+    /**
+     * @brief List the files of a directory with their filenames, in ascending ID order
+     * @param dir Directory ID
+     * @param cursor Pointer to the cursor to stream the file IDs and filenames with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listDirFileNames(unsigned int dir, NameCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_DIR_FILE_NAMES);
+        return openCursor("SELECT id, name FROM file WHERE dir = ?1 ORDER BY id;", dir, cursor, errmsg);
+    }
+
+    /**
+     * @brief Get directory ID by path, counting ancestors that were only added implicitly
+     * @param path The directory path to search for
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 Error or directory doesn't exist
+     * @return The ID of the directory, usable with the subtree listings
+     */
+    int Database::findDir(const char* path, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_FIND_DIR);
+        std::string normalized;
+        if (!normalizePath(path, &normalized)) return -1;
+        int res = resolveDir(normalized, false, true, nullptr, errmsg);
+        return res < 0 ? -1 : res;
+    }
+
+    /**
+     * @brief List a directory and every directory under it, in ascending ID order
+     * @param dir Directory ID
+     * @param cursor Pointer to the cursor to stream the directory IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listSubtreeDirs(unsigned int dir, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_SUBTREE_DIRS);
+        return openCursor("SELECT descendant FROM dirtree WHERE ancestor = ?1 ORDER BY descendant;", dir, cursor, errmsg);
+    }
+
+    /**
+     * @brief List the files in a directory and every directory under it, in ascending ID order
+     * @param dir Directory ID
+     * @param cursor Pointer to the cursor to stream the file IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listSubtreeFiles(unsigned int dir, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_SUBTREE_FILES);
+        return openCursor("SELECT file.id FROM dirtree JOIN file ON file.dir = dirtree.descendant "
+                          "WHERE dirtree.ancestor = ?1 ORDER BY file.id;", dir, cursor, errmsg);
     }
 
     /**
-     * @brief SQLite3 callback function
-     * @param unused Unused
-     * @param argc How many items were returned
-     * @param argv Returned values
-     * @param azColName Column name of the returned values, matching index
-     * @return int No idea what this is
+     * @brief Read the hierarchy columns of a tag
+     * @param tag Tag ID
+     * @param parent Pointer to the return int, 0 for top level
+     * @param alias Pointer to the return int, 0 if it isn't an alias
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 Tag doesn't exist
+     * @retval 1 Tag found
      */
-    int callback(void* unused, int argc, char** argv, char** azColName) {
-        switch (callbackAction) {
-            default:
-            case CALLBACK_NULL:
-                break;
-            case CALLBACK_DIRCHECK:
-                // If something was returned, the dir was found
-                // or file
-                // or tag, whatever, basically whatever it is we were looking for was found
-                if (argc) *(bool*)sharedVar = true;
-                break;
-            case CALLBACK_GETID:
-                // Return argv if possible
-                if (argc) *(int*)sharedVar = std::stoi(argv[0], nullptr, 10);
-                break;
-            case CALLBACK_GETDIRPATH:
-                // Copy path char* if possible
-                if (argc) *(std::string*)sharedVar = std::string(argv[0]);
-                break;
+    short Database::tagNode(unsigned int tag, int* parent, int* alias, char** errmsg) {
+        sqlite3_stmt* stmt = statement(STMT_TAG_NODE, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, tag);
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_DONE) return 0;
+        if (ecode != SQLITE_ROW) {
+            setError(errmsg);
+            return -1;
         }
-        return 0;
+        *parent = sqlite3_column_int(stmt, 0);
+        *alias = sqlite3_column_int(stmt, 1);
+        return 1;
     }
 
     /**
-     * @brief Create a new database file
+     * @brief Move a tag's subtree under a new parent, the tag table row is left to the caller
+     * @param tag Tag ID
+     * @param parent ID of the new parent, 0 for top level
      * @param errmsg SQLite3 error message char**
-     * @retval true Database was created successfully
-     * @retval false Database creation failed - check for file existence and/or write access to directory
+     * @retval true Subtree relinked
+     * @retval false The parent is under the tag or an error has occurred
      */
-    bool createDatabase(char** errmsg) {
-        // Open (create) database, check if it's open
-        sqlite3* db = nullptr;
-        int ecode = 0; //Exit code
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) return false;
-        // Create table dir
-        ecode = sqlite3_exec(db, "CREATE TABLE dir("
-                                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                                 "path VARCHAR(256) UNIQUE NOT NULL);", nullptr, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            return false;
+    bool Database::relinkTag(unsigned int tag, unsigned int parent, char** errmsg) {
+        sqlite3_stmt* inTree = statement(STMT_TAG_IN_TREE, errmsg);
+        sqlite3_stmt* unlink = statement(STMT_UNLINK_TAG_TREE, errmsg);
+        sqlite3_stmt* link = statement(STMT_LINK_TAG_TREE, errmsg);
+        if (!inTree || !unlink || !link) return false;
+        if (parent > 0) {
+            StatementReset reset{inTree};
+            sqlite3_bind_int64(inTree, 1, tag);
+            sqlite3_bind_int64(inTree, 2, parent);
+            if (stepInt(inTree, errmsg) != -1) return false;
         }
-        // Create table file
-        ecode = sqlite3_exec(db, "CREATE TABLE file("
-                                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                                 "dir INTEGER NOT NULL, "
-                                 "name VARCHAR(64) NOT NULL, "
-                                 "FOREIGN KEY (dir) REFERENCES dir(id));", nullptr, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
+        // The subtree's own links stay, only the ones to the old ancestors are swapped for the new
+        StatementReset resetUnlink{unlink};
+        StatementReset resetLink{link};
+        sqlite3_bind_int64(unlink, 1, tag);
+        sqlite3_bind_int64(link, 1, tag);
+        sqlite3_bind_int64(link, 2, parent);
+        return stepDone(unlink, errmsg) && stepDone(link, errmsg);
+    }
+
+    /**
+     * @brief Get the parent of a tag
+     * @param tag Tag ID
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 Error or tag doesn't exist
+     * @retval 0 Tag is top level
+     * @return The ID of the parent tag
+     */
+    int Database::getTagParent(unsigned int tag, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_TAG_PARENT);
+        int parent = 0, alias = 0;
+        return tagNode(tag, &parent, &alias, errmsg) == 1 ? parent : -1;
+    }
+
+    /**
+     * @brief Move a tag with everything under it below another tag
+     * @param tag Tag ID
+     * @param parent ID of the new parent, 0 to make the tag top level
+     * @param errmsg SQLite3 error message char**
+     * @retval true Tag moved
+     * @retval false A tag doesn't exist, the parent is under the tag, or an error has occurred
+     */
+    bool Database::setTagParent(unsigned int tag, unsigned int parent, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_SET_TAG_PARENT);
+        sqlite3_stmt* update = statement(STMT_SET_TAG_PARENT, errmsg);
+        if (!update) return false;
+        int oldParent = 0, alias = 0;
+        if (tagNode(tag, &oldParent, &alias, errmsg) != 1) return false;
+        if (parent > 0 && tagNode(parent, &oldParent, &alias, errmsg) != 1) return false;
+        if (!begin(errmsg)) return false;
+        bool ok = relinkTag(tag, parent, errmsg);
+        if (ok) {
+            StatementReset reset{update};
+            sqlite3_bind_int64(update, 1, tag);
+            sqlite3_bind_int64(update, 2, parent);
+            sqlite3_bind_int64(update, 3, 0);
+            ok = stepDone(update, errmsg);
+        }
+        if (!ok || !commit(errmsg)) {
+            rollback(nullptr);
             return false;
         }
-        // Create table tag
-        ecode = sqlite3_exec(db, "CREATE TABLE tag("
-                                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                                 "tag VARCHAR(64) UNIQUE NOT NULL);", nullptr, nullptr, errmsg);
-        if (ecode != SQLITE_OK)  {
-            sqlite3_close(db);
+        return true;
+    }
+
+    /**
+     * @brief Get the tag an alias stands for
+     * @param tag Tag ID
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 Error or tag doesn't exist
+     * @retval 0 Tag isn't an alias
+     * @return The ID of the tag it stands for
+     */
+    int Database::getTagAlias(unsigned int tag, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_TAG_ALIAS);
+        int parent = 0, alias = 0;
+        return tagNode(tag, &parent, &alias, errmsg) == 1 ? alias : -1;
+    }
+
+    /**
+     * @brief Make a tag an alias of another one, or a tag of its own again
+     * @param tag Tag ID
+     * @param target ID of the tag it stands for, 0 to stop being an alias and stay where it is
+     * @param errmsg SQLite3 error message char**
+     * @retval true Alias set
+     * @retval false A tag doesn't exist, the target is under the tag, or an error has occurred
+     */
+    bool Database::setTagAlias(unsigned int tag, unsigned int target, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_SET_TAG_ALIAS);
+        sqlite3_stmt* update = statement(STMT_SET_TAG_PARENT, errmsg);
+        sqlite3_stmt* repoint = statement(STMT_REPOINT_ALIASES, errmsg);
+        if (!update || !repoint) return false;
+        int parent = 0, alias = 0;
+        if (tagNode(tag, &parent, &alias, errmsg) != 1) return false;
+        if (target > 0) {
+            int targetParent = 0, targetAlias = 0;
+            if (tagNode(target, &targetParent, &targetAlias, errmsg) != 1) return false;
+            // Aliases always point at a tag of its own, so resolving one never takes more than a lookup
+            parent = (int)(targetAlias > 0 ? (unsigned int)targetAlias : target);
+        }
+        if (!begin(errmsg)) return false;
+        bool ok = target == 0 || relinkTag(tag, parent, errmsg);
+        if (ok) {
+            StatementReset reset{update};
+            sqlite3_bind_int64(update, 1, tag);
+            sqlite3_bind_int64(update, 2, parent);
+            sqlite3_bind_int64(update, 3, target > 0 ? parent : 0);
+            ok = stepDone(update, errmsg);
+        }
+        if (ok && target > 0) {
+            StatementReset reset{repoint};
+            sqlite3_bind_int64(repoint, 1, tag);
+            sqlite3_bind_int64(repoint, 2, parent);
+            ok = stepDone(repoint, errmsg);
+        }
+        if (!ok || !commit(errmsg)) {
+            rollback(nullptr);
             return false;
         }
-        // Close db and return true
-        sqlite3_close(db);
         return true;
     }
 
+    /**
+     * @brief List a tag and every tag under it, in ascending ID order
+     * @param tag Tag ID
+     * @param cursor Pointer to the cursor to stream the tag IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listSubtreeTags(unsigned int tag, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_SUBTREE_TAGS);
+        return openCursor("SELECT descendant FROM tagtree WHERE ancestor = ?1 ORDER BY descendant;", tag, cursor, errmsg);
+    }
+
+    /**
+     * @brief List the files with a tag or any tag under it, in ascending ID order
+     * @param tag Tag ID
+     * @param cursor Pointer to the cursor to stream the file IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listSubtreeTagFiles(unsigned int tag, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_SUBTREE_TAG_FILES);
+        return openCursor("SELECT DISTINCT filetag.file FROM tagtree JOIN filetag ON filetag.tag = tagtree.descendant "
+                          "WHERE tagtree.ancestor = ?1 ORDER BY filetag.file;", tag, cursor, errmsg);
+    }
+
+    /**
+     * @brief Get how many files have a tag
+     * @param tag Tag ID
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @return Number of files with the tag, kept up to date by the database so this doesn't count rows
+     */
+    int Database::getTagFileCount(unsigned int tag, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_TAG_FILE_COUNT);
+        sqlite3_stmt* stmt = statement(STMT_TAG_FILE_COUNT, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, tag);
+        int res = stepInt(stmt, errmsg);
+        if (res == -2) return -1;
+        // Tags that were never used have no row
+        return res == -1 ? 0 : res;
+    }
+
+    /**
+     * @brief Get the stored content fingerprint of a file
+     * @param file File ID
+     * @param fingerprint Pointer to the return Fingerprint
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 File doesn't exist or wasn't hashed yet
+     * @retval 1 Fingerprint returned
+     */
+    short Database::getFileFingerprint(unsigned int file, Fingerprint* fingerprint, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_GET_FILE_FINGERPRINT);
+        sqlite3_stmt* stmt = statement(STMT_FILE_FINGERPRINT, errmsg);
+        if (!stmt) return -1;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, file);
+        int ecode = sqlite3_step(stmt);
+        if (ecode == SQLITE_DONE) return 0;
+        if (ecode != SQLITE_ROW) {
+            setError(errmsg);
+            return -1;
+        }
+        fingerprint->size = sqlite3_column_int64(stmt, 0);
+        fingerprint->mtime = sqlite3_column_int64(stmt, 1);
+        fingerprint->inode = sqlite3_column_int64(stmt, 2);
+        fingerprint->hash = (uint64_t)sqlite3_column_int64(stmt, 3);
+        return 1;
+    }
+
+    /**
+     * @brief Store the content fingerprint of a file
+     * @param file File ID
+     * @param fingerprint The fingerprint, usually from hashFile()
+     * @param errmsg SQLite3 error message char**
+     * @retval true Fingerprint stored
+     * @retval false File doesn't exist or an error has occurred
+     */
+    bool Database::setFileFingerprint(unsigned int file, const Fingerprint& fingerprint, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_SET_FILE_FINGERPRINT);
+        sqlite3_stmt* stmt = statement(STMT_SET_FILE_FINGERPRINT, errmsg);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        sqlite3_bind_int64(stmt, 1, file);
+        sqlite3_bind_int64(stmt, 2, fingerprint.size);
+        sqlite3_bind_int64(stmt, 3, fingerprint.mtime);
+        sqlite3_bind_int64(stmt, 4, fingerprint.inode);
+        // Stored as the signed integer with the same bits, SQLite has no unsigned type
+        sqlite3_bind_int64(stmt, 5, (sqlite3_int64)fingerprint.hash);
+        if (!stepDone(stmt, errmsg)) return false;
+        return sqlite3_changes(db) == 1;
+    }
+
+    /**
+     * @brief List the files whose content has a hash, in ascending ID order
+     * @param hash Content hash, as in Fingerprint
+     * @param cursor Pointer to the cursor to stream the file IDs with
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listing started
+     * @retval false An error has occurred
+     */
+    bool Database::listHashFiles(uint64_t hash, IdCursor* cursor, char** errmsg) {
+        Metrics::Scope scope(metrics, Metrics::OP_LIST_HASH_FILES);
+        return openCursor("SELECT id FROM file WHERE hash = ?1 ORDER BY id;", (sqlite3_int64)hash, cursor, errmsg);
+    }
+
+    /**
+     * @brief Attach a name cache, consulted and kept up to date by the directory and tag lookups
+     * @param cache The cache, nullptr to go back to the session's own; must outlive its attachment
+     * @note Several sessions may share one cache, but only if every session writing to the
+     * database has it attached. The session's own cache is dropped whenever another
+     * connection commits, so it needs no such care.
+     */
+    void Database::setCache(NameCache* cache) {
+        this->cache = cache;
+    }
+
+    /**
+     * @brief Attach metrics, counting this session's calls, statements, lock waits and cache lookups
+     * @param metrics The metrics, nullptr to stop counting; must outlive its attachment
+     * @note Replaces the busy timeout with a handler that waits the same way and counts the waits
+     */
+    void Database::setMetrics(Metrics* metrics) {
+        this->metrics = metrics;
+        hookMetrics();
+    }
+
+    /**
+     * @brief Get the attached metrics
+     * @return The metrics, nullptr if none
+     */
+    Metrics* Database::getMetrics() const {
+        return metrics;
+    }
+
+    /**
+     * @brief Attach tag co-occurrence statistics, runQuery() orders intersections by them
+     * @param cooccurrence The statistics, nullptr to plan without; must outlive its attachment
+     * @note Only used for estimates, stale statistics make plans slower, never results wrong
+     */
+    void Database::setCooccurrence(const TagCooccurrence* cooccurrence) {
+        this->cooccurrence = cooccurrence;
+    }
+
+    /**
+     * @brief Get the attached tag co-occurrence statistics
+     * @return The statistics, nullptr if none
+     */
+    const TagCooccurrence* Database::getCooccurrence() const {
+        return cooccurrence;
+    }
+
+    /**
+     * @brief Hook the attached metrics into the connection, or unhook them if there are none
+     */
+    void Database::hookMetrics() {
+        if (!db) return;
+        if (!metrics) {
+            sqlite3_trace_v2(db, 0, nullptr, nullptr);
+            sqlite3_busy_timeout(db, busyTimeoutMs);
+            return;
+        }
+        // Rows are only counted, statements get their time and effects when they finish
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, Metrics::trace, metrics);
+        sqlite3_busy_handler(db, countingBusyHandler, metrics);
+    }
+
+    /**
+     * @brief Register an observer for the changes made through this session
+     * @param observer The observer, must outlive its registration
+     */
+    void Database::addObserver(Observer* observer) {
+        observers.push_back(observer);
+    }
+
+    /**
+     * @brief Unregister an observer
+     * @param observer The observer
+     */
+    void Database::removeObserver(Observer* observer) {
+        observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+    }
+
+    // Free functions, each one runs on a short-lived session on databasePath
+
+    /**
+     * @brief Open a session on the path set with setDatabasePath
+     * @param db The session to open
+     * @param errmsg SQLite3 error message char**
+     * @retval true Database opened
+     * @retval false Database could not be opened
+     */
+    bool openDefault(Database& db, char** errmsg) {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(databasePathMutex);
+            path = databasePath;
+        }
+        return db.open(path.c_str(), errmsg);
+    }
+
+    /**
+     * @brief Create a new database file
+     * @param errmsg SQLite3 error message char**
+     * @retval true Database was created successfully
+     * @retval false Database creation failed - check for file existence and/or write access to directory
+     */
+    bool createDatabase(char** errmsg) {
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.createDatabase(errmsg);
+    }
+
     /**
      * @brief Checks the existence of a directory in the database
      * @param path Path of the directory to check
@@ -118,33 +2632,9 @@ namespace ftagmgr {
      * @retval 1 Directory does exist
      */
     short dirExists(const char* path, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) {
-            return -1;
-        }
-        // Prepare callback
-        bool result = false;
-        callbackAction = CALLBACK_DIRCHECK;
-        sharedVar = &result;
-        // Run query
-        std::string query = "SELECT id FROM dir WHERE path = '";
-        query += path;
-        query += "';";
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return -1;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return result ? 1 : 0;
+        Database db;
+        if (!openDefault(db, errmsg)) return -1;
+        return db.dirExists(path, errmsg);
     }
 
     /**
@@ -153,29 +2643,12 @@ namespace ftagmgr {
      * @param errmsg SQLite3 error message char**
      * @retval true Directory added
      * @retval false Directory could not be added
+     * @note Ancestors that aren't in the database yet are added along with it
      */
     bool addDir(const char* path, char** errmsg) {
-        //Check directory existence
-        if (!dirExists(path, errmsg)) {
-            // Open database
-            sqlite3* db = nullptr;
-            int ecode = 0;
-            sqlite3_open(databasePath.c_str(), &db);
-            if (!db) return false;
-            // Prepare query
-            std::string query = "INSERT INTO dir(path) VALUES('";
-            query += path;
-            query += "');";
-            // Run query
-            ecode = sqlite3_exec(db, query.c_str(), nullptr, nullptr, errmsg);
-            if (ecode != SQLITE_OK) {
-                sqlite3_close(db);
-                return false;
-            }
-            // Close database and return
-            sqlite3_close(db);
-            return true;
-        } else return false;
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.addDir(path, errmsg);
     }
 
     /**
@@ -186,67 +2659,23 @@ namespace ftagmgr {
      * @return The ID of the directory
      */
     int getDir(const char* path, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) return -1;
-        // Prepare callback
-        int res = -1;
-        callbackAction = CALLBACK_GETID;
-        sharedVar = &res;
-        // Prepare query
-        std::string query = "SELECT id FROM dir WHERE path = '";
-        query += path;
-        query += "';";
-        // Run query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return -1;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return res;
+        Database db;
+        if (!openDefault(db, errmsg)) return -1;
+        return db.getDir(path, errmsg);
     }
 
     /**
      * @brief Get directory path by ID
      * @param id The directory ID to search for
-     * @param path Pointer to the return std::string
+     * @param path Pointer to the return std::string; left untouched if not found or only added implicitly
      * @param errmsg SQLite3 error message char**
      * @retval true Directory found, name returned
      * @retval false An error has occurred
      */
     bool getDirPath(unsigned int id, std::string* path, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        // Prepare callback
-        callbackAction = CALLBACK_GETDIRPATH;
-        sharedVar = path;
-        // Prepare query
-        std::string query = "SELECT path FROM dir WHERE id = ";
-        query += std::to_string(id);
-        query += ";";
-        // Run query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return false;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return true;
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.getDirPath(id, path, errmsg);
     }
 
     /**
@@ -259,33 +2688,9 @@ namespace ftagmgr {
      * @retval 1 File does exist
      */
     short fileExists(unsigned int dir, const char* filename, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        // Prepare callback
-        bool result = false;
-        sharedVar = &result;
-        callbackAction = CALLBACK_DIRCHECK;
-        // Prepare query
-        std::string query = "SELECT id FROM file WHERE dir = ";
-        query += std::to_string(dir);
-        query += " AND name = '";
-        query += filename;
-        query += "';";
-        // Run query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return -1;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return result;
+        Database db;
+        if (!openDefault(db, errmsg)) return -1;
+        return db.fileExists(dir, filename, errmsg);
     }
 
     /**
@@ -297,28 +2702,9 @@ namespace ftagmgr {
      * @retval false File could not be added
      */
     bool addFile(unsigned int dir, const char* filename, char** errmsg) {
-        // Check file existince in database
-        if (!fileExists(dir, filename, errmsg)) {
-            // Open database
-            sqlite3* db = nullptr;
-            int ecode = 0;
-            sqlite3_open(databasePath.c_str(), &db);
-            // Prepare query
-            std::string query = "INSERT INTO file(dir, name) VALUES(";
-            query += std::to_string(dir);
-            query += ", '";
-            query += filename;
-            query += "');";
-            // Run query
-            ecode = sqlite3_exec(db, query.c_str(), nullptr, nullptr, errmsg);
-            if (ecode != SQLITE_OK) {
-                sqlite3_close(db);
-                return false;
-            }
-            // Close database and return
-            sqlite3_close(db);
-            return true;
-        } else return false;
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.addFile(dir, filename, errmsg);
     }
 
     /**
@@ -330,33 +2716,9 @@ namespace ftagmgr {
      * @return The ID of the file
      */
     int getFile(unsigned int dir, const char* filename, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        // Prepare callback
-        callbackAction = CALLBACK_GETID;
-        int res = -1;
-        sharedVar = &res;
-        // Prepare query
-        std::string query = "SELECT id FROM file WHERE dir = ";
-        query += std::to_string(dir);
-        query += " AND name = '";
-        query += filename;
-        query += "';";
-        // Execute query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return -1;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return res;
+        Database db;
+        if (!openDefault(db, errmsg)) return -1;
+        return db.getFile(dir, filename, errmsg);
     }
 
     /**
@@ -368,30 +2730,9 @@ namespace ftagmgr {
      * @retval false An error has occurred
      */
     bool getFileName(unsigned int id, std::string* filename, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        // Prepare callback
-        callbackAction = CALLBACK_GETDIRPATH;
-        sharedVar = filename;
-        // Prepare query
-        std::string query = "SELECT name FROM file WHERE id = ";
-        query += std::to_string(id);
-        query += ';';
-        // Execute query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return false;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return true;
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.getFileName(id, filename, errmsg);
     }
 
     /**
@@ -403,32 +2744,9 @@ namespace ftagmgr {
      * @retval 1 Tag exists
      */
     short tagExists(const char* value, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) return -1;
-        // Prepare callback
-        callbackAction = CALLBACK_DIRCHECK;
-        bool result = false;
-        sharedVar = &result;
-        // Prepare query
-        std::string query = "SELECT id FROM tag WHERE tag = '";
-        query += value;
-        query += "';";
-        // Execute query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return -1;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return result ? 1 : 0;
+        Database db;
+        if (!openDefault(db, errmsg)) return -1;
+        return db.tagExists(value, errmsg);
     }
 
     /**
@@ -439,26 +2757,11 @@ namespace ftagmgr {
      * @retval true Added successfully
      */
     bool addTag(const char* value, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) return false;
-        // Prepare query
-        std::string query = "INSERT INTO tag(tag) VALUES('";
-        query += value;
-        query += "');";
-        // Execute query
-        ecode = sqlite3_exec(db, query.c_str(), nullptr, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            return false;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        return true;
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.addTag(value, errmsg);
     }
-    
+
     /**
      * @brief Gets tag ID by tag name
      * @param value Tag name
@@ -467,32 +2770,9 @@ namespace ftagmgr {
      * @return Tag ID
      */
     int getTag(const char* value, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) return -1;
-        // Prepare callback
-        callbackAction = CALLBACK_GETID;
-        int result = -1;
-        sharedVar = &result;
-        // Prepare query
-        std::string query = "SELECT id FROM tag WHERE tag = '";
-        query += value;
-        query += "';";
-        // Execute query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return -1;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return result;
+        Database db;
+        if (!openDefault(db, errmsg)) return -1;
+        return db.getTag(value, errmsg);
     }
 
     /**
@@ -504,30 +2784,36 @@ namespace ftagmgr {
      * @retval false Error
      */
     bool getTagValue(unsigned int id, std::string* value, char** errmsg) {
-        // Open database
-        sqlite3* db = nullptr;
-        int ecode = 0;
-        sqlite3_open(databasePath.c_str(), &db);
-        if (!db) return false;
-        // Prepare callback
-        callbackAction = CALLBACK_GETDIRPATH;
-        sharedVar = value;
-        // Prepare query
-        std::string query = "SELECT tag FROM tag WHERE id = ";
-        query += std::to_string(id);
-        query += ';';
-        // Execute query
-        ecode = sqlite3_exec(db, query.c_str(), callback, nullptr, errmsg);
-        if (ecode != SQLITE_OK) {
-            sqlite3_close(db);
-            callbackAction = CALLBACK_NULL;
-            sharedVar = nullptr;
-            return false;
-        }
-        // Close database and return
-        sqlite3_close(db);
-        callbackAction = CALLBACK_NULL;
-        sharedVar = nullptr;
-        return true;
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.getTagValue(id, value, errmsg);
+    }
+
+    /**
+     * @brief Tag a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite error message char**
+     * @retval true File tagged
+     * @retval false File already has the tag or an error has occurred
+     */
+    bool tagFile(unsigned int file, unsigned int tag, char** errmsg) {
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.tagFile(file, tag, errmsg);
+    }
+
+    /**
+     * @brief Remove a tag from a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite error message char**
+     * @retval true Tag removed
+     * @retval false File didn't have the tag or an error has occurred
+     */
+    bool untagFile(unsigned int file, unsigned int tag, char** errmsg) {
+        Database db;
+        if (!openDefault(db, errmsg)) return false;
+        return db.untagFile(file, tag, errmsg);
     }
 }
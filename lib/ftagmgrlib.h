@@ -3,13 +3,1104 @@
  * @brief FTagMgrLib header file
  */
 
+#ifndef FTAGMGRLIB_H
+#define FTAGMGRLIB_H
+
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 #include <sqlite3.h>
+#include "ftagmgrcache.h"
 
 namespace ftagmgr {
+    class Database;
+    class Metrics;
+    class TagCooccurrence;
+
+    /**
+     * @brief A file-tag link
+     */
+    struct FileTag {
+        unsigned int file;
+        unsigned int tag;
+    };
+
+    /**
+     * @brief Content fingerprint of a file, with the stat fields telling if it's still current
+     */
+    struct Fingerprint {
+        // Size in bytes
+        long long size;
+        // Modification time in nanoseconds since the epoch
+        long long mtime;
+        // Inode number, a file replaced by another one gets a new one
+        long long inode;
+        // XXH64 of the content
+        uint64_t hash;
+    };
+
+    // Schema version this library creates and upgrades databases to
+    const int schemaVersion = 6;
+
+    /**
+     * @brief Connection settings applied when a session opens
+     *
+     * The defaults suit a database written by one indexer and read by
+     * several clients at once.
+     */
+    struct Tunables {
+        // Write-ahead log, readers and the writer don't block each other; kept in the file once set
+        bool wal = true;
+        // PRAGMA synchronous: 0 OFF, 1 NORMAL, 2 FULL. With WAL, NORMAL only syncs at checkpoints
+        int synchronous = 1;
+        // Bytes of the file read through a memory map instead of copied into the page cache, 0 for none
+        long long mmapSize = 256LL * 1024 * 1024;
+        // Page cache of the connection in KiB
+        int cacheSizeKiB = 16 * 1024;
+        // Session's own directory and tag name cache in KiB, used while no NameCache is attached; 0 for none
+        int nameCacheKiB = 1024;
+        // Open read-only, the journal mode is then left as the writer set it
+        bool readOnly = false;
+    };
+
+    /**
+     * @brief Gets told about changes made through a Database session
+     *
+     * Used to keep in-memory structures in sync with the database. Every
+     * function is called after the change is made and has a no-op default.
+     * Batches notify after they commit. A change made inside a transaction
+     * opened with begin() is reported even if that transaction is later
+     * rolled back.
+     */
+    class Observer {
+    public:
+        virtual ~Observer() = default;
+
+        /**
+         * @brief A file was added
+         * @param file File ID
+         */
+        virtual void fileAdded(unsigned int file);
+
+        /**
+         * @brief A file was tagged
+         * @param file File ID
+         * @param tag Tag ID
+         */
+        virtual void tagged(unsigned int file, unsigned int tag);
+
+        /**
+         * @brief A tag was removed from a file
+         * @param file File ID
+         * @param tag Tag ID
+         */
+        virtual void untagged(unsigned int file, unsigned int tag);
+
+        /**
+         * @brief A file was removed, after untagged() for each of its tags
+         * @param file File ID
+         */
+        virtual void fileRemoved(unsigned int file);
+
+        /**
+         * @brief A file was renamed or moved to another directory, its ID and tags are kept
+         * @param file File ID
+         */
+        virtual void fileMoved(unsigned int file);
+
+        /**
+         * @brief A directory path changed, called for the directory and each of its subdirectories
+         * @param dir Directory ID
+         */
+        virtual void dirMoved(unsigned int dir);
+
+        /**
+         * @brief A directory was removed, after fileRemoved() for each of its files
+         * @param dir Directory ID
+         */
+        virtual void dirRemoved(unsigned int dir);
+
+        /**
+         * @brief A tag was added
+         * @param tag Tag ID
+         * @param value Tag name, only valid during the call
+         */
+        virtual void tagAdded(unsigned int tag, std::string_view value);
+    };
+
+    /**
+     * @brief Streams the IDs returned by a listing one at a time
+     *
+     * Rows are read from SQLite as next() is called, so listings of any size
+     * use constant memory. Movable, not copyable. Must not outlive the
+     * Database session that opened it.
+     */
+    class IdCursor {
+    public:
+        IdCursor();
+        ~IdCursor();
+        IdCursor(IdCursor&& other) noexcept;
+        IdCursor& operator=(IdCursor&& other) noexcept;
+        IdCursor(const IdCursor&) = delete;
+        IdCursor& operator=(const IdCursor&) = delete;
+
+        /**
+         * @brief Get the next ID
+         * @param id Pointer to the return int
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 No more IDs
+         * @retval 1 ID returned
+         */
+        short next(int* id, char** errmsg);
+
+        /**
+         * @brief Stop the listing and release its statement
+         */
+        void close();
+
+    protected:
+        /**
+         * @brief Move to the next row
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred, the cursor is closed
+         * @retval 0 No more rows, the cursor is closed
+         * @retval 1 On a row
+         */
+        short step(char** errmsg);
+
+        friend class Database;
+        sqlite3_stmt* stmt;
+    };
+
+    /**
+     * @brief Streams the IDs and names returned by a listing one at a time
+     *
+     * Names are views into SQLite's copy of the row, so a listing of any
+     * size makes no heap allocations of its own. A name is only valid
+     * until the next call, copy it e.g. into an arena to keep it.
+     */
+    class NameCursor : public IdCursor {
+    public:
+        using IdCursor::next;
+
+        /**
+         * @brief Get the next ID and name
+         * @param id Pointer to the return int
+         * @param name Pointer to the return view, valid until the next call on the cursor
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 No more rows
+         * @retval 1 ID and name returned
+         */
+        short next(int* id, std::string_view* name, char** errmsg);
+    };
+
+    /**
+     * @brief Database session
+     *
+     * Keeps one SQLite3 connection open for its whole lifetime, so the
+     * member functions don't have to reopen the database file on every call.
+     * Movable, not copyable. Results are returned per call and the library has no
+     * shared query state, so any number of threads can work in parallel as long as
+     * each one uses its own session. A session must not be used by two threads at once.
+     */
+    class Database {
+    public:
+        /**
+         * @brief Create a closed session
+         */
+        Database();
+
+        /**
+         * @brief Open a session on a database file
+         * @param path Path to the database file
+         * @note Check isOpen() to see if opening succeeded
+         */
+        explicit Database(const char* path);
+
+        /**
+         * @brief Open a session on a database file with custom settings
+         * @param path Path to the database file
+         * @param tunables Connection settings
+         * @note Check isOpen() to see if opening succeeded
+         */
+        Database(const char* path, const Tunables& tunables);
+
+        ~Database();
+        Database(Database&& other) noexcept;
+        Database& operator=(Database&& other) noexcept;
+        Database(const Database&) = delete;
+        Database& operator=(const Database&) = delete;
+
+        /**
+         * @brief Open the database file, closing the current connection first
+         * @param path Path to the database file
+         * @param errmsg SQLite3 error message char**
+         * @retval true Database opened
+         * @retval false Database could not be opened
+         */
+        bool open(const char* path, char** errmsg);
+
+        /**
+         * @brief Open the database file with custom settings, closing the current connection first
+         * @param path Path to the database file
+         * @param tunables Connection settings
+         * @param errmsg SQLite3 error message char**
+         * @retval true Database opened and configured
+         * @retval false Database could not be opened or configured
+         */
+        bool open(const char* path, const Tunables& tunables, char** errmsg);
+
+        /**
+         * @brief Close the connection
+         */
+        void close();
+
+        /**
+         * @brief Check if the session has an open connection
+         * @retval true Connection is open
+         * @retval false Connection is closed
+         */
+        bool isOpen() const;
+
+        /**
+         * @brief Get the underlying SQLite3 connection
+         * @return The connection handle, nullptr if closed
+         */
+        sqlite3* handle() const;
+
+        /**
+         * @brief Create the database tables
+         * @param errmsg SQLite3 error message char**
+         * @retval true Tables were created successfully
+         * @retval false Table creation failed - check if the database already has tables
+         */
+        bool createDatabase(char** errmsg);
+
+        /**
+         * @brief Get the schema version of the database
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @return The version, 0 for databases created before versioning
+         */
+        int getSchemaVersion(char** errmsg);
+
+        /**
+         * @brief Upgrade the schema to schemaVersion one step at a time
+         * @param errmsg SQLite3 error message char**
+         * @retval true Schema is up to date
+         * @retval false A step failed and was rolled back, or the database is newer than the library
+         * @note open() runs this on read-write sessions, callers only need it after createDatabase() on their own
+         */
+        bool migrate(char** errmsg);
+
+        /**
+         * @brief Checks the existence of a directory in the database
+         * @param path Path of the directory to check
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 Directory does not exist
+         * @retval 1 Directory does exist
+         */
+        short dirExists(const char* path, char** errmsg);
+
+        /**
+         * @brief Adds a directory to the database
+         * @param path The path of the directory
+         * @param errmsg SQLite3 error message char**
+         * @retval true Directory added
+         * @retval false Directory could not be added
+         * @note Ancestors that aren't in the database yet are added along with it
+         */
+        bool addDir(const char* path, char** errmsg);
+
+        /**
+         * @brief Get directory ID by path
+         * @param path The directory path to search for
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 Error or directory doesn't exist
+         * @return The ID of the directory
+         */
+        int getDir(const char* path, char** errmsg);
+
+        /**
+         * @brief Get directory path by ID
+         * @param id The directory ID to search for
+         * @param path Pointer to the return std::string; left untouched if not found or only added implicitly
+         * @param errmsg SQLite3 error message char**
+         * @retval true Directory found, name returned
+         * @retval false An error has occurred
+         */
+        bool getDirPath(unsigned int id, std::string* path, char** errmsg);
+
+        /**
+         * @brief Get directory path by ID, copied into an arena
+         * @param id The directory ID to search for
+         * @param arena Memory the path is copied into, e.g. a std::pmr::monotonic_buffer_resource
+         * @param path Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+         * @param errmsg SQLite3 error message char**
+         * @retval true Directory found, path returned
+         * @retval false An error has occurred
+         */
+        bool getDirPath(unsigned int id, std::pmr::memory_resource* arena, std::string_view* path, char** errmsg);
+
+        /**
+         * @brief Check the existence of a file in the database
+         * @param dir Directory ID
+         * @param filename Name of the file to check
+         * @param errmsg SQLite error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 File does not exist
+         * @retval 1 File does exist
+         */
+        short fileExists(unsigned int dir, const char* filename, char** errmsg);
+
+        /**
+         * @brief Adds a file to the database
+         * @param dir Directory ID
+         * @param filename Name of the file to add
+         * @param errmsg SQLite error message char**
+         * @retval true File added successfully
+         * @retval false File could not be added
+         */
+        bool addFile(unsigned int dir, const char* filename, char** errmsg);
+
+        /**
+         * @brief Get file ID by dir and filename
+         * @param dir Directory ID
+         * @param filename Name of the file
+         * @param errmsg SQLite error message char**
+         * @retval -1 Error or file doesn't exist
+         * @return The ID of the file
+         */
+        int getFile(unsigned int dir, const char* filename, char** errmsg);
+
+        /**
+         * @brief Get filename by ID
+         * @param id File ID
+         * @param filename Pointer to the return std::string
+         * @param errmsg SQLite error message char**
+         * @retval true File found, filename returned
+         * @retval false An error has occurred
+         */
+        bool getFileName(unsigned int id, std::string* filename, char** errmsg);
+
+        /**
+         * @brief Get filename by ID, copied into an arena
+         * @param id File ID
+         * @param arena Memory the filename is copied into, e.g. a std::pmr::monotonic_buffer_resource
+         * @param filename Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+         * @param errmsg SQLite error message char**
+         * @retval true File found, filename returned
+         * @retval false An error has occurred
+         */
+        bool getFileName(unsigned int id, std::pmr::memory_resource* arena, std::string_view* filename, char** errmsg);
+
+        /**
+         * @brief Get the full path of a file by ID
+         * @param id File ID
+         * @param path Pointer to the return std::string, directory path and filename joined with '/'
+         * @param errmsg SQLite error message char**
+         * @retval true File found, path returned
+         * @retval false An error has occurred
+         */
+        bool getFilePath(unsigned int id, std::string* path, char** errmsg);
+
+        /**
+         * @brief Get the full path of a file by ID, copied into an arena
+         * @param id File ID
+         * @param arena Memory the path is copied into, e.g. a std::pmr::monotonic_buffer_resource
+         * @param path Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+         * @param errmsg SQLite error message char**
+         * @retval true File found, path returned
+         * @retval false An error has occurred
+         */
+        bool getFilePath(unsigned int id, std::pmr::memory_resource* arena, std::string_view* path, char** errmsg);
+
+        /**
+         * @brief Check the existence of a tag in the database
+         * @param value Tag name
+         * @param errmsg SQLite error message char**
+         * @retval -1 Error
+         * @retval 0 Tag does not exist
+         * @retval 1 Tag exists
+         */
+        short tagExists(const char* value, char** errmsg);
+
+        /**
+         * @brief Add a tag into the database
+         * @param value Tag name
+         * @param errmsg SQLite error message char**
+         * @retval false Error or tag already exists
+         * @retval true Added successfully
+         * @note The parent named by the part before the last slash is added along with it, and so on up
+         */
+        bool addTag(const char* value, char** errmsg);
+
+        /**
+         * @brief Gets tag ID by tag name
+         * @param value Tag name
+         * @param errmsg SQLite error message char**
+         * @retval -1 Error or tag does not exist
+         * @return Tag ID
+         */
+        int getTag(const char* value, char** errmsg);
+
+        /**
+         * @brief Get tag value by ID
+         * @param id Tag ID
+         * @param value Pointer to the return std::string
+         * @param errmsg SQLite error message char**
+         * @retval true Value returned
+         * @retval false Error
+         */
+        bool getTagValue(unsigned int id, std::string* value, char** errmsg);
+
+        /**
+         * @brief Get tag value by ID, copied into an arena
+         * @param id Tag ID
+         * @param arena Memory the value is copied into, e.g. a std::pmr::monotonic_buffer_resource
+         * @param value Pointer to the return view, valid as long as the arena's memory; left untouched if not found
+         * @param errmsg SQLite error message char**
+         * @retval true Value returned
+         * @retval false Error
+         */
+        bool getTagValue(unsigned int id, std::pmr::memory_resource* arena, std::string_view* value, char** errmsg);
+
+        /**
+         * @brief Add many directories in one transaction
+         * @param paths Directory paths, already existing ones are skipped
+         * @param ids Pointer to the return std::vector, gets the ID of every path in input order
+         * @param errmsg SQLite3 error message char**
+         * @retval true All directories added or already present
+         * @retval false An error has occurred, nothing was added
+         */
+        bool addDirs(const std::vector<std::string_view>& paths, std::vector<int>* ids, char** errmsg);
+
+        /**
+         * @brief Add many files of one directory in one transaction
+         * @param dir Directory ID
+         * @param filenames Names of the files, already existing ones are skipped
+         * @param ids Pointer to the return std::vector, gets the ID of every file in input order
+         * @param errmsg SQLite3 error message char**
+         * @retval true All files added or already present
+         * @retval false An error has occurred, nothing was added
+         */
+        bool addFiles(unsigned int dir, const std::vector<std::string_view>& filenames, std::vector<int>* ids, char** errmsg);
+
+        /**
+         * @brief Add many tags in one transaction, with their missing parents as addTag() does
+         * @param values Tag names, already existing ones are skipped
+         * @param ids Pointer to the return std::vector, gets the ID of every tag in input order
+         * @param errmsg SQLite3 error message char**
+         * @retval true All tags added or already present
+         * @retval false An error has occurred, nothing was added
+         */
+        bool addTags(const std::vector<std::string_view>& values, std::vector<int>* ids, char** errmsg);
+
+        /**
+         * @brief Start a write transaction
+         * @param errmsg SQLite3 error message char**
+         * @retval true Transaction started
+         * @retval false An error has occurred
+         * @note Nests: inside an open transaction this opens a savepoint instead
+         */
+        bool begin(char** errmsg);
+
+        /**
+         * @brief Commit the innermost transaction started with begin()
+         * @param errmsg SQLite3 error message char**
+         * @retval true Committed
+         * @retval false An error has occurred, the transaction is still open
+         */
+        bool commit(char** errmsg);
+
+        /**
+         * @brief Roll back the innermost transaction started with begin()
+         * @param errmsg SQLite3 error message char**
+         * @retval true Rolled back
+         * @retval false An error has occurred
+         */
+        bool rollback(char** errmsg);
+
+        /**
+         * @brief Tag a file
+         * @param file File ID
+         * @param tag Tag ID
+         * @param errmsg SQLite3 error message char**
+         * @retval true File tagged
+         * @retval false File already has the tag or an error has occurred
+         */
+        bool tagFile(unsigned int file, unsigned int tag, char** errmsg);
+
+        /**
+         * @brief Remove a tag from a file
+         * @param file File ID
+         * @param tag Tag ID
+         * @param errmsg SQLite3 error message char**
+         * @retval true Tag removed
+         * @retval false File didn't have the tag or an error has occurred
+         */
+        bool untagFile(unsigned int file, unsigned int tag, char** errmsg);
+
+        /**
+         * @brief Check if a file has a tag
+         * @param file File ID
+         * @param tag Tag ID
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 File doesn't have the tag
+         * @retval 1 File has the tag
+         */
+        short fileHasTag(unsigned int file, unsigned int tag, char** errmsg);
+
+        /**
+         * @brief Add many file-tag links in one transaction
+         * @param links The links to add, already existing ones are skipped
+         * @param errmsg SQLite3 error message char**
+         * @retval true All links present
+         * @retval false An error has occurred, nothing was added
+         */
+        bool tagFiles(const std::vector<FileTag>& links, char** errmsg);
+
+        /**
+         * @brief Remove many file-tag links in one transaction
+         * @param links The links to remove, missing ones are skipped
+         * @param errmsg SQLite3 error message char**
+         * @retval true No link left
+         * @retval false An error has occurred, nothing was removed
+         */
+        bool untagFiles(const std::vector<FileTag>& links, char** errmsg);
+
+        /**
+         * @brief Rename a file or move it to another directory, keeping its ID and tags
+         * @param file File ID
+         * @param dir ID of the new directory
+         * @param filename New name of the file
+         * @param errmsg SQLite3 error message char**
+         * @retval true File moved
+         * @retval false File doesn't exist, the new name is taken or an error has occurred
+         */
+        bool moveFile(unsigned int file, unsigned int dir, const char* filename, char** errmsg);
+
+        /**
+         * @brief Remove a file and its tags
+         * @param file File ID
+         * @param errmsg SQLite3 error message char**
+         * @retval true File removed
+         * @retval false File doesn't exist or an error has occurred
+         */
+        bool removeFile(unsigned int file, char** errmsg);
+
+        /**
+         * @brief Change the path of a directory and of all its subdirectories
+         * @param dir Directory ID
+         * @param path New path of the directory, missing ancestors are added
+         * @param errmsg SQLite3 error message char**
+         * @retval true Directory moved, its files keep their IDs and tags
+         * @retval false Directory doesn't exist, the new path is taken or inside the directory, or an error has occurred
+         */
+        bool moveDir(unsigned int dir, const char* path, char** errmsg);
+
+        /**
+         * @brief Remove a directory with its subdirectories, their files and their tags
+         * @param dir Directory ID
+         * @param errmsg SQLite3 error message char**
+         * @retval true Directory removed
+         * @retval false Directory doesn't exist or an error has occurred
+         */
+        bool removeDir(unsigned int dir, char** errmsg);
+
+        /**
+         * @brief List the tags of a file, in ascending ID order
+         * @param file File ID
+         * @param cursor Pointer to the cursor to stream the tag IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listFileTags(unsigned int file, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the files with a tag, in ascending ID order
+         * @param tag Tag ID
+         * @param cursor Pointer to the cursor to stream the file IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listTagFiles(unsigned int tag, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the files of a directory, in ascending ID order
+         * @param dir Directory ID
+         * @param cursor Pointer to the cursor to stream the file IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listDirFiles(unsigned int dir, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the tags of a file with their values, in ascending ID order
+         * @param file File ID
+         * @param cursor Pointer to the cursor to stream the tag IDs and values with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listFileTagNames(unsigned int file, NameCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the files with a tag with their filenames, in ascending ID order
+         * @param tag Tag ID
+         * @param cursor Pointer to the cursor to stream the file IDs and filenames with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listTagFileNames(unsigned int tag, NameCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the files of a directory with their filenames, in ascending ID order
+         * @param dir Directory ID
+         * @param cursor Pointer to the cursor to stream the file IDs and filenames with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listDirFileNames(unsigned int dir, NameCursor* cursor, char** errmsg);
+
+        /**
+         * @brief Get directory ID by path, counting ancestors that were only added implicitly
+         * @param path The directory path to search for
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 Error or directory doesn't exist
+         * @return The ID of the directory, usable with the subtree listings
+         */
+        int findDir(const char* path, char** errmsg);
+
+        /**
+         * @brief List a directory and every directory under it, in ascending ID order
+         * @param dir Directory ID
+         * @param cursor Pointer to the cursor to stream the directory IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listSubtreeDirs(unsigned int dir, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the files in a directory and every directory under it, in ascending ID order
+         * @param dir Directory ID
+         * @param cursor Pointer to the cursor to stream the file IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listSubtreeFiles(unsigned int dir, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief Get the parent of a tag
+         * @param tag Tag ID
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 Error or tag doesn't exist
+         * @retval 0 Tag is top level
+         * @return The ID of the parent tag
+         */
+        int getTagParent(unsigned int tag, char** errmsg);
+
+        /**
+         * @brief Move a tag with everything under it below another tag
+         *
+         * Tags get the parent their name implies when added, "photo" for
+         * "photo/2024"; this links tags whose names don't say so, like
+         * "paris" under "france". The tag stops being an alias.
+         *
+         * @param tag Tag ID
+         * @param parent ID of the new parent, 0 to make the tag top level
+         * @param errmsg SQLite3 error message char**
+         * @retval true Tag moved
+         * @retval false A tag doesn't exist, the parent is under the tag, or an error has occurred
+         */
+        bool setTagParent(unsigned int tag, unsigned int parent, char** errmsg);
+
+        /**
+         * @brief Get the tag an alias stands for
+         * @param tag Tag ID
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 Error or tag doesn't exist
+         * @retval 0 Tag isn't an alias
+         * @return The ID of the tag it stands for
+         */
+        int getTagAlias(unsigned int tag, char** errmsg);
+
+        /**
+         * @brief Make a tag an alias of another one, or a tag of its own again
+         *
+         * The alias is moved under its target, so queries for the target
+         * match files tagged with the alias, and queries for the alias are
+         * run as queries for the target. An alias of an alias stands for
+         * the final target, and aliases of the tag follow it to the target.
+         *
+         * @param tag Tag ID
+         * @param target ID of the tag it stands for, 0 to stop being an alias and stay where it is
+         * @param errmsg SQLite3 error message char**
+         * @retval true Alias set
+         * @retval false A tag doesn't exist, the target is under the tag, or an error has occurred
+         */
+        bool setTagAlias(unsigned int tag, unsigned int target, char** errmsg);
+
+        /**
+         * @brief List a tag and every tag under it, in ascending ID order
+         * @param tag Tag ID
+         * @param cursor Pointer to the cursor to stream the tag IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listSubtreeTags(unsigned int tag, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief List the files with a tag or any tag under it, in ascending ID order
+         * @param tag Tag ID
+         * @param cursor Pointer to the cursor to stream the file IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listSubtreeTagFiles(unsigned int tag, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief Get how many files have a tag
+         * @param tag Tag ID
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @return Number of files with the tag, kept up to date by the database so this doesn't count rows
+         */
+        int getTagFileCount(unsigned int tag, char** errmsg);
+
+        /**
+         * @brief Get the stored content fingerprint of a file
+         * @param file File ID
+         * @param fingerprint Pointer to the return Fingerprint
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 File doesn't exist or wasn't hashed yet
+         * @retval 1 Fingerprint returned
+         */
+        short getFileFingerprint(unsigned int file, Fingerprint* fingerprint, char** errmsg);
+
+        /**
+         * @brief Store the content fingerprint of a file
+         * @param file File ID
+         * @param fingerprint The fingerprint, usually from hashFile()
+         * @param errmsg SQLite3 error message char**
+         * @retval true Fingerprint stored
+         * @retval false File doesn't exist or an error has occurred
+         */
+        bool setFileFingerprint(unsigned int file, const Fingerprint& fingerprint, char** errmsg);
+
+        /**
+         * @brief List the files whose content has a hash, in ascending ID order
+         * @param hash Content hash, as in Fingerprint
+         * @param cursor Pointer to the cursor to stream the file IDs with
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listing started
+         * @retval false An error has occurred
+         */
+        bool listHashFiles(uint64_t hash, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief Register an observer for the changes made through this session
+         * @param observer The observer, must outlive its registration
+         */
+        void addObserver(Observer* observer);
+
+        /**
+         * @brief Unregister an observer
+         * @param observer The observer
+         */
+        void removeObserver(Observer* observer);
+
+        /**
+         * @brief Attach a name cache, consulted and kept up to date by the directory and tag lookups
+         * @param cache The cache, nullptr to go back to the session's own; must outlive its attachment
+         * @note Several sessions may share one cache, but only if every session writing to the
+         * database has it attached. The session's own cache is dropped whenever another
+         * connection commits, so it needs no such care.
+         */
+        void setCache(NameCache* cache);
+
+        /**
+         * @brief Attach metrics, counting this session's calls, statements, lock waits and cache lookups
+         * @param metrics The metrics, nullptr to stop counting; must outlive its attachment
+         * @note Replaces the busy timeout with a handler that waits the same way and counts the waits
+         */
+        void setMetrics(Metrics* metrics);
+
+        /**
+         * @brief Get the attached metrics
+         * @return The metrics, nullptr if none
+         */
+        Metrics* getMetrics() const;
+
+        /**
+         * @brief Attach tag co-occurrence statistics, runQuery() orders intersections by them
+         * @param cooccurrence The statistics, nullptr to plan without; must outlive its attachment
+         * @note Only used for estimates, stale statistics make plans slower, never results wrong
+         */
+        void setCooccurrence(const TagCooccurrence* cooccurrence);
+
+        /**
+         * @brief Get the attached tag co-occurrence statistics
+         * @return The statistics, nullptr if none
+         */
+        const TagCooccurrence* getCooccurrence() const;
+
+    private:
+        // Query shapes with a cached prepared statement
+        enum Statement {
+            STMT_DIR_CHILD, STMT_DIR_NODE, STMT_ADD_DIR,
+            STMT_FILE_BY_NAME, STMT_FILE_NAME, STMT_ADD_FILE,
+            STMT_TAG_BY_VALUE, STMT_TAG_VALUE,
+            STMT_ADD_FILE_IGNORE, STMT_ADD_TAG_IGNORE,
+            STMT_TAG_FILE, STMT_UNTAG_FILE, STMT_FILE_HAS_TAG,
+            STMT_FILE_NODE, STMT_TAG_FILE_COUNT,
+            STMT_MOVE_FILE, STMT_REMOVE_FILE_TAGS, STMT_REMOVE_FILE,
+            STMT_FILE_TAGS, STMT_DIR_FILES, STMT_DIR_TREE, STMT_MOVE_DIR,
+            STMT_REMOVE_DIR_TAGS, STMT_REMOVE_DIR_FILES, STMT_REMOVE_DIR,
+            STMT_ADD_DIR_LINKS, STMT_UNLINK_DIR_TREE, STMT_LINK_DIR_TREE,
+            STMT_REMOVE_DIR_LINKS, STMT_DIR_IN_TREE, STMT_REGISTER_DIR,
+            STMT_DATA_VERSION, STMT_TAG_NODE, STMT_ADD_TAG_ROOT, STMT_ADD_TAG_LINKS,
+            STMT_TAG_IN_TREE, STMT_UNLINK_TAG_TREE, STMT_LINK_TAG_TREE,
+            STMT_SET_TAG_PARENT, STMT_REPOINT_ALIASES,
+            STMT_FILE_FINGERPRINT, STMT_SET_FILE_FINGERPRINT, STMT_DIR_LAST_ID,
+            STMT_COUNT
+        };
+
+        /**
+         * @brief Get a cached prepared statement, preparing it on first use
+         * @param which The query shape
+         * @param errmsg SQLite3 error message char**
+         * @return The statement, nullptr on error
+         */
+        sqlite3_stmt* statement(Statement which, char** errmsg);
+
+        /**
+         * @brief Run a statement that returns at most one integer
+         * @param stmt Statement with its parameters bound
+         * @param errmsg SQLite3 error message char**
+         * @retval -2 An error has occurred
+         * @retval -1 No row returned
+         * @return The integer in the first column
+         */
+        int stepInt(sqlite3_stmt* stmt, char** errmsg);
+
+        /**
+         * @brief Run a statement that returns at most one string
+         * @param stmt Statement with its parameters bound
+         * @param out Pointer to the return std::string, left untouched if no row is returned
+         * @param errmsg SQLite3 error message char**
+         * @retval true Statement ran successfully
+         * @retval false An error has occurred
+         */
+        bool stepString(sqlite3_stmt* stmt, std::string* out, char** errmsg);
+
+        /**
+         * @brief Run a statement that returns no rows
+         * @param stmt Statement with its parameters bound
+         * @param errmsg SQLite3 error message char**
+         * @retval true Statement ran successfully
+         * @retval false An error has occurred
+         */
+        bool stepDone(sqlite3_stmt* stmt, char** errmsg);
+
+        /**
+         * @brief Run a statement that returns a column of IDs
+         * @param stmt Statement with its parameters bound
+         * @param ids Pointer to the std::vector to append the IDs to
+         * @param errmsg SQLite3 error message char**
+         * @retval true Statement ran successfully
+         * @retval false An error has occurred
+         */
+        bool stepIds(sqlite3_stmt* stmt, std::vector<unsigned int>* ids, char** errmsg);
+
+        /**
+         * @brief Run a statement that returns IDs with their names
+         * @param stmt Statement with its parameters bound
+         * @param ids Pointer to the std::vector to append the IDs to
+         * @param names Pointer to the std::vector to append the names to
+         * @param errmsg SQLite3 error message char**
+         * @retval true Statement ran successfully
+         * @retval false An error has occurred
+         */
+        bool stepIdNames(sqlite3_stmt* stmt, std::vector<unsigned int>* ids, std::vector<std::string>* names, char** errmsg);
+
+        /**
+         * @brief Collect the links of files about to be removed, for the observers
+         * @param files File IDs
+         * @param links Pointer to the std::vector to append the links to
+         * @param errmsg SQLite3 error message char**
+         * @retval true Links collected
+         * @retval false An error has occurred
+         */
+        bool collectLinks(const std::vector<unsigned int>& files, std::vector<FileTag>* links, char** errmsg);
+
+        /**
+         * @brief Insert one row with INSERT OR IGNORE and get its ID
+         * @param insert Insert statement with its parameters bound
+         * @param select Lookup statement with the same parameters bound, used if the row already existed
+         * @param inserted Pointer to the return bool, set to whether the row is new
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @return The ID of the new or existing row
+         */
+        int insertOrGet(sqlite3_stmt* insert, sqlite3_stmt* select, bool* inserted, char** errmsg);
+
+        /**
+         * @brief Find a directory by its normalized path, optionally adding it and its missing ancestors
+         * @param path Normalized path
+         * @param create Whether to add the directory if it's missing, needs an open transaction
+         * @param implicit Whether implicit directories are wanted, e.g. to be a parent, or added if missing
+         * @param inserted Pointer to the return bool, set to true if the directory was added; may be nullptr
+         * @param errmsg SQLite3 error message char**
+         * @retval -2 An error has occurred
+         * @retval -1 Directory doesn't exist and create is false
+         * @return The ID of the directory
+         */
+        int resolveDir(std::string_view path, bool create, bool implicit, bool* inserted, char** errmsg);
+
+        /**
+         * @brief Find a tag by name, adding it and its missing ancestors if needed
+         * @param value Tag name
+         * @param added Pointer to the return vector, gets the tags added, parents first
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @return The ID of the tag
+         */
+        int insertTag(std::string_view value, std::vector<std::pair<unsigned int, std::string>>* added, char** errmsg);
+
+        /**
+         * @brief Read the hierarchy columns of a tag
+         * @param tag Tag ID
+         * @param parent Pointer to the return int, 0 for top level
+         * @param alias Pointer to the return int, 0 if it isn't an alias
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 Tag doesn't exist
+         * @retval 1 Tag found
+         */
+        short tagNode(unsigned int tag, int* parent, int* alias, char** errmsg);
+
+        /**
+         * @brief Move a tag's subtree under a new parent, the tag table row is left to the caller
+         * @param tag Tag ID
+         * @param parent ID of the new parent, 0 for top level
+         * @param errmsg SQLite3 error message char**
+         * @retval true Subtree relinked
+         * @retval false The parent is under the tag or an error has occurred
+         */
+        bool relinkTag(unsigned int tag, unsigned int parent, char** errmsg);
+
+        /**
+         * @brief Build the path of a directory by walking up to the top
+         * @param id Directory ID
+         * @param path Pointer to the return std::string, left untouched if the directory doesn't exist
+         * @param isImplicit Pointer to the return bool, set to whether the directory is implicit
+         * @param errmsg SQLite3 error message char**
+         * @retval true Walk finished
+         * @retval false An error has occurred
+         */
+        bool buildDirPath(unsigned int id, std::string* path, bool* isImplicit, char** errmsg);
+
+        /**
+         * @brief Get the path of any directory row by ID, implicit ones included, through the name cache
+         * @param id Directory ID
+         * @param path Pointer to the return std::string, left untouched if the directory doesn't exist
+         * @param isImplicit Pointer to the return bool, set to whether the directory is implicit
+         * @param errmsg SQLite3 error message char**
+         * @retval true Lookup finished
+         * @retval false An error has occurred
+         */
+        bool lookupDirPath(unsigned int id, std::string* path, bool* isImplicit, char** errmsg);
+
+        /**
+         * @brief Prepare a statement for a cursor, one that isn't cached
+         * @param sql The query, with ?1 as its only parameter
+         * @param id Value for ?1
+         * @param cursor Pointer to the cursor to hand the statement to
+         * @param errmsg SQLite3 error message char**
+         * @retval true Cursor ready
+         * @retval false An error has occurred
+         */
+        bool openCursor(const char* sql, sqlite3_int64 id, IdCursor* cursor, char** errmsg);
+
+        /**
+         * @brief Run one cached link statement for every link, in one transaction
+         * @param which Link statement taking the file as ?1 and the tag as ?2
+         * @param links The links
+         * @param errmsg SQLite3 error message char**
+         * @retval true Statement ran for every link
+         * @retval false An error has occurred, the transaction was rolled back
+         */
+        bool runLinks(Statement which, const std::vector<FileTag>& links, char** errmsg);
+
+        /**
+         * @brief Tell the observers about file-tag link changes
+         * @param links The links that changed
+         * @param added true if the links were added, false if removed
+         */
+        void notifyLinks(const std::vector<FileTag>& links, bool added);
+
+        /**
+         * @brief Copy the connection error message into errmsg
+         * @param errmsg SQLite3 error message char**, may be nullptr
+         */
+        void setError(char** errmsg);
+
+        /**
+         * @brief Get the name cache in use, the attached one or the session's own
+         * @param validate Drop the session's own cache first if another connection committed since
+         * @return The cache, nullptr if there is none or it could not be validated
+         */
+        NameCache* nameCache(bool validate = true);
+
+        /**
+         * @brief Hook the attached metrics into the connection, or unhook them if there are none
+         */
+        void hookMetrics();
+
+        sqlite3* db;
+        sqlite3_stmt* statements[STMT_COUNT];
+        // How many begin() calls are open
+        int transactionDepth;
+        // Whether the outermost begin() started the transaction, every other level is a savepoint
+        bool ownsTransaction;
+        std::vector<Observer*> observers;
+        NameCache* cache;
+        // Used while no cache is attached, made on first use
+        std::unique_ptr<NameCache> sessionCache;
+        size_t sessionCacheBytes;
+        // PRAGMA data_version the session's own cache was filled under
+        long long sessionCacheVersion;
+        Metrics* metrics;
+        const TagCooccurrence* cooccurrence;
+        // Reused by the arena lookups, so they don't allocate once it has grown
+        std::string scratch;
+    };
+
     /**
      * @brief Set the database path string
      * @param path Path to the database file
+     * @note The free functions below open a new session on this path for every call,
+     * use a Database session when doing more than a few operations. Safe to call while
+     * other threads use the free functions.
      */
     void setDatabasePath(const char* path);
 
@@ -37,6 +1128,7 @@ namespace ftagmgr {
      * @param errmsg SQLite3 error message char**
      * @retval true Directory added
      * @retval false Directory could not be added
+     * @note Ancestors that aren't in the database yet are added along with it
      */
     bool addDir(const char* path, char** errmsg);
 
@@ -52,7 +1144,7 @@ namespace ftagmgr {
     /**
      * @brief Get directory path by ID
      * @param id The directory ID to search for
-     * @param path Pointer to the return std::string
+     * @param path Pointer to the return std::string; left untouched if not found or only added implicitly
      * @param errmsg SQLite3 error message char**
      * @retval true Directory found, name returned
      * @retval false An error has occurred
@@ -137,4 +1229,26 @@ namespace ftagmgr {
      * @retval false Error
      */
     bool getTagValue(unsigned int id, std::string* value, char** errmsg);
+
+    /**
+     * @brief Tag a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite error message char**
+     * @retval true File tagged
+     * @retval false File already has the tag or an error has occurred
+     */
+    bool tagFile(unsigned int file, unsigned int tag, char** errmsg);
+
+    /**
+     * @brief Remove a tag from a file
+     * @param file File ID
+     * @param tag Tag ID
+     * @param errmsg SQLite error message char**
+     * @retval true Tag removed
+     * @retval false File didn't have the tag or an error has occurred
+     */
+    bool untagFile(unsigned int file, unsigned int tag, char** errmsg);
 }
+
+#endif
@@ -0,0 +1,380 @@
+/**
+ * @file ftagmgrmetrics.cpp
+ * @brief FTagMgr metrics source code
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <sqlite3.h>
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        // Names of every Metrics::Operation, same order as the enum
+        const char* operationNames[] = {
+            "open", "createDatabase", "getSchemaVersion", "migrate",
+            "dirExists", "addDir", "getDir", "getDirPath",
+            "fileExists", "addFile", "getFile", "getFileName", "getFilePath",
+            "tagExists", "addTag", "getTag", "getTagValue",
+            "addDirs", "addFiles", "addTags",
+            "begin", "commit", "rollback",
+            "tagFile", "untagFile", "fileHasTag", "tagFiles", "untagFiles",
+            "moveFile", "removeFile", "moveDir", "removeDir",
+            "listFileTags", "listTagFiles", "listDirFiles",
+            "listFileTagNames", "listTagFileNames", "listDirFileNames",
+            "findDir", "listSubtreeDirs", "listSubtreeFiles",
+            "getTagParent", "setTagParent", "getTagAlias", "setTagAlias",
+            "listSubtreeTags", "listSubtreeTagFiles", "getTagFileCount",
+            "getFileFingerprint", "setFileFingerprint", "listHashFiles",
+            "runQuery", "TagIndex::build", "crawl", "Watcher::poll",
+            "exportDatabase", "importDatabase", "compileSnapshot", "TagSearch::build",
+            "hashTree", "findDuplicates", "XattrMirror::sync", "XattrMirror::mirrorDir",
+            "TagCooccurrence::build"
+        };
+        static_assert(sizeof(operationNames) / sizeof(operationNames[0]) == Metrics::OP_COUNT, "one name per operation");
+
+        // Measured calls open on this thread, only the outermost one is recorded
+        thread_local int scopeDepth = 0;
+        // Operation of the outermost call, -1 outside of any
+        thread_local int currentOperation = -1;
+
+        // When the statements running on this thread started, SQLite only times them to the millisecond
+        thread_local std::unordered_map<sqlite3_stmt*, std::chrono::steady_clock::time_point> statementStarts;
+
+        /**
+         * @brief Find the histogram bucket of a duration
+         * @param ns The duration
+         * @return Bucket index, durations in [2^(i-1), 2^i) ns go to bucket i
+         */
+        inline int bucketOf(uint64_t ns) {
+            int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+            return std::min(bucket, histogramBuckets - 1);
+        }
+
+        /**
+         * @brief Check if a statement changes rows, sqlite3_changes() is only about those
+         * @param sql The statement's SQL
+         * @retval true INSERT, UPDATE, DELETE, REPLACE or a WITH in front of one
+         * @retval false Anything else, e.g. BEGIN or PRAGMA
+         */
+        bool changesRows(const char* sql) {
+            while (*sql == ' ' || *sql == '\n' || *sql == '\t') sql++;
+            for (const char* verb : {"INSERT", "UPDATE", "DELETE", "REPLACE", "WITH"}) {
+                if (sqlite3_strnicmp(sql, verb, (int)std::strlen(verb)) == 0) return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief Append a string with quotes, backslashes and control characters escaped, as JSON and Prometheus labels want
+         * @param text The string
+         * @param out Pointer to the std::string to append to
+         */
+        void appendEscaped(std::string_view text, std::string* out) {
+            for (char c : text) {
+                if (c == '"' || c == '\\') {
+                    out->push_back('\\');
+                    out->push_back(c);
+                } else if (c == '\n') {
+                    out->append("\\n");
+                } else if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out->append(escaped);
+                } else {
+                    out->push_back(c);
+                }
+            }
+        }
+
+        void appendf(std::string* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+        void appendf(std::string* out, const char* format, ...) {
+            char buffer[256];
+            va_list args;
+            va_start(args, format);
+            int length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+            va_end(args);
+            if (length <= 0) return;
+            if ((size_t)length < sizeof(buffer)) {
+                out->append(buffer, (size_t)length);
+                return;
+            }
+            // Too long for the buffer, format again straight into the output
+            size_t used = out->size();
+            out->resize(used + (size_t)length + 1);
+            va_start(args, format);
+            std::vsnprintf(&(*out)[used], (size_t)length + 1, format, args);
+            va_end(args);
+            out->resize(used + (size_t)length);
+        }
+
+        // Smallest histogram bound in the Prometheus output, shorter calls fall into its bucket
+        const int firstPrometheusBucket = 10;
+    }
+
+    /**
+     * @brief Estimate a latency quantile from the histogram
+     * @param q The quantile, e.g. 0.99
+     * @return Upper bound of the bucket holding the quantile in ns, 0 without calls
+     */
+    uint64_t OperationMetrics::quantileNs(double q) const {
+        if (calls == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (double)(calls - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < histogramBuckets; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return 1ULL << i;
+        }
+        return 1ULL << (histogramBuckets - 1);
+    }
+
+    void Metrics::Scope::enter(Metrics* metrics, Operation op) {
+        this->metrics = metrics;
+        this->op = op;
+        outermost = scopeDepth++ == 0;
+        if (!outermost) return;
+        currentOperation = op;
+        start = std::chrono::steady_clock::now();
+    }
+
+    void Metrics::Scope::leave() {
+        scopeDepth--;
+        if (!outermost) return;
+        currentOperation = -1;
+        metrics->record(op, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    Metrics::Metrics() : counters(), shards(new StatementShard[statementShards]) {
+        reset();
+    }
+
+    Metrics::~Metrics() = default;
+
+    /**
+     * @brief Copy out every counter
+     * @param snapshot Pointer to the return MetricsSnapshot
+     */
+    void Metrics::snapshot(MetricsSnapshot* snapshot) const {
+        snapshot->operations.clear();
+        for (int op = 0; op < OP_COUNT; op++) {
+            const Counters& counter = counters[op];
+            OperationMetrics metrics;
+            metrics.name = operationNames[op];
+            metrics.calls = counter.calls.load(std::memory_order_relaxed);
+            if (metrics.calls == 0) continue;
+            metrics.errors = counter.errors.load(std::memory_order_relaxed);
+            metrics.totalNs = counter.totalNs.load(std::memory_order_relaxed);
+            // Calls go on while this copies, summing the buckets keeps the count and the histogram in agreement
+            metrics.calls = 0;
+            for (int i = 0; i < histogramBuckets; i++) metrics.calls += metrics.buckets[i] = counter.buckets[i].load(std::memory_order_relaxed);
+            snapshot->operations.push_back(metrics);
+        }
+        snapshot->statements.clear();
+        for (size_t i = 0; i < statementShards; i++) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            for (const auto& [hash, statements] : shards[i].bySql) snapshot->statements.insert(snapshot->statements.end(), statements.begin(), statements.end());
+        }
+        std::sort(snapshot->statements.begin(), snapshot->statements.end(), [](const StatementMetrics& a, const StatementMetrics& b) {
+            return a.totalNs > b.totalNs;
+        });
+        snapshot->rowsRead = rowsRead.load(std::memory_order_relaxed);
+        snapshot->rowsWritten = rowsWritten.load(std::memory_order_relaxed);
+        snapshot->lockWaits = lockWaits.load(std::memory_order_relaxed);
+        snapshot->lockWaitNs = lockWaitNs.load(std::memory_order_relaxed);
+        snapshot->lockTimeouts = lockTimeouts.load(std::memory_order_relaxed);
+        snapshot->cacheHits = cacheHits.load(std::memory_order_relaxed);
+        snapshot->cacheMisses = cacheMisses.load(std::memory_order_relaxed);
+        snapshot->otherErrors = otherErrors.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Set every counter back to 0
+     */
+    void Metrics::reset() {
+        for (Counters& counter : counters) {
+            counter.calls = 0;
+            counter.errors = 0;
+            counter.totalNs = 0;
+            for (std::atomic<uint64_t>& bucket : counter.buckets) bucket = 0;
+        }
+        for (size_t i = 0; i < statementShards; i++) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            shards[i].bySql.clear();
+        }
+        rowsRead = 0;
+        rowsWritten = 0;
+        lockWaits = 0;
+        lockWaitNs = 0;
+        lockTimeouts = 0;
+        cacheHits = 0;
+        cacheMisses = 0;
+        otherErrors = 0;
+    }
+
+    /**
+     * @brief Count an SQLite error, against the function running on this thread
+     */
+    void Metrics::countError() {
+        if (currentOperation >= 0) counters[currentOperation].errors.fetch_add(1, std::memory_order_relaxed);
+        else otherErrors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Count a wait for another connection's lock
+     * @param ns How long the session slept
+     * @param first Whether it's the first sleep of this wait
+     * @param gaveUp Whether the session stopped waiting after it
+     */
+    void Metrics::countLockWait(uint64_t ns, bool first, bool gaveUp) {
+        if (first) lockWaits.fetch_add(1, std::memory_order_relaxed);
+        if (gaveUp) lockTimeouts.fetch_add(1, std::memory_order_relaxed);
+        lockWaitNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Callback for sqlite3_trace_v2(), with a Metrics as its context
+     */
+    int Metrics::trace(unsigned int type, void* context, void* p, void* x) {
+        Metrics* metrics = (Metrics*)context;
+        if (type == SQLITE_TRACE_ROW) {
+            metrics->rowsRead.fetch_add(1, std::memory_order_relaxed);
+        } else if (type == SQLITE_TRACE_STMT) {
+            // Also called for every trigger the statement fires, the first call is the start
+            statementStarts.emplace((sqlite3_stmt*)p, std::chrono::steady_clock::now());
+        } else if (type == SQLITE_TRACE_PROFILE) {
+            sqlite3_stmt* stmt = (sqlite3_stmt*)p;
+            uint64_t ns = (uint64_t)*(sqlite3_int64*)x;
+            auto started = statementStarts.find(stmt);
+            if (started != statementStarts.end()) {
+                ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started->second).count();
+                statementStarts.erase(started);
+            }
+            const char* sql = sqlite3_sql(stmt);
+            if (!sql) return 0;
+            uint64_t written = 0;
+            if (!sqlite3_stmt_readonly(stmt) && changesRows(sql)) written = (uint64_t)sqlite3_changes64(sqlite3_db_handle(stmt));
+            uint64_t fullScanSteps = (uint64_t)sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+            metrics->recordStatement(sql, ns, written, fullScanSteps);
+        }
+        return 0;
+    }
+
+    void Metrics::record(Operation op, uint64_t ns) {
+        Counters& counter = counters[op];
+        counter.calls.fetch_add(1, std::memory_order_relaxed);
+        counter.totalNs.fetch_add(ns, std::memory_order_relaxed);
+        counter.buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Metrics::recordStatement(std::string_view sql, uint64_t ns, uint64_t written, uint64_t fullScanSteps) {
+        if (written) rowsWritten.fetch_add(written, std::memory_order_relaxed);
+        size_t hash = std::hash<std::string_view>()(sql);
+        StatementShard& shard = shards[hash % statementShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::vector<StatementMetrics>& statements = shard.bySql[hash];
+        auto found = std::find_if(statements.begin(), statements.end(), [&](const StatementMetrics& s) { return s.sql == sql; });
+        if (found == statements.end()) found = statements.insert(statements.end(), {std::string(sql), 0, 0, 0, 0, 0});
+        found->runs++;
+        found->totalNs += ns;
+        found->maxNs = std::max(found->maxNs, ns);
+        found->rowsWritten += written;
+        found->fullScanSteps += fullScanSteps;
+    }
+
+    /**
+     * @brief Format a snapshot in the Prometheus text exposition format
+     * @param snapshot The snapshot
+     * @param out Pointer to the return std::string, replaced
+     */
+    void formatPrometheus(const MetricsSnapshot& snapshot, std::string* out) {
+        out->clear();
+        out->append("# HELP ftagmgr_calls_total Calls of library functions\n# TYPE ftagmgr_calls_total counter\n");
+        for (const OperationMetrics& op : snapshot.operations) appendf(out, "ftagmgr_calls_total{function=\"%s\"} %" PRIu64 "\n", op.name, op.calls);
+        out->append("# HELP ftagmgr_errors_total Calls of library functions that hit an SQLite error\n# TYPE ftagmgr_errors_total counter\n");
+        for (const OperationMetrics& op : snapshot.operations) appendf(out, "ftagmgr_errors_total{function=\"%s\"} %" PRIu64 "\n", op.name, op.errors);
+        appendf(out, "ftagmgr_errors_total{function=\"\"} %" PRIu64 "\n", snapshot.otherErrors);
+        out->append("# HELP ftagmgr_call_duration_seconds Latency of library functions\n# TYPE ftagmgr_call_duration_seconds histogram\n");
+        for (const OperationMetrics& op : snapshot.operations) {
+            uint64_t cumulative = 0;
+            for (int i = 0; i < histogramBuckets - 1; i++) {
+                cumulative += op.buckets[i];
+                if (i < firstPrometheusBucket) continue;
+                appendf(out, "ftagmgr_call_duration_seconds_bucket{function=\"%s\",le=\"%g\"} %" PRIu64 "\n", op.name, (double)(1ULL << i) * 1e-9, cumulative);
+            }
+            appendf(out, "ftagmgr_call_duration_seconds_bucket{function=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", op.name, op.calls);
+            appendf(out, "ftagmgr_call_duration_seconds_sum{function=\"%s\"} %.9f\n", op.name, (double)op.totalNs * 1e-9);
+            appendf(out, "ftagmgr_call_duration_seconds_count{function=\"%s\"} %" PRIu64 "\n", op.name, op.calls);
+        }
+        out->append("# HELP ftagmgr_statement_seconds_total Time SQLite spent running a statement\n# TYPE ftagmgr_statement_seconds_total counter\n");
+        for (const StatementMetrics& statement : snapshot.statements) {
+            out->append("ftagmgr_statement_seconds_total{sql=\"");
+            appendEscaped(statement.sql, out);
+            appendf(out, "\"} %.9f\n", (double)statement.totalNs * 1e-9);
+        }
+        out->append("# HELP ftagmgr_statement_runs_total Runs of a statement\n# TYPE ftagmgr_statement_runs_total counter\n");
+        for (const StatementMetrics& statement : snapshot.statements) {
+            out->append("ftagmgr_statement_runs_total{sql=\"");
+            appendEscaped(statement.sql, out);
+            appendf(out, "\"} %" PRIu64 "\n", statement.runs);
+        }
+        out->append("# HELP ftagmgr_statement_full_scan_steps_total Steps of a statement through full table or index scans\n"
+                    "# TYPE ftagmgr_statement_full_scan_steps_total counter\n");
+        for (const StatementMetrics& statement : snapshot.statements) {
+            if (statement.fullScanSteps == 0) continue;
+            out->append("ftagmgr_statement_full_scan_steps_total{sql=\"");
+            appendEscaped(statement.sql, out);
+            appendf(out, "\"} %" PRIu64 "\n", statement.fullScanSteps);
+        }
+        const struct {
+            const char* name;
+            const char* help;
+            double value;
+        } totals[] = {
+            {"ftagmgr_rows_read_total", "Rows returned by SQLite", (double)snapshot.rowsRead},
+            {"ftagmgr_rows_written_total", "Rows inserted, updated or deleted", (double)snapshot.rowsWritten},
+            {"ftagmgr_lock_waits_total", "Waits for another connection's lock", (double)snapshot.lockWaits},
+            {"ftagmgr_lock_wait_seconds_total", "Time spent waiting for other connections' locks", (double)snapshot.lockWaitNs * 1e-9},
+            {"ftagmgr_lock_timeouts_total", "Lock waits that gave up", (double)snapshot.lockTimeouts},
+            {"ftagmgr_cache_hits_total", "Name cache lookups that found the name", (double)snapshot.cacheHits},
+            {"ftagmgr_cache_misses_total", "Name cache lookups that went to the database", (double)snapshot.cacheMisses}
+        };
+        for (const auto& total : totals) {
+            appendf(out, "# HELP %s %s\n# TYPE %s counter\n%s %.9g\n", total.name, total.help, total.name, total.name, total.value);
+        }
+    }
+
+    /**
+     * @brief Format a snapshot as a JSON object
+     * @param snapshot The snapshot
+     * @param out Pointer to the return std::string, replaced
+     */
+    void formatJson(const MetricsSnapshot& snapshot, std::string* out) {
+        out->assign("{\"operations\": [");
+        for (size_t i = 0; i < snapshot.operations.size(); i++) {
+            const OperationMetrics& op = snapshot.operations[i];
+            appendf(out, "%s{\"name\": \"%s\", \"calls\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"total_ns\": %" PRIu64
+                         ", \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"buckets\": [",
+                    i ? ", " : "", op.name, op.calls, op.errors, op.totalNs, op.quantileNs(0.5), op.quantileNs(0.99));
+            for (int b = 0; b < histogramBuckets; b++) appendf(out, "%s%" PRIu64, b ? ", " : "", op.buckets[b]);
+            out->append("]}");
+        }
+        out->append("], \"statements\": [");
+        for (size_t i = 0; i < snapshot.statements.size(); i++) {
+            const StatementMetrics& statement = snapshot.statements[i];
+            out->append(i ? ", {\"sql\": \"" : "{\"sql\": \"");
+            appendEscaped(statement.sql, out);
+            appendf(out, "\", \"runs\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"rows_written\": %" PRIu64
+                         ", \"full_scan_steps\": %" PRIu64 "}",
+                    statement.runs, statement.totalNs, statement.maxNs, statement.rowsWritten, statement.fullScanSteps);
+        }
+        appendf(out, "], \"rows_read\": %" PRIu64 ", \"rows_written\": %" PRIu64 ", \"lock_waits\": %" PRIu64 ", \"lock_wait_ns\": %" PRIu64
+                     ", \"lock_timeouts\": %" PRIu64 ", \"cache_hits\": %" PRIu64 ", \"cache_misses\": %" PRIu64 ", \"other_errors\": %" PRIu64 "}",
+                snapshot.rowsRead, snapshot.rowsWritten, snapshot.lockWaits, snapshot.lockWaitNs,
+                snapshot.lockTimeouts, snapshot.cacheHits, snapshot.cacheMisses, snapshot.otherErrors);
+    }
+}
@@ -0,0 +1,237 @@
+/**
+ * @file ftagmgrmetrics.h
+ * @brief FTagMgrLib metrics header file
+ */
+
+#ifndef FTAGMGRMETRICS_H
+#define FTAGMGRMETRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ftagmgr {
+    // Latency histogram buckets, bucket i counts durations below 2^i ns; the last one takes the rest
+    const int histogramBuckets = 40;
+
+    /**
+     * @brief Counters and latencies of one library function
+     */
+    struct OperationMetrics {
+        // Function name, e.g. "addTag"
+        const char* name;
+        uint64_t calls;
+        // Calls that hit an SQLite error
+        uint64_t errors;
+        uint64_t totalNs;
+        uint64_t buckets[histogramBuckets];
+
+        /**
+         * @brief Estimate a latency quantile from the histogram
+         * @param q The quantile, e.g. 0.99
+         * @return Upper bound of the bucket holding the quantile in ns, 0 without calls
+         */
+        uint64_t quantileNs(double q) const;
+    };
+
+    /**
+     * @brief Counters of one SQL statement, as SQLite reported its runs
+     */
+    struct StatementMetrics {
+        // SQL text with its parameters unexpanded
+        std::string sql;
+        uint64_t runs;
+        uint64_t totalNs;
+        uint64_t maxNs;
+        uint64_t rowsWritten;
+        // Steps through a table or index in a full scan, nonzero means an index is missing
+        uint64_t fullScanSteps;
+    };
+
+    /**
+     * @brief Everything Metrics has counted, copied out at one point in time
+     */
+    struct MetricsSnapshot {
+        // Functions that were called at least once, in declaration order
+        std::vector<OperationMetrics> operations;
+        // Statements in descending total time
+        std::vector<StatementMetrics> statements;
+        // Rows returned by SQLite to the library
+        uint64_t rowsRead;
+        // Rows inserted, updated or deleted
+        uint64_t rowsWritten;
+        // Times a session waited for another connection's lock, and for how long
+        uint64_t lockWaits;
+        uint64_t lockWaitNs;
+        // Lock waits that gave up, the call then failed with SQLITE_BUSY
+        uint64_t lockTimeouts;
+        uint64_t cacheHits;
+        uint64_t cacheMisses;
+        // SQLite errors outside of any measured function
+        uint64_t otherErrors;
+    };
+
+    /**
+     * @brief Call counts, latencies and SQLite activity of the sessions it's attached to
+     *
+     * Attach it with Database::setMetrics(). Every public library function
+     * taking a session is then timed into a log2 histogram; a call made by
+     * another library function, e.g. addFiles() by crawl(), counts towards
+     * the outer one only. SQLite reports every statement it runs through
+     * sqlite3_trace_v2(), with its time, rows and full scan steps, and
+     * lock waits through a busy handler.
+     *
+     * Sessions without metrics pay one pointer check per call.
+     *
+     * Thread-safe, one instance can serve any number of sessions.
+     */
+    class Metrics {
+    public:
+        // Measured functions, same order as their names in the source
+        enum Operation {
+            OP_OPEN, OP_CREATE_DATABASE, OP_GET_SCHEMA_VERSION, OP_MIGRATE,
+            OP_DIR_EXISTS, OP_ADD_DIR, OP_GET_DIR, OP_GET_DIR_PATH,
+            OP_FILE_EXISTS, OP_ADD_FILE, OP_GET_FILE, OP_GET_FILE_NAME, OP_GET_FILE_PATH,
+            OP_TAG_EXISTS, OP_ADD_TAG, OP_GET_TAG, OP_GET_TAG_VALUE,
+            OP_ADD_DIRS, OP_ADD_FILES, OP_ADD_TAGS,
+            OP_BEGIN, OP_COMMIT, OP_ROLLBACK,
+            OP_TAG_FILE, OP_UNTAG_FILE, OP_FILE_HAS_TAG, OP_TAG_FILES, OP_UNTAG_FILES,
+            OP_MOVE_FILE, OP_REMOVE_FILE, OP_MOVE_DIR, OP_REMOVE_DIR,
+            OP_LIST_FILE_TAGS, OP_LIST_TAG_FILES, OP_LIST_DIR_FILES,
+            OP_LIST_FILE_TAG_NAMES, OP_LIST_TAG_FILE_NAMES, OP_LIST_DIR_FILE_NAMES,
+            OP_FIND_DIR, OP_LIST_SUBTREE_DIRS, OP_LIST_SUBTREE_FILES,
+            OP_GET_TAG_PARENT, OP_SET_TAG_PARENT, OP_GET_TAG_ALIAS, OP_SET_TAG_ALIAS,
+            OP_LIST_SUBTREE_TAGS, OP_LIST_SUBTREE_TAG_FILES, OP_GET_TAG_FILE_COUNT,
+            OP_GET_FILE_FINGERPRINT, OP_SET_FILE_FINGERPRINT, OP_LIST_HASH_FILES,
+            OP_RUN_QUERY, OP_BUILD_TAG_INDEX, OP_CRAWL, OP_WATCHER_POLL,
+            OP_EXPORT_DATABASE, OP_IMPORT_DATABASE, OP_COMPILE_SNAPSHOT, OP_BUILD_TAG_SEARCH,
+            OP_HASH_TREE, OP_FIND_DUPLICATES, OP_XATTR_SYNC, OP_XATTR_MIRROR_DIR,
+            OP_BUILD_COOCCURRENCE,
+            OP_COUNT
+        };
+
+        /**
+         * @brief Times a function call from construction to destruction
+         *
+         * Does nothing, not even read the clock, when constructed with nullptr.
+         */
+        class Scope {
+        public:
+            Scope(Metrics* metrics, Operation op) : metrics(nullptr) {
+                if (metrics) enter(metrics, op);
+            }
+
+            ~Scope() {
+                if (metrics) leave();
+            }
+
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+        private:
+            void enter(Metrics* metrics, Operation op);
+            void leave();
+
+            Metrics* metrics;
+            Operation op;
+            // Outermost measured call on this thread, only that one is recorded
+            bool outermost;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        Metrics();
+        ~Metrics();
+        Metrics(const Metrics&) = delete;
+        Metrics& operator=(const Metrics&) = delete;
+
+        /**
+         * @brief Copy out every counter
+         * @param snapshot Pointer to the return MetricsSnapshot
+         */
+        void snapshot(MetricsSnapshot* snapshot) const;
+
+        /**
+         * @brief Set every counter back to 0
+         */
+        void reset();
+
+        /**
+         * @brief Count an SQLite error, against the function running on this thread
+         */
+        void countError();
+
+        /**
+         * @brief Count a name cache lookup
+         * @param hit Whether the name was cached
+         */
+        void countCache(bool hit) {
+            (hit ? cacheHits : cacheMisses).fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Count a wait for another connection's lock
+         * @param ns How long the session slept
+         * @param first Whether it's the first sleep of this wait
+         * @param gaveUp Whether the session stopped waiting after it
+         */
+        void countLockWait(uint64_t ns, bool first, bool gaveUp);
+
+        /**
+         * @brief Callback for sqlite3_trace_v2(), with a Metrics as its context
+         */
+        static int trace(unsigned int type, void* context, void* p, void* x);
+
+    private:
+        struct Counters {
+            std::atomic<uint64_t> calls;
+            std::atomic<uint64_t> errors;
+            std::atomic<uint64_t> totalNs;
+            std::atomic<uint64_t> buckets[histogramBuckets];
+        };
+
+        // Statements by the hash of their SQL, split so sessions rarely wait for each other
+        struct StatementShard {
+            std::mutex mutex;
+            std::unordered_map<size_t, std::vector<StatementMetrics>> bySql;
+        };
+
+        static const size_t statementShards = 16;
+
+        void record(Operation op, uint64_t ns);
+        void recordStatement(std::string_view sql, uint64_t ns, uint64_t written, uint64_t fullScanSteps);
+
+        Counters counters[OP_COUNT];
+        std::unique_ptr<StatementShard[]> shards;
+        std::atomic<uint64_t> rowsRead;
+        std::atomic<uint64_t> rowsWritten;
+        std::atomic<uint64_t> lockWaits;
+        std::atomic<uint64_t> lockWaitNs;
+        std::atomic<uint64_t> lockTimeouts;
+        std::atomic<uint64_t> cacheHits;
+        std::atomic<uint64_t> cacheMisses;
+        std::atomic<uint64_t> otherErrors;
+    };
+
+    /**
+     * @brief Format a snapshot in the Prometheus text exposition format
+     * @param snapshot The snapshot
+     * @param out Pointer to the return std::string, replaced
+     */
+    void formatPrometheus(const MetricsSnapshot& snapshot, std::string* out);
+
+    /**
+     * @brief Format a snapshot as a JSON object
+     * @param snapshot The snapshot
+     * @param out Pointer to the return std::string, replaced
+     */
+    void formatJson(const MetricsSnapshot& snapshot, std::string* out);
+}
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * @file ftagmgrpool.cpp
+ * @brief FTagMgr connection pool source code
+ */
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ftagmgrpool.h"
+
+namespace ftagmgr {
+    ConnectionPool::Lease::Lease() : pool(nullptr), db(nullptr) {}
+
+    ConnectionPool::Lease::~Lease() {
+        release();
+    }
+
+    ConnectionPool::Lease::Lease(Lease&& other) noexcept : pool(other.pool), db(other.db) {
+        other.pool = nullptr;
+        other.db = nullptr;
+    }
+
+    ConnectionPool::Lease& ConnectionPool::Lease::operator=(Lease&& other) noexcept {
+        if (this != &other) {
+            release();
+            pool = other.pool;
+            db = other.db;
+            other.pool = nullptr;
+            other.db = nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Give the session back before the lease is destroyed
+     */
+    void ConnectionPool::Lease::release() {
+        if (pool && db) pool->giveBack(db);
+        pool = nullptr;
+        db = nullptr;
+    }
+
+    ConnectionPool::ConnectionPool() : writerBorrowed(false) {}
+
+    ConnectionPool::~ConnectionPool() {
+        close();
+    }
+
+    /**
+     * @brief Open the writer and the readers
+     * @param path Path to the database file, created if missing
+     * @param readers Number of read-only sessions, 0 for one per core
+     * @param tunables Connection settings, readOnly is ignored
+     * @param errmsg SQLite3 error message char**
+     * @retval true Pool ready
+     * @retval false A session could not be opened, the pool is left closed
+     */
+    bool ConnectionPool::open(const char* path, unsigned int readers, const Tunables& tunables, char** errmsg) {
+        close();
+        std::lock_guard<std::mutex> lock(mutex);
+        // The writer goes first, it switches the file to WAL before the readers attach
+        Tunables settings = tunables;
+        settings.readOnly = false;
+        if (!writerDb.open(path, settings, errmsg)) return false;
+        if (readers == 0) readers = std::thread::hardware_concurrency();
+        if (readers == 0) readers = 1;
+        settings.readOnly = true;
+        for (unsigned int i = 0; i < readers; i++) {
+            std::unique_ptr<Database> reader(new Database());
+            if (!reader->open(path, settings, errmsg)) {
+                this->readers.clear();
+                idle.clear();
+                writerDb.close();
+                return false;
+            }
+            idle.push_back(reader.get());
+            this->readers.push_back(std::move(reader));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Close every session, all leases must have been returned
+     */
+    void ConnectionPool::close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.clear();
+        readers.clear();
+        writerDb.close();
+        writerBorrowed = false;
+        returned.notify_all();
+    }
+
+    /**
+     * @brief Borrow the writer session, waiting while another thread has it
+     * @return The lease, empty if the pool is closed
+     */
+    ConnectionPool::Lease ConnectionPool::writer() {
+        Lease lease;
+        std::unique_lock<std::mutex> lock(mutex);
+        returned.wait(lock, [this] { return !writerBorrowed || !writerDb.isOpen(); });
+        if (!writerDb.isOpen()) return lease;
+        writerBorrowed = true;
+        lease.pool = this;
+        lease.db = &writerDb;
+        return lease;
+    }
+
+    /**
+     * @brief Borrow a read-only session, waiting while all are borrowed
+     * @return The lease, empty if the pool is closed
+     */
+    ConnectionPool::Lease ConnectionPool::reader() {
+        Lease lease;
+        std::unique_lock<std::mutex> lock(mutex);
+        returned.wait(lock, [this] { return !idle.empty() || readers.empty(); });
+        if (idle.empty()) return lease;
+        lease.pool = this;
+        lease.db = idle.back();
+        idle.pop_back();
+        return lease;
+    }
+
+    /**
+     * @brief Get the number of read-only sessions
+     * @return The number of readers
+     */
+    size_t ConnectionPool::readerCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return readers.size();
+    }
+
+    /**
+     * @brief Take a session back from a lease
+     * @param db The session
+     */
+    void ConnectionPool::giveBack(Database* db) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (db == &writerDb) writerBorrowed = false;
+            else idle.push_back(db);
+        }
+        // Writer and reader waiters share the condition, wake them all
+        returned.notify_all();
+    }
+}
@@ -0,0 +1,127 @@
+/**
+ * @file ftagmgrpool.h
+ * @brief FTagMgrLib connection pool header file
+ */
+
+#ifndef FTAGMGRPOOL_H
+#define FTAGMGRPOOL_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief One writer session and a fixed set of read-only sessions on one database
+     *
+     * Threads borrow a session with writer() or reader() and give it back
+     * when the Lease goes out of scope. A thread keeps its lease for as long
+     * as it works, so borrowing is not on the hot path. The database is put
+     * in WAL mode, so readers see the last committed state and never wait
+     * for the writer, however long its transaction runs.
+     *
+     * Thread-safe. Every lease must be returned before close().
+     */
+    class ConnectionPool {
+    public:
+        /**
+         * @brief A borrowed session, given back on destruction
+         *
+         * Movable, not copyable. Must not outlive its pool.
+         */
+        class Lease {
+        public:
+            Lease();
+            ~Lease();
+            Lease(Lease&& other) noexcept;
+            Lease& operator=(Lease&& other) noexcept;
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+
+            Database* operator->() const {
+                return db;
+            }
+
+            Database& operator*() const {
+                return *db;
+            }
+
+            /**
+             * @brief Check if the lease holds a session
+             * @retval true Session borrowed
+             * @retval false Empty lease, the pool is closed
+             */
+            explicit operator bool() const {
+                return db != nullptr;
+            }
+
+            /**
+             * @brief Give the session back before the lease is destroyed
+             */
+            void release();
+
+        private:
+            friend class ConnectionPool;
+            ConnectionPool* pool;
+            Database* db;
+        };
+
+        ConnectionPool();
+        ~ConnectionPool();
+        ConnectionPool(const ConnectionPool&) = delete;
+        ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+        /**
+         * @brief Open the writer and the readers
+         * @param path Path to the database file, created if missing
+         * @param readers Number of read-only sessions, 0 for one per core
+         * @param tunables Connection settings, readOnly is ignored
+         * @param errmsg SQLite3 error message char**
+         * @retval true Pool ready
+         * @retval false A session could not be opened, the pool is left closed
+         */
+        bool open(const char* path, unsigned int readers, const Tunables& tunables, char** errmsg);
+
+        /**
+         * @brief Close every session, all leases must have been returned
+         */
+        void close();
+
+        /**
+         * @brief Borrow the writer session, waiting while another thread has it
+         * @return The lease, empty if the pool is closed
+         */
+        Lease writer();
+
+        /**
+         * @brief Borrow a read-only session, waiting while all are borrowed
+         * @return The lease, empty if the pool is closed
+         */
+        Lease reader();
+
+        /**
+         * @brief Get the number of read-only sessions
+         * @return The number of readers
+         */
+        size_t readerCount() const;
+
+    private:
+        /**
+         * @brief Take a session back from a lease
+         * @param db The session
+         */
+        void giveBack(Database* db);
+
+        mutable std::mutex mutex;
+        std::condition_variable returned;
+        Database writerDb;
+        bool writerBorrowed;
+        std::vector<std::unique_ptr<Database>> readers;
+        // Readers not borrowed right now
+        std::vector<Database*> idle;
+    };
+}
+
+#endif
@@ -0,0 +1,1098 @@
+/**
+ * @file ftagmgrquery.cpp
+ * @brief FTagMgr tag query source code
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sqlite3.h>
+#include "ftagmgrbitmap.h"
+#include "ftagmgrcooccur.h"
+#include "ftagmgrmetrics.h"
+#include "ftagmgrquery.h"
+#include "ftagmgrsnapshot.h"
+
+namespace ftagmgr {
+    /**
+     * @brief A sorted stream of file IDs the query is built from
+     *
+     * Streams only ever move forward. seek() is used both for stepping
+     * (target = last ID + 1) and for skipping ahead during intersections.
+     */
+    class Postings {
+    public:
+        virtual ~Postings() = default;
+
+        /**
+         * @brief Move to the first ID not smaller than target
+         * @param target Smallest acceptable ID
+         * @param id Pointer to the return int
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 No more IDs
+         * @retval 1 ID returned
+         */
+        virtual short seek(int target, int* id, char** errmsg) = 0;
+
+        /**
+         * @brief Describe this part of the plan
+         * @param depth Indentation level
+         * @param out The string to append the description to
+         */
+        virtual void explain(int depth, std::string* out) const = 0;
+
+        // Estimated number of IDs, used to order inputs
+        long long estimate = 0;
+        // Tag whose files these are, 0 for anything else, pairs of them have co-occurrence estimates
+        unsigned int sourceTag = 0;
+    };
+
+    namespace {
+        /**
+         * @brief Matches nothing, used for tags that don't exist
+         */
+        class EmptyPostings : public Postings {
+        public:
+            short seek(int, int*, char**) override {
+                return 0;
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append("EMPTY\n");
+            }
+        };
+
+        /**
+         * @brief IDs read from an index range with a lower bound parameter
+         *
+         * Stepping forward reuses the running statement. Skipping far ahead
+         * restarts it from the new lower bound, which is an index search.
+         */
+        class SqlPostings : public Postings {
+        public:
+            /**
+             * @param db Connection
+             * @param sql Query returning sorted IDs, lower bound as ?2, tag as ?1 if any
+             * @param tag Tag ID bound to ?1, -1 for none
+             * @param label Description for explain()
+             */
+            SqlPostings(sqlite3* db, const char* sql, int tag, std::string label)
+                : db(db), sql(sql), tag(tag), label(std::move(label)), stmt(nullptr), current(-1), done(false) {}
+
+            ~SqlPostings() override {
+                sqlite3_finalize(stmt);
+            }
+
+            short seek(int target, int* id, char** errmsg) override {
+                if (done) return 0;
+                if (current >= target) {
+                    *id = current;
+                    return 1;
+                }
+                // Close targets are cheaper to step to than to search for
+                if (current != -1) {
+                    for (int i = 0; i < stepsBeforeSeek && current < target; i++) {
+                        short res = step(errmsg);
+                        if (res != 1) return res;
+                    }
+                    if (current >= target) {
+                        *id = current;
+                        return 1;
+                    }
+                }
+                if (!stmt && sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+                    return -1;
+                }
+                sqlite3_reset(stmt);
+                if (tag != -1) sqlite3_bind_int64(stmt, 1, tag);
+                sqlite3_bind_int64(stmt, 2, target);
+                short res = step(errmsg);
+                if (res == 1) *id = current;
+                return res;
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append(label);
+                out->append(" (~" + std::to_string(estimate) + " files)\n");
+            }
+
+        private:
+            short step(char** errmsg) {
+                int ecode = sqlite3_step(stmt);
+                if (ecode == SQLITE_ROW) {
+                    current = sqlite3_column_int(stmt, 0);
+                    return 1;
+                }
+                if (ecode == SQLITE_DONE) {
+                    done = true;
+                    return 0;
+                }
+                if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+                return -1;
+            }
+
+            static const int stepsBeforeSeek = 8;
+            sqlite3* db;
+            const char* sql;
+            int tag;
+            std::string label;
+            sqlite3_stmt* stmt;
+            int current;
+            bool done;
+        };
+
+        /**
+         * @brief Files in all inputs, leapfrog intersection
+         *
+         * Inputs are sorted by estimate, so the most selective one proposes
+         * candidates and the others only ever seek to them.
+         */
+        class AndPostings : public Postings {
+        public:
+            explicit AndPostings(std::vector<std::unique_ptr<Postings>> inputs) : inputs(std::move(inputs)) {
+                estimate = this->inputs.front()->estimate;
+                for (const auto& input : this->inputs) estimate = std::min(estimate, input->estimate);
+            }
+
+            short seek(int target, int* id, char** errmsg) override {
+                size_t agreed = 0;
+                int candidate = target;
+                for (size_t i = 0;; i = (i + 1) % inputs.size()) {
+                    int value = 0;
+                    short res = inputs[i]->seek(candidate, &value, errmsg);
+                    if (res != 1) return res;
+                    if (value == candidate && agreed) agreed++;
+                    else {
+                        candidate = value;
+                        agreed = 1;
+                    }
+                    if (agreed == inputs.size()) {
+                        *id = candidate;
+                        return 1;
+                    }
+                }
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append("AND (~" + std::to_string(estimate) + " files)\n");
+                for (const auto& input : inputs) input->explain(depth + 1, out);
+            }
+
+        private:
+            std::vector<std::unique_ptr<Postings>> inputs;
+        };
+
+        /**
+         * @brief Files in any input, merge union
+         */
+        class OrPostings : public Postings {
+        public:
+            explicit OrPostings(std::vector<std::unique_ptr<Postings>> inputs)
+                : inputs(std::move(inputs)), heads(this->inputs.size(), -1), done(this->inputs.size(), false) {
+                for (const auto& input : this->inputs) estimate += input->estimate;
+            }
+
+            short seek(int target, int* id, char** errmsg) override {
+                bool found = false;
+                for (size_t i = 0; i < inputs.size(); i++) {
+                    if (done[i]) continue;
+                    if (heads[i] < target) {
+                        short res = inputs[i]->seek(target, &heads[i], errmsg);
+                        if (res == -1) return -1;
+                        if (res == 0) {
+                            done[i] = true;
+                            continue;
+                        }
+                    }
+                    if (!found || heads[i] < *id) *id = heads[i];
+                    found = true;
+                }
+                return found ? 1 : 0;
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append("OR\n");
+                for (const auto& input : inputs) input->explain(depth + 1, out);
+            }
+
+        private:
+            std::vector<std::unique_ptr<Postings>> inputs;
+            std::vector<int> heads;
+            std::vector<bool> done;
+        };
+
+        /**
+         * @brief Files in the base input but in none of the excluded ones
+         *
+         * This is where NOT ends up, excluded inputs are only probed with
+         * the IDs the base produces.
+         */
+        class ExceptPostings : public Postings {
+        public:
+            ExceptPostings(std::unique_ptr<Postings> base, std::vector<std::unique_ptr<Postings>> excluded)
+                : base(std::move(base)), excluded(std::move(excluded)) {
+                estimate = this->base->estimate;
+            }
+
+            short seek(int target, int* id, char** errmsg) override {
+                while (true) {
+                    int value = 0;
+                    short res = base->seek(target, &value, errmsg);
+                    if (res != 1) return res;
+                    bool hit = false;
+                    for (const auto& input : excluded) {
+                        int other = 0;
+                        short exres = input->seek(value, &other, errmsg);
+                        if (exres == -1) return -1;
+                        if (exres == 1 && other == value) {
+                            hit = true;
+                            break;
+                        }
+                    }
+                    if (!hit) {
+                        *id = value;
+                        return 1;
+                    }
+                    target = value + 1;
+                }
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append("EXCEPT\n");
+                base->explain(depth + 1, out);
+                for (const auto& input : excluded) {
+                    out->append((depth + 1) * 2, ' ');
+                    out->append("-\n");
+                    input->explain(depth + 2, out);
+                }
+            }
+
+        private:
+            std::unique_ptr<Postings> base;
+            std::vector<std::unique_ptr<Postings>> excluded;
+        };
+
+        /**
+         * @brief IDs of an already evaluated bitmap
+         */
+        class BitmapPostings : public Postings {
+        public:
+            /**
+             * @param bitmap The IDs
+             * @param label Description for explain()
+             */
+            explicit BitmapPostings(Bitmap bitmap, std::string label = "BITMAP") : bitmap(std::move(bitmap)), label(std::move(label)) {
+                estimate = this->bitmap.cardinality();
+            }
+
+            short seek(int target, int* id, char**) override {
+                uint32_t value = 0;
+                if (!bitmap.nextFrom(target, &value)) return 0;
+                *id = (int)value;
+                return 1;
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append(label + " (" + std::to_string(estimate) + " files)\n");
+            }
+
+        private:
+            Bitmap bitmap;
+            std::string label;
+        };
+
+        /**
+         * @brief IDs of a sorted list in a snapshot
+         *
+         * Seeking gallops ahead from the current position, so stepping is
+         * constant time and long skips during intersections are logarithmic.
+         */
+        class SpanPostings : public Postings {
+        public:
+            /**
+             * @param ids The IDs
+             * @param label Description for explain()
+             */
+            SpanPostings(IdSpan ids, std::string label) : ids(ids), label(std::move(label)), position(0) {
+                estimate = (long long)ids.size();
+            }
+
+            short seek(int target, int* id, char**) override {
+                const uint32_t* begin = ids.begin() + position;
+                if (begin == ids.end()) return 0;
+                uint32_t value = (uint32_t)std::max(target, 0);
+                if (*begin < value) {
+                    // Double the step until it's past the target, then search the last step
+                    size_t step = 1, available = ids.end() - begin;
+                    while (step < available && begin[step] < value) step *= 2;
+                    begin = std::lower_bound(begin + step / 2, begin + std::min(step + 1, available), value);
+                }
+                position = begin - ids.begin();
+                if (begin == ids.end()) return 0;
+                *id = (int)*begin;
+                return 1;
+            }
+
+            void explain(int depth, std::string* out) const override {
+                out->append(depth * 2, ' ');
+                out->append(label + " (" + std::to_string(estimate) + " files)\n");
+            }
+
+        private:
+            IdSpan ids;
+            std::string label;
+            size_t position;
+        };
+
+        /**
+         * @brief Parsed query expression
+         */
+        struct Node {
+            enum Kind { TAG, DIR, NOT, AND, OR };
+            Kind kind;
+            // Tag name, or directory path for DIR
+            std::string tag;
+            std::vector<std::unique_ptr<Node>> children;
+        };
+
+        /**
+         * @brief Recursive descent parser for query expressions
+         *
+         * or  := and ('|' and)*
+         * and := not (['&'] not)*
+         * not := '!' not | '(' or ')' | '@' tag | tag
+         *
+         * '@' makes the name a directory, matching every file under it.
+         */
+        class Parser {
+        public:
+            explicit Parser(const char* text) : text(text), pos(0) {}
+
+            /**
+             * @brief Parse the whole expression
+             * @param error Pointer to the return std::string, set on syntax errors
+             * @return The expression tree, nullptr on syntax errors
+             */
+            std::unique_ptr<Node> parse(std::string* error) {
+                std::unique_ptr<Node> node = parseOr(error);
+                if (!node) return nullptr;
+                skipSpace();
+                if (text[pos]) {
+                    *error = "Unexpected '" + std::string(1, text[pos]) + "' at position " + std::to_string(pos);
+                    return nullptr;
+                }
+                return node;
+            }
+
+        private:
+            void skipSpace() {
+                while (text[pos] && std::isspace((unsigned char)text[pos])) pos++;
+            }
+
+            static bool isOperator(char c) {
+                return c == '&' || c == '|' || c == '!' || c == '(' || c == ')' || c == '"';
+            }
+
+            std::unique_ptr<Node> parseOr(std::string* error) {
+                std::unique_ptr<Node> left = parseAnd(error);
+                if (!left) return nullptr;
+                skipSpace();
+                if (text[pos] != '|') return left;
+                auto node = std::make_unique<Node>();
+                node->kind = Node::OR;
+                node->children.push_back(std::move(left));
+                while (text[pos] == '|') {
+                    pos++;
+                    std::unique_ptr<Node> right = parseAnd(error);
+                    if (!right) return nullptr;
+                    node->children.push_back(std::move(right));
+                    skipSpace();
+                }
+                return node;
+            }
+
+            std::unique_ptr<Node> parseAnd(std::string* error) {
+                std::unique_ptr<Node> left = parseNot(error);
+                if (!left) return nullptr;
+                auto node = std::make_unique<Node>();
+                node->kind = Node::AND;
+                node->children.push_back(std::move(left));
+                while (true) {
+                    skipSpace();
+                    if (text[pos] == '&') pos++;
+                    // Anything that starts a term is an implicit &
+                    else if (!text[pos] || text[pos] == '|' || text[pos] == ')') break;
+                    std::unique_ptr<Node> right = parseNot(error);
+                    if (!right) return nullptr;
+                    node->children.push_back(std::move(right));
+                }
+                if (node->children.size() == 1) return std::move(node->children.front());
+                return node;
+            }
+
+            std::unique_ptr<Node> parseNot(std::string* error) {
+                skipSpace();
+                if (text[pos] == '!') {
+                    pos++;
+                    std::unique_ptr<Node> inner = parseNot(error);
+                    if (!inner) return nullptr;
+                    auto node = std::make_unique<Node>();
+                    node->kind = Node::NOT;
+                    node->children.push_back(std::move(inner));
+                    return node;
+                }
+                if (text[pos] == '(') {
+                    pos++;
+                    std::unique_ptr<Node> inner = parseOr(error);
+                    if (!inner) return nullptr;
+                    skipSpace();
+                    if (text[pos] != ')') {
+                        *error = "Missing ')' at position " + std::to_string(pos);
+                        return nullptr;
+                    }
+                    pos++;
+                    return inner;
+                }
+                auto node = std::make_unique<Node>();
+                node->kind = Node::TAG;
+                if (text[pos] == '@') {
+                    node->kind = Node::DIR;
+                    pos++;
+                }
+                if (text[pos] == '"') {
+                    size_t start = ++pos;
+                    while (text[pos] && text[pos] != '"') pos++;
+                    if (!text[pos]) {
+                        *error = "Missing '\"' for the tag at position " + std::to_string(start - 1);
+                        return nullptr;
+                    }
+                    node->tag.assign(text + start, pos - start);
+                    pos++;
+                    return node;
+                }
+                size_t start = pos;
+                while (text[pos] && !std::isspace((unsigned char)text[pos]) && !isOperator(text[pos])) pos++;
+                if (pos == start) {
+                    if (text[pos]) *error = "Expected a tag at position " + std::to_string(pos);
+                    else *error = "Expected a tag at the end of the query";
+                    return nullptr;
+                }
+                node->tag.assign(text + start, pos - start);
+                return node;
+            }
+
+            const char* text;
+            size_t pos;
+        };
+
+        /**
+         * @brief Load the files under a directory, from the directory tree
+         * @param db Session
+         * @param path Directory path
+         * @param out Pointer to the return Bitmap, empty if the directory doesn't exist
+         * @param errmsg SQLite3 error message char**
+         * @retval true Files loaded
+         * @retval false An error has occurred
+         */
+        bool loadSubtree(Database& db, const std::string& path, Bitmap* out, char** errmsg) {
+            *out = Bitmap();
+            char* error = nullptr;
+            int dir = db.findDir(path.c_str(), &error);
+            if (error) {
+                if (errmsg) *errmsg = error;
+                else sqlite3_free(error);
+                return false;
+            }
+            if (dir == -1) return true;
+            IdCursor cursor;
+            if (!db.listSubtreeFiles(dir, &cursor, errmsg)) return false;
+            int file = 0;
+            short res;
+            while ((res = cursor.next(&file, errmsg)) == 1) out->add(file);
+            return res == 0;
+        }
+
+        /**
+         * @brief Find the tag a query term stands for
+         *
+         * Aliases are followed to their target, which is one lookup as they
+         * never point at another alias.
+         *
+         * @param db The session
+         * @param name Tag name
+         * @param tag Pointer to the return int, -1 if the tag doesn't exist
+         * @param subtags Pointer to the return bool, set to whether any tag is under it
+         * @param errmsg SQLite3 error message char**
+         * @retval true Tag resolved
+         * @retval false An error has occurred
+         */
+        bool resolveTag(Database& db, const std::string& name, int* tag, bool* subtags, char** errmsg) {
+            char* error = nullptr;
+            *tag = db.getTag(name.c_str(), &error);
+            int alias = *tag == -1 ? 0 : db.getTagAlias(*tag, &error);
+            if (error) {
+                if (errmsg) *errmsg = error;
+                else sqlite3_free(error);
+                return false;
+            }
+            *subtags = false;
+            if (*tag == -1) return true;
+            if (alias > 0) *tag = alias;
+            // The tag itself and at most one more row tell whether it has any
+            IdCursor cursor;
+            if (!db.listSubtreeTags(*tag, &cursor, errmsg)) return false;
+            int id = 0;
+            short res = 0;
+            for (int rows = 0; rows < 2 && (res = cursor.next(&id, errmsg)) == 1; rows++) *subtags = rows == 1;
+            return res != -1;
+        }
+
+        /**
+         * @brief Load the files of a tag and every tag under it
+         * @param db The session
+         * @param tag Tag ID
+         * @param out Pointer to the return Bitmap
+         * @param errmsg SQLite3 error message char**
+         * @retval true Files loaded
+         * @retval false An error has occurred
+         */
+        bool loadTagTree(Database& db, int tag, Bitmap* out, char** errmsg) {
+            *out = Bitmap();
+            IdCursor cursor;
+            if (!db.listSubtreeTagFiles(tag, &cursor, errmsg)) return false;
+            int file = 0;
+            short res;
+            while ((res = cursor.next(&file, errmsg)) == 1) out->add(file);
+            return res == 0;
+        }
+
+        /**
+         * @brief Collect the inputs of nested ORs into one list
+         */
+        void flattenOr(const Node& node, std::vector<const Node*>* out) {
+            if (node.kind == Node::OR) for (const auto& child : node.children) flattenOr(*child, out);
+            else out->push_back(&node);
+        }
+
+        /**
+         * @brief Split an AND into included and excluded inputs
+         *
+         * Nested ANDs are merged, double negations cancel out and
+         * !(a | b) becomes two exclusions.
+         */
+        void flattenAnd(const Node& node, bool negated, std::vector<const Node*>* include, std::vector<const Node*>* exclude) {
+            if (node.kind == Node::NOT) flattenAnd(*node.children.front(), !negated, include, exclude);
+            else if (node.kind == Node::AND && !negated) for (const auto& child : node.children) flattenAnd(*child, false, include, exclude);
+            else if (node.kind == Node::OR && negated) for (const auto& child : node.children) flattenAnd(*child, true, include, exclude);
+            else (negated ? exclude : include)->push_back(&node);
+        }
+
+        /**
+         * @brief Turns an expression tree into postings
+         *
+         * Combining inputs is the same for every backend, subclasses only
+         * provide the postings of single tags and directories.
+         */
+        class Planner {
+        public:
+            virtual ~Planner() = default;
+
+            /**
+             * @brief Plan a node
+             * @param node The expression
+             * @param errmsg SQLite3 error message char**
+             * @return The postings, nullptr on error
+             */
+            std::unique_ptr<Postings> plan(const Node& node, char** errmsg) {
+                switch (node.kind) {
+                    case Node::TAG:
+                        return planTag(node.tag, errmsg);
+                    case Node::DIR:
+                        return planDir(node.tag, errmsg);
+                    case Node::OR:
+                        return planOr(node, errmsg);
+                    case Node::AND:
+                    case Node::NOT:
+                    default:
+                        // A lone NOT is an AND with nothing but exclusions
+                        return planAnd(node, errmsg);
+                }
+            }
+
+        protected:
+            /**
+             * @brief Postings of a tag, EmptyPostings if it doesn't exist
+             */
+            virtual std::unique_ptr<Postings> planTag(const std::string& name, char** errmsg) = 0;
+
+            /**
+             * @brief Postings of the files under a directory, EmptyPostings if it doesn't exist
+             */
+            virtual std::unique_ptr<Postings> planDir(const std::string& path, char** errmsg) = 0;
+
+            /**
+             * @brief Postings of every file, the base of a lone NOT
+             */
+            virtual std::unique_ptr<Postings> planAll(char** errmsg) = 0;
+
+            /**
+             * @brief Tag co-occurrence statistics to estimate intersections with, nullptr for none
+             */
+            virtual const TagCooccurrence* cooccurrence() const {
+                return nullptr;
+            }
+
+        private:
+            std::unique_ptr<Postings> planOr(const Node& node, char** errmsg) {
+                std::vector<const Node*> children;
+                flattenOr(node, &children);
+                std::vector<std::unique_ptr<Postings>> inputs;
+                for (const Node* child : children) {
+                    std::unique_ptr<Postings> input = plan(*child, errmsg);
+                    if (!input) return nullptr;
+                    if (input->estimate > 0) inputs.push_back(std::move(input));
+                }
+                if (inputs.empty()) return std::make_unique<EmptyPostings>();
+                if (inputs.size() == 1) return std::move(inputs.front());
+                return std::make_unique<OrPostings>(std::move(inputs));
+            }
+
+            std::unique_ptr<Postings> planAnd(const Node& node, char** errmsg) {
+                std::vector<const Node*> include, exclude;
+                flattenAnd(node, false, &include, &exclude);
+                std::vector<std::unique_ptr<Postings>> inputs;
+                for (const Node* child : include) {
+                    std::unique_ptr<Postings> input = plan(*child, errmsg);
+                    if (!input) return nullptr;
+                    // One empty input empties the whole intersection
+                    if (input->estimate == 0) return std::make_unique<EmptyPostings>();
+                    inputs.push_back(std::move(input));
+                }
+                if (inputs.empty()) {
+                    std::unique_ptr<Postings> all = planAll(errmsg);
+                    if (!all) return nullptr;
+                    inputs.push_back(std::move(all));
+                }
+                // Most selective input first, it drives the intersection
+                std::stable_sort(inputs.begin(), inputs.end(), [](const auto& a, const auto& b) { return a->estimate < b->estimate; });
+                long long together = -1;
+                if (inputs.size() > 1 && cooccurrence()) together = orderByPairs(*cooccurrence(), &inputs);
+                std::unique_ptr<Postings> base;
+                if (inputs.size() == 1) base = std::move(inputs.front());
+                else base = std::make_unique<AndPostings>(std::move(inputs));
+                // Statistics may be stale, an estimate of 0 would drop the intersection from ORs
+                if (together >= 0) base->estimate = std::max(1LL, std::min(base->estimate, together));
+                if (exclude.empty()) return base;
+                std::vector<std::unique_ptr<Postings>> excluded;
+                for (const Node* child : exclude) {
+                    std::unique_ptr<Postings> input = plan(*child, errmsg);
+                    if (!input) return nullptr;
+                    if (input->estimate > 0) excluded.push_back(std::move(input));
+                }
+                if (excluded.empty()) return base;
+                // Largest exclusions first, they are the most likely to reject a candidate
+                std::stable_sort(excluded.begin(), excluded.end(), [](const auto& a, const auto& b) { return a->estimate > b->estimate; });
+                return std::make_unique<ExceptPostings>(std::move(base), std::move(excluded));
+            }
+
+            /**
+             * @brief Put the inputs that share the fewest files with the driving input right after it
+             * @param stats Co-occurrence statistics
+             * @param inputs Inputs sorted by estimate, reordered after the first
+             * @return The fewest files any two tag inputs share, -1 if fewer than two are tags
+             */
+            static long long orderByPairs(const TagCooccurrence& stats, std::vector<std::unique_ptr<Postings>>* inputs) {
+                long long fewest = -1;
+                for (size_t i = 0; i < inputs->size(); i++) {
+                    for (size_t j = i + 1; j < inputs->size(); j++) {
+                        if (!(*inputs)[i]->sourceTag || !(*inputs)[j]->sourceTag) continue;
+                        long long together = stats.pairCount((*inputs)[i]->sourceTag, (*inputs)[j]->sourceTag);
+                        if (fewest < 0 || together < fewest) fewest = together;
+                    }
+                }
+                const Postings& driver = *inputs->front();
+                if (!driver.sourceTag || fewest < 0) return fewest;
+                // Candidates of the driver mostly fail the input checked right after it
+                auto shared = [&](const std::unique_ptr<Postings>& input) {
+                    return input->sourceTag ? (long long)stats.pairCount(driver.sourceTag, input->sourceTag) : input->estimate;
+                };
+                std::stable_sort(inputs->begin() + 1, inputs->end(), [&](const auto& a, const auto& b) { return shared(a) < shared(b); });
+                return fewest;
+            }
+        };
+
+        /**
+         * @brief Plans with SQLite range scans
+         */
+        class SqlPlanner : public Planner {
+        public:
+            explicit SqlPlanner(Database& db) : db(db) {}
+
+        protected:
+            std::unique_ptr<Postings> planTag(const std::string& name, char** errmsg) override {
+                int tag = -1;
+                bool subtags = false;
+                if (!resolveTag(db, name, &tag, &subtags, errmsg)) return nullptr;
+                if (tag == -1) return std::make_unique<EmptyPostings>();
+                if (subtags) {
+                    // Files of many tags, sorted and merged once up front like a directory subtree
+                    Bitmap files;
+                    if (!loadTagTree(db, tag, &files, errmsg)) return nullptr;
+                    if (files.empty()) return std::make_unique<EmptyPostings>();
+                    return std::make_unique<BitmapPostings>(std::move(files), "TAG TREE \"" + name + '"');
+                }
+                int count = db.getTagFileCount(tag, errmsg);
+                if (count == -1) return nullptr;
+                if (count == 0) return std::make_unique<EmptyPostings>();
+                auto postings = std::make_unique<SqlPostings>(db.handle(),
+                    "SELECT file FROM filetag WHERE tag = ?1 AND file >= ?2 ORDER BY file;", tag, "TAG \"" + name + '"');
+                postings->estimate = count;
+                postings->sourceTag = (unsigned int)tag;
+                return postings;
+            }
+
+            std::unique_ptr<Postings> planDir(const std::string& path, char** errmsg) override {
+                // A subtree's files are scattered over the ID range, sorting them once beats seeking
+                Bitmap files;
+                if (!loadSubtree(db, path, &files, errmsg)) return nullptr;
+                if (files.empty()) return std::make_unique<EmptyPostings>();
+                return std::make_unique<BitmapPostings>(std::move(files), "UNDER \"" + path + '"');
+            }
+
+            std::unique_ptr<Postings> planAll(char** errmsg) override {
+                auto postings = std::make_unique<SqlPostings>(db.handle(),
+                    "SELECT id FROM file WHERE id >= ?2 ORDER BY id;", -1, "ALL FILES");
+                // IDs are handed out in order, the largest one is a cheap upper bound
+                sqlite3_stmt* stmt = nullptr;
+                if (sqlite3_prepare_v2(db.handle(), "SELECT max(id) FROM file;", -1, &stmt, nullptr) != SQLITE_OK) {
+                    if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+                    return nullptr;
+                }
+                if (sqlite3_step(stmt) == SQLITE_ROW) postings->estimate = sqlite3_column_int64(stmt, 0);
+                sqlite3_finalize(stmt);
+                return postings;
+            }
+
+            const TagCooccurrence* cooccurrence() const override {
+                return db.getCooccurrence();
+            }
+
+        private:
+            Database& db;
+        };
+
+        /**
+         * @brief Plans with the postings of a snapshot, nothing is read besides them
+         */
+        class SnapshotPlanner : public Planner {
+        public:
+            explicit SnapshotPlanner(const Snapshot& snapshot) : snapshot(snapshot) {}
+
+        protected:
+            std::unique_ptr<Postings> planTag(const std::string& name, char**) override {
+                int tag = snapshot.getTag(name.c_str());
+                if (tag == -1) return std::make_unique<EmptyPostings>();
+                int alias = snapshot.getTagAlias(tag);
+                if (alias > 0) tag = alias;
+                IdSpan subtree = snapshot.listSubtreeTags(tag);
+                if (subtree.size() > 1) {
+                    Bitmap files;
+                    for (uint32_t subtag : subtree) for (uint32_t file : snapshot.listTagFiles(subtag)) files.add(file);
+                    if (files.empty()) return std::make_unique<EmptyPostings>();
+                    return std::make_unique<BitmapPostings>(std::move(files), "TAG TREE \"" + name + '"');
+                }
+                IdSpan files = snapshot.listTagFiles(tag);
+                if (files.empty()) return std::make_unique<EmptyPostings>();
+                return std::make_unique<SpanPostings>(files, "TAG \"" + name + '"');
+            }
+
+            std::unique_ptr<Postings> planDir(const std::string& path, char**) override {
+                int dir = snapshot.findDir(path.c_str());
+                if (dir == -1) return std::make_unique<EmptyPostings>();
+                std::vector<unsigned int> dirs;
+                snapshot.listSubtreeDirs(dir, &dirs);
+                Bitmap files;
+                for (unsigned int subdir : dirs) for (uint32_t file : snapshot.listDirFiles(subdir)) files.add(file);
+                if (files.empty()) return std::make_unique<EmptyPostings>();
+                return std::make_unique<BitmapPostings>(std::move(files), "UNDER \"" + path + '"');
+            }
+
+            std::unique_ptr<Postings> planAll(char**) override {
+                return std::make_unique<SpanPostings>(snapshot.listFiles(), "ALL FILES");
+            }
+
+        private:
+            const Snapshot& snapshot;
+        };
+
+        /**
+         * @brief Evaluates an expression tree with the bitmaps of a tag index
+         *
+         * Same rules as the Planner: ANDs intersect the smallest sets first
+         * and subtract their exclusions, a lone NOT subtracts from all files.
+         * Needs the index read lock held.
+         */
+        class BitmapEvaluator {
+        public:
+            BitmapEvaluator(Database& db, const TagIndex& index) : db(db), index(index) {}
+
+            /**
+             * @brief Evaluate a node
+             * @param node The expression
+             * @param out Pointer to the return Bitmap
+             * @param errmsg SQLite3 error message char**
+             * @retval true Evaluated
+             * @retval false An error has occurred
+             */
+            bool evaluate(const Node& node, Bitmap* out, char** errmsg) {
+                const Bitmap* set = nullptr;
+                if (node.kind == Node::TAG) {
+                    if (!lookup(node.tag, &set, out, errmsg)) return false;
+                    if (set != out) *out = set ? *set : Bitmap();
+                    return true;
+                }
+                // The index has no directories, subtrees come from the database
+                if (node.kind == Node::DIR) return loadSubtree(db, node.tag, out, errmsg);
+                if (node.kind == Node::OR) {
+                    std::vector<const Node*> children;
+                    flattenOr(node, &children);
+                    *out = Bitmap();
+                    for (const Node* child : children) {
+                        std::vector<Bitmap> scratch(1);
+                        if (!resolve(*child, &set, &scratch.front(), errmsg)) return false;
+                        if (set) *out = Bitmap::unite(*out, *set);
+                    }
+                    return true;
+                }
+                std::vector<const Node*> include, exclude;
+                flattenAnd(node, false, &include, &exclude);
+                // Evaluated subexpressions, kept alive while their pointers are used
+                std::vector<Bitmap> scratch(include.size() + exclude.size());
+                std::vector<const Bitmap*> sets;
+                for (size_t i = 0; i < include.size(); i++) {
+                    if (!resolve(*include[i], &set, &scratch[i], errmsg)) return false;
+                    if (!set) {
+                        *out = Bitmap();
+                        return true;
+                    }
+                    sets.push_back(set);
+                }
+                if (sets.empty()) sets.push_back(&index.allFiles());
+                std::stable_sort(sets.begin(), sets.end(), [](const Bitmap* a, const Bitmap* b) { return a->cardinality() < b->cardinality(); });
+                *out = *sets.front();
+                for (size_t i = 1; i < sets.size() && !out->empty(); i++) *out = Bitmap::intersect(*out, *sets[i]);
+                for (size_t i = 0; i < exclude.size() && !out->empty(); i++) {
+                    if (!resolve(*exclude[i], &set, &scratch[include.size() + i], errmsg)) return false;
+                    if (set) *out = Bitmap::subtract(*out, *set);
+                }
+                return true;
+            }
+
+        private:
+            /**
+             * @brief Get the set of a tag straight from the index, without copying unless tags are under it
+             * @param name Tag name
+             * @param set Pointer to the return pointer, nullptr if no file has the tag
+             * @param scratch Bitmap to merge the sets of the tags under it into
+             * @param errmsg SQLite3 error message char**
+             * @retval true Tag resolved
+             * @retval false An error has occurred
+             */
+            bool lookup(const std::string& name, const Bitmap** set, Bitmap* scratch, char** errmsg) {
+                int tag = -1;
+                bool subtags = false;
+                if (!resolveTag(db, name, &tag, &subtags, errmsg)) return false;
+                if (!subtags) {
+                    *set = tag == -1 ? nullptr : index.tagFiles(tag);
+                    return true;
+                }
+                IdCursor cursor;
+                if (!db.listSubtreeTags(tag, &cursor, errmsg)) return false;
+                std::vector<const Bitmap*> sets;
+                int subtag = 0;
+                short res;
+                while ((res = cursor.next(&subtag, errmsg)) == 1) {
+                    const Bitmap* files = index.tagFiles(subtag);
+                    if (files) sets.push_back(files);
+                }
+                if (res == -1) return false;
+                // Merged in pairs, so each ID is copied once per level rather than once per tag
+                std::vector<Bitmap> merged;
+                for (size_t i = 0; i < sets.size(); i += 2) merged.push_back(i + 1 < sets.size() ? Bitmap::unite(*sets[i], *sets[i + 1]) : *sets[i]);
+                while (merged.size() > 1) {
+                    std::vector<Bitmap> next;
+                    for (size_t i = 0; i < merged.size(); i += 2) {
+                        next.push_back(i + 1 < merged.size() ? Bitmap::unite(merged[i], merged[i + 1]) : std::move(merged[i]));
+                    }
+                    merged.swap(next);
+                }
+                *scratch = merged.empty() ? Bitmap() : std::move(merged.front());
+                *set = scratch->empty() ? nullptr : scratch;
+                return true;
+            }
+
+            /**
+             * @brief Get the set of a node, evaluating into scratch unless it's a plain tag
+             * @param node The expression
+             * @param set Pointer to the return pointer, nullptr if the set is empty
+             * @param scratch Bitmap to evaluate into
+             * @param errmsg SQLite3 error message char**
+             * @retval true Node resolved
+             * @retval false An error has occurred
+             */
+            bool resolve(const Node& node, const Bitmap** set, Bitmap* scratch, char** errmsg) {
+                if (node.kind == Node::TAG) return lookup(node.tag, set, scratch, errmsg);
+                if (!evaluate(node, scratch, errmsg)) return false;
+                *set = scratch->empty() ? nullptr : scratch;
+                return true;
+            }
+
+            Database& db;
+            const TagIndex& index;
+        };
+    }
+
+    QueryResult::QueryResult() : db(nullptr), snapshot(nullptr), last(0) {}
+
+    QueryResult::~QueryResult() = default;
+
+    QueryResult::QueryResult(QueryResult&& other) noexcept = default;
+
+    QueryResult& QueryResult::operator=(QueryResult&& other) noexcept = default;
+
+    /**
+     * @brief Get the next matching file ID
+     * @param file Pointer to the return int
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 No more files
+     * @retval 1 File ID returned
+     */
+    short QueryResult::next(int* file, char** errmsg) {
+        if (!root) return 0;
+        short res = root->seek(last + 1, file, errmsg);
+        if (res == 1) last = *file;
+        else root.reset();
+        return res;
+    }
+
+    /**
+     * @brief Get the full path of the next matching file
+     * @param path Pointer to the return std::string
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred
+     * @retval 0 No more files
+     * @retval 1 Path returned
+     */
+    short QueryResult::nextPath(std::string* path, char** errmsg) {
+        int file = 0;
+        short res = next(&file, errmsg);
+        if (res != 1) return res;
+        if (snapshot) {
+            // Files come from the snapshot's own postings, so they are always found
+            snapshot->getFilePath(file, path);
+            return 1;
+        }
+        return db->getFilePath(file, path, errmsg) ? 1 : -1;
+    }
+
+    /**
+     * @brief Describe the plan the query is run with
+     * @return The plan, one operator per line, most selective inputs first
+     */
+    std::string QueryResult::explain() const {
+        std::string out;
+        if (root) root->explain(0, &out);
+        return out;
+    }
+
+    /**
+     * @brief Run a tag query
+     * @param db The session to run the query on
+     * @param expression The query
+     * @param result Pointer to the result to stream the matching files with
+     * @param errmsg SQLite3 error message char**, also used for syntax errors
+     * @retval true Query planned, results can be read
+     * @retval false Syntax error or an error has occurred
+     */
+    bool runQuery(Database& db, const char* expression, QueryResult* result, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_RUN_QUERY);
+        *result = QueryResult();
+        if (!db.isOpen()) return false;
+        std::string error;
+        std::unique_ptr<Node> tree = Parser(expression).parse(&error);
+        if (!tree) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", error.c_str());
+            return false;
+        }
+        std::unique_ptr<Postings> root = SqlPlanner(db).plan(*tree, errmsg);
+        if (!root) return false;
+        result->db = &db;
+        result->root = std::move(root);
+        return true;
+    }
+
+    /**
+     * @brief Run a tag query against an in-memory tag index
+     * @param db The session to resolve names with
+     * @param index Tag index of the same database
+     * @param expression The query
+     * @param result Pointer to the result to stream the matching files with
+     * @param errmsg SQLite3 error message char**, also used for syntax errors
+     * @retval true Query evaluated, results can be read
+     * @retval false Syntax error or an error has occurred
+     */
+    bool runQuery(Database& db, const TagIndex& index, const char* expression, QueryResult* result, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_RUN_QUERY);
+        *result = QueryResult();
+        if (!db.isOpen()) return false;
+        std::string error;
+        std::unique_ptr<Node> tree = Parser(expression).parse(&error);
+        if (!tree) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", error.c_str());
+            return false;
+        }
+        Bitmap files;
+        {
+            std::shared_lock<std::shared_mutex> lock = index.readLock();
+            if (!BitmapEvaluator(db, index).evaluate(*tree, &files, errmsg)) return false;
+        }
+        result->db = &db;
+        result->root = std::make_unique<BitmapPostings>(std::move(files));
+        return true;
+    }
+
+    /**
+     * @brief Run a tag query against a read-only snapshot
+     * @param snapshot The open snapshot
+     * @param expression The query
+     * @param result Pointer to the result to stream the matching files with
+     * @param errmsg Error message char**, used for syntax errors
+     * @retval true Query planned, results can be read
+     * @retval false Syntax error or the snapshot isn't open
+     */
+    bool runQuery(const Snapshot& snapshot, const char* expression, QueryResult* result, char** errmsg) {
+        *result = QueryResult();
+        if (!snapshot.isOpen()) return false;
+        std::string error;
+        std::unique_ptr<Node> tree = Parser(expression).parse(&error);
+        if (!tree) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", error.c_str());
+            return false;
+        }
+        result->snapshot = &snapshot;
+        result->root = SnapshotPlanner(snapshot).plan(*tree, errmsg);
+        return true;
+    }
+}
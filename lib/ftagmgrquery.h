@@ -0,0 +1,128 @@
+/**
+ * @file ftagmgrquery.h
+ * @brief FTagMgrLib tag query header file
+ */
+
+#ifndef FTAGMGRQUERY_H
+#define FTAGMGRQUERY_H
+
+#include <memory>
+#include <string>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    class Postings;
+    class Snapshot;
+    class TagIndex;
+
+    /**
+     * @brief Lazily streams the files matching a tag query
+     *
+     * Matching files are found as next() is called, in ascending ID order,
+     * so the first results come back without evaluating the whole query.
+     * Movable, not copyable. Must not outlive the Database session or
+     * Snapshot it was run on.
+     */
+    class QueryResult {
+    public:
+        QueryResult();
+        ~QueryResult();
+        QueryResult(QueryResult&& other) noexcept;
+        QueryResult& operator=(QueryResult&& other) noexcept;
+        QueryResult(const QueryResult&) = delete;
+        QueryResult& operator=(const QueryResult&) = delete;
+
+        /**
+         * @brief Get the next matching file ID
+         * @param file Pointer to the return int
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 No more files
+         * @retval 1 File ID returned
+         */
+        short next(int* file, char** errmsg);
+
+        /**
+         * @brief Get the full path of the next matching file
+         * @param path Pointer to the return std::string
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred
+         * @retval 0 No more files
+         * @retval 1 Path returned
+         */
+        short nextPath(std::string* path, char** errmsg);
+
+        /**
+         * @brief Describe the plan the query is run with
+         * @return The plan, one operator per line, most selective inputs first
+         */
+        std::string explain() const;
+
+    private:
+        friend bool runQuery(Database& db, const char* expression, QueryResult* result, char** errmsg);
+        friend bool runQuery(Database& db, const TagIndex& index, const char* expression, QueryResult* result, char** errmsg);
+        friend bool runQuery(const Snapshot& snapshot, const char* expression, QueryResult* result, char** errmsg);
+        // Where paths are resolved, one of the two
+        Database* db;
+        const Snapshot* snapshot;
+        std::unique_ptr<Postings> root;
+        // Last ID returned, the next one is searched from here
+        int last;
+    };
+
+    /**
+     * @brief Run a tag query
+     *
+     * Expressions combine tag names with ! (not), & (and), | (or) and
+     * parentheses. Terms next to each other without an operator are and-ed,
+     * so "photo 2024 !private" means photo & 2024 & !private. Tag names
+     * containing spaces or operators can be written in double quotes.
+     * Tags that don't exist match no files. A tag also matches the files
+     * of every tag under it, so "photo" finds files tagged "photo/2024",
+     * and an alias matches what the tag it stands for does. A name starting with @ is a
+     * directory and matches every file under it, so "@/photos/2024 !private"
+     * looks at one subtree only.
+     *
+     * @param db The session to run the query on
+     * @param expression The query
+     * @param result Pointer to the result to stream the matching files with
+     * @param errmsg SQLite3 error message char**, also used for syntax errors
+     * @retval true Query planned, results can be read
+     * @retval false Syntax error or an error has occurred
+     */
+    bool runQuery(Database& db, const char* expression, QueryResult* result, char** errmsg);
+
+    /**
+     * @brief Run a tag query against an in-memory tag index
+     *
+     * Same expressions and results as the SQLite version, but the whole
+     * query is evaluated up front with bitmap operations. The session is
+     * only used to resolve tag names and file paths.
+     *
+     * @param db The session to resolve names with
+     * @param index Tag index of the same database
+     * @param expression The query
+     * @param result Pointer to the result to stream the matching files with
+     * @param errmsg SQLite3 error message char**, also used for syntax errors
+     * @retval true Query evaluated, results can be read
+     * @retval false Syntax error or an error has occurred
+     */
+    bool runQuery(Database& db, const TagIndex& index, const char* expression, QueryResult* result, char** errmsg);
+
+    /**
+     * @brief Run a tag query against a read-only snapshot
+     *
+     * Same expressions, plans and results as the SQLite version, with the
+     * postings read straight from the mapped snapshot instead of SQLite.
+     *
+     * @param snapshot The open snapshot
+     * @param expression The query
+     * @param result Pointer to the result to stream the matching files with
+     * @param errmsg Error message char**, used for syntax errors
+     * @retval true Query planned, results can be read
+     * @retval false Syntax error or the snapshot isn't open
+     */
+    bool runQuery(const Snapshot& snapshot, const char* expression, QueryResult* result, char** errmsg);
+}
+
+#endif
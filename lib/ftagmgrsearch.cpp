@@ -0,0 +1,340 @@
+/**
+ * @file ftagmgrsearch.cpp
+ * @brief FTagMgr tag name search source code
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <queue>
+#include <sqlite3.h>
+#include "ftagmgrsearch.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        const uint32_t noPosition = 0xffffffffU;
+        // Pending tags are merged once there are this many, or 1/64 of the index if that's more
+        const size_t minPending = 1024;
+
+        /**
+         * @brief Get the distinct trigrams of a name, ASCII-lowercased and padded like pg_trgm
+         * @param text The name
+         * @param out Pointer to the return vector, sorted, three bytes per trigram
+         */
+        void trigramsOf(std::string_view text, std::vector<uint32_t>* out) {
+            out->clear();
+            if (text.empty()) return;
+            std::string padded = "  ";
+            for (char c : text) padded += (char)((c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c);
+            padded += ' ';
+            for (size_t i = 0; i + 3 <= padded.size(); i++) {
+                out->push_back((uint32_t)(unsigned char)padded[i] << 16 | (uint32_t)(unsigned char)padded[i + 1] << 8 | (unsigned char)padded[i + 2]);
+            }
+            std::sort(out->begin(), out->end());
+            out->erase(std::unique(out->begin(), out->end()), out->end());
+        }
+
+        bool startsWith(std::string_view text, std::string_view prefix) {
+            return text.compare(0, prefix.size(), prefix) == 0;
+        }
+    }
+
+    /**
+     * @brief Load every tag and its file count from the database
+     * @param db The session to read from
+     * @param errmsg SQLite3 error message char**
+     * @retval true Index loaded
+     * @retval false An error has occurred, the index was left unchanged
+     */
+    bool TagSearch::build(Database& db, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_BUILD_TAG_SEARCH);
+        if (!db.isOpen()) return false;
+        Data loaded;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db.handle(), "SELECT tag.id, tag.tag, coalesce(tagstat.files, 0) FROM tag "
+                                            "LEFT JOIN tagstat ON tagstat.tag = tag.id ORDER BY tag.id;", -1, &stmt, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            return false;
+        }
+        int ecode = 0;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char* value = (const char*)sqlite3_column_text(stmt, 1);
+            insert(&loaded, (unsigned int)sqlite3_column_int64(stmt, 0), std::string_view(value ? value : "", (size_t)sqlite3_column_bytes(stmt, 1)),
+                   sqlite3_column_int(stmt, 2));
+        }
+        if (ecode != SQLITE_DONE) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        sqlite3_finalize(stmt);
+        merge(&loaded);
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::swap(data, loaded);
+        return true;
+    }
+
+    void TagSearch::tagAdded(unsigned int tag, std::string_view value) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (data.byId.count(tag)) return;
+        insert(&data, tag, value, 0);
+        if (data.pending.size() >= std::max(minPending, data.sorted.size() / 64)) merge(&data);
+    }
+
+    void TagSearch::tagged(unsigned int, unsigned int tag) {
+        count(tag, 1);
+    }
+
+    void TagSearch::untagged(unsigned int, unsigned int tag) {
+        count(tag, -1);
+    }
+
+    /**
+     * @brief Find the tags starting with a prefix, case sensitive
+     * @param prefix Start of the tag names, empty for every tag
+     * @param limit Most matches to return
+     * @param out Pointer to the return vector, most used tags first, ties in name order
+     */
+    void TagSearch::complete(std::string_view prefix, size_t limit, std::vector<TagMatch>* out) const {
+        out->clear();
+        if (!limit) return;
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const std::vector<Entry>& entries = data.entries;
+        // The names with the prefix are one range of the sorted names
+        auto lo = std::lower_bound(data.sorted.begin(), data.sorted.end(), prefix,
+                                   [&](uint32_t index, std::string_view key) { return std::string_view(entries[index].value) < key; });
+        auto hi = std::partition_point(lo, data.sorted.end(), [&](uint32_t index) { return startsWith(entries[index].value, prefix); });
+        // Ranges ordered by their most used tag; taking one splits its range around it
+        struct Range {
+            uint32_t lo, hi, top;
+        };
+        auto worse = [&](const Range& a, const Range& b) { return a.top != b.top && better(data, a.top, b.top) == b.top; };
+        std::priority_queue<Range, std::vector<Range>, decltype(worse)> ranges(worse);
+        uint32_t first = (uint32_t)(lo - data.sorted.begin()), last = (uint32_t)(hi - data.sorted.begin());
+        if (first < last) ranges.push({first, last, best(data, first, last)});
+        std::vector<uint32_t> found;
+        while (!ranges.empty() && found.size() < limit) {
+            Range range = ranges.top();
+            ranges.pop();
+            found.push_back(data.sorted[range.top]);
+            if (range.lo < range.top) ranges.push({range.lo, range.top, best(data, range.lo, range.top)});
+            if (range.top + 1 < range.hi) ranges.push({range.top + 1, range.hi, best(data, range.top + 1, range.hi)});
+        }
+        for (uint32_t index : data.pending) if (startsWith(entries[index].value, prefix)) found.push_back(index);
+        auto ranked = [&](uint32_t a, uint32_t b) {
+            if (entries[a].files != entries[b].files) return entries[a].files > entries[b].files;
+            return entries[a].value < entries[b].value;
+        };
+        size_t kept = std::min(limit, found.size());
+        std::partial_sort(found.begin(), found.begin() + kept, found.end(), ranked);
+        for (size_t i = 0; i < kept; i++) {
+            const Entry& entry = entries[found[i]];
+            out->push_back(TagMatch{entry.id, entry.value, entry.files, 1.0});
+        }
+    }
+
+    /**
+     * @brief Find the tags with names similar to a text, tolerating typos
+     * @param text The text to search for
+     * @param limit Most matches to return
+     * @param minSimilarity Smallest similarity to return, from 0 to 1; 0.3 is a good start
+     * @param out Pointer to the return vector, most similar first, ties by use and then name
+     */
+    void TagSearch::fuzzy(std::string_view text, size_t limit, double minSimilarity, std::vector<TagMatch>* out) const {
+        out->clear();
+        std::vector<uint32_t> query;
+        trigramsOf(text, &query);
+        if (!limit || query.empty()) return;
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        static const std::vector<uint32_t> none;
+        std::vector<const std::vector<uint32_t>*> lists;
+        for (uint32_t gram : query) {
+            auto it = data.grams.find(gram);
+            lists.push_back(it == data.grams.end() ? &none : &it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+        const double q = (double)query.size();
+        // Shared trigrams per entry so far, reset through touched before returning
+        thread_local std::vector<uint16_t> hits;
+        thread_local std::vector<uint32_t> touched;
+        if (hits.size() < data.entries.size()) hits.resize(data.entries.size());
+        struct Candidate {
+            uint32_t index;
+            double similarity;
+        };
+        std::vector<Candidate> found;
+        // The best matches are usually far above the threshold, stricter passes read fewer lists and stop once they have enough
+        for (double threshold : {std::max(minSimilarity, 0.6), std::max(minSimilarity, 0.45), minSimilarity}) {
+            found.clear();
+            // A match shares at least needed trigrams, so it is in one of the shortest size - needed + 1 lists
+            size_t needed = std::min(query.size(), (size_t)std::max(1.0, std::ceil(threshold * q - 1e-9)));
+            size_t scanned = query.size() - needed + 1;
+            touched.clear();
+            for (size_t i = 0; i < scanned; i++) {
+                for (uint32_t index : *lists[i]) if (hits[index]++ == 0) touched.push_back(index);
+            }
+            // Similarity is shared / (q + c - shared), so an entry's trigram count c and the lists left bound it
+            auto reachable = [&](uint32_t index, size_t left) {
+                double c = data.entries[index].trigrams;
+                if (c < threshold * q || c * threshold > q) return false;
+                return (double)(hits[index] + left) >= threshold * (q + c) / (1 + threshold) - 1e-9;
+            };
+            std::vector<uint32_t> candidates;
+            for (uint32_t index : touched) {
+                if (reachable(index, query.size() - scanned)) candidates.push_back(index);
+                else hits[index] = 0;
+            }
+            // The long lists only add to candidates, probed one by one or walked, whichever is fewer steps
+            for (size_t i = scanned; i < lists.size() && !candidates.empty(); i++) {
+                const std::vector<uint32_t>& list = *lists[i];
+                if ((double)candidates.size() * std::log2((double)list.size() + 1) < (double)list.size()) {
+                    for (uint32_t index : candidates) if (std::binary_search(list.begin(), list.end(), index)) hits[index]++;
+                } else {
+                    for (uint32_t index : list) if (hits[index]) hits[index]++;
+                }
+                size_t kept = 0;
+                for (uint32_t index : candidates) {
+                    if (reachable(index, query.size() - i - 1)) candidates[kept++] = index;
+                    else hits[index] = 0;
+                }
+                candidates.resize(kept);
+            }
+            for (uint32_t index : candidates) {
+                double shared = hits[index];
+                double similarity = shared / (q + data.entries[index].trigrams - shared);
+                if (similarity >= threshold) found.push_back({index, similarity});
+            }
+            for (uint32_t index : touched) hits[index] = 0;
+            if (found.size() >= limit || threshold <= minSimilarity) break;
+        }
+        const std::vector<Entry>& entries = data.entries;
+        auto ranked = [&](const Candidate& a, const Candidate& b) {
+            if (a.similarity != b.similarity) return a.similarity > b.similarity;
+            if (entries[a.index].files != entries[b.index].files) return entries[a.index].files > entries[b.index].files;
+            return entries[a.index].value < entries[b.index].value;
+        };
+        size_t kept = std::min(limit, found.size());
+        std::partial_sort(found.begin(), found.begin() + kept, found.end(), ranked);
+        for (size_t i = 0; i < kept; i++) {
+            const Entry& entry = entries[found[i].index];
+            out->push_back(TagMatch{entry.id, entry.value, entry.files, found[i].similarity});
+        }
+    }
+
+    /**
+     * @brief Get the number of tags in the index
+     * @return Number of tags
+     */
+    size_t TagSearch::size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return data.entries.size();
+    }
+
+    /**
+     * @brief Get the approximate heap memory used by the index
+     * @return Memory use in bytes
+     */
+    size_t TagSearch::memoryUsage() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        size_t bytes = data.entries.capacity() * sizeof(Entry) + data.byId.bucket_count() * sizeof(void*)
+                       + data.byId.size() * (sizeof(void*) + 2 * sizeof(uint32_t))
+                       + (data.sorted.capacity() + data.tree.capacity() + data.pending.capacity()) * sizeof(uint32_t)
+                       + data.grams.bucket_count() * sizeof(void*);
+        // Short names live inside the std::string
+        for (const Entry& entry : data.entries) if (entry.value.capacity() > 15) bytes += entry.value.capacity() + 1;
+        for (const auto& gram : data.grams) bytes += sizeof(void*) + sizeof(gram) + gram.second.capacity() * sizeof(uint32_t);
+        return bytes;
+    }
+
+    /**
+     * @brief Add a tag to the pending run and the trigram lists
+     * @param data The index
+     * @param id Tag ID
+     * @param value Tag name
+     * @param files Files with the tag
+     */
+    void TagSearch::insert(Data* data, unsigned int id, std::string_view value, int files) {
+        uint32_t index = (uint32_t)data->entries.size();
+        std::vector<uint32_t> grams;
+        trigramsOf(value, &grams);
+        // Entries are only ever appended, so the lists stay sorted
+        for (uint32_t gram : grams) data->grams[gram].push_back(index);
+        data->entries.push_back(Entry{id, std::string(value), files, noPosition, (uint32_t)grams.size()});
+        data->byId.emplace(id, index);
+        data->pending.push_back(index);
+    }
+
+    /**
+     * @brief Merge the pending run into the sorted names
+     * @param data The index
+     */
+    void TagSearch::merge(Data* data) {
+        if (data->pending.empty()) return;
+        const std::vector<Entry>& entries = data->entries;
+        auto byName = [&](uint32_t a, uint32_t b) { return entries[a].value < entries[b].value; };
+        std::sort(data->pending.begin(), data->pending.end(), byName);
+        std::vector<uint32_t> merged(data->sorted.size() + data->pending.size());
+        std::merge(data->sorted.begin(), data->sorted.end(), data->pending.begin(), data->pending.end(), merged.begin(), byName);
+        data->sorted.swap(merged);
+        data->pending.clear();
+        for (size_t i = 0; i < data->sorted.size(); i++) data->entries[data->sorted[i]].position = (uint32_t)i;
+        rebuildTree(data);
+    }
+
+    /**
+     * @brief Build the segment tree over the sorted names, leaves at n + position
+     * @param data The index
+     */
+    void TagSearch::rebuildTree(Data* data) {
+        size_t n = data->sorted.size();
+        data->tree.assign(2 * n, noPosition);
+        for (size_t i = 0; i < n; i++) data->tree[n + i] = (uint32_t)i;
+        for (size_t i = n - 1; i >= 1 && n > 1; i--) data->tree[i] = better(*data, data->tree[2 * i], data->tree[2 * i + 1]);
+    }
+
+    /**
+     * @brief Pick the sorted position whose tag has more files, the first one on ties
+     * @return Position a or b, the other one if either is noPosition
+     */
+    uint32_t TagSearch::better(const Data& data, uint32_t a, uint32_t b) {
+        if (a == noPosition) return b;
+        if (b == noPosition) return a;
+        int filesA = data.entries[data.sorted[a]].files, filesB = data.entries[data.sorted[b]].files;
+        if (filesA != filesB) return filesA > filesB ? a : b;
+        return std::min(a, b);
+    }
+
+    /**
+     * @brief Find the position with the most files in a range of the sorted names
+     * @param data The index
+     * @param lo First position
+     * @param hi Position past the last one
+     * @return The position, noPosition for an empty range
+     */
+    uint32_t TagSearch::best(const Data& data, uint32_t lo, uint32_t hi) {
+        size_t n = data.sorted.size();
+        uint32_t result = noPosition;
+        for (size_t l = lo + n, r = hi + n; l < r; l /= 2, r /= 2) {
+            if (l & 1) result = better(data, result, data.tree[l++]);
+            if (r & 1) result = better(data, result, data.tree[--r]);
+        }
+        return result;
+    }
+
+    /**
+     * @brief Change the file count of a tag and the tree nodes above it
+     * @param tag Tag ID
+     * @param delta Files added or removed
+     */
+    void TagSearch::count(unsigned int tag, int delta) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = data.byId.find(tag);
+        if (it == data.byId.end()) return;
+        Entry& entry = data.entries[it->second];
+        entry.files += delta;
+        if (entry.position == noPosition) return;
+        size_t n = data.sorted.size();
+        for (size_t i = (entry.position + n) / 2; i >= 1; i /= 2) data.tree[i] = better(data, data.tree[2 * i], data.tree[2 * i + 1]);
+    }
+}
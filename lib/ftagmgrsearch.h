@@ -0,0 +1,129 @@
+/**
+ * @file ftagmgrsearch.h
+ * @brief FTagMgrLib tag name search header file
+ */
+
+#ifndef FTAGMGRSEARCH_H
+#define FTAGMGRSEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief A tag found by TagSearch
+     */
+    struct TagMatch {
+        unsigned int id;
+        std::string value;
+        // Files with the tag
+        int files;
+        // Trigram similarity to the searched text, 1 for prefix matches
+        double similarity;
+    };
+
+    /**
+     * @brief In-memory tag name index for autocompletion
+     *
+     * Tag names are kept sorted, with a max segment tree over their file
+     * counts, so the most used tags under a prefix come out in O(limit *
+     * log n) however many tags share the prefix. Tags added since the last
+     * merge wait in a small unsorted run that searches scan, and are merged
+     * in once it reaches 1/64 of the index. Fuzzy search goes through
+     * posting lists of the ASCII-lowercased trigrams of every name.
+     *
+     * Attach it to a session with Database::addObserver() after build() to
+     * keep it in sync. Safe to search from many threads while one updates.
+     */
+    class TagSearch : public Observer {
+    public:
+        /**
+         * @brief Load every tag and its file count from the database
+         * @param db The session to read from
+         * @param errmsg SQLite3 error message char**
+         * @retval true Index loaded
+         * @retval false An error has occurred, the index was left unchanged
+         */
+        bool build(Database& db, char** errmsg);
+
+        void tagAdded(unsigned int tag, std::string_view value) override;
+        void tagged(unsigned int file, unsigned int tag) override;
+        void untagged(unsigned int file, unsigned int tag) override;
+
+        /**
+         * @brief Find the tags starting with a prefix, case sensitive
+         * @param prefix Start of the tag names, empty for every tag
+         * @param limit Most matches to return
+         * @param out Pointer to the return vector, most used tags first, ties in name order
+         */
+        void complete(std::string_view prefix, size_t limit, std::vector<TagMatch>* out) const;
+
+        /**
+         * @brief Find the tags with names similar to a text, tolerating typos
+         *
+         * Similarity is the Jaccard index of the two names' trigram sets,
+         * as in PostgreSQL's pg_trgm. Names are padded with two spaces in
+         * front and one at the end, so "phto" still finds "photo".
+         *
+         * @param text The text to search for
+         * @param limit Most matches to return
+         * @param minSimilarity Smallest similarity to return, from 0 to 1; 0.3 is a good start
+         * @param out Pointer to the return vector, most similar first, ties by use and then name
+         */
+        void fuzzy(std::string_view text, size_t limit, double minSimilarity, std::vector<TagMatch>* out) const;
+
+        /**
+         * @brief Get the number of tags in the index
+         * @return Number of tags
+         */
+        size_t size() const;
+
+        /**
+         * @brief Get the approximate heap memory used by the index
+         * @return Memory use in bytes
+         */
+        size_t memoryUsage() const;
+
+    private:
+        struct Entry {
+            unsigned int id;
+            std::string value;
+            int files;
+            // Index in sorted, noPosition while still pending
+            uint32_t position;
+            // Distinct trigrams of the name
+            uint32_t trigrams;
+        };
+
+        struct Data {
+            std::vector<Entry> entries;
+            std::unordered_map<unsigned int, uint32_t> byId;
+            // Entry indices in name order
+            std::vector<uint32_t> sorted;
+            // Segment tree over sorted, each node holds the position with the most files under it
+            std::vector<uint32_t> tree;
+            // Entries added since the last merge
+            std::vector<uint32_t> pending;
+            // Entry indices of every trigram, ascending
+            std::unordered_map<uint32_t, std::vector<uint32_t>> grams;
+        };
+
+        static void insert(Data* data, unsigned int id, std::string_view value, int files);
+        static void merge(Data* data);
+        static void rebuildTree(Data* data);
+        static uint32_t better(const Data& data, uint32_t a, uint32_t b);
+        static uint32_t best(const Data& data, uint32_t lo, uint32_t hi);
+        void count(unsigned int tag, int delta);
+
+        mutable std::shared_mutex mutex;
+        Data data;
+    };
+}
+
+#endif
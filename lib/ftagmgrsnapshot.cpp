@@ -0,0 +1,950 @@
+/**
+ * @file ftagmgrsnapshot.cpp
+ * @brief FTagMgr read-only snapshot source code
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ftagmgrsnapshot.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        const char magic[8] = {'F', 'T', 'A', 'G', 'S', 'N', 'A', 'P'};
+        const uint32_t formatVersion = 2;
+        // Reads back differently on a host with the other byte order
+        const uint32_t byteOrderMark = 0x01020304;
+        // Offsets and counts are 32-bit, past this the database is too large for a snapshot
+        const uint64_t maxEntries = 0xffffffffULL;
+        // Marks an unused slot of a hash table
+        const uint32_t emptySlot = 0xffffffffU;
+        // Displacements tried per bucket before starting over with another seed
+        const uint32_t maxDisplacement = 1 << 16;
+        const uint32_t maxSeeds = 16;
+
+        enum SectionIndex {
+            SECTION_DIRS, SECTION_FILES, SECTION_TAGS,
+            SECTION_DIR_HASH, SECTION_FILE_HASH, SECTION_TAG_HASH,
+            SECTION_DIR_PATHS, SECTION_TAG_VALUES, SECTION_FILE_IDS,
+            SECTION_POSTINGS, SECTION_STRINGS, SECTION_COUNT
+        };
+
+        struct Section {
+            uint64_t offset;
+            uint64_t bytes;
+        };
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t byteOrder;
+            // Size of the whole file, a truncated copy is refused
+            uint64_t size;
+            Section sections[SECTION_COUNT];
+        };
+
+        // String fields are offsets into SECTION_STRINGS, ID lists offsets into SECTION_POSTINGS
+
+        struct DirRecord {
+            uint32_t id;
+            uint32_t parent;
+            uint32_t path;
+            uint32_t pathLength;
+            uint32_t files;
+            uint32_t fileCount;
+            uint32_t implicit;
+            uint32_t reserved;
+        };
+
+        struct FileRecord {
+            uint32_t id;
+            uint32_t dir;
+            uint32_t name;
+            uint32_t nameLength;
+            uint32_t tags;
+            uint32_t tagCount;
+        };
+
+        struct TagRecord {
+            uint32_t id;
+            uint32_t value;
+            uint32_t valueLength;
+            uint32_t files;
+            uint32_t fileCount;
+            uint32_t parent;
+            uint32_t alias;
+            // The tag and every tag under it
+            uint32_t subtree;
+            uint32_t subtreeCount;
+            uint32_t reserved;
+        };
+
+        /**
+         * @brief Start of a hash table section, followed by the bucket displacements and the slots
+         */
+        struct HashHeader {
+            uint32_t seed;
+            uint32_t buckets;
+            uint32_t slots;
+            uint32_t reserved;
+        };
+
+        uint64_t mix(uint64_t x) {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdULL;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ULL;
+            x ^= x >> 33;
+            return x;
+        }
+
+        /**
+         * @brief Hash a string, eight bytes at a time
+         * @param text The string
+         * @param seed Seed, different seeds give unrelated hashes
+         * @return The hash
+         */
+        uint64_t hashText(std::string_view text, uint64_t seed) {
+            uint64_t h = mix(seed ^ (text.size() * 0x9e3779b97f4a7c15ULL));
+            size_t i = 0;
+            for (; i + 8 <= text.size(); i += 8) {
+                uint64_t word;
+                std::memcpy(&word, text.data() + i, 8);
+                h = mix(h ^ word) + i;
+            }
+            uint64_t tail = 0;
+            std::memcpy(&tail, text.data() + i, text.size() - i);
+            return mix(h ^ tail);
+        }
+
+        uint64_t hashFile(uint32_t dir, std::string_view name, uint64_t seed) {
+            return hashText(name, seed ^ mix(dir + 1));
+        }
+
+        size_t hashBucket(uint64_t hash, uint32_t buckets) {
+            return (size_t)((hash >> 32) % buckets);
+        }
+
+        size_t hashSlot(uint64_t hash, uint32_t displacement, uint32_t slots) {
+            return (size_t)(mix(hash + displacement * 0x9e3779b97f4a7c15ULL) % slots);
+        }
+
+        /**
+         * @brief Build a hash-and-displace perfect hash table over count keys
+         *
+         * Keys are spread over buckets of about four, and the buckets are
+         * placed largest first, each with the first displacement that moves
+         * all its keys to free slots. A lookup is then one hash, the bucket's
+         * displacement and the slot, with no probing.
+         *
+         * @param count Number of keys
+         * @param hashOf Called with a key index and a seed, returns the key's hash
+         * @param out Pointer to the return section, as 32-bit words
+         * @retval true Table built
+         * @retval false No seed worked, only possible with colliding or duplicate keys
+         */
+        template<typename F>
+        bool buildHash(size_t count, F hashOf, std::vector<uint32_t>* out) {
+            HashHeader header{0, (uint32_t)(count / 4 + 1), (uint32_t)(count + count / 4 + 1), 0};
+            std::vector<uint64_t> hashes(count);
+            std::vector<uint32_t> order(count), displacements, slots;
+            for (uint32_t seed = 1; seed <= maxSeeds; seed++) {
+                for (size_t i = 0; i < count; i++) hashes[i] = hashOf(i, seed);
+                for (size_t i = 0; i < count; i++) order[i] = (uint32_t)i;
+                std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                    return hashBucket(hashes[a], header.buckets) < hashBucket(hashes[b], header.buckets);
+                });
+                // Ranges of order sharing a bucket, largest first
+                std::vector<std::pair<size_t, size_t>> groups;
+                for (size_t i = 0; i < count;) {
+                    size_t j = i + 1;
+                    while (j < count && hashBucket(hashes[order[j]], header.buckets) == hashBucket(hashes[order[i]], header.buckets)) j++;
+                    groups.emplace_back(i, j);
+                    i = j;
+                }
+                std::stable_sort(groups.begin(), groups.end(), [](const auto& a, const auto& b) { return a.second - a.first > b.second - b.first; });
+                displacements.assign(header.buckets, 0);
+                slots.assign(header.slots, emptySlot);
+                bool placed = true;
+                std::vector<size_t> taken;
+                for (const auto& group : groups) {
+                    uint32_t displacement = 0;
+                    for (; displacement < maxDisplacement; displacement++) {
+                        taken.clear();
+                        for (size_t i = group.first; i < group.second; i++) {
+                            size_t slot = hashSlot(hashes[order[i]], displacement, header.slots);
+                            if (slots[slot] != emptySlot) break;
+                            slots[slot] = order[i];
+                            taken.push_back(slot);
+                        }
+                        if (taken.size() == group.second - group.first) break;
+                        for (size_t slot : taken) slots[slot] = emptySlot;
+                    }
+                    if (displacement == maxDisplacement) {
+                        placed = false;
+                        break;
+                    }
+                    displacements[hashBucket(hashes[order[group.first]], header.buckets)] = displacement;
+                }
+                if (!placed) continue;
+                header.seed = seed;
+                out->resize(sizeof(HashHeader) / 4);
+                std::memcpy(out->data(), &header, sizeof(HashHeader));
+                out->insert(out->end(), displacements.begin(), displacements.end());
+                out->insert(out->end(), slots.begin(), slots.end());
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief Normalize a directory path the way Database does, dropping repeated and trailing slashes
+         * @param path The path
+         * @param out Pointer to the return std::string
+         * @retval true Path normalized
+         * @retval false Path is empty
+         */
+        bool normalizePath(std::string_view path, std::string* out) {
+            out->clear();
+            for (size_t i = 0; i < path.size(); i++) {
+                if (path[i] == '/' && i > 0 && path[i - 1] == '/') continue;
+                out->push_back(path[i]);
+            }
+            if (out->size() > 1 && out->back() == '/') out->pop_back();
+            return !out->empty();
+        }
+
+        /**
+         * @brief Run a query and hand every row to a function
+         * @param db The session
+         * @param sql The query
+         * @param fn Called with the statement on every row
+         * @param errmsg SQLite3 error message char**
+         * @retval true Every row handled
+         * @retval false An error has occurred
+         */
+        template<typename F>
+        bool forEachRow(Database& db, const char* sql, F fn, char** errmsg) {
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(db.handle(), sql, -1, &stmt, nullptr) != SQLITE_OK) {
+                if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+                return false;
+            }
+            int ecode;
+            while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) fn(stmt);
+            if (ecode != SQLITE_DONE && errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            return ecode == SQLITE_DONE;
+        }
+
+        std::string columnText(sqlite3_stmt* stmt, int column) {
+            const char* text = (const char*)sqlite3_column_text(stmt, column);
+            return std::string(text ? text : "", (size_t)sqlite3_column_bytes(stmt, column));
+        }
+
+        /**
+         * @brief The tables of the database, as read by the compiler
+         */
+        struct Tables {
+            // Sorted by ID
+            std::vector<uint32_t> dirIds, dirParents, tagIds, tagParents, tagAliases, fileIds, fileDirs;
+            std::vector<bool> dirImplicit;
+            std::vector<std::string> dirPaths, tagValues, fileNames;
+            // Sorted by file, then tag
+            std::vector<std::pair<uint32_t, uint32_t>> links;
+        };
+
+        /**
+         * @brief Read every table, in a transaction so they come from the same snapshot
+         * @param db The session
+         * @param tables Pointer to the return Tables
+         * @param errmsg SQLite3 error message char**
+         * @retval true Tables read
+         * @retval false An error has occurred
+         */
+        bool readTables(Database& db, Tables* tables, char** errmsg) {
+            if (!db.begin(errmsg)) return false;
+            bool ok = forEachRow(db, "SELECT id, tag, parent, alias FROM tag ORDER BY id;", [&](sqlite3_stmt* stmt) {
+                tables->tagIds.push_back((uint32_t)sqlite3_column_int64(stmt, 0));
+                tables->tagValues.push_back(columnText(stmt, 1));
+                tables->tagParents.push_back((uint32_t)sqlite3_column_int64(stmt, 2));
+                tables->tagAliases.push_back((uint32_t)sqlite3_column_int64(stmt, 3));
+            }, errmsg);
+            // Same paths as Database::getDirPath, built top-down
+            ok = ok && forEachRow(db, "WITH RECURSIVE sub(id, parent, path, implicit) AS ("
+                                      "SELECT id, parent, CASE WHEN name = '' THEN '/' ELSE name END, implicit FROM dir WHERE parent = 0 UNION ALL "
+                                      "SELECT dir.id, dir.parent, CASE WHEN sub.path = '/' THEN '/' ELSE sub.path || '/' END || dir.name, dir.implicit "
+                                      "FROM dir JOIN sub ON dir.parent = sub.id) "
+                                      "SELECT id, parent, path, implicit FROM sub ORDER BY id;", [&](sqlite3_stmt* stmt) {
+                tables->dirIds.push_back((uint32_t)sqlite3_column_int64(stmt, 0));
+                tables->dirParents.push_back((uint32_t)sqlite3_column_int64(stmt, 1));
+                tables->dirPaths.push_back(columnText(stmt, 2));
+                tables->dirImplicit.push_back(sqlite3_column_int(stmt, 3) != 0);
+            }, errmsg);
+            ok = ok && forEachRow(db, "SELECT id, dir, name FROM file ORDER BY id;", [&](sqlite3_stmt* stmt) {
+                tables->fileIds.push_back((uint32_t)sqlite3_column_int64(stmt, 0));
+                tables->fileDirs.push_back((uint32_t)sqlite3_column_int64(stmt, 1));
+                tables->fileNames.push_back(columnText(stmt, 2));
+            }, errmsg);
+            ok = ok && forEachRow(db, "SELECT file, tag FROM filetag ORDER BY file, tag;", [&](sqlite3_stmt* stmt) {
+                tables->links.emplace_back((uint32_t)sqlite3_column_int64(stmt, 0), (uint32_t)sqlite3_column_int64(stmt, 1));
+            }, errmsg);
+            db.commit(nullptr);
+            return ok;
+        }
+
+        /**
+         * @brief Index of an ID in a sorted ID list
+         * @return The index, or ids.size() if the ID isn't in the list
+         */
+        size_t indexOf(const std::vector<uint32_t>& ids, uint32_t id) {
+            auto it = std::lower_bound(ids.begin(), ids.end(), id);
+            return it != ids.end() && *it == id ? (size_t)(it - ids.begin()) : ids.size();
+        }
+
+        /**
+         * @brief Indices of strings, sorted by the strings
+         */
+        std::vector<uint32_t> sortedOrder(const std::vector<std::string>& values) {
+            std::vector<uint32_t> order(values.size());
+            for (size_t i = 0; i < order.size(); i++) order[i] = (uint32_t)i;
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+            return order;
+        }
+
+        /**
+         * @brief Write a section's bytes, padded to eight bytes
+         * @retval true Written
+         * @retval false Write error
+         */
+        bool writeSection(FILE* file, const void* bytes, size_t length) {
+            static const char padding[8] = {};
+            if (length && fwrite(bytes, 1, length, file) != length) return false;
+            size_t pad = (8 - length % 8) % 8;
+            return !pad || fwrite(padding, 1, pad, file) == pad;
+        }
+
+        const Header* header(const unsigned char* data) {
+            return (const Header*)data;
+        }
+
+        /**
+         * @brief Get a section as an array of T
+         * @param data The mapping
+         * @param which The section
+         * @param count Pointer to the return number of elements
+         * @return The first element
+         */
+        template<typename T>
+        const T* section(const unsigned char* data, SectionIndex which, size_t* count) {
+            const Section& s = header(data)->sections[which];
+            *count = (size_t)(s.bytes / sizeof(T));
+            return (const T*)(data + s.offset);
+        }
+
+        std::string_view text(const unsigned char* data, uint32_t offset, uint32_t length) {
+            size_t size = 0;
+            const char* strings = section<char>(data, SECTION_STRINGS, &size);
+            if ((uint64_t)offset + length > size) return std::string_view();
+            return std::string_view(strings + offset, length);
+        }
+
+        IdSpan ids(const unsigned char* data, uint32_t offset, uint32_t count) {
+            size_t size = 0;
+            const uint32_t* postings = section<uint32_t>(data, SECTION_POSTINGS, &size);
+            if ((uint64_t)offset + count > size) return IdSpan();
+            return IdSpan{postings + offset, count};
+        }
+
+        /**
+         * @brief Find a record by ID, records are sorted by ID
+         * @return The record, nullptr if not found or no snapshot is open
+         */
+        template<typename T>
+        const T* record(const unsigned char* data, SectionIndex which, unsigned int id) {
+            if (!data) return nullptr;
+            size_t count = 0;
+            const T* records = section<T>(data, which, &count);
+            const T* it = std::lower_bound(records, records + count, id, [](const T& r, unsigned int value) { return r.id < value; });
+            return it != records + count && it->id == id ? it : nullptr;
+        }
+
+        /**
+         * @brief Look a hash up in a hash table section
+         * @return The candidate record index, the caller compares its key; emptySlot if none
+         */
+        uint32_t lookup(const unsigned char* data, SectionIndex which, uint64_t (*hashOf)(const void*, uint64_t), const void* key) {
+            size_t words = 0;
+            const uint32_t* table = section<uint32_t>(data, which, &words);
+            const HashHeader* h = (const HashHeader*)table;
+            uint64_t hash = hashOf(key, h->seed);
+            const uint32_t* displacements = table + sizeof(HashHeader) / 4;
+            const uint32_t* slots = displacements + h->buckets;
+            return slots[hashSlot(hash, displacements[hashBucket(hash, h->buckets)], h->slots)];
+        }
+
+        const DirRecord* findDirRecord(const unsigned char* data, const char* path) {
+            std::string normalized;
+            if (!data || !normalizePath(path, &normalized)) return nullptr;
+            std::string_view key = normalized;
+            uint32_t index = lookup(data, SECTION_DIR_HASH, [](const void* k, uint64_t seed) {
+                return hashText(*(const std::string_view*)k, seed);
+            }, &key);
+            size_t count = 0;
+            const DirRecord* dirs = section<DirRecord>(data, SECTION_DIRS, &count);
+            if (index >= count || text(data, dirs[index].path, dirs[index].pathLength) != key) return nullptr;
+            return dirs + index;
+        }
+
+        struct FileKey {
+            uint32_t dir;
+            std::string_view name;
+        };
+
+        const TagRecord* findTagRecord(const unsigned char* data, std::string_view value) {
+            if (!data) return nullptr;
+            uint32_t index = lookup(data, SECTION_TAG_HASH, [](const void* k, uint64_t seed) {
+                return hashText(*(const std::string_view*)k, seed);
+            }, &value);
+            size_t count = 0;
+            const TagRecord* tags = section<TagRecord>(data, SECTION_TAGS, &count);
+            if (index >= count || text(data, tags[index].value, tags[index].valueLength) != value) return nullptr;
+            return tags + index;
+        }
+
+        /**
+         * @brief Check that the mapping is a snapshot this build can read
+         * @return Why it isn't, nullptr if it is
+         */
+        const char* validate(const unsigned char* data, size_t size) {
+            if (size < sizeof(Header) || std::memcmp(data, magic, sizeof(magic)) != 0) return "not a snapshot file";
+            const Header* h = header(data);
+            if (h->version != formatVersion) return "unsupported snapshot version";
+            if (h->byteOrder != byteOrderMark) return "snapshot written with another byte order";
+            if (h->size != size) return "snapshot file is truncated";
+            const size_t recordSizes[SECTION_COUNT] = {
+                sizeof(DirRecord), sizeof(FileRecord), sizeof(TagRecord), 4, 4, 4, 4, 4, 4, 4, 1
+            };
+            for (int i = 0; i < SECTION_COUNT; i++) {
+                const Section& s = h->sections[i];
+                if (s.offset % 8 || s.offset < sizeof(Header) || s.offset > size || s.bytes > size - s.offset || s.bytes % recordSizes[i]) {
+                    return "snapshot file is corrupt";
+                }
+            }
+            for (SectionIndex i : {SECTION_DIR_HASH, SECTION_FILE_HASH, SECTION_TAG_HASH}) {
+                const Section& s = h->sections[i];
+                if (s.bytes < sizeof(HashHeader)) return "snapshot file is corrupt";
+                const HashHeader* table = (const HashHeader*)(data + s.offset);
+                if (!table->buckets || !table->slots || sizeof(HashHeader) + 4 * ((uint64_t)table->buckets + table->slots) != s.bytes) {
+                    return "snapshot file is corrupt";
+                }
+            }
+            return nullptr;
+        }
+    }
+
+    /**
+     * @brief Write a read-only snapshot of the database for Snapshot to map
+     * @param db The session to read with
+     * @param path Path of the snapshot file, replaced if it exists
+     * @param errmsg SQLite3 error message char**
+     * @retval true Snapshot written
+     * @retval false The file couldn't be written or a database error has occurred
+     */
+    bool compileSnapshot(Database& db, const char* path, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_COMPILE_SNAPSHOT);
+        if (!db.isOpen()) {
+            if (errmsg) *errmsg = sqlite3_mprintf("database is not open");
+            return false;
+        }
+        Tables t;
+        if (!readTables(db, &t, errmsg)) return false;
+        std::string strings;
+        std::vector<uint32_t> postings;
+        std::vector<DirRecord> dirs(t.dirIds.size());
+        std::vector<FileRecord> files(t.fileIds.size());
+        std::vector<TagRecord> tags(t.tagIds.size());
+        // Sorted string tables, the strings are stored in this order too so neighbours share pages
+        std::vector<uint32_t> dirOrder = sortedOrder(t.dirPaths), tagOrder = sortedOrder(t.tagValues);
+        for (uint32_t i : dirOrder) {
+            dirs[i] = DirRecord{t.dirIds[i], t.dirParents[i], (uint32_t)strings.size(), (uint32_t)t.dirPaths[i].size(), 0, 0, t.dirImplicit[i] ? 1U : 0U, 0};
+            strings += t.dirPaths[i];
+        }
+        for (uint32_t i : tagOrder) {
+            tags[i] = TagRecord{t.tagIds[i], (uint32_t)strings.size(), (uint32_t)t.tagValues[i].size(), 0, 0, t.tagParents[i], t.tagAliases[i], 0, 0, 0};
+            strings += t.tagValues[i];
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            files[i] = FileRecord{t.fileIds[i], t.fileDirs[i], (uint32_t)strings.size(), (uint32_t)t.fileNames[i].size(), 0, 0};
+            strings += t.fileNames[i];
+        }
+        // Files of every directory, in ID order since the files are
+        std::vector<size_t> fileDir(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            fileDir[i] = indexOf(t.dirIds, t.fileDirs[i]);
+            if (fileDir[i] < dirs.size()) dirs[fileDir[i]].fileCount++;
+        }
+        for (DirRecord& dir : dirs) {
+            dir.files = (uint32_t)postings.size();
+            postings.resize(postings.size() + dir.fileCount);
+            dir.fileCount = 0;
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            if (fileDir[i] < dirs.size()) postings[dirs[fileDir[i]].files + dirs[fileDir[i]].fileCount++] = t.fileIds[i];
+        }
+        // Tags of every file, links come sorted by file and tag
+        for (size_t i = 0, link = 0; i < files.size(); i++) {
+            while (link < t.links.size() && t.links[link].first < t.fileIds[i]) link++;
+            files[i].tags = (uint32_t)postings.size();
+            for (; link < t.links.size() && t.links[link].first == t.fileIds[i]; link++) postings.push_back(t.links[link].second);
+            files[i].tagCount = (uint32_t)(postings.size() - files[i].tags);
+        }
+        // Files of every tag, still sorted as the links are walked in file order
+        std::vector<size_t> linkTag(t.links.size());
+        for (size_t i = 0; i < t.links.size(); i++) {
+            linkTag[i] = indexOf(t.tagIds, t.links[i].second);
+            if (linkTag[i] < tags.size()) tags[linkTag[i]].fileCount++;
+        }
+        for (TagRecord& tag : tags) {
+            tag.files = (uint32_t)postings.size();
+            postings.resize(postings.size() + tag.fileCount);
+            tag.fileCount = 0;
+        }
+        for (size_t i = 0; i < t.links.size(); i++) {
+            if (linkTag[i] < tags.size()) postings[tags[linkTag[i]].files + tags[linkTag[i]].fileCount++] = t.links[i].first;
+        }
+        // Subtree of every tag, each tag is appended to its own list and its ancestors' in ID order
+        std::vector<size_t> tagParent(tags.size());
+        for (size_t i = 0; i < tags.size(); i++) tagParent[i] = indexOf(t.tagIds, t.tagParents[i]);
+        auto forEachAncestor = [&](size_t i, auto fn) {
+            // Bounded, so a corrupt parent loop can't hang the compiler
+            for (size_t depth = 0; i < tags.size() && depth <= tags.size(); i = tagParent[i], depth++) fn(tags[i]);
+        };
+        for (size_t i = 0; i < tags.size(); i++) forEachAncestor(i, [](TagRecord& tag) { tag.subtreeCount++; });
+        for (TagRecord& tag : tags) {
+            tag.subtree = (uint32_t)postings.size();
+            postings.resize(postings.size() + tag.subtreeCount);
+            tag.subtreeCount = 0;
+        }
+        for (size_t i = 0; i < tags.size(); i++) {
+            forEachAncestor(i, [&](TagRecord& tag) { postings[tag.subtree + tag.subtreeCount++] = t.tagIds[i]; });
+        }
+        if (postings.size() > maxEntries || strings.size() > maxEntries) {
+            if (errmsg) *errmsg = sqlite3_mprintf("database is too large for a snapshot");
+            return false;
+        }
+        std::vector<uint32_t> dirHash, fileHash, tagHash;
+        bool hashed = buildHash(dirs.size(), [&](size_t i, uint64_t seed) { return hashText(t.dirPaths[i], seed); }, &dirHash)
+            && buildHash(files.size(), [&](size_t i, uint64_t seed) { return hashFile(t.fileDirs[i], t.fileNames[i], seed); }, &fileHash)
+            && buildHash(tags.size(), [&](size_t i, uint64_t seed) { return hashText(t.tagValues[i], seed); }, &tagHash);
+        if (!hashed) {
+            if (errmsg) *errmsg = sqlite3_mprintf("couldn't build the snapshot hash tables");
+            return false;
+        }
+        const std::pair<const void*, size_t> contents[SECTION_COUNT] = {
+            {dirs.data(), dirs.size() * sizeof(DirRecord)},
+            {files.data(), files.size() * sizeof(FileRecord)},
+            {tags.data(), tags.size() * sizeof(TagRecord)},
+            {dirHash.data(), dirHash.size() * 4},
+            {fileHash.data(), fileHash.size() * 4},
+            {tagHash.data(), tagHash.size() * 4},
+            {dirOrder.data(), dirOrder.size() * 4},
+            {tagOrder.data(), tagOrder.size() * 4},
+            {t.fileIds.data(), t.fileIds.size() * 4},
+            {postings.data(), postings.size() * 4},
+            {strings.data(), strings.size()}
+        };
+        Header h{};
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = formatVersion;
+        h.byteOrder = byteOrderMark;
+        uint64_t offset = (sizeof(Header) + 7) / 8 * 8;
+        for (int i = 0; i < SECTION_COUNT; i++) {
+            h.sections[i] = Section{offset, contents[i].second};
+            offset += (contents[i].second + 7) / 8 * 8;
+        }
+        h.size = offset;
+        // Written aside and renamed, so a mapped snapshot is never changed underneath its readers
+        std::string temp = std::string(path) + ".tmp";
+        FILE* file = fopen(temp.c_str(), "wb");
+        if (!file) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot open %s: %s", temp.c_str(), strerror(errno));
+            return false;
+        }
+        bool ok = writeSection(file, &h, sizeof(Header));
+        for (int i = 0; i < SECTION_COUNT && ok; i++) ok = writeSection(file, contents[i].first, contents[i].second);
+        if (fclose(file) != 0) ok = false;
+        if (ok && std::rename(temp.c_str(), path) != 0) ok = false;
+        if (!ok) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot write %s: %s", path, strerror(errno));
+            std::remove(temp.c_str());
+        }
+        return ok;
+    }
+
+    Snapshot::Snapshot() : data(nullptr), size(0) {}
+
+    Snapshot::~Snapshot() {
+        close();
+    }
+
+    Snapshot::Snapshot(Snapshot&& other) noexcept : data(other.data), size(other.size) {
+        other.data = nullptr;
+        other.size = 0;
+    }
+
+    Snapshot& Snapshot::operator=(Snapshot&& other) noexcept {
+        if (this != &other) {
+            close();
+            data = std::exchange(other.data, nullptr);
+            size = std::exchange(other.size, 0);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Map a snapshot file, closing the one open before
+     * @param path Path of the snapshot file
+     * @param errmsg Error message char**, freed with sqlite3_free
+     * @retval true Snapshot opened
+     * @retval false The file couldn't be mapped or isn't a snapshot
+     */
+    bool Snapshot::open(const char* path, char** errmsg) {
+        close();
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(Header)) {
+            ::close(fd);
+            if (errmsg) *errmsg = sqlite3_mprintf("%s is not a snapshot file", path);
+            return false;
+        }
+        void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid without the descriptor
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot map %s: %s", path, strerror(errno));
+            return false;
+        }
+        const char* problem = validate((const unsigned char*)mapped, (size_t)info.st_size);
+        if (problem) {
+            munmap(mapped, (size_t)info.st_size);
+            if (errmsg) *errmsg = sqlite3_mprintf("%s: %s", path, problem);
+            return false;
+        }
+        // Lookups jump around, readahead would only fault in pages nobody asked for
+        madvise(mapped, (size_t)info.st_size, MADV_RANDOM);
+        data = (const unsigned char*)mapped;
+        size = (size_t)info.st_size;
+        return true;
+    }
+
+    /**
+     * @brief Unmap the snapshot, views and spans from it become invalid
+     */
+    void Snapshot::close() {
+        if (data) munmap((void*)data, size);
+        data = nullptr;
+        size = 0;
+    }
+
+    /**
+     * @brief Check if a snapshot is open
+     * @retval true Snapshot open
+     * @retval false No snapshot open
+     */
+    bool Snapshot::isOpen() const {
+        return data != nullptr;
+    }
+
+    /**
+     * @brief Check the existence of a directory
+     * @param path Path of the directory to check
+     * @retval true Directory exists
+     * @retval false Directory doesn't exist or was only added implicitly
+     */
+    bool Snapshot::dirExists(const char* path) const {
+        return getDir(path) != -1;
+    }
+
+    /**
+     * @brief Get directory ID by path
+     * @param path The directory path to search for
+     * @retval -1 Directory doesn't exist or was only added implicitly
+     * @return The ID of the directory
+     */
+    int Snapshot::getDir(const char* path) const {
+        const DirRecord* dir = findDirRecord(data, path);
+        return dir && !dir->implicit ? (int)dir->id : -1;
+    }
+
+    /**
+     * @brief Get directory ID by path, counting directories that were only added implicitly
+     * @param path The directory path to search for
+     * @retval -1 Directory doesn't exist
+     * @return The ID of the directory, usable with listSubtreeDirs()
+     */
+    int Snapshot::findDir(const char* path) const {
+        const DirRecord* dir = findDirRecord(data, path);
+        return dir ? (int)dir->id : -1;
+    }
+
+    /**
+     * @brief Get directory path by ID
+     * @param id The directory ID to search for
+     * @param path Pointer to the return view; left untouched if not found
+     * @retval true Directory found, path returned
+     * @retval false Directory doesn't exist or was only added implicitly
+     */
+    bool Snapshot::getDirPath(unsigned int id, std::string_view* path) const {
+        const DirRecord* dir = record<DirRecord>(data, SECTION_DIRS, id);
+        if (!dir || dir->implicit) return false;
+        *path = text(data, dir->path, dir->pathLength);
+        return true;
+    }
+
+    /**
+     * @brief Check the existence of a file
+     * @param dir Directory ID
+     * @param filename Name of the file to check
+     * @retval true File exists
+     * @retval false File doesn't exist
+     */
+    bool Snapshot::fileExists(unsigned int dir, const char* filename) const {
+        return getFile(dir, filename) != -1;
+    }
+
+    /**
+     * @brief Get file ID by directory and name
+     * @param dir Directory ID
+     * @param filename Name of the file
+     * @retval -1 File doesn't exist
+     * @return The ID of the file
+     */
+    int Snapshot::getFile(unsigned int dir, const char* filename) const {
+        if (!data) return -1;
+        FileKey key{dir, filename};
+        uint32_t index = lookup(data, SECTION_FILE_HASH, [](const void* k, uint64_t seed) {
+            const FileKey* file = (const FileKey*)k;
+            return hashFile(file->dir, file->name, seed);
+        }, &key);
+        size_t count = 0;
+        const FileRecord* files = section<FileRecord>(data, SECTION_FILES, &count);
+        if (index >= count || files[index].dir != dir || text(data, files[index].name, files[index].nameLength) != key.name) return -1;
+        return (int)files[index].id;
+    }
+
+    /**
+     * @brief Get the name of a file by ID
+     * @param id File ID
+     * @param filename Pointer to the return view; left untouched if not found
+     * @retval true File found, name returned
+     * @retval false File doesn't exist
+     */
+    bool Snapshot::getFileName(unsigned int id, std::string_view* filename) const {
+        const FileRecord* file = record<FileRecord>(data, SECTION_FILES, id);
+        if (!file) return false;
+        *filename = text(data, file->name, file->nameLength);
+        return true;
+    }
+
+    /**
+     * @brief Get the full path of a file by ID
+     * @param id File ID
+     * @param path Pointer to the return std::string; left untouched if not found
+     * @retval true File found, path returned
+     * @retval false File doesn't exist
+     */
+    bool Snapshot::getFilePath(unsigned int id, std::string* path) const {
+        const FileRecord* file = record<FileRecord>(data, SECTION_FILES, id);
+        // A file's directory has a path even if it was only added implicitly
+        const DirRecord* dirRecord = file ? record<DirRecord>(data, SECTION_DIRS, file->dir) : nullptr;
+        if (!dirRecord) return false;
+        std::string_view dir = text(data, dirRecord->path, dirRecord->pathLength);
+        std::string_view name = text(data, file->name, file->nameLength);
+        path->assign(dir);
+        if (dir != "/") *path += '/';
+        path->append(name);
+        return true;
+    }
+
+    /**
+     * @brief Check the existence of a tag
+     * @param value Name of the tag
+     * @retval true Tag exists
+     * @retval false Tag doesn't exist
+     */
+    bool Snapshot::tagExists(const char* value) const {
+        return findTagRecord(data, value) != nullptr;
+    }
+
+    /**
+     * @brief Get tag ID by name
+     * @param value Name of the tag
+     * @retval -1 Tag doesn't exist
+     * @return The ID of the tag
+     */
+    int Snapshot::getTag(const char* value) const {
+        const TagRecord* tag = findTagRecord(data, value);
+        return tag ? (int)tag->id : -1;
+    }
+
+    /**
+     * @brief Get the name of a tag by ID
+     * @param id Tag ID
+     * @param value Pointer to the return view; left untouched if not found
+     * @retval true Tag found, name returned
+     * @retval false Tag doesn't exist
+     */
+    bool Snapshot::getTagValue(unsigned int id, std::string_view* value) const {
+        const TagRecord* tag = record<TagRecord>(data, SECTION_TAGS, id);
+        if (!tag) return false;
+        *value = text(data, tag->value, tag->valueLength);
+        return true;
+    }
+
+    /**
+     * @brief Get how many files have a tag
+     * @param tag Tag ID
+     * @retval -1 Tag doesn't exist
+     * @return Number of files with the tag
+     */
+    int Snapshot::getTagFileCount(unsigned int tag) const {
+        const TagRecord* found = record<TagRecord>(data, SECTION_TAGS, tag);
+        return found ? (int)found->fileCount : -1;
+    }
+
+    /**
+     * @brief Get the parent of a tag
+     * @param tag Tag ID
+     * @retval -1 Tag doesn't exist
+     * @retval 0 Tag is top level
+     * @return The ID of the parent tag
+     */
+    int Snapshot::getTagParent(unsigned int tag) const {
+        const TagRecord* found = record<TagRecord>(data, SECTION_TAGS, tag);
+        return found ? (int)found->parent : -1;
+    }
+
+    /**
+     * @brief Get the tag an alias stands for
+     * @param tag Tag ID
+     * @retval -1 Tag doesn't exist
+     * @retval 0 Tag isn't an alias
+     * @return The ID of the tag it stands for
+     */
+    int Snapshot::getTagAlias(unsigned int tag) const {
+        const TagRecord* found = record<TagRecord>(data, SECTION_TAGS, tag);
+        return found ? (int)found->alias : -1;
+    }
+
+    /**
+     * @brief Find the tags starting with a prefix
+     * @param prefix Start of the tag names, empty for every tag
+     * @param ids Pointer to the return vector of tag IDs, in name order
+     */
+    void Snapshot::findTags(std::string_view prefix, std::vector<unsigned int>* ids) const {
+        ids->clear();
+        if (!data) return;
+        size_t count = 0, tagCount = 0;
+        const uint32_t* order = section<uint32_t>(data, SECTION_TAG_VALUES, &count);
+        const TagRecord* tags = section<TagRecord>(data, SECTION_TAGS, &tagCount);
+        auto value = [&](uint32_t index) {
+            return index < tagCount ? text(data, tags[index].value, tags[index].valueLength) : std::string_view();
+        };
+        const uint32_t* it = std::lower_bound(order, order + count, prefix, [&](uint32_t index, std::string_view key) { return value(index) < key; });
+        // Any name starts with an empty prefix, so an index past the records has to end the list itself
+        for (; it != order + count && *it < tagCount && value(*it).substr(0, prefix.size()) == prefix; ++it) ids->push_back(tags[*it].id);
+    }
+
+    /**
+     * @brief List the tags of a file
+     * @param file File ID
+     * @return Tag IDs in ascending order, empty if the file doesn't exist
+     */
+    IdSpan Snapshot::listFileTags(unsigned int file) const {
+        const FileRecord* found = record<FileRecord>(data, SECTION_FILES, file);
+        return found ? ids(data, found->tags, found->tagCount) : IdSpan();
+    }
+
+    /**
+     * @brief List the files with a tag
+     * @param tag Tag ID
+     * @return File IDs in ascending order, empty if the tag doesn't exist
+     */
+    IdSpan Snapshot::listTagFiles(unsigned int tag) const {
+        const TagRecord* found = record<TagRecord>(data, SECTION_TAGS, tag);
+        return found ? ids(data, found->files, found->fileCount) : IdSpan();
+    }
+
+    /**
+     * @brief List a tag and every tag under it
+     * @param tag Tag ID
+     * @return Tag IDs in ascending order, empty if the tag doesn't exist
+     */
+    IdSpan Snapshot::listSubtreeTags(unsigned int tag) const {
+        const TagRecord* found = record<TagRecord>(data, SECTION_TAGS, tag);
+        return found ? ids(data, found->subtree, found->subtreeCount) : IdSpan();
+    }
+
+    /**
+     * @brief List the files in a directory
+     * @param dir Directory ID
+     * @return File IDs in ascending order, empty if the directory doesn't exist
+     */
+    IdSpan Snapshot::listDirFiles(unsigned int dir) const {
+        const DirRecord* found = record<DirRecord>(data, SECTION_DIRS, dir);
+        return found ? ids(data, found->files, found->fileCount) : IdSpan();
+    }
+
+    /**
+     * @brief List every file
+     * @return File IDs in ascending order
+     */
+    IdSpan Snapshot::listFiles() const {
+        if (!data) return IdSpan();
+        size_t count = 0;
+        const uint32_t* files = section<uint32_t>(data, SECTION_FILE_IDS, &count);
+        return IdSpan{files, count};
+    }
+
+    /**
+     * @brief List a directory and every directory under it
+     * @param dir Directory ID
+     * @param dirs Pointer to the return vector of directory IDs, in path order
+     */
+    void Snapshot::listSubtreeDirs(unsigned int dir, std::vector<unsigned int>* dirs) const {
+        dirs->clear();
+        const DirRecord* top = record<DirRecord>(data, SECTION_DIRS, dir);
+        if (!top) return;
+        // Descendants are the paths starting with this one and a slash, a contiguous range of the sorted paths
+        std::string prefix(text(data, top->path, top->pathLength));
+        if (prefix != "/") {
+            dirs->push_back(top->id);
+            prefix += '/';
+        }
+        size_t count = 0, dirCount = 0;
+        const uint32_t* order = section<uint32_t>(data, SECTION_DIR_PATHS, &count);
+        const DirRecord* records = section<DirRecord>(data, SECTION_DIRS, &dirCount);
+        auto path = [&](uint32_t index) {
+            return index < dirCount ? text(data, records[index].path, records[index].pathLength) : std::string_view();
+        };
+        const uint32_t* it = std::lower_bound(order, order + count, std::string_view(prefix), [&](uint32_t index, std::string_view key) { return path(index) < key; });
+        for (; it != order + count && path(*it).substr(0, prefix.size()) == prefix; ++it) dirs->push_back(records[*it].id);
+    }
+}
@@ -0,0 +1,279 @@
+/**
+ * @file ftagmgrsnapshot.h
+ * @brief FTagMgrLib read-only snapshot header file
+ */
+
+#ifndef FTAGMGRSNAPSHOT_H
+#define FTAGMGRSNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Sorted IDs stored in a snapshot, valid while the snapshot stays open
+     */
+    struct IdSpan {
+        const uint32_t* first = nullptr;
+        size_t count = 0;
+
+        const uint32_t* begin() const {
+            return first;
+        }
+
+        const uint32_t* end() const {
+            return first + count;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+    };
+
+    /**
+     * @brief Write a read-only snapshot of the database for Snapshot to map
+     *
+     * The file holds fixed-size directory, file and tag records sorted by
+     * ID, a perfect hash table each for directory paths, (directory, name)
+     * pairs and tag names, directory paths and tag names in sorted order,
+     * every file-tag link twice, as sorted ID lists per file and per tag,
+     * and the tags under every tag. Everything is laid out as it is used,
+     * in native byte order, so opening it only checks the header.
+     *
+     * The database is read from a single read transaction. The snapshot is
+     * written next to path and renamed over it once complete, so hosts with
+     * the old file mapped keep reading the old one until they reopen.
+     *
+     * @param db The session to read with
+     * @param path Path of the snapshot file, replaced if it exists
+     * @param errmsg SQLite3 error message char**
+     * @retval true Snapshot written
+     * @retval false The file couldn't be written or a database error has occurred
+     */
+    bool compileSnapshot(Database& db, const char* path, char** errmsg);
+
+    /**
+     * @brief A memory-mapped snapshot, answering the lookups of Database without SQLite
+     *
+     * Opening maps the file and checks its header, nothing is read or built
+     * up front; the pages a lookup touches are faulted in on first use and
+     * shared with every other process mapping the same file. Names come
+     * back as views into the mapping. Lookups can't fail, only miss, and
+     * are safe from any number of threads.
+     *
+     * The data is as of compileSnapshot(), writes to the database don't
+     * show up until it's compiled and opened again. Movable, not copyable.
+     */
+    class Snapshot {
+    public:
+        Snapshot();
+        ~Snapshot();
+        Snapshot(Snapshot&& other) noexcept;
+        Snapshot& operator=(Snapshot&& other) noexcept;
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        /**
+         * @brief Map a snapshot file, closing the one open before
+         * @param path Path of the snapshot file
+         * @param errmsg Error message char**, freed with sqlite3_free
+         * @retval true Snapshot opened
+         * @retval false The file couldn't be mapped or isn't a snapshot
+         */
+        bool open(const char* path, char** errmsg);
+
+        /**
+         * @brief Unmap the snapshot, views and spans from it become invalid
+         */
+        void close();
+
+        /**
+         * @brief Check if a snapshot is open
+         * @retval true Snapshot open
+         * @retval false No snapshot open
+         */
+        bool isOpen() const;
+
+        /**
+         * @brief Check the existence of a directory
+         * @param path Path of the directory to check
+         * @retval true Directory exists
+         * @retval false Directory doesn't exist or was only added implicitly
+         */
+        bool dirExists(const char* path) const;
+
+        /**
+         * @brief Get directory ID by path
+         * @param path The directory path to search for
+         * @retval -1 Directory doesn't exist or was only added implicitly
+         * @return The ID of the directory
+         */
+        int getDir(const char* path) const;
+
+        /**
+         * @brief Get directory ID by path, counting directories that were only added implicitly
+         * @param path The directory path to search for
+         * @retval -1 Directory doesn't exist
+         * @return The ID of the directory, usable with listSubtreeDirs()
+         */
+        int findDir(const char* path) const;
+
+        /**
+         * @brief Get directory path by ID
+         * @param id The directory ID to search for
+         * @param path Pointer to the return view; left untouched if not found
+         * @retval true Directory found, path returned
+         * @retval false Directory doesn't exist or was only added implicitly
+         */
+        bool getDirPath(unsigned int id, std::string_view* path) const;
+
+        /**
+         * @brief Check the existence of a file
+         * @param dir Directory ID
+         * @param filename Name of the file to check
+         * @retval true File exists
+         * @retval false File doesn't exist
+         */
+        bool fileExists(unsigned int dir, const char* filename) const;
+
+        /**
+         * @brief Get file ID by directory and name
+         * @param dir Directory ID
+         * @param filename Name of the file
+         * @retval -1 File doesn't exist
+         * @return The ID of the file
+         */
+        int getFile(unsigned int dir, const char* filename) const;
+
+        /**
+         * @brief Get the name of a file by ID
+         * @param id File ID
+         * @param filename Pointer to the return view; left untouched if not found
+         * @retval true File found, name returned
+         * @retval false File doesn't exist
+         */
+        bool getFileName(unsigned int id, std::string_view* filename) const;
+
+        /**
+         * @brief Get the full path of a file by ID
+         * @param id File ID
+         * @param path Pointer to the return std::string; left untouched if not found
+         * @retval true File found, path returned
+         * @retval false File doesn't exist
+         */
+        bool getFilePath(unsigned int id, std::string* path) const;
+
+        /**
+         * @brief Check the existence of a tag
+         * @param value Name of the tag
+         * @retval true Tag exists
+         * @retval false Tag doesn't exist
+         */
+        bool tagExists(const char* value) const;
+
+        /**
+         * @brief Get tag ID by name
+         * @param value Name of the tag
+         * @retval -1 Tag doesn't exist
+         * @return The ID of the tag
+         */
+        int getTag(const char* value) const;
+
+        /**
+         * @brief Get the name of a tag by ID
+         * @param id Tag ID
+         * @param value Pointer to the return view; left untouched if not found
+         * @retval true Tag found, name returned
+         * @retval false Tag doesn't exist
+         */
+        bool getTagValue(unsigned int id, std::string_view* value) const;
+
+        /**
+         * @brief Get how many files have a tag
+         * @param tag Tag ID
+         * @retval -1 Tag doesn't exist
+         * @return Number of files with the tag
+         */
+        int getTagFileCount(unsigned int tag) const;
+
+        /**
+         * @brief Get the parent of a tag
+         * @param tag Tag ID
+         * @retval -1 Tag doesn't exist
+         * @retval 0 Tag is top level
+         * @return The ID of the parent tag
+         */
+        int getTagParent(unsigned int tag) const;
+
+        /**
+         * @brief Get the tag an alias stands for
+         * @param tag Tag ID
+         * @retval -1 Tag doesn't exist
+         * @retval 0 Tag isn't an alias
+         * @return The ID of the tag it stands for
+         */
+        int getTagAlias(unsigned int tag) const;
+
+        /**
+         * @brief Find the tags starting with a prefix
+         * @param prefix Start of the tag names, empty for every tag
+         * @param ids Pointer to the return vector of tag IDs, in name order
+         */
+        void findTags(std::string_view prefix, std::vector<unsigned int>* ids) const;
+
+        /**
+         * @brief List the tags of a file
+         * @param file File ID
+         * @return Tag IDs in ascending order, empty if the file doesn't exist
+         */
+        IdSpan listFileTags(unsigned int file) const;
+
+        /**
+         * @brief List the files with a tag
+         * @param tag Tag ID
+         * @return File IDs in ascending order, empty if the tag doesn't exist
+         */
+        IdSpan listTagFiles(unsigned int tag) const;
+
+        /**
+         * @brief List a tag and every tag under it
+         * @param tag Tag ID
+         * @return Tag IDs in ascending order, empty if the tag doesn't exist
+         */
+        IdSpan listSubtreeTags(unsigned int tag) const;
+
+        /**
+         * @brief List the files in a directory
+         * @param dir Directory ID
+         * @return File IDs in ascending order, empty if the directory doesn't exist
+         */
+        IdSpan listDirFiles(unsigned int dir) const;
+
+        /**
+         * @brief List every file
+         * @return File IDs in ascending order
+         */
+        IdSpan listFiles() const;
+
+        /**
+         * @brief List a directory and every directory under it
+         * @param dir Directory ID
+         * @param dirs Pointer to the return vector of directory IDs, in path order
+         */
+        void listSubtreeDirs(unsigned int dir, std::vector<unsigned int>* dirs) const;
+
+    private:
+        const unsigned char* data;
+        size_t size;
+    };
+}
+
+#endif
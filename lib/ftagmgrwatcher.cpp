@@ -0,0 +1,565 @@
+/**
+ * @file ftagmgrwatcher.cpp
+ * @brief FTagMgr filesystem watcher source code
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sqlite3.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ftagmgrmetrics.h"
+#include "ftagmgrwatcher.h"
+
+namespace ftagmgr {
+    namespace {
+        // Changes to the entries of a directory, and its own removal for the topmost watched ones
+        const uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+        /**
+         * @brief Join a directory path and an entry name
+         * @param dir Directory path
+         * @param name Entry name
+         * @return The entry path
+         */
+        std::string join(const std::string& dir, const std::string& name) {
+            return dir.back() == '/' ? dir + name : dir + '/' + name;
+        }
+
+        /**
+         * @brief Report a system call failure through errmsg
+         * @param what What was being done
+         * @param path Path it was done to
+         * @param errmsg Error message char**
+         */
+        void setSystemError(const char* what, const std::string& path, char** errmsg) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s %s: %s", what, path.c_str(), strerror(errno));
+        }
+
+        /**
+         * @brief Tell a lookup that found nothing apart from one that failed
+         * @param err Error message the lookup filled in, moved to errmsg
+         * @param errmsg SQLite3 error message char**
+         * @retval true Lookup went fine, it may still have found nothing
+         * @retval false An error has occurred
+         */
+        bool checkLookup(char* err, char** errmsg) {
+            if (!err) return true;
+            if (errmsg) *errmsg = err;
+            else sqlite3_free(err);
+            return false;
+        }
+
+        bool sameTime(const struct timespec& a, const struct timespec& b) {
+            return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+        }
+    }
+
+    /**
+     * @brief Create a watcher, start() makes it watch
+     * @param db The session to apply the changes with, must outlive the watcher
+     * @param options Watcher settings
+     */
+    Watcher::Watcher(Database& db, const WatchOptions& options) : db(db), options(options), inotifyFd(-1), wakeFd(-1) {}
+
+    Watcher::~Watcher() {
+        if (inotifyFd >= 0) close(inotifyFd);
+        if (wakeFd >= 0) close(wakeFd);
+    }
+
+    /**
+     * @brief Watch every registered directory that exists
+     * @param errmsg SQLite3 error message char**, also used for inotify errors
+     * @retval true Watching
+     * @retval false An error has occurred, e.g. the inotify watch limit was hit
+     */
+    bool Watcher::start(char** errmsg) {
+        if (inotifyFd < 0) inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (wakeFd < 0) wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (inotifyFd < 0 || wakeFd < 0) {
+            setSystemError("cannot set up", "inotify", errmsg);
+            return false;
+        }
+        sqlite3_stmt* stmt = nullptr;
+        // Paths are built top-down from the tree, implicit ancestors are not watched
+        const char* sql = "WITH RECURSIVE sub(id, path, implicit) AS ("
+                          "SELECT id, CASE WHEN name = '' THEN '/' ELSE name END, implicit FROM dir WHERE parent = 0 UNION ALL "
+                          "SELECT dir.id, CASE WHEN sub.path = '/' THEN '/' ELSE sub.path || '/' END || dir.name, dir.implicit "
+                          "FROM dir JOIN sub ON dir.parent = sub.id) "
+                          "SELECT path FROM sub WHERE implicit = 0;";
+        if (sqlite3_prepare_v2(db.handle(), sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            return false;
+        }
+        std::vector<std::string> paths;
+        int ecode;
+        while ((ecode = sqlite3_step(stmt)) == SQLITE_ROW) paths.emplace_back((const char*)sqlite3_column_text(stmt, 0));
+        if (ecode != SQLITE_DONE) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            sqlite3_finalize(stmt);
+            return false;
+        }
+        sqlite3_finalize(stmt);
+        for (const std::string& path : paths) {
+            int wd = inotify_add_watch(inotifyFd, path.c_str(), watchMask);
+            if (wd < 0) {
+                // Directories removed while nobody watched are left to the caller
+                if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) continue;
+                setSystemError("cannot watch", path, errmsg);
+                return false;
+            }
+            dirs[wd].path = path;
+            wds[path] = wd;
+            markSynced(wd);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Wait for a burst of changes and apply it
+     * @param timeoutMs How long to wait for the first event, -1 for no limit
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 An error has occurred, nothing of the burst was applied, the next call retries it
+     * @retval 0 Nothing happened before the timeout, or stop() was called
+     * @retval 1 Changes applied
+     */
+    short Watcher::poll(int timeoutMs, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_WATCHER_POLL);
+        if (inotifyFd < 0) return -1;
+        struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+        // A failed burst doesn't wait for new events to be retried
+        int ready = ::poll(fds, 2, retry.empty() ? timeoutMs : 0);
+        if (ready < 0 && errno != EINTR) {
+            setSystemError("cannot poll", "inotify", errmsg);
+            return -1;
+        }
+        if (fds[1].revents || (ready <= 0 && retry.empty())) return 0;
+        std::vector<Event> events;
+        events.swap(retry);
+        auto first = std::chrono::steady_clock::now();
+        auto deadline = first + std::chrono::milliseconds(options.maxDelayMs);
+        // Keep collecting while events keep coming, up to the deadline
+        while (true) {
+            if (!readEvents(&events)) {
+                setSystemError("cannot read", "inotify", errmsg);
+                return -1;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) break;
+            long remaining = (long)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+            int wait = (int)std::min<long>(options.debounceMs, remaining);
+            if (::poll(fds, 1, wait) <= 0) break;
+        }
+        // A rename's two halves may straddle the end of the window
+        if (!events.empty() && (events.back().mask & IN_MOVED_FROM) && ::poll(fds, 1, 10) > 0) readEvents(&events);
+        if (events.empty()) return 0;
+        if (apply(events, errmsg)) return 1;
+        retry = std::move(events);
+        return -1;
+    }
+
+    /**
+     * @brief Apply changes until stop() is called
+     * @param errmsg SQLite3 error message char**
+     * @retval true Stopped
+     * @retval false An error has occurred
+     */
+    bool Watcher::run(char** errmsg) {
+        while (true) {
+            short res = poll(-1, errmsg);
+            if (res == -1) return false;
+            uint64_t value;
+            if (res == 0 && read(wakeFd, &value, sizeof(value)) == sizeof(value)) return true;
+        }
+    }
+
+    /**
+     * @brief Make run() return, callable from any thread
+     */
+    void Watcher::stop() {
+        uint64_t one = 1;
+        if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) return;
+    }
+
+    /**
+     * @brief Get what was applied so far
+     * @return The counters
+     */
+    const WatchStats& Watcher::stats() const {
+        return counters;
+    }
+
+    /**
+     * @brief Read the queued inotify events
+     * @param events Pointer to the std::vector to append the events to
+     * @retval true Events read
+     * @retval false inotify read error
+     */
+    bool Watcher::readEvents(std::vector<Event>* events) {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        while (true) {
+            ssize_t bytes = read(inotifyFd, buffer, sizeof(buffer));
+            if (bytes < 0) return errno == EAGAIN || errno == EINTR;
+            if (bytes == 0) return true;
+            for (ssize_t offset = 0; offset < bytes;) {
+                const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+                std::string name = event->len ? event->name : "";
+                if (options.skipHidden && !name.empty() && name[0] == '.') continue;
+                events->push_back({event->wd, event->mask, event->cookie, std::move(name)});
+            }
+        }
+    }
+
+    /**
+     * @brief Watch a new directory and the directories under it, and add them with their files
+     * @param path Directory path
+     * @param errmsg SQLite3 error message char**, also used for inotify errors
+     * @retval true Added, or the directory is gone already
+     * @retval false An error has occurred
+     */
+    bool Watcher::addTree(const std::string& path, char** errmsg) {
+        // Watch first, so nothing created while listing is missed
+        int wd = inotify_add_watch(inotifyFd, path.c_str(), watchMask);
+        if (wd < 0) {
+            if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) return true;
+            setSystemError("cannot watch", path, errmsg);
+            return false;
+        }
+        dirs[wd].path = path;
+        wds[path] = wd;
+        markSynced(wd);
+        DIR* dir = opendir(path.c_str());
+        if (!dir) return true;
+        std::vector<std::string> files;
+        std::vector<std::string> subdirs;
+        while (struct dirent* entry = readdir(dir)) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (options.skipHidden && name[0] == '.') continue;
+            bool isDir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                isDir = fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            (isDir ? subdirs : files).push_back(name);
+        }
+        closedir(dir);
+        std::vector<int> ids;
+        if (!db.addDirs({std::string_view(path)}, &ids, errmsg)) return false;
+        std::vector<std::string_view> names(files.begin(), files.end());
+        if (!names.empty() && !db.addFiles(ids[0], names, &ids, errmsg)) return false;
+        counters.added += 1 + names.size();
+        for (const std::string& subdir : subdirs) if (!addTree(join(path, subdir), errmsg)) return false;
+        return true;
+    }
+
+    /**
+     * @brief Stop watching a directory and the directories under it, the watches go once the burst commits
+     * @param path Directory path
+     */
+    void Watcher::unwatchTree(const std::string& path) {
+        auto it = wds.find(path);
+        if (it != wds.end()) {
+            unwatched.push_back(it->second);
+            dirs.erase(it->second);
+            wds.erase(it);
+        }
+        // Siblings like "a-old" sort between "a" and "a/", the subtree is only a range from "a/" on
+        std::string prefix = join(path, "");
+        it = wds.lower_bound(prefix);
+        while (it != wds.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            unwatched.push_back(it->second);
+            dirs.erase(it->second);
+            it = wds.erase(it);
+        }
+    }
+
+    /**
+     * @brief Remember a directory's modification time as in sync
+     * @param wd Watch descriptor of the directory
+     */
+    void Watcher::markSynced(int wd) {
+        auto it = dirs.find(wd);
+        if (it == dirs.end()) return;
+        struct stat st;
+        if (stat(it->second.path.c_str(), &st) == 0) it->second.mtime = st.st_mtim;
+        else it->second.mtime = {0, 0};
+    }
+
+    /**
+     * @brief Apply one burst of events in one transaction
+     * @param events The events, in kernel order
+     * @param errmsg SQLite3 error message char**
+     * @retval true Applied
+     * @retval false An error has occurred, rolled back along with the watches
+     */
+    bool Watcher::apply(std::vector<Event>& events, char** errmsg) {
+        // Coalesce: an entry created and deleted within the burst never reaches the database
+        std::map<std::pair<int, std::string>, size_t> created;
+        std::vector<bool> skip(events.size(), false);
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event& event = events[i];
+            std::pair<int, std::string> key{event.wd, event.name};
+            if (event.mask & IN_CREATE) created[key] = i;
+            else if (event.mask & IN_DELETE) {
+                auto it = created.find(key);
+                if (it != created.end()) {
+                    skip[it->second] = skip[i] = true;
+                    created.erase(it);
+                }
+            } else if (event.mask & IN_MOVED_FROM) created.erase(key);
+        }
+
+        if (!db.begin(errmsg)) return false;
+        // The handlers change the watches as they go, a rollback puts them back
+        std::unordered_map<int, WatchedDir> savedDirs = dirs;
+        std::map<std::string, int> savedWds = wds;
+        WatchStats savedCounters = counters;
+        bool ok = true;
+        bool overflow = false;
+        std::set<int> touched;
+        for (size_t i = 0; ok && i < events.size(); i++) {
+            if (skip[i]) continue;
+            const Event& event = events[i];
+            if (event.mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            if (event.mask & IN_IGNORED) {
+                // Directory deleted or unmounted, the kernel dropped the watch
+                auto it = dirs.find(event.wd);
+                if (it != dirs.end()) {
+                    wds.erase(it->second.path);
+                    dirs.erase(it);
+                }
+                continue;
+            }
+            auto dir = dirs.find(event.wd);
+            if (dir == dirs.end()) continue;
+            // Copied, the handlers below may rename watched directories
+            std::string path = dir->second.path;
+            bool isDir = event.mask & IN_ISDIR;
+            touched.insert(event.wd);
+            if (event.mask & IN_DELETE_SELF) {
+                // Other directories go away with their parent's IN_DELETE
+                size_t slash = path.find_last_of('/');
+                if (slash != std::string::npos && slash > 0 && !wds.count(path.substr(0, slash))) {
+                    ok = removeEntry(path.substr(0, slash), path.substr(slash + 1), true, errmsg);
+                }
+            } else if (event.mask & IN_MOVED_FROM) {
+                // Pair with the IN_MOVED_TO of the same rename, if it was inside the watched tree
+                size_t j = i + 1;
+                while (j < events.size() && !(events[j].cookie == event.cookie && (events[j].mask & IN_MOVED_TO))) j++;
+                auto target = j < events.size() ? dirs.find(events[j].wd) : dirs.end();
+                if (target == dirs.end()) {
+                    ok = removeEntry(path, event.name, isDir, errmsg);
+                } else {
+                    skip[j] = true;
+                    touched.insert(events[j].wd);
+                    ok = moveEntry(path, event.name, target->second.path, events[j].name, isDir, errmsg);
+                }
+            } else if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+                ok = addEntry(path, event.name, isDir, errmsg);
+            } else if (event.mask & IN_DELETE) {
+                ok = removeEntry(path, event.name, isDir, errmsg);
+            }
+        }
+        if (ok && overflow) {
+            // Events were lost, list again every directory that changed since it was last in sync
+            std::vector<std::string> stale;
+            for (const auto& watched : dirs) {
+                struct stat st;
+                if (stat(watched.second.path.c_str(), &st) == 0 && !sameTime(st.st_mtim, watched.second.mtime)) stale.push_back(watched.second.path);
+            }
+            for (size_t i = 0; ok && i < stale.size(); i++) {
+                if (!wds.count(stale[i])) continue;
+                ok = rescan(stale[i], errmsg);
+                counters.rescanned++;
+            }
+        }
+        if (!ok || !db.commit(errmsg)) {
+            db.rollback(nullptr);
+            // Watches added for the burst go, the ones it dropped were kept until now
+            for (const auto& watched : dirs) if (!savedDirs.count(watched.first)) inotify_rm_watch(inotifyFd, watched.first);
+            dirs = std::move(savedDirs);
+            wds = std::move(savedWds);
+            counters = savedCounters;
+            unwatched.clear();
+            return false;
+        }
+        // Unless a directory came back within the burst, with the same watch
+        for (int wd : unwatched) if (!dirs.count(wd)) inotify_rm_watch(inotifyFd, wd);
+        unwatched.clear();
+        for (int wd : touched) markSynced(wd);
+        return true;
+    }
+
+    bool Watcher::addEntry(const std::string& dir, const std::string& name, bool isDir, char** errmsg) {
+        std::string path = join(dir, name);
+        // Listed on this thread, a new directory rarely holds much
+        if (isDir) return addTree(path, errmsg);
+        char* err = nullptr;
+        int dirId = db.getDir(dir.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        if (dirId == -1) return true;
+        if (db.addFile(dirId, name.c_str(), &err)) counters.added++;
+        return checkLookup(err, errmsg);
+    }
+
+    bool Watcher::removeEntry(const std::string& dir, const std::string& name, bool isDir, char** errmsg) {
+        char* err = nullptr;
+        if (isDir) {
+            std::string path = join(dir, name);
+            unwatchTree(path);
+            int id = db.getDir(path.c_str(), &err);
+            if (!checkLookup(err, errmsg)) return false;
+            if (id == -1) return true;
+            if (!db.removeDir(id, errmsg)) return false;
+            counters.removed++;
+            return true;
+        }
+        int dirId = db.getDir(dir.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        if (dirId == -1) return true;
+        int file = db.getFile(dirId, name.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        if (file == -1) return true;
+        if (!db.removeFile(file, errmsg)) return false;
+        counters.removed++;
+        return true;
+    }
+
+    bool Watcher::moveEntry(const std::string& fromDir, const std::string& fromName, const std::string& toDir, const std::string& toName, bool isDir, char** errmsg) {
+        char* err = nullptr;
+        if (isDir) {
+            std::string from = join(fromDir, fromName);
+            std::string to = join(toDir, toName);
+            int id = db.getDir(from.c_str(), &err);
+            if (!checkLookup(err, errmsg)) return false;
+            if (id == -1) return addEntry(toDir, toName, true, errmsg);
+            // rename() only replaces empty directories, drop what the database still has there
+            int replaced = db.getDir(to.c_str(), &err);
+            if (!checkLookup(err, errmsg)) return false;
+            if (replaced != -1) {
+                unwatchTree(to);
+                if (!db.removeDir(replaced, errmsg)) return false;
+            }
+            if (!db.moveDir(id, to.c_str(), errmsg)) return false;
+            // Watches follow the inodes, only the paths we keep for them change
+            std::vector<std::pair<std::string, int>> moved;
+            auto own = wds.find(from);
+            if (own != wds.end()) {
+                moved.emplace_back(to, own->second);
+                wds.erase(own);
+            }
+            std::string prefix = join(from, "");
+            for (auto it = wds.lower_bound(prefix); it != wds.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+                moved.emplace_back(join(to, it->first.substr(prefix.size())), it->second);
+                it = wds.erase(it);
+            }
+            for (const auto& entry : moved) {
+                wds[entry.first] = entry.second;
+                dirs[entry.second].path = entry.first;
+            }
+            counters.moved++;
+            return true;
+        }
+        int fromId = db.getDir(fromDir.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        int toId = db.getDir(toDir.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        int file = fromId == -1 ? -1 : db.getFile(fromId, fromName.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        if (file == -1 || toId == -1) return addEntry(toDir, toName, false, errmsg);
+        // rename() over an existing file replaces it
+        int replaced = db.getFile(toId, toName.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        if (replaced != -1 && replaced != file && !db.removeFile(replaced, errmsg)) return false;
+        if (!db.moveFile(file, toId, toName.c_str(), errmsg)) return false;
+        counters.moved++;
+        return true;
+    }
+
+    /**
+     * @brief Bring one directory's files and subdirectories in line with the filesystem
+     * @param path Directory path
+     * @param errmsg SQLite3 error message char**
+     * @retval true Directory synced
+     * @retval false An error has occurred
+     */
+    bool Watcher::rescan(const std::string& path, char** errmsg) {
+        // Transparent, so names streamed as views can be looked up
+        std::set<std::string, std::less<>> files;
+        std::set<std::string, std::less<>> subdirs;
+        DIR* dir = opendir(path.c_str());
+        if (!dir) return true;
+        while (struct dirent* entry = readdir(dir)) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (options.skipHidden && name[0] == '.') continue;
+            bool isDir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                isDir = fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            (isDir ? subdirs : files).insert(name);
+        }
+        closedir(dir);
+
+        char* err = nullptr;
+        int dirId = db.getDir(path.c_str(), &err);
+        if (!checkLookup(err, errmsg)) return false;
+        if (dirId == -1) return true;
+        // Files the database has that are gone, and the ones it's missing
+        std::vector<int> gone;
+        NameCursor cursor;
+        int id;
+        std::string_view name;
+        if (!db.listDirFileNames(dirId, &cursor, errmsg)) return false;
+        short res;
+        while ((res = cursor.next(&id, &name, errmsg)) == 1) {
+            auto found = files.find(name);
+            if (found != files.end()) files.erase(found);
+            else gone.push_back(id);
+        }
+        cursor.close();
+        if (res == -1) return false;
+        for (int file : gone) {
+            if (!db.removeFile(file, errmsg)) return false;
+            counters.removed++;
+        }
+        std::vector<std::string_view> added(files.begin(), files.end());
+        std::vector<int> ids;
+        if (!db.addFiles(dirId, added, &ids, errmsg)) return false;
+        counters.added += added.size();
+
+        // Subdirectories we watch that are gone, and new ones
+        std::string prefix = join(path, "");
+        std::vector<std::string> goneDirs;
+        for (auto it = wds.lower_bound(prefix); it != wds.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            std::string child = it->first.substr(prefix.size());
+            // The root "/" is its own prefix
+            if (child.empty() || child.find('/') != std::string::npos) continue;
+            if (!subdirs.erase(child)) goneDirs.push_back(child);
+        }
+        for (const std::string& child : goneDirs) if (!removeEntry(path, child, true, errmsg)) return false;
+        for (const std::string& child : subdirs) if (!addEntry(path, child, true, errmsg)) return false;
+        auto watched = wds.find(path);
+        if (watched != wds.end()) markSynced(watched->second);
+        return true;
+    }
+}
@@ -0,0 +1,184 @@
+/**
+ * @file ftagmgrwatcher.h
+ * @brief FTagMgrLib filesystem watcher header file
+ */
+
+#ifndef FTAGMGRWATCHER_H
+#define FTAGMGRWATCHER_H
+
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Watcher settings
+     */
+    struct WatchOptions {
+        // A batch is applied once no event came for this long
+        unsigned int debounceMs = 100;
+        // ...or once its first event is this old, so a steady stream still gets applied
+        unsigned int maxDelayMs = 2000;
+        // Ignore entries whose name starts with '.'
+        bool skipHidden = false;
+    };
+
+    /**
+     * @brief What a watcher applied so far
+     */
+    struct WatchStats {
+        size_t added = 0;
+        size_t removed = 0;
+        size_t moved = 0;
+        // Directories listed again after the event queue overflowed
+        size_t rescanned = 0;
+    };
+
+    /**
+     * @brief Keeps the dir and file tables in sync with the filesystem
+     *
+     * Watches every registered directory with inotify and applies the
+     * changes in batches, one transaction per burst of events. Renames and
+     * moves within the watched directories keep file IDs, so files keep
+     * their tags. New directories are listed and watched, removed ones are
+     * dropped with their files. When the kernel queue overflows, only the
+     * directories modified since they were last synced are listed again.
+     *
+     * Runs on one thread, the one that owns the Database session; only
+     * stop() may be called from other threads.
+     */
+    class Watcher {
+    public:
+        /**
+         * @brief Create a watcher, start() makes it watch
+         * @param db The session to apply the changes with, must outlive the watcher
+         * @param options Watcher settings
+         */
+        explicit Watcher(Database& db, const WatchOptions& options = WatchOptions());
+        ~Watcher();
+        Watcher(const Watcher&) = delete;
+        Watcher& operator=(const Watcher&) = delete;
+
+        /**
+         * @brief Watch every registered directory that exists
+         * @param errmsg SQLite3 error message char**, also used for inotify errors
+         * @retval true Watching
+         * @retval false An error has occurred, e.g. the inotify watch limit was hit
+         */
+        bool start(char** errmsg);
+
+        /**
+         * @brief Wait for a burst of changes and apply it
+         * @param timeoutMs How long to wait for the first event, -1 for no limit
+         * @param errmsg SQLite3 error message char**
+         * @retval -1 An error has occurred, nothing of the burst was applied, the next call retries it
+         * @retval 0 Nothing happened before the timeout, or stop() was called
+         * @retval 1 Changes applied
+         */
+        short poll(int timeoutMs, char** errmsg);
+
+        /**
+         * @brief Apply changes until stop() is called
+         * @param errmsg SQLite3 error message char**
+         * @retval true Stopped
+         * @retval false An error has occurred
+         */
+        bool run(char** errmsg);
+
+        /**
+         * @brief Make run() return, callable from any thread
+         */
+        void stop();
+
+        /**
+         * @brief Get what was applied so far
+         * @return The counters
+         */
+        const WatchStats& stats() const;
+
+    private:
+        struct Event {
+            int wd;
+            uint32_t mask;
+            uint32_t cookie;
+            std::string name;
+        };
+
+        struct WatchedDir {
+            std::string path;
+            // Modification time when the directory was last in sync
+            struct timespec mtime;
+        };
+
+        /**
+         * @brief Read the queued inotify events
+         * @param events Pointer to the std::vector to append the events to
+         * @retval true Events read
+         * @retval false inotify read error
+         */
+        bool readEvents(std::vector<Event>* events);
+
+        /**
+         * @brief Watch a new directory and the directories under it, and add them with their files
+         * @param path Directory path
+         * @param errmsg SQLite3 error message char**, also used for inotify errors
+         * @retval true Added, or the directory is gone already
+         * @retval false An error has occurred
+         */
+        bool addTree(const std::string& path, char** errmsg);
+
+        /**
+         * @brief Stop watching a directory and the directories under it, the watches go once the burst commits
+         * @param path Directory path
+         */
+        void unwatchTree(const std::string& path);
+
+        /**
+         * @brief Apply one burst of events in one transaction
+         * @param events The events, in kernel order
+         * @param errmsg SQLite3 error message char**
+         * @retval true Applied
+         * @retval false An error has occurred, rolled back along with the watches
+         */
+        bool apply(std::vector<Event>& events, char** errmsg);
+
+        bool addEntry(const std::string& dir, const std::string& name, bool isDir, char** errmsg);
+        bool removeEntry(const std::string& dir, const std::string& name, bool isDir, char** errmsg);
+        bool moveEntry(const std::string& fromDir, const std::string& fromName, const std::string& toDir, const std::string& toName, bool isDir, char** errmsg);
+
+        /**
+         * @brief Bring one directory's files and subdirectories in line with the filesystem
+         * @param path Directory path
+         * @param errmsg SQLite3 error message char**
+         * @retval true Directory synced
+         * @retval false An error has occurred
+         */
+        bool rescan(const std::string& path, char** errmsg);
+
+        /**
+         * @brief Remember a directory's modification time as in sync
+         * @param wd Watch descriptor of the directory
+         */
+        void markSynced(int wd);
+
+        Database& db;
+        WatchOptions options;
+        WatchStats counters;
+        int inotifyFd;
+        // Written to by stop()
+        int wakeFd;
+        std::unordered_map<int, WatchedDir> dirs;
+        // Sorted, so the directories under "a" are the range of keys starting with "a/"
+        std::map<std::string, int> wds;
+        // Watches to remove once the burst that dropped them commits
+        std::vector<int> unwatched;
+        // Events of a burst that failed to apply, retried with the next one
+        std::vector<Event> retry;
+    };
+}
+
+#endif
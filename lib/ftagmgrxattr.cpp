@@ -0,0 +1,280 @@
+/**
+ * @file ftagmgrxattr.cpp
+ * @brief FTagMgr extended attribute tag mirror source code
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sqlite3.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "ftagmgrxattr.h"
+#include "ftagmgrmetrics.h"
+
+namespace ftagmgr {
+    namespace {
+        // Format byte of the encoding, bumped if it ever changes
+        const unsigned char xattrFormat = 1;
+
+        // Attribute read size tried first, larger values take a second syscall for their size
+        const size_t xattrReadSize = 4096;
+
+        /**
+         * @brief Append a LEB128 varint
+         * @param out The string
+         * @param value The number
+         */
+        void putVarint(std::string* out, size_t value) {
+            while (value >= 0x80) {
+                out->push_back((char)(value | 0x80));
+                value >>= 7;
+            }
+            out->push_back((char)value);
+        }
+
+        /**
+         * @brief Read a LEB128 varint
+         * @param data The encoding, advanced past the number
+         * @param value Pointer to the return number
+         * @retval true Number read
+         * @retval false Truncated or too long
+         */
+        bool getVarint(std::string_view* data, size_t* value) {
+            size_t result = 0;
+            for (int shift = 0; shift < 35; shift += 7) {
+                if (data->empty()) return false;
+                unsigned char byte = (unsigned char)data->front();
+                data->remove_prefix(1);
+                result |= (size_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    *value = result;
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    /**
+     * @brief Encode tag names for the tag attribute
+     * @param names Tag names, in any order, duplicates are dropped
+     * @param out Pointer to the return std::string, replaced
+     */
+    void encodeTags(std::vector<std::string> names, std::string* out) {
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        out->clear();
+        out->push_back((char)xattrFormat);
+        std::string_view previous;
+        for (const std::string& name : names) {
+            size_t shared = 0;
+            size_t limit = std::min(previous.size(), name.size());
+            while (shared < limit && previous[shared] == name[shared]) shared++;
+            putVarint(out, shared);
+            putVarint(out, name.size() - shared);
+            out->append(name, shared, std::string::npos);
+            previous = name;
+        }
+    }
+
+    /**
+     * @brief Decode the tag attribute
+     * @param data The attribute value
+     * @param names Pointer to the return vector, in ascending order
+     * @retval true Names decoded
+     * @retval false Unknown format or malformed value
+     */
+    bool decodeTags(std::string_view data, std::vector<std::string>* names) {
+        names->clear();
+        if (data.empty() || (unsigned char)data.front() != xattrFormat) return false;
+        data.remove_prefix(1);
+        while (!data.empty()) {
+            size_t shared = 0;
+            size_t rest = 0;
+            if (!getVarint(&data, &shared) || !getVarint(&data, &rest) || rest > data.size()) return false;
+            if (shared > (names->empty() ? 0 : names->back().size())) return false;
+            std::string name = names->empty() ? std::string() : names->back().substr(0, shared);
+            name.append(data.data(), rest);
+            data.remove_prefix(rest);
+            names->push_back(std::move(name));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read the tags of a file from its attribute, with one syscall for most files
+     * @param path Path of the file, symbolic links aren't followed
+     * @param names Pointer to the return vector, in ascending order
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 File couldn't be read or the attribute is malformed
+     * @retval 0 File has no tag attribute
+     * @retval 1 Tags returned
+     */
+    short readTagXattr(const char* path, std::vector<std::string>* names, char** errmsg) {
+        names->clear();
+        char buffer[xattrReadSize];
+        std::string large;
+        ssize_t length = lgetxattr(path, tagXattrName, buffer, sizeof(buffer));
+        const char* data = buffer;
+        // Grown between the two calls, so try until the size holds
+        while (length < 0 && errno == ERANGE) {
+            length = lgetxattr(path, tagXattrName, nullptr, 0);
+            if (length < 0) break;
+            large.resize((size_t)length);
+            length = lgetxattr(path, tagXattrName, large.data(), large.size());
+            data = large.data();
+        }
+        if (length < 0) {
+            if (errno == ENODATA || errno == ENOTSUP) return 0;
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot read %s of %s: %s", tagXattrName, path, strerror(errno));
+            return -1;
+        }
+        if (!decodeTags(std::string_view(data, (size_t)length), names)) {
+            if (errmsg) *errmsg = sqlite3_mprintf("malformed %s of %s", tagXattrName, path);
+            return -1;
+        }
+        return 1;
+    }
+
+    /**
+     * @brief Write the tags of a file to its attribute
+     * @param path Path of the file, symbolic links aren't followed
+     * @param names Tag names, an empty list removes the attribute
+     * @param errmsg SQLite3 error message char**
+     * @retval true Attribute written
+     * @retval false File is missing, the filesystem has no user attributes or the names don't fit
+     */
+    bool writeTagXattr(const char* path, const std::vector<std::string>& names, char** errmsg) {
+        int result;
+        if (names.empty()) {
+            result = lremovexattr(path, tagXattrName);
+            if (result != 0 && errno == ENODATA) result = 0;
+        } else {
+            std::string value;
+            encodeTags(names, &value);
+            result = lsetxattr(path, tagXattrName, value.data(), value.size(), 0);
+        }
+        if (result != 0) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot write %s of %s: %s", tagXattrName, path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void XattrMirror::tagged(unsigned int file, unsigned int) {
+        dirty.push_back(file);
+    }
+
+    void XattrMirror::untagged(unsigned int file, unsigned int) {
+        dirty.push_back(file);
+    }
+
+    void XattrMirror::fileMoved(unsigned int file) {
+        dirty.push_back(file);
+    }
+
+    /**
+     * @brief Write the attributes of the files changed since the last sync
+     * @param db The session to read the tags from
+     * @param stats Pointer to the return MirrorStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Attributes written, files that couldn't be written are counted in stats
+     * @retval false A database error has occurred, the unwritten files stay pending
+     */
+    bool XattrMirror::sync(Database& db, MirrorStats* stats, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_XATTR_SYNC);
+        // A file tagged several times since the last sync is written once
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        MirrorStats counted;
+        bool ok = write(db, &dirty, &counted, errmsg);
+        if (stats) *stats = counted;
+        return ok;
+    }
+
+    /**
+     * @brief Write the attributes of every file in a directory tree, e.g. to start mirroring
+     * @param db The session to read the tags from
+     * @param dir Directory ID, e.g. from findDir()
+     * @param stats Pointer to the return MirrorStats, may be nullptr
+     * @param errmsg SQLite3 error message char**
+     * @retval true Attributes written, files that couldn't be written are counted in stats
+     * @retval false A database error has occurred
+     */
+    bool XattrMirror::mirrorDir(Database& db, unsigned int dir, MirrorStats* stats, char** errmsg) {
+        Metrics::Scope scope(db.getMetrics(), Metrics::OP_XATTR_MIRROR_DIR);
+        std::vector<unsigned int> files;
+        IdCursor cursor;
+        if (!db.listSubtreeFiles(dir, &cursor, errmsg)) return false;
+        int id = 0;
+        short step;
+        while ((step = cursor.next(&id, errmsg)) == 1) files.push_back((unsigned int)id);
+        if (step < 0) return false;
+        MirrorStats counted;
+        bool ok = write(db, &files, &counted, errmsg);
+        if (stats) *stats = counted;
+        return ok;
+    }
+
+    /**
+     * @brief Get the number of changed files waiting for sync()
+     * @return The number of files
+     */
+    size_t XattrMirror::pending() const {
+        std::vector<unsigned int> unique(dirty);
+        std::sort(unique.begin(), unique.end());
+        return std::unique(unique.begin(), unique.end()) - unique.begin();
+    }
+
+    /**
+     * @brief Write the attributes of some files
+     * @param db The session to read the tags from
+     * @param files File IDs, written ones are removed from the front
+     * @param stats Counts the files
+     * @param errmsg SQLite3 error message char**
+     * @retval true Attributes written
+     * @retval false A database error has occurred
+     */
+    bool XattrMirror::write(Database& db, std::vector<unsigned int>* files, MirrorStats* stats, char** errmsg) {
+        std::string path;
+        std::vector<std::string> names;
+        NameCursor cursor;
+        int id = 0;
+        std::string_view name;
+        size_t done = 0;
+        bool ok = true;
+        for (; done < files->size(); done++) {
+            unsigned int file = (*files)[done];
+            char* error = nullptr;
+            if (!db.getFilePath(file, &path, &error)) {
+                // Removed from the database since it changed
+                if (!error) continue;
+                if (errmsg) *errmsg = error;
+                else sqlite3_free(error);
+                ok = false;
+                break;
+            }
+            names.clear();
+            if (!db.listFileTagNames(file, &cursor, errmsg)) {
+                ok = false;
+                break;
+            }
+            short step;
+            while ((step = cursor.next(&id, &name, errmsg)) == 1) names.emplace_back(name);
+            if (step < 0) {
+                ok = false;
+                break;
+            }
+            if (!writeTagXattr(path.c_str(), names, nullptr)) stats->skipped++;
+            else if (names.empty()) stats->cleared++;
+            else stats->written++;
+        }
+        cursor.close();
+        files->erase(files->begin(), files->begin() + done);
+        return ok;
+    }
+}
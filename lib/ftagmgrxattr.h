@@ -0,0 +1,142 @@
+/**
+ * @file ftagmgrxattr.h
+ * @brief FTagMgrLib extended attribute tag mirror header file
+ */
+
+#ifndef FTAGMGRXATTR_H
+#define FTAGMGRXATTR_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ftagmgrlib.h"
+
+namespace ftagmgr {
+    // Extended attribute holding the tag names of a file
+    const char* const tagXattrName = "user.ftagmgr.tags";
+
+    /**
+     * @brief Encode tag names for the tag attribute
+     *
+     * Names are sorted and front coded: after a format byte, every name
+     * is the length of the prefix it shares with the one before, the
+     * length of the rest and the rest, the lengths as LEB128 varints.
+     * Tags under one parent, like "photo/2023" and "photo/2024", then
+     * cost little more than their last segment.
+     *
+     * @param names Tag names, in any order, duplicates are dropped
+     * @param out Pointer to the return std::string, replaced
+     */
+    void encodeTags(std::vector<std::string> names, std::string* out);
+
+    /**
+     * @brief Decode the tag attribute
+     * @param data The attribute value
+     * @param names Pointer to the return vector, in ascending order
+     * @retval true Names decoded
+     * @retval false Unknown format or malformed value
+     */
+    bool decodeTags(std::string_view data, std::vector<std::string>* names);
+
+    /**
+     * @brief Read the tags of a file from its attribute, with one syscall for most files
+     *
+     * Needs no database, so any tool can read the tags of a single file.
+     *
+     * @param path Path of the file, symbolic links aren't followed
+     * @param names Pointer to the return vector, in ascending order
+     * @param errmsg SQLite3 error message char**
+     * @retval -1 File couldn't be read or the attribute is malformed
+     * @retval 0 File has no tag attribute
+     * @retval 1 Tags returned
+     */
+    short readTagXattr(const char* path, std::vector<std::string>* names, char** errmsg);
+
+    /**
+     * @brief Write the tags of a file to its attribute
+     * @param path Path of the file, symbolic links aren't followed
+     * @param names Tag names, an empty list removes the attribute
+     * @param errmsg SQLite3 error message char**
+     * @retval true Attribute written
+     * @retval false File is missing, the filesystem has no user attributes or the names don't fit
+     */
+    bool writeTagXattr(const char* path, const std::vector<std::string>& names, char** errmsg);
+
+    /**
+     * @brief What a mirror pass wrote
+     */
+    struct MirrorStats {
+        // Files whose attribute got their tags
+        size_t written = 0;
+        // Files without tags, their attribute removed
+        size_t cleared = 0;
+        // Files that are missing or whose attribute couldn't be written
+        size_t skipped = 0;
+    };
+
+    /**
+     * @brief Mirrors the tag names of every file into its tag attribute
+     *
+     * The attribute travels with the file when it is moved or renamed
+     * outside of the library, and crawl() with CrawlOptions::readTags
+     * rebuilds the tags of a tree from it. Attach it to a session with
+     * Database::addObserver(): changed files are noted as they change and
+     * written out by sync(), to be called once the transaction making the
+     * changes has committed. The tag hierarchy is kept as far as names
+     * tell it; parents set with setTagParent() and aliases aren't stored.
+     * A file removed from the database keeps its attribute.
+     *
+     * Not thread-safe, use it from the thread of the session it's attached to.
+     */
+    class XattrMirror : public Observer {
+    public:
+        void tagged(unsigned int file, unsigned int tag) override;
+        void untagged(unsigned int file, unsigned int tag) override;
+        void fileMoved(unsigned int file) override;
+
+        /**
+         * @brief Write the attributes of the files changed since the last sync
+         * @param db The session to read the tags from
+         * @param stats Pointer to the return MirrorStats, may be nullptr
+         * @param errmsg SQLite3 error message char**
+         * @retval true Attributes written, files that couldn't be written are counted in stats
+         * @retval false A database error has occurred, the unwritten files stay pending
+         */
+        bool sync(Database& db, MirrorStats* stats, char** errmsg);
+
+        /**
+         * @brief Write the attributes of every file in a directory tree, e.g. to start mirroring
+         * @param db The session to read the tags from
+         * @param dir Directory ID, e.g. from findDir()
+         * @param stats Pointer to the return MirrorStats, may be nullptr
+         * @param errmsg SQLite3 error message char**
+         * @retval true Attributes written, files that couldn't be written are counted in stats
+         * @retval false A database error has occurred
+         */
+        bool mirrorDir(Database& db, unsigned int dir, MirrorStats* stats, char** errmsg);
+
+        /**
+         * @brief Get the number of changed files waiting for sync()
+         * @return The number of files
+         */
+        size_t pending() const;
+
+    private:
+        /**
+         * @brief Write the attributes of some files
+         * @param db The session to read the tags from
+         * @param files File IDs, written ones are removed from the front
+         * @param stats Counts the files
+         * @param errmsg SQLite3 error message char**
+         * @retval true Attributes written
+         * @retval false A database error has occurred
+         */
+        bool write(Database& db, std::vector<unsigned int>* files, MirrorStats* stats, char** errmsg);
+
+        // Changed files, may hold duplicates until sync()
+        std::vector<unsigned int> dirty;
+    };
+}
+
+#endif
@@ -3,8 +3,70 @@
  * @brief FTagMgrLib test utility source code
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
 #include "ftagmgrlib.h"
+#include "ftagmgrasync.h"
+#include "ftagmgrbitmap.h"
+#include "ftagmgrcache.h"
+#include "ftagmgrcooccur.h"
+#include "ftagmgrexport.h"
+#include "ftagmgrhash.h"
+#include "ftagmgrindexer.h"
+#include "ftagmgrmetrics.h"
+#include "ftagmgrpool.h"
+#include "ftagmgrquery.h"
+#include "ftagmgrsearch.h"
+#include "ftagmgrsnapshot.h"
+#include "ftagmgrwatcher.h"
+#include "ftagmgrxattr.h"
+
+/**
+ * @brief Memory resource counting what the arena APIs take from it, passed on to another resource
+ */
+class CountingResource : public std::pmr::memory_resource {
+public:
+    /**
+     * @brief Create a resource in front of another
+     * @param upstream The resource that does the allocations
+     */
+    explicit CountingResource(std::pmr::memory_resource* upstream) : upstream(upstream) {}
+
+    // Number of allocations and bytes taken
+    unsigned long allocations = 0;
+    size_t bytes = 0;
+
+private:
+    std::pmr::memory_resource* upstream;
+
+    void* do_allocate(size_t size, size_t alignment) override {
+        allocations++;
+        bytes += size;
+        return upstream->allocate(size, alignment);
+    }
+
+    void do_deallocate(void* ptr, size_t size, size_t alignment) override {
+        upstream->deallocate(ptr, size, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
 
 /**
  * @brief The main function
@@ -100,6 +162,16 @@ int main() {
         } else std::cout << "FTagMgrLib error." << std::endl;
     }
 
+    // Add and get a directory with a quote in its path
+    std::cout << "Quoted directory path ";
+    if (ftagmgr::addDir("/tmp/it's", &err) && ftagmgr::getDir("/tmp/it's", &err) != -1) {
+        std::cout << "OK." << std::endl;
+    } else if (err) {
+        std::cout << "failed." << std::endl << "SQLite3 error." << std::endl << err << std::endl;
+        sqlite3_free(err);
+        err = nullptr;
+    } else std::cout << "failed." << std::endl << "FTagMgrLib error." << std::endl;
+
     // Check file existence
     sres = -2;
     sres = ftagmgr::fileExists(1, "test.cpp", &err);
@@ -260,5 +332,1274 @@ int main() {
         sqlite3_free(err);
         err = nullptr;
     } else std::cout << "failed." << std::endl << "FTagMgrLib error." << std::endl;
+
+    // Batch file addition, with a file that already exists and a duplicate
+    {
+        ftagmgr::Database db("./test.db");
+        std::vector<int> ids;
+        std::cout << "Batch file addition ";
+        if (!db.addFiles(1, {"a.txt", "b.txt", "test.cpp", "a.txt"}, &ids, &err)) {
+            std::cout << "failed." << std::endl;
+            if (err) {
+                std::cout << "SQLite3 error." << std::endl << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            } else std::cout << "FTagMgrLib error." << std::endl;
+        } else if (ids.size() != 4 || ids[0] == -1 || ids[1] == -1 || ids[0] == ids[1]
+                   || ids[2] != db.getFile(1, "test.cpp", nullptr) || ids[3] != ids[0]
+                   || ids[1] != db.getFile(1, "b.txt", nullptr)) {
+            std::cout << "failed." << std::endl << "Wrong IDs returned." << std::endl;
+        } else std::cout << "OK." << std::endl;
+    }
+
+    // Tag files, list the links both ways and untag
+    {
+        ftagmgr::Database db("./test.db");
+        int file = db.getFile(1, "test.cpp", nullptr);
+        int other = db.getFile(1, "a.txt", nullptr);
+        int tag = db.getTag("sketch", nullptr);
+        db.addTag("draft", nullptr);
+        int draft = db.getTag("draft", nullptr);
+        std::cout << "File tagging ";
+        if (ftagmgr::tagFile(file, tag, &err) && db.tagFiles({{(unsigned int)file, (unsigned int)draft}, {(unsigned int)other, (unsigned int)tag}}, &err)
+            && db.fileHasTag(file, draft, &err) == 1) {
+            std::cout << "OK." << std::endl;
+        } else if (err) {
+            std::cout << "failed." << std::endl << "SQLite3 error." << std::endl << err << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else std::cout << "failed." << std::endl << "FTagMgrLib error." << std::endl;
+
+        // Files with the tag, should be test.cpp and a.txt in ID order
+        std::vector<int> files;
+        ftagmgr::IdCursor cursor;
+        int id = 0;
+        if (db.listTagFiles(tag, &cursor, nullptr)) while (cursor.next(&id, nullptr) == 1) files.push_back(id);
+        std::cout << "Listing files by tag ";
+        if (files == std::vector<int>{file, other}) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << "Wrong files listed." << std::endl;
+
+        // Tags of the file, should be sketch and draft
+        std::vector<int> tags;
+        if (db.listFileTags(file, &cursor, nullptr)) while (cursor.next(&id, nullptr) == 1) tags.push_back(id);
+        std::cout << "Listing tags by file ";
+        if (tags == std::vector<int>{tag, draft}) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << "Wrong tags listed." << std::endl;
+
+        std::cout << "File untagging ";
+        if (db.untagFile(file, draft, nullptr) && !db.untagFile(file, draft, nullptr) && db.fileHasTag(file, draft, nullptr) == 0) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << "Tag still linked." << std::endl;
+    }
+
+    // Tag queries over q0..q9: qa on even files, qb on multiples of 3, qc on files below 5
+    {
+        ftagmgr::Database db("./test.db");
+        std::vector<std::string> names;
+        for (int i = 0; i < 10; i++) names.push_back("q" + std::to_string(i));
+        std::vector<int> files, tags;
+        db.addFiles(1, std::vector<std::string_view>(names.begin(), names.end()), &files, nullptr);
+        db.addTags({"qa", "qb", "qc"}, &tags, nullptr);
+        // Bitmap index built before tagging, kept in sync by the session from here on
+        ftagmgr::TagIndex index;
+        index.build(db, nullptr);
+        db.addObserver(&index);
+        std::vector<ftagmgr::FileTag> links;
+        for (int i = 0; i < 10; i++) {
+            if (i % 2 == 0) links.push_back({(unsigned int)files[i], (unsigned int)tags[0]});
+            if (i % 3 == 0) links.push_back({(unsigned int)files[i], (unsigned int)tags[1]});
+            if (i < 5) links.push_back({(unsigned int)files[i], (unsigned int)tags[2]});
+        }
+        db.tagFiles(links, nullptr);
+        // Query and expected file names
+        std::vector<std::pair<const char*, std::vector<std::string>>> queries = {
+            {"qa qb", {"q0", "q6"}},
+            {"qa & !qc", {"q6", "q8"}},
+            {"qa | qb", {"q0", "q2", "q3", "q4", "q6", "q8", "q9"}},
+            {"!(qa | qb) & qc", {"q1"}},
+            {"qc & (qb | \"qa\") & !q0missing", {"q0", "q2", "q3", "q4"}},
+            {"qa & missing", {}}
+        };
+        for (int useIndex = 0; useIndex < 2; useIndex++) for (const auto& query : queries) {
+            std::cout << (useIndex ? "Bitmap tag query \"" : "Tag query \"") << query.first << "\" ";
+            ftagmgr::QueryResult result;
+            std::vector<std::string> found;
+            std::string name;
+            int id = 0;
+            bool ran = useIndex ? ftagmgr::runQuery(db, index, query.first, &result, &err) : ftagmgr::runQuery(db, query.first, &result, &err);
+            if (!ran) {
+                std::cout << "failed." << std::endl;
+                if (err) {
+                    std::cout << "SQLite3 error." << std::endl << err << std::endl;
+                    sqlite3_free(err);
+                    err = nullptr;
+                } else std::cout << "FTagMgrLib error." << std::endl;
+                continue;
+            }
+            while (result.next(&id, nullptr) == 1) {
+                db.getFileName(id, &name, nullptr);
+                found.push_back(name);
+            }
+            if (found == query.second) std::cout << "OK." << std::endl;
+            else std::cout << "failed." << std::endl << "Wrong files returned." << std::endl;
+        }
+        // Syntax errors are reported through errmsg
+        ftagmgr::QueryResult result;
+        std::cout << "Tag query syntax error ";
+        if (!ftagmgr::runQuery(db, "(qa | qb", &result, &err) && err) {
+            std::cout << "OK. (" << err << ')' << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else std::cout << "failed." << std::endl << "Query with a missing ')' accepted." << std::endl;
+
+        // Untagging through the session updates the index too
+        db.untagFile(files[6], tags[1], nullptr);
+        std::vector<int> found;
+        int id = 0;
+        ftagmgr::runQuery(db, index, "qa qb", &result, nullptr);
+        while (result.next(&id, nullptr) == 1) found.push_back(id);
+        std::cout << "Bitmap index incremental update ";
+        if (found == std::vector<int>{files[0]}) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << "Index out of sync." << std::endl;
+        db.removeObserver(&index);
+    }
+
+    // Co-occurrence counts kept by a session against a fresh build, and against brute force
+    {
+        std::remove("./cooccur.db");
+        ftagmgr::Database db("./cooccur.db");
+        db.createDatabase(nullptr);
+        std::vector<std::string> names, tagNames;
+        for (int i = 0; i < 30; i++) names.push_back("c" + std::to_string(i));
+        for (int i = 0; i < 8; i++) tagNames.push_back("ct" + std::to_string(i));
+        std::vector<int> files, tags;
+        db.addFiles(1, std::vector<std::string_view>(names.begin(), names.end()), &files, nullptr);
+        db.addTags(std::vector<std::string_view>(tagNames.begin(), tagNames.end()), &tags, nullptr);
+        std::mt19937 rng(7);
+        for (int i = 0; i < 60; i++) db.tagFile(files[rng() % files.size()], tags[rng() % tags.size()], nullptr);
+        // Partner lists hold every tag, so the incremental lists stay exact through untagging
+        ftagmgr::TagCooccurrence cooccurrence(8);
+        bool ok = cooccurrence.build(db, &err);
+        db.addObserver(&cooccurrence);
+        for (int i = 0; i < 300; i++) {
+            unsigned int file = files[rng() % files.size()], tag = tags[rng() % tags.size()];
+            if (rng() % 3) db.tagFile(file, tag, nullptr);
+            else db.untagFile(file, tag, nullptr);
+        }
+        db.removeFile(files[0], nullptr);
+        db.removeObserver(&cooccurrence);
+        ftagmgr::TagCooccurrence fresh(8), narrow(2);
+        ok = ok && fresh.build(db, &err) && narrow.build(db, &err);
+        // Brute force from the file listings
+        std::map<std::pair<int, int>, uint32_t> expected;
+        std::map<int, uint32_t> counts;
+        for (int file : files) {
+            ftagmgr::IdCursor cursor;
+            std::vector<int> fileTags;
+            int tag = 0;
+            if (db.listFileTags(file, &cursor, nullptr)) while (cursor.next(&tag, nullptr) == 1) fileTags.push_back(tag);
+            for (int a : fileTags) {
+                counts[a]++;
+                for (int b : fileTags) if (a < b) expected[{a, b}]++;
+            }
+        }
+        for (int a : tags) {
+            ok = ok && cooccurrence.tagCount(a) == counts[a] && fresh.tagCount(a) == counts[a];
+            for (int b : tags) {
+                if (a >= b) continue;
+                uint32_t together = expected[{a, b}];
+                ok = ok && cooccurrence.pairCount(a, b) == together && cooccurrence.pairCount(b, a) == together && fresh.pairCount(a, b) == together;
+            }
+        }
+        // Suggestions for one tag rank its partners by the share of its files they are on
+        std::vector<ftagmgr::TagSuggestion> incremental, built, top2;
+        int given = tags[0];
+        cooccurrence.suggest({(unsigned int)given}, 3, &incremental);
+        fresh.suggest({(unsigned int)given}, 3, &built);
+        narrow.suggest({(unsigned int)given}, 3, &top2);
+        std::vector<std::pair<double, int>> ranked;
+        for (int b : tags) {
+            uint32_t together = b == given ? 0 : expected[{std::min(given, b), std::max(given, b)}];
+            if (together) ranked.push_back({-(double)together / counts[given], b});
+        }
+        std::sort(ranked.begin(), ranked.end());
+        auto matches = [&](const std::vector<ftagmgr::TagSuggestion>& suggestions, size_t count) {
+            if (suggestions.size() != std::min(count, ranked.size())) return false;
+            for (size_t i = 0; i < suggestions.size(); i++) {
+                if ((int)suggestions[i].tag != ranked[i].second || std::abs(suggestions[i].score + ranked[i].first) > 1e-9) return false;
+            }
+            return true;
+        };
+        ok = ok && matches(incremental, 3) && matches(built, 3) && matches(top2, 2);
+        // Two given tags average their shares, neither comes back
+        cooccurrence.suggest({(unsigned int)tags[0], (unsigned int)tags[1], 999999}, 8, &incremental);
+        for (const ftagmgr::TagSuggestion& suggestion : incremental) ok = ok && suggestion.tag != (unsigned int)tags[0] && suggestion.tag != (unsigned int)tags[1];
+        // The planner estimates an intersection by its pair
+        db.setCooccurrence(&fresh);
+        ftagmgr::QueryResult result;
+        std::string expectedPlan = "AND (~" + std::to_string(std::max<uint32_t>(1, expected[{tags[0], tags[1]}])) + " files)";
+        bool planned = ftagmgr::runQuery(db, "ct0 & ct1", &result, nullptr) && result.explain().find(expectedPlan) == 0;
+        db.setCooccurrence(nullptr);
+        std::cout << "Tag co-occurrence ";
+        if (ok && planned) std::cout << "OK. (" << fresh.memoryUsage() << " bytes)" << std::endl;
+        else {
+            std::cout << "failed." << std::endl << result.explain();
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        }
+        db.close();
+        std::remove("./cooccur.db");
+    }
+
+    // Bitmap set operations against std::set, with sparse and dense containers
+    {
+        std::mt19937 rng(42);
+        ftagmgr::Bitmap a, b;
+        std::set<uint32_t> sa, sb;
+        for (int i = 0; i < 20000; i++) {
+            // Dense run in the first container, sparse values spread over the rest
+            uint32_t va = i < 10000 ? rng() % 12000 : rng() % 400000;
+            uint32_t vb = i < 10000 ? rng() % 12000 : rng() % 400000;
+            a.add(va);
+            sa.insert(va);
+            b.add(vb);
+            sb.insert(vb);
+        }
+        for (int i = 0; i < 3000; i++) {
+            uint32_t v = rng() % 12000;
+            a.remove(v);
+            sa.erase(v);
+        }
+        std::vector<uint32_t> expectAnd, expectOr, expectNot;
+        std::set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(expectAnd));
+        std::set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(expectOr));
+        std::set_difference(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(expectNot));
+        uint32_t next = 0;
+        bool seekOk = a.nextFrom(5000, &next) && next == *sa.lower_bound(5000);
+        std::cout << "Bitmap set operations ";
+        if (ftagmgr::Bitmap::intersect(a, b).toVector() == expectAnd && ftagmgr::Bitmap::unite(a, b).toVector() == expectOr
+            && ftagmgr::Bitmap::subtract(a, b).toVector() == expectNot && a.cardinality() == sa.size() && seekOk) {
+            std::cout << "OK." << std::endl;
+        } else std::cout << "failed." << std::endl << "Results differ from std::set." << std::endl;
+    }
+
+    // Concurrent lookups, every thread with its own session
+    {
+        const int rows = 200;
+        const int threads = 8;
+        const int rounds = 20;
+        ftagmgr::Database db("./test.db");
+        sqlite3_exec(db.handle(), "BEGIN;", nullptr, nullptr, nullptr);
+        for (int i = 0; i < rows; i++) {
+            db.addDir(("/tmp/stress/" + std::to_string(i)).c_str(), nullptr);
+            db.addTag(("stress" + std::to_string(i)).c_str(), nullptr);
+        }
+        sqlite3_exec(db.handle(), "COMMIT;", nullptr, nullptr, nullptr);
+        // Expected IDs, looked up once up front
+        std::vector<int> dirIds, tagIds;
+        for (int i = 0; i < rows; i++) {
+            dirIds.push_back(db.getDir(("/tmp/stress/" + std::to_string(i)).c_str(), nullptr));
+            tagIds.push_back(db.getTag(("stress" + std::to_string(i)).c_str(), nullptr));
+        }
+        std::atomic<int> mismatches(0);
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back([&, t]() {
+                ftagmgr::Database session("./test.db");
+                std::string value;
+                for (int r = 0; r < rounds; r++) {
+                    for (int i = (t * 7) % rows, n = 0; n < rows; i = (i + 1) % rows, n++) {
+                        std::string name = std::to_string(i);
+                        if (session.getDir(("/tmp/stress/" + name).c_str(), nullptr) != dirIds[i]) mismatches++;
+                        if (session.getTag(("stress" + name).c_str(), nullptr) != tagIds[i]) mismatches++;
+                        if (!session.getTagValue(tagIds[i], &value, nullptr) || value != "stress" + name) mismatches++;
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : pool) thread.join();
+        std::cout << "Concurrent lookup stress test ";
+        if (mismatches == 0) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << mismatches << " wrong results." << std::endl;
+    }
+
+    // Crawl a tree of 1 + 4 + 16 directories with 5 files each and a symlink at the top
+    {
+        namespace fs = std::filesystem;
+        fs::remove_all("./crawl");
+        std::vector<fs::path> dirs{"./crawl"};
+        for (int level = 0, first = 0; level < 2; level++) {
+            int last = (int)dirs.size();
+            for (int i = first; i < last; i++) for (int j = 0; j < 4; j++) dirs.push_back(dirs[i] / ("d" + std::to_string(j)));
+            first = last;
+        }
+        for (const fs::path& dir : dirs) {
+            fs::create_directories(dir);
+            for (int i = 0; i < 5; i++) std::ofstream(dir / ("f" + std::to_string(i)));
+        }
+        fs::create_symlink("d0", "./crawl/link");
+        ftagmgr::Database db("./test.db");
+        ftagmgr::CrawlOptions options;
+        options.threads = 4;
+        options.batchSize = 16;
+        ftagmgr::CrawlStats stats;
+        std::cout << "Parallel crawl ";
+        bool ok = ftagmgr::crawl(db, "./crawl", options, &stats, &err);
+        // Crawling again must find the same entries and add nothing
+        int before = db.getFile(db.getDir(fs::canonical("./crawl/d3/d2").c_str(), nullptr), "f4", nullptr);
+        ok = ok && ftagmgr::crawl(db, "./crawl/", options, &stats, &err);
+        if (!ok) {
+            std::cout << "failed." << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        } else if (stats.dirs != 21 || stats.files != 106 || stats.unreadable != 0) {
+            std::cout << "failed." << std::endl << stats.dirs << " directories, " << stats.files << " files." << std::endl;
+        } else if (before < 0 || db.getFile(db.getDir(fs::canonical("./crawl/d3/d2").c_str(), nullptr), "f4", nullptr) != before
+                   || db.fileExists(db.getDir(fs::canonical("./crawl").c_str(), nullptr), "link", nullptr) != 1) {
+            std::cout << "failed." << std::endl << "Entries not registered." << std::endl;
+        } else std::cout << "OK." << std::endl;
+        fs::remove_all("./crawl");
+    }
+
+    // Watch a crawled tree and change it behind the database's back
+    {
+        namespace fs = std::filesystem;
+        fs::remove_all("./watch");
+        fs::create_directories("./watch/a");
+        fs::create_directories("./watch/b");
+        for (const char* file : {"./watch/a/x", "./watch/a/y", "./watch/b/z"}) std::ofstream{file};
+        ftagmgr::Database db("./test.db");
+        ftagmgr::crawl(db, "./watch", ftagmgr::CrawlOptions(), nullptr, nullptr);
+        std::string root = fs::canonical("./watch").string();
+        auto fileId = [&](const std::string& dir, const char* name) {
+            int id = db.getDir((root + dir).c_str(), nullptr);
+            return id == -1 ? -1 : db.getFile(id, name, nullptr);
+        };
+        db.addTag("watched", nullptr);
+        int tag = db.getTag("watched", nullptr);
+        int x = fileId("/a", "x");
+        db.tagFile(x, tag, nullptr);
+        ftagmgr::WatchOptions options;
+        options.debounceMs = 50;
+        ftagmgr::Watcher watcher(db, options);
+        std::cout << "Watcher sync ";
+        if (!watcher.start(&err)) {
+            std::cout << "failed." << std::endl << err << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else {
+            fs::rename("./watch/a/x", "./watch/b/x2");
+            std::ofstream{"./watch/a/new"};
+            std::ofstream{"./watch/a/tmp"};
+            fs::remove("./watch/a/tmp");
+            fs::remove("./watch/b/z");
+            fs::create_directories("./watch/a/sub");
+            std::ofstream{"./watch/a/sub/f"};
+            fs::rename("./watch/b", "./watch/c");
+            while (watcher.poll(200, &err) == 1) {}
+            if (err) {
+                std::cout << "failed." << std::endl << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            } else if (fileId("/c", "x2") != x || db.fileHasTag(x, tag, nullptr) != 1 || fileId("/a", "new") == -1
+                       || fileId("/a", "tmp") != -1 || fileId("/c", "z") != -1 || db.getDir((root + "/b").c_str(), nullptr) != -1
+                       || fileId("/a/sub", "f") == -1) {
+                std::cout << "failed." << std::endl << "Database out of sync." << std::endl;
+            } else std::cout << "OK." << std::endl;
+
+            // More events than the kernel queues, only the changed directory should be listed again
+            std::cout << "Watcher queue overflow ";
+            for (int i = 0; i < 17000; i++) std::ofstream{"./watch/c/n" + std::to_string(i)};
+            while (watcher.poll(200, nullptr) == 1) {}
+            int files = 0, id = 0;
+            ftagmgr::IdCursor cursor;
+            if (db.listDirFiles(db.getDir((root + "/c").c_str(), nullptr), &cursor, nullptr)) while (cursor.next(&id, nullptr) == 1) files++;
+            if (watcher.stats().rescanned == 1 && files == 17001) std::cout << "OK." << std::endl;
+            else std::cout << "failed." << std::endl << watcher.stats().rescanned << " directories rescanned, " << files << " files." << std::endl;
+
+            // A burst that can't be written is retried, with the watches as they were before it
+            std::cout << "Watcher retry ";
+            sqlite3* locker = nullptr;
+            sqlite3_open("./test.db", &locker);
+            sqlite3_exec(locker, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+            sqlite3_busy_timeout(db.handle(), 0);
+            fs::create_directories("./watch/c/later");
+            std::ofstream{"./watch/c/later/f"};
+            fs::rename("./watch/a/sub", "./watch/c/sub2");
+            bool failed = watcher.poll(200, &err) == -1;
+            sqlite3_free(err);
+            err = nullptr;
+            sqlite3_exec(locker, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_close(locker);
+            bool retried = watcher.poll(0, nullptr) == 1 && fileId("/c/later", "f") != -1 && fileId("/c/sub2", "f") != -1;
+            std::ofstream{"./watch/c/later/g"};
+            std::ofstream{"./watch/c/sub2/g"};
+            while (watcher.poll(200, nullptr) == 1) {}
+            sqlite3_busy_timeout(db.handle(), 5000);
+            if (failed && retried && fileId("/c/later", "g") != -1 && fileId("/c/sub2", "g") != -1) std::cout << "OK." << std::endl;
+            else std::cout << "failed." << std::endl << failed << retried << std::endl;
+
+            // "s-old" sorts between "s" and "s/sub", the watch of s/sub still has to follow the rename
+            std::cout << "Watcher sibling rename ";
+            fs::create_directories("./watch/s/sub");
+            fs::create_directories("./watch/s-old");
+            while (watcher.poll(200, nullptr) == 1) {}
+            fs::rename("./watch/s", "./watch/t");
+            while (watcher.poll(200, nullptr) == 1) {}
+            std::ofstream{"./watch/t/sub/new.txt"};
+            while (watcher.poll(200, nullptr) == 1) {}
+            if (fileId("/t/sub", "new.txt") != -1 && db.getDir((root + "/s-old").c_str(), nullptr) != -1) std::cout << "OK." << std::endl;
+            else std::cout << "failed." << std::endl;
+        }
+        fs::remove_all("./watch");
+    }
+
+    // Fingerprint a tree, then move files behind the database's back and rescan
+    {
+        namespace fs = std::filesystem;
+        std::cout << "XXH64 ";
+        std::string big(3 * 1024 * 1024 + 7, '\0');
+        std::mt19937_64 random(7);
+        for (char& c : big) c = (char)random();
+        ftagmgr::Hasher chunked;
+        for (size_t at = 0, step = 1; at < big.size(); at += step, step = step * 3 % 1000 + 1) chunked.update(big.data() + at, std::min(step, big.size() - at));
+        const char* phrase = "Nobody inspects the spammish repetition";
+        if (ftagmgr::hash64("", 0) == 0xEF46DB3751D8E999ULL && ftagmgr::hash64("abc", 3) == 0x44BC2CF5AD770999ULL
+            && ftagmgr::hash64(phrase, std::strlen(phrase)) == 0xFBCEA83C8A378BF1ULL && chunked.digest() == ftagmgr::hash64(big.data(), big.size())) {
+            std::cout << "OK." << std::endl;
+        } else std::cout << "failed." << std::endl;
+
+        fs::remove_all("./hash");
+        fs::create_directories("./hash/a");
+        fs::create_directories("./hash/b");
+        std::ofstream("./hash/a/one") << "alpha";
+        std::ofstream("./hash/a/two") << "beta";
+        std::ofstream("./hash/a/copy") << "alpha";
+        std::ofstream("./hash/a/three") << "gamma";
+        std::ofstream("./hash/b/big", std::ios::binary) << big;
+        ftagmgr::Database db("./test.db");
+        ftagmgr::crawl(db, "./hash", ftagmgr::CrawlOptions(), nullptr, nullptr);
+        std::string root = fs::canonical("./hash").string();
+        auto fileId = [&](const std::string& dir, const char* name) {
+            int id = db.getDir((root + dir).c_str(), nullptr);
+            return id == -1 ? -1 : db.getFile(id, name, nullptr);
+        };
+        db.addTag("hashed", nullptr);
+        int tag = db.getTag("hashed", nullptr);
+        int two = fileId("/a", "two"), three = fileId("/a", "three");
+        db.tagFile(two, tag, nullptr);
+        db.tagFile(three, tag, nullptr);
+        ftagmgr::HashOptions options;
+        options.threads = 3;
+        options.batchSize = 2;
+        ftagmgr::HashStats first, second, third;
+        std::cout << "Content hashing ";
+        bool ok = ftagmgr::hashTree(db, "./hash", options, &first, &err);
+        std::vector<ftagmgr::DuplicateGroup> groups;
+        ok = ok && ftagmgr::findDuplicates(db, db.findDir(root.c_str(), nullptr), &groups, &err);
+        // Nothing changed, a second pass only stats
+        ok = ok && ftagmgr::hashTree(db, "./hash", options, &second, &err);
+        ftagmgr::Fingerprint stored{};
+        if (!ok) {
+            std::cout << "failed." << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        } else if (first.hashed != 5 || first.bytes != 19 + big.size() || second.unchanged != 5 || second.hashed != 0
+                   || groups.size() != 1 || groups[0].files != std::vector<unsigned int>{(unsigned int)fileId("/a", "one"), (unsigned int)fileId("/a", "copy")}
+                   || db.getFileFingerprint(fileId("/b", "big"), &stored, nullptr) != 1 || stored.hash != ftagmgr::hash64(big.data(), big.size())) {
+            std::cout << "failed." << std::endl << first.hashed << " hashed, " << second.unchanged << " unchanged, " << groups.size() << " duplicate groups." << std::endl;
+        } else std::cout << "OK." << std::endl;
+
+        // A rename keeps the inode, a copy and delete only the content
+        std::cout << "Moved file tracking ";
+        fs::rename("./hash/a/two", "./hash/b/renamed");
+        fs::remove("./hash/a/three");
+        std::ofstream("./hash/b/copied") << "gamma";
+        fs::remove("./hash/a/copy");
+        ok = ftagmgr::crawl(db, "./hash", ftagmgr::CrawlOptions(), nullptr, &err) && ftagmgr::hashTree(db, "./hash", options, &third, &err);
+        if (!ok) {
+            std::cout << "failed." << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        } else if (third.moved != 2 || third.hashed != 1 || third.missing != 1 || fileId("/b", "renamed") != two || fileId("/b", "copied") != three
+                   || db.fileHasTag(two, tag, nullptr) != 1 || db.fileHasTag(three, tag, nullptr) != 1 || fileId("/a", "two") != -1) {
+            std::cout << "failed." << std::endl << third.moved << " moved, " << third.hashed << " hashed, " << third.missing << " missing." << std::endl;
+        } else std::cout << "OK." << std::endl;
+        fs::remove_all("./hash");
+    }
+
+    // Tags mirrored into file attributes follow a file moved behind the database's back into a rebuilt database
+    {
+        namespace fs = std::filesystem;
+        std::cout << "Tag attribute encoding ";
+        std::string encoded;
+        std::vector<std::string> decoded;
+        ftagmgr::encodeTags({"photo/2024", "photo/2023", "a", "photo/2023", ""}, &encoded);
+        std::vector<std::string> expected{"", "a", "photo/2023", "photo/2024"};
+        // Format byte, then shared prefix, rest length and rest per name
+        bool ok = ftagmgr::decodeTags(encoded, &decoded) && decoded == expected && encoded.size() == 1 + 2 + 3 + 12 + 3;
+        ok = ok && !ftagmgr::decodeTags(std::string("\x01\x05\x01x", 4), &decoded) && !ftagmgr::decodeTags(std::string("\x02", 1), &decoded)
+             && !ftagmgr::decodeTags(std::string("\x01\x00\x09" "ab", 5), &decoded);
+        std::cout << (ok ? "OK." : "failed.") << std::endl;
+
+        fs::remove_all("./xattr");
+        fs::create_directories("./xattr/a");
+        fs::create_directories("./xattr/b");
+        std::ofstream("./xattr/a/one") << "one";
+        std::ofstream("./xattr/a/two") << "two";
+        std::remove("./xattr.db");
+        std::remove("./xattr2.db");
+        ftagmgr::Database db("./xattr.db");
+        db.createDatabase(nullptr);
+        ftagmgr::crawl(db, "./xattr", ftagmgr::CrawlOptions(), nullptr, nullptr);
+        std::string root = fs::canonical("./xattr").string();
+        int a = db.getDir((root + "/a").c_str(), nullptr);
+        int one = db.getFile(a, "one", nullptr), two = db.getFile(a, "two", nullptr);
+        std::vector<int> tags;
+        db.addTags({"photo/2024", "work"}, &tags, nullptr);
+        ftagmgr::XattrMirror mirror;
+        db.addObserver(&mirror);
+        db.tagFiles({{(unsigned int)one, (unsigned int)tags[0]}, {(unsigned int)one, (unsigned int)tags[1]}, {(unsigned int)two, (unsigned int)tags[1]}}, nullptr);
+        std::cout << "Tag attribute mirror ";
+        ftagmgr::MirrorStats first, second;
+        std::vector<std::string> names;
+        ok = mirror.pending() == 2 && mirror.sync(db, &first, &err) && mirror.pending() == 0;
+        short read = ftagmgr::readTagXattr((root + "/a/one").c_str(), &names, nullptr);
+        db.untagFile(two, tags[1], nullptr);
+        ok = ok && mirror.sync(db, &second, &err);
+        db.removeObserver(&mirror);
+        if (!ok) {
+            std::cout << "failed." << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        } else if (first.written == 2 && second.cleared == 1 && read == 1 && names == std::vector<std::string>{"photo/2024", "work"}
+                   && ftagmgr::readTagXattr((root + "/a/two").c_str(), &names, nullptr) == 0) {
+            std::cout << "OK." << std::endl;
+        } else if (first.skipped == 2) {
+            // Filesystems without user attributes can't hold the mirror
+            std::cout << "skipped." << std::endl;
+        } else std::cout << "failed." << std::endl << first.written << " written, " << second.cleared << " cleared." << std::endl;
+
+        // Moved outside of the library, then crawled into a new database
+        fs::rename("./xattr/a/one", "./xattr/b/moved");
+        ftagmgr::Database rebuilt("./xattr2.db");
+        rebuilt.createDatabase(nullptr);
+        ftagmgr::CrawlOptions options;
+        options.readTags = true;
+        options.threads = 2;
+        ftagmgr::CrawlStats stats;
+        std::cout << "Rebuild from tag attributes ";
+        if (first.skipped == 2) std::cout << "skipped." << std::endl;
+        else if (!ftagmgr::crawl(rebuilt, "./xattr", options, &stats, &err)) {
+            std::cout << "failed." << std::endl << err << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else {
+            int moved = rebuilt.getFile(rebuilt.getDir((root + "/b").c_str(), nullptr), "moved", nullptr);
+            int photo = rebuilt.getTag("photo/2024", nullptr), work = rebuilt.getTag("work", nullptr);
+            if (stats.files == 2 && stats.tagged == 1 && moved > 0 && rebuilt.fileHasTag(moved, photo, nullptr) == 1 && rebuilt.fileHasTag(moved, work, nullptr) == 1
+                && rebuilt.getTagParent(photo, nullptr) == rebuilt.getTag("photo", nullptr) && rebuilt.getTagFileCount(work, nullptr) == 1) {
+                std::cout << "OK." << std::endl;
+            } else std::cout << "failed." << std::endl << stats.tagged << " tagged." << std::endl;
+        }
+        fs::remove_all("./xattr");
+        db.close();
+        rebuilt.close();
+        std::remove("./xattr.db");
+        std::remove("./xattr2.db");
+    }
+
+    // Readers of a pool see committed data while the writer holds a transaction open
+    {
+        ftagmgr::ConnectionPool pool;
+        std::cout << "Connection pool ";
+        if (!pool.open("./test.db", 4, ftagmgr::Tunables(), &err)) {
+            std::cout << "failed." << std::endl << err << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else {
+            ftagmgr::ConnectionPool::Lease writer = pool.writer();
+            writer->begin(nullptr);
+            writer->addTag("uncommitted", nullptr);
+            std::atomic<int> wrong(0);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; i++) {
+                threads.emplace_back([&]() {
+                    ftagmgr::ConnectionPool::Lease reader = pool.reader();
+                    if (reader->getTag("sketch", nullptr) == -1 || reader->tagExists("uncommitted", nullptr) != 0) wrong++;
+                    // Read-only sessions refuse writes
+                    if (reader->addTag("readonly", nullptr)) wrong++;
+                });
+            }
+            for (std::thread& thread : threads) thread.join();
+            writer->commit(nullptr);
+            std::string mode;
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(writer->handle(), "PRAGMA journal_mode;", -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+                mode = (const char*)sqlite3_column_text(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+            if (wrong == 0 && mode == "wal" && pool.reader()->tagExists("uncommitted", nullptr) == 1) std::cout << "OK." << std::endl;
+            else std::cout << "failed." << std::endl << wrong << " wrong reads, journal mode " << mode << '.' << std::endl;
+        }
+    }
+
+    // Writes from several threads share transactions, a failing one is undone alone
+    {
+        std::cout << "Async writes ";
+        std::remove("./async.db");
+        ftagmgr::Database("./async.db").createDatabase(nullptr);
+        ftagmgr::AsyncDatabase async;
+        ftagmgr::AsyncOptions options;
+        options.readers = 2;
+        options.queueCapacity = 64;
+        if (!async.open("./async.db", options, &err)) {
+            std::cout << "failed." << std::endl << err << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else {
+            std::atomic<int> called(0);
+            std::vector<std::future<ftagmgr::AsyncResult>> futures[4];
+            std::vector<std::thread> producers;
+            for (int t = 0; t < 4; t++) {
+                producers.emplace_back([&, t]() {
+                    for (int i = 0; i < 250; i++) {
+                        futures[t].push_back(async.addTag("async " + std::to_string(t * 250 + i), [&](const ftagmgr::AsyncResult&) { called++; }));
+                    }
+                });
+            }
+            for (std::thread& thread : producers) thread.join();
+            std::future<ftagmgr::AsyncResult> failing = async.write([](ftagmgr::Database& db, char** errmsg) {
+                db.addTag("undone", nullptr);
+                *errmsg = sqlite3_mprintf("refused");
+                return -1;
+            });
+            std::future<ftagmgr::AsyncResult> kept = async.addTag("kept");
+            bool flushed = async.flush().get().value == 1;
+            std::set<int> ids;
+            for (auto& list : futures) for (auto& future : list) ids.insert(future.get().value);
+            ftagmgr::AsyncResult undone = failing.get();
+            int keptId = kept.get().value;
+            // Reads run on the read-only sessions, after the flush they see every write
+            int found = async.read([&](ftagmgr::Database& db, char**) {
+                int count = 0;
+                for (int i = 0; i < 1000; i++) count += db.tagExists(("async " + std::to_string(i)).c_str(), nullptr) == 1;
+                return count + (db.tagExists("undone", nullptr) == 1 ? 10000 : 0) + (db.getTag("kept", nullptr) == keptId ? 100000 : 0);
+            }).get().value;
+            if (flushed && called == 1000 && ids.size() == 1000 && *ids.begin() > 0 && undone.error == "refused" && found == 101000) std::cout << "OK." << std::endl;
+            else std::cout << "failed." << std::endl << ids.size() << " IDs, " << called << " callbacks, " << found << " found, error " << undone.error << '.' << std::endl;
+        }
+    }
+
+    // A full queue refuses requests at once when asked to, and a closed session refuses them all
+    {
+        std::cout << "Async backpressure ";
+        ftagmgr::AsyncDatabase async;
+        ftagmgr::AsyncOptions options;
+        options.readers = 1;
+        options.queueCapacity = 1;
+        options.failWhenFull = true;
+        async.open("./async.db", options, nullptr);
+        std::promise<void> started;
+        std::promise<void> release;
+        std::shared_future<void> released = release.get_future().share();
+        std::future<ftagmgr::AsyncResult> busy = async.write([&](ftagmgr::Database&, char**) {
+            started.set_value();
+            released.wait();
+            return 1;
+        });
+        started.get_future().wait();
+        std::future<ftagmgr::AsyncResult> queued = async.addTag("queued");
+        std::string refused = async.addTag("refused").get().error;
+        release.set_value();
+        bool done = busy.get().value == 1 && queued.get().value > 0;
+        async.close();
+        std::string closed = async.addTag("closed").get().error;
+        if (done && refused == "request queue is full" && closed == "async session is closed" && !async.isOpen()) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << "Refused: " << refused << ", closed: " << closed << '.' << std::endl;
+        std::remove("./async.db");
+    }
+
+    // Build a directory tree, query a subtree and move it around
+    {
+        ftagmgr::Database db("./test.db");
+        std::cout << "Directory tree ";
+        auto collect = [](ftagmgr::IdCursor& cursor) {
+            std::vector<int> ids;
+            int id = 0;
+            while (cursor.next(&id, nullptr) == 1) ids.push_back(id);
+            return ids;
+        };
+        // Ancestors are added implicitly and stay hidden until added for real
+        bool added = db.addDir("/tree//a/b/", nullptr) && db.getDir("/tree/a/b", nullptr) >= 0;
+        std::string hiddenPath;
+        bool hidden = db.dirExists("/tree/a", nullptr) == 0 && db.getDir("/tree", nullptr) == -1 && db.findDir("/tree", nullptr) >= 0
+                      && db.getDirPath(db.findDir("/tree", nullptr), &hiddenPath, nullptr) && hiddenPath.empty();
+        bool registered = db.addDir("/tree/a", nullptr) && db.dirExists("/tree/a", nullptr) == 1 && !db.addDir("/tree/a/", nullptr);
+        db.addDir("/tree/c", nullptr);
+        int a = db.getDir("/tree/a", nullptr), b = db.getDir("/tree/a/b", nullptr), c = db.getDir("/tree/c", nullptr);
+        db.addFile(a, "fa", nullptr);
+        db.addFile(b, "fb", nullptr);
+        db.addFile(c, "fc", nullptr);
+        int fa = db.getFile(a, "fa", nullptr), fb = db.getFile(b, "fb", nullptr), fc = db.getFile(c, "fc", nullptr);
+        db.addTag("treetag", nullptr);
+        db.tagFile(fb, db.getTag("treetag", nullptr), nullptr);
+        db.tagFile(fc, db.getTag("treetag", nullptr), nullptr);
+        ftagmgr::IdCursor cursor;
+        db.listSubtreeFiles(a, &cursor, nullptr);
+        bool subtree = collect(cursor) == std::vector<int>{fa, fb};
+        ftagmgr::TagIndex index;
+        index.build(db, nullptr);
+        ftagmgr::QueryResult result;
+        int file = 0;
+        bool queried = ftagmgr::runQuery(db, "@/tree treetag", &result, nullptr) && result.next(&file, nullptr) == 1 && file == fb
+                       && result.next(&file, nullptr) == 1 && file == fc && result.next(&file, nullptr) == 0
+                       && ftagmgr::runQuery(db, "@/tree/a treetag", &result, nullptr) && result.next(&file, nullptr) == 1 && file == fb
+                       && result.next(&file, nullptr) == 0 && ftagmgr::runQuery(db, index, "treetag !@\"/tree/a\"", &result, nullptr)
+                       && result.next(&file, nullptr) == 1 && file == fc && result.next(&file, nullptr) == 0;
+        // A directory can't go inside itself, but can go anywhere else with its whole subtree
+        std::string path;
+        bool moved = !db.moveDir(a, "/tree/a/b/x", nullptr) && db.moveDir(a, "/tree/c/a", nullptr)
+                     && db.getFilePath(fb, &path, nullptr) && path == "/tree/c/a/b/fb" && db.getDir("/tree/a/b", nullptr) == -1;
+        db.listSubtreeDirs(c, &cursor, nullptr);
+        // b was added before its implicit ancestor a, so it has the lower ID
+        moved = moved && collect(cursor) == std::vector<int>{b, a, c};
+        bool removed = db.removeDir(c, nullptr) && db.dirExists("/tree/c/a/b", nullptr) == 0;
+        db.listSubtreeDirs(c, &cursor, nullptr);
+        removed = removed && collect(cursor).empty();
+        // The session's own name cache drops what another connection changed
+        ftagmgr::Database other("./test.db");
+        db.addDir("/tree/d", nullptr);
+        int d = db.getDir("/tree/d", nullptr);
+        bool fresh = other.moveDir(d, "/tree/e", nullptr) && db.getDir("/tree/d", nullptr) == -1 && db.getDir("/tree/e", nullptr) == d
+                     && db.getDirPath(d, &path, nullptr) && path == "/tree/e";
+        if (added && hidden && registered && subtree && queried && moved && removed && fresh) std::cout << "OK." << std::endl;
+        else {
+            std::cout << "failed." << std::endl << added << hidden << registered << subtree << queried << moved << removed << fresh << std::endl;
+        }
+    }
+
+    // Resolve names through a shared cache, then move a tree under it
+    {
+        ftagmgr::NameCache cache;
+        ftagmgr::Database db("./test.db");
+        ftagmgr::Database other("./test.db");
+        db.setCache(&cache);
+        other.setCache(&cache);
+        std::cout << "Name cache ";
+        db.addDir("/cache/a", nullptr);
+        db.addDir("/cache/a/b", nullptr);
+        db.addTag("cached", nullptr);
+        int dir = db.getDir("/cache/a/b", nullptr);
+        int tag = db.getTag("cached", nullptr);
+        std::string path, value;
+        ftagmgr::NameCache::Stats before = cache.stats();
+        // Filled on insert, so these never reach the database
+        bool hit = other.getDir("/cache/a/b", nullptr) == dir && other.getTag("cached", nullptr) == tag
+                   && other.getDirPath(dir, &path, nullptr) && other.getTagValue(tag, &value, nullptr) && value == "cached";
+        ftagmgr::NameCache::Stats after = cache.stats();
+        // Adding a tag that exists changes nothing, the cache included
+        bool kept = !db.addTag("cached", nullptr) && cache.stats().entries == after.entries;
+        bool moved = db.moveDir(db.getDir("/cache/a", nullptr), "/cache/c", nullptr);
+        path.clear();
+        bool invalidated = other.getDir("/cache/a/b", nullptr) == -1 && other.getDir("/cache/c/b", nullptr) == dir
+                           && other.getDirPath(dir, &path, nullptr) && path == "/cache/c/b";
+        // A small budget keeps the cache small whatever is looked up
+        ftagmgr::NameCache small(4096, 1);
+        db.setCache(&small);
+        for (int i = 0; i < 200; i++) db.addDir(("/cache/many/" + std::to_string(i)).c_str(), nullptr);
+        ftagmgr::NameCache::Stats bounded = small.stats();
+        db.setCache(nullptr);
+        if (hit && after.hits - before.hits == 4 && after.misses == before.misses && kept && moved && invalidated
+            && bounded.bytes <= 4096 && bounded.evictions > 0 && db.getDir("/cache/many/0", nullptr) >= 0) {
+            std::cout << "OK." << std::endl;
+        } else {
+            std::cout << "failed." << std::endl << after.hits - before.hits << " hits, " << bounded.bytes << " bytes cached." << std::endl;
+        }
+    }
+
+    // Stream names and copy them into an arena without touching the heap
+    {
+        ftagmgr::Database db("./test.db");
+        std::cout << "Zero-copy names ";
+        db.addDir("/zerocopy", nullptr);
+        int dir = db.getDir("/zerocopy", nullptr);
+        std::vector<std::string> names;
+        for (int i = 0; i < 20000; i++) names.push_back("name" + std::to_string(i));
+        std::vector<std::string_view> views(names.begin(), names.end());
+        std::vector<int> ids;
+        db.addFiles(dir, views, &ids, nullptr);
+        db.addTag("zctag", nullptr);
+        db.tagFile(ids[0], db.getTag("zctag", nullptr), nullptr);
+        ftagmgr::NameCursor cursor;
+        int id = 0;
+        std::string_view name;
+        size_t rows = 0;
+        bool match = true;
+        if (db.listDirFileNames(dir, &cursor, nullptr)) {
+            while (cursor.next(&id, &name, nullptr) == 1) {
+                match = match && rows < ids.size() && id == ids[rows] && name == names[rows];
+                rows++;
+            }
+        }
+        // Arena lookups copy each result once, into a buffer that can't fall back to the heap
+        std::vector<char> buffer(1024 * 1024);
+        std::pmr::monotonic_buffer_resource fixed(buffer.data(), buffer.size(), std::pmr::null_memory_resource());
+        CountingResource arena(&fixed);
+        std::string_view first, path, tag;
+        size_t expected = std::string_view("/zerocopy/name1").size() + std::string_view("zctag").size();
+        for (size_t i = 0; i < ids.size(); i++) {
+            db.getFileName(ids[i], &arena, &views[i], nullptr);
+            expected += names[i].size();
+        }
+        db.getFilePath(ids[1], &arena, &path, nullptr);
+        db.getTagValue(db.getTag("zctag", nullptr), &arena, &tag, nullptr);
+        bool copied = arena.allocations == ids.size() + 2 && arena.bytes == expected;
+        bool kept = std::equal(views.begin(), views.end(), names.begin()) && path == "/zerocopy/name1" && tag == "zctag";
+        db.listFileTagNames(ids[0], &cursor, nullptr);
+        bool tagged = cursor.next(&id, &name, nullptr) == 1 && name == "zctag" && cursor.next(&id, &name, nullptr) == 0;
+        db.listTagFileNames(db.getTag("zctag", nullptr), &cursor, nullptr);
+        tagged = tagged && cursor.next(&id, &name, nullptr) == 1 && id == ids[0] && name == "name0";
+        if (rows == names.size() && match && copied && kept && tagged) std::cout << "OK." << std::endl;
+        else {
+            std::cout << "failed." << std::endl << rows << " rows, " << arena.allocations << " allocations and "
+                      << arena.bytes << " bytes copying, " << kept << tagged << std::endl;
+        }
+    }
+
+    // Build a tag hierarchy with an alias, query it on every backend, move part of it and carry it through an export
+    {
+        ftagmgr::Database db("./test.db");
+        std::cout << "Tag hierarchy ";
+        // Parents come from the names
+        bool added = db.addTag("hier/2024/paris", nullptr) && db.tagExists("hier/2024", nullptr) == 1 && !db.addTag("hier/2024", nullptr);
+        std::vector<int> ids;
+        added = added && db.addTags({"hier/2024/rome", "hier/2023", "pics", "france"}, &ids, nullptr);
+        int hier = db.getTag("hier", nullptr), year = db.getTag("hier/2024", nullptr), paris = db.getTag("hier/2024/paris", nullptr);
+        int pics = ids[2], france = ids[3];
+        added = added && db.getTagParent(paris, nullptr) == year && db.getTagParent(year, nullptr) == hier && db.getTagParent(hier, nullptr) == 0;
+        db.addDir("/hier", nullptr);
+        int dir = db.getDir("/hier", nullptr);
+        std::vector<int> files;
+        db.addFiles(dir, {"paris.jpg", "rome.jpg", "old.jpg", "pic.jpg"}, &files, nullptr);
+        db.tagFiles({{(unsigned int)files[0], (unsigned int)paris}, {(unsigned int)files[1], (unsigned int)ids[0]},
+                     {(unsigned int)files[2], (unsigned int)ids[1]}, {(unsigned int)files[3], (unsigned int)pics}}, nullptr);
+        bool aliased = db.setTagAlias(pics, hier, nullptr) && db.getTagAlias(pics, nullptr) == hier && !db.setTagAlias(hier, pics, nullptr);
+        bool moved = db.setTagParent(paris, france, nullptr) && !db.setTagParent(france, paris, nullptr) && !db.setTagParent(hier, year, nullptr);
+        ftagmgr::TagIndex index;
+        index.build(db, nullptr);
+        ftagmgr::Snapshot snapshot;
+        bool ok = ftagmgr::compileSnapshot(db, "./hier.snap", &err) && snapshot.open("./hier.snap", &err);
+        // Every backend has to agree with the expected files
+        const std::pair<const char*, std::vector<int>> cases[] = {
+            {"hier", {files[1], files[2], files[3]}},
+            {"pics", {files[1], files[2], files[3]}},
+            {"hier/2024", {files[1]}},
+            {"france", {files[0]}},
+            {"hier !hier/2023", {files[1], files[3]}},
+            {"france | hier/2024", {files[0], files[1]}}
+        };
+        bool queried = ok;
+        for (const auto& [expression, expected] : cases) {
+            for (int backend = 0; backend < 3 && queried; backend++) {
+                ftagmgr::QueryResult result;
+                if (backend == 0) queried = ftagmgr::runQuery(db, expression, &result, nullptr);
+                else if (backend == 1) queried = ftagmgr::runQuery(db, index, expression, &result, nullptr);
+                else queried = ftagmgr::runQuery(snapshot, expression, &result, nullptr);
+                std::vector<int> found;
+                int file = 0;
+                while (result.next(&file, nullptr) == 1) found.push_back(file);
+                queried = queried && found == expected;
+            }
+        }
+        queried = queried && snapshot.getTagAlias(pics) == hier && snapshot.getTagParent(paris) == france
+                  && snapshot.listSubtreeTags(hier).size() == 5;
+        // Only the relations the names don't imply travel as their own records
+        std::remove("./hiercopy.db");
+        ftagmgr::Database copy("./hiercopy.db");
+        copy.createDatabase(nullptr);
+        bool carried = ftagmgr::exportDatabase(db, "./hier.ftx", ftagmgr::ExportOptions(), nullptr, &err)
+                       && ftagmgr::importDatabase(copy, "./hier.ftx", ftagmgr::ImportOptions(), nullptr, &err);
+        int copyHier = copy.getTag("hier", nullptr);
+        carried = carried && copy.getTagAlias(copy.getTag("pics", nullptr), nullptr) == copyHier
+                  && copy.getTagParent(copy.getTag("hier/2024/paris", nullptr), nullptr) == copy.getTag("france", nullptr)
+                  && copy.getTagParent(copy.getTag("hier/2024/rome", nullptr), nullptr) == copy.getTag("hier/2024", nullptr);
+        if (added && aliased && moved && queried && carried) std::cout << "OK." << std::endl;
+        else {
+            std::cout << "failed." << std::endl << added << aliased << moved << queried << carried << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        }
+    }
+
+    // Export the test database, import it into an empty one and merge it in again
+    {
+        ftagmgr::Database db("./test.db");
+        std::cout << "Export round trip ";
+        // Every directory path, and every file path with its tags, as one set of lines
+        // Implicit directories holding files come back as added ones
+        auto dump = [](ftagmgr::Database& session) {
+            std::set<std::string> lines;
+            std::vector<int> dirs, files;
+            sqlite3_stmt* stmt = nullptr;
+            sqlite3_prepare_v2(session.handle(), "SELECT id FROM dir WHERE implicit = 0 OR id IN (SELECT dir FROM file);", -1, &stmt, nullptr);
+            while (sqlite3_step(stmt) == SQLITE_ROW) dirs.push_back(sqlite3_column_int(stmt, 0));
+            sqlite3_finalize(stmt);
+            sqlite3_prepare_v2(session.handle(), "SELECT id FROM file;", -1, &stmt, nullptr);
+            while (sqlite3_step(stmt) == SQLITE_ROW) files.push_back(sqlite3_column_int(stmt, 0));
+            sqlite3_finalize(stmt);
+            std::string path, tag;
+            for (int dir : dirs) {
+                session.getDirPath(dir, &path, nullptr);
+                lines.insert("dir " + path);
+            }
+            ftagmgr::IdCursor cursor;
+            int id = 0;
+            for (int file : files) {
+                session.getFilePath(file, &path, nullptr);
+                std::string line = "file " + path;
+                session.listFileTags(file, &cursor, nullptr);
+                while (cursor.next(&id, nullptr) == 1) {
+                    session.getTagValue(id, &tag, nullptr);
+                    line += " " + tag;
+                }
+                lines.insert(line);
+            }
+            return lines;
+        };
+        std::remove("./copy.db");
+        ftagmgr::Database copy("./copy.db");
+        copy.createDatabase(nullptr);
+        ftagmgr::TransferStats exported, imported, merged;
+        bool ok = ftagmgr::exportDatabase(db, "./export.ftx", ftagmgr::ExportOptions(), &exported, &err);
+        ftagmgr::ImportOptions options;
+        // Small batches, so the import commits several times
+        options.batchSize = 1000;
+        ok = ok && ftagmgr::importDatabase(copy, "./export.ftx", options, &imported, &err);
+        std::set<std::string> original = dump(db);
+        bool same = ok && dump(copy) == original && imported.links == exported.links && imported.files == exported.files;
+        ok = ok && ftagmgr::importDatabase(copy, "./export.ftx", options, &merged, &err);
+        bool idempotent = ok && dump(copy) == original;
+        // Cut the file short, the import has to notice
+        std::filesystem::resize_file("./export.ftx", exported.bytes / 2);
+        char* cut = nullptr;
+        bool truncated = !ftagmgr::importDatabase(copy, "./export.ftx", options, nullptr, &cut) && cut;
+        sqlite3_free(cut);
+        if (same && idempotent && truncated && exported.links > 0) {
+            std::cout << "OK. (" << exported.links << " links in " << exported.bytes << " bytes)" << std::endl;
+        } else {
+            std::cout << "failed." << std::endl << same << idempotent << truncated << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        }
+    }
+
+    // IDs near the top of the range import without a table reaching up to them
+    {
+        std::remove("./sparse.db");
+        std::remove("./sparsecopy.db");
+        ftagmgr::Database db("./sparse.db");
+        db.createDatabase(nullptr);
+        sqlite3_exec(db.handle(), "DELETE FROM sqlite_sequence WHERE name IN ('file', 'tag');"
+                                  "INSERT INTO sqlite_sequence(name, seq) VALUES ('file', 2000000000), ('tag', 2000000000);", nullptr, nullptr, nullptr);
+        db.addDir("/sparse", nullptr);
+        db.addFile(db.getDir("/sparse", nullptr), "far", nullptr);
+        db.addTag("far", nullptr);
+        int file = db.getFile(db.getDir("/sparse", nullptr), "far", nullptr);
+        db.tagFile(file, db.getTag("far", nullptr), nullptr);
+        ftagmgr::Database copy("./sparsecopy.db");
+        copy.createDatabase(nullptr);
+        ftagmgr::TransferStats imported;
+        std::cout << "Sparse ID import ";
+        bool ok = file > 2000000000 && ftagmgr::exportDatabase(db, "./sparse.ftx", ftagmgr::ExportOptions(), nullptr, nullptr)
+                  && ftagmgr::importDatabase(copy, "./sparse.ftx", ftagmgr::ImportOptions(), &imported, nullptr);
+        int copied = copy.getFile(copy.getDir("/sparse", nullptr), "far", nullptr);
+        if (ok && imported.links == 1 && copy.fileHasTag(copied, copy.getTag("far", nullptr), nullptr) == 1) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl;
+        db.close();
+        copy.close();
+        std::remove("./sparse.db");
+        std::remove("./sparsecopy.db");
+        std::remove("./sparse.ftx");
+    }
+
+    // Compile a snapshot of the test database and check every lookup and query against the database
+    {
+        ftagmgr::Database db("./test.db");
+        std::cout << "Snapshot ";
+        db.addDir("/snap/a/b", nullptr);
+        db.addDir("/snap/c", nullptr);
+        int b = db.getDir("/snap/a/b", nullptr), c = db.getDir("/snap/c", nullptr);
+        db.addFile(b, "fb", nullptr);
+        db.addFile(c, "fc", nullptr);
+        db.addTag("snaptag", nullptr);
+        int fb = db.getFile(b, "fb", nullptr);
+        db.tagFile(fb, db.getTag("snaptag", nullptr), nullptr);
+        db.tagFile(db.getFile(c, "fc", nullptr), db.getTag("snaptag", nullptr), nullptr);
+        ftagmgr::Snapshot snapshot;
+        bool ok = ftagmgr::compileSnapshot(db, "./test.snap", &err) && snapshot.open("./test.snap", &err);
+        auto ids = [&](const char* sql) {
+            std::vector<int> out;
+            sqlite3_stmt* stmt = nullptr;
+            sqlite3_prepare_v2(db.handle(), sql, -1, &stmt, nullptr);
+            while (sqlite3_step(stmt) == SQLITE_ROW) out.push_back(sqlite3_column_int(stmt, 0));
+            sqlite3_finalize(stmt);
+            return out;
+        };
+        size_t mismatches = 0;
+        std::string path, name;
+        std::string_view view;
+        ftagmgr::IdCursor cursor;
+        int id = 0;
+        auto same = [&](ftagmgr::IdSpan span) {
+            std::vector<int> listed;
+            while (cursor.next(&id, nullptr) == 1) listed.push_back(id);
+            return listed == std::vector<int>(span.begin(), span.end());
+        };
+        for (int dir : ids("SELECT id FROM dir;")) {
+            // Implicit directories have no path in either
+            path.clear();
+            view = {};
+            db.getDirPath(dir, &path, nullptr);
+            db.listDirFiles(dir, &cursor, nullptr);
+            snapshot.getDirPath(dir, &view);
+            if (view != path || (!path.empty() && (snapshot.findDir(path.c_str()) != dir || snapshot.getDir(path.c_str()) != db.getDir(path.c_str(), nullptr)))
+                || !same(snapshot.listDirFiles(dir))) mismatches++;
+        }
+        for (int file : ids("SELECT id FROM file;")) {
+            db.getFilePath(file, &path, nullptr);
+            db.getFileName(file, &name, nullptr);
+            db.listFileTags(file, &cursor, nullptr);
+            std::string snapped;
+            int dir = ids(("SELECT dir FROM file WHERE id = " + std::to_string(file) + ";").c_str()).front();
+            if (!snapshot.getFilePath(file, &snapped) || snapped != path || !snapshot.getFileName(file, &view) || view != name
+                || snapshot.getFile(dir, name.c_str()) != file || !same(snapshot.listFileTags(file))) mismatches++;
+        }
+        for (int tag : ids("SELECT id FROM tag;")) {
+            db.getTagValue(tag, &name, nullptr);
+            db.listTagFiles(tag, &cursor, nullptr);
+            if (!snapshot.getTagValue(tag, &view) || view != name || snapshot.getTag(name.c_str()) != tag
+                || snapshot.getTagFileCount(tag) != db.getTagFileCount(tag, nullptr) || !same(snapshot.listTagFiles(tag))) mismatches++;
+        }
+        bool missing = snapshot.getTag("nosuchtag") == -1 && !snapshot.fileExists(b, "nosuchfile") && snapshot.findDir("/snap/x") == -1
+                       && snapshot.getDir("/snap") == -1 && snapshot.findDir("/snap//a/") == db.findDir("/snap/a", nullptr);
+        std::vector<unsigned int> found;
+        snapshot.findTags("snapt", &found);
+        bool prefixed = found == std::vector<unsigned int>{(unsigned int)db.getTag("snaptag", nullptr)};
+        // Queries give the same files with both backends
+        for (const char* query : {"qa qb", "qa & !qc", "!(qa | qb) & qc", "@/snap snaptag", "@/snap/a snaptag", "!snaptag @/", "qa | missing"}) {
+            ftagmgr::QueryResult expected, actual;
+            ftagmgr::runQuery(db, query, &expected, nullptr);
+            if (!ftagmgr::runQuery(snapshot, query, &actual, nullptr)) mismatches++;
+            int want = 0, got = 0;
+            short wantRes, gotRes;
+            do {
+                wantRes = expected.next(&want, nullptr);
+                gotRes = actual.next(&got, nullptr);
+                if (wantRes != gotRes || want != got) mismatches++;
+            } while (wantRes == 1 && gotRes == 1);
+        }
+        ftagmgr::QueryResult result;
+        bool paths = ftagmgr::runQuery(snapshot, "@/snap/a", &result, nullptr) && result.nextPath(&path, nullptr) == 1 && path == "/snap/a/b/fb";
+        // Compiling needs an open session, and says so
+        ftagmgr::Database closed;
+        char* notOpen = nullptr;
+        bool unopened = !ftagmgr::compileSnapshot(closed, "./closed.snap", &notOpen) && notOpen;
+        sqlite3_free(notOpen);
+        // A cut snapshot is refused when opened
+        ftagmgr::Snapshot cut;
+        std::filesystem::resize_file("./test.snap", std::filesystem::file_size("./test.snap") / 2);
+        char* refused = nullptr;
+        bool truncated = !cut.open("./test.snap", &refused) && refused;
+        sqlite3_free(refused);
+        if (ok && mismatches == 0 && missing && prefixed && paths && unopened && truncated) std::cout << "OK." << std::endl;
+        else {
+            std::cout << "failed." << std::endl << ok << mismatches << missing << prefixed << paths << unopened << truncated << std::endl;
+            if (err) {
+                std::cout << err << std::endl;
+                sqlite3_free(err);
+                err = nullptr;
+            }
+        }
+    }
+
+    // Autocomplete and fuzzy search over tag names, kept in sync while tagging
+    {
+        ftagmgr::Database db("./test.db");
+        std::cout << "Tag search ";
+        std::vector<int> tags, files;
+        db.addTags({"photo", "photography", "phone", "phonetics"}, &tags, nullptr);
+        ftagmgr::TagSearch search;
+        bool ok = search.build(db, &err);
+        db.addObserver(&search);
+        // Added after the build, so still in the pending run
+        db.addTag("photos", nullptr);
+        db.addFiles(1, {"s0", "s1", "s2"}, &files, nullptr);
+        int photos = db.getTag("photos", nullptr);
+        db.tagFiles({{(unsigned int)files[0], (unsigned int)tags[1]}, {(unsigned int)files[1], (unsigned int)tags[1]},
+                     {(unsigned int)files[0], (unsigned int)photos}, {(unsigned int)files[2], (unsigned int)tags[2]}}, nullptr);
+        auto names = [](const std::vector<ftagmgr::TagMatch>& matches) {
+            std::vector<std::string> out;
+            for (const auto& match : matches) out.push_back(match.value);
+            return out;
+        };
+        std::vector<ftagmgr::TagMatch> matches;
+        search.complete("pho", 3, &matches);
+        bool completed = names(matches) == std::vector<std::string>{"photography", "phone", "photos"} && matches[0].files == 2;
+        search.complete("photo", 10, &matches);
+        completed = completed && names(matches) == std::vector<std::string>{"photography", "photos", "photo"};
+        // Enough new tags to force a merge, ranks then have to come from the tree
+        std::vector<std::string> bulk;
+        for (int i = 0; i < 3000; i++) bulk.push_back("bulk" + std::to_string(i));
+        std::vector<int> bulkIds;
+        db.addTags(std::vector<std::string_view>(bulk.begin(), bulk.end()), &bulkIds, nullptr);
+        db.untagFile(files[0], tags[1], nullptr);
+        db.untagFile(files[1], tags[1], nullptr);
+        db.tagFile(files[1], bulkIds[1234], nullptr);
+        search.complete("pho", 2, &matches);
+        bool merged = names(matches) == std::vector<std::string>{"phone", "photos"};
+        search.complete("bulk", 2, &matches);
+        merged = merged && names(matches) == std::vector<std::string>{"bulk1234", "bulk0"} && search.size() >= 3005;
+        // Every tag against a brute force ranking of the database
+        std::vector<std::pair<int, std::string>> expected;
+        for (const std::string& name : bulk) {
+            if (name.compare(0, 5, "bulk1") == 0) expected.emplace_back(-db.getTagFileCount(db.getTag(name.c_str(), nullptr), nullptr), name);
+        }
+        std::sort(expected.begin(), expected.end());
+        search.complete("bulk1", 5, &matches);
+        for (size_t i = 0; i < 5 && merged; i++) merged = matches.size() == 5 && matches[i].value == expected[i].second;
+        search.fuzzy("photgraphy", 2, 0.3, &matches);
+        bool fuzzy = !matches.empty() && matches[0].value == "photography";
+        search.fuzzy("PHONETIX", 1, 0.3, &matches);
+        fuzzy = fuzzy && matches.size() == 1 && matches[0].value == "phonetics";
+        search.fuzzy("zzzz", 5, 0.3, &matches);
+        fuzzy = fuzzy && matches.empty();
+        db.removeObserver(&search);
+        if (ok && completed && merged && fuzzy) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << ok << completed << merged << fuzzy << std::endl;
+    }
+
+    // Count calls, statements, cache lookups and a lock wait on a fresh database
+    {
+        std::remove("./metrics.db");
+        ftagmgr::Database db("./metrics.db");
+        db.createDatabase(nullptr);
+        ftagmgr::Metrics metrics;
+        db.setMetrics(&metrics);
+        std::cout << "Metrics ";
+        for (const char* tag : {"m1", "m2", "m3"}) db.addTag(tag, nullptr);
+        for (int i = 0; i < 10; i++) db.getTag("m2", nullptr);
+        db.addDir("/metrics", nullptr);
+        db.addFile(db.getDir("/metrics", nullptr), "f", nullptr);
+        db.tagFile(db.getFile(db.getDir("/metrics", nullptr), "f", nullptr), db.getTag("m1", nullptr), nullptr);
+        // Another connection holds the write lock for a moment
+        ftagmgr::Database other("./metrics.db");
+        other.begin(nullptr);
+        std::thread holder([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            other.rollback(nullptr);
+        });
+        bool waited = db.begin(nullptr) && db.rollback(nullptr);
+        holder.join();
+        ftagmgr::MetricsSnapshot snapshot;
+        metrics.snapshot(&snapshot);
+        // Detached, calls aren't counted anymore
+        db.setMetrics(nullptr);
+        db.addTag("m4", nullptr);
+        ftagmgr::MetricsSnapshot after;
+        metrics.snapshot(&after);
+        auto calls = [](const ftagmgr::MetricsSnapshot& snapshot, const char* name) {
+            for (const ftagmgr::OperationMetrics& op : snapshot.operations) if (std::string(op.name) == name) return op.calls;
+            return (uint64_t)0;
+        };
+        std::string prometheus, json;
+        ftagmgr::formatPrometheus(snapshot, &prometheus);
+        ftagmgr::formatJson(snapshot, &json);
+        bool counted = calls(snapshot, "addTag") == 3 && calls(snapshot, "getTag") == 11 && calls(snapshot, "begin") == 1
+                       && calls(after, "addTag") == 3 && snapshot.cacheHits >= 10 && snapshot.rowsWritten >= 5 && !snapshot.statements.empty();
+        bool locked = waited && snapshot.lockWaits == 1 && snapshot.lockWaitNs >= 10000000ULL && snapshot.lockTimeouts == 0;
+        bool formatted = prometheus.find("ftagmgr_calls_total{function=\"addTag\"} 3\n") != std::string::npos
+                         && prometheus.find("ftagmgr_call_duration_seconds_count{function=\"getTag\"} 11\n") != std::string::npos
+                         && json.find("{\"name\": \"addTag\", \"calls\": 3,") != std::string::npos && json.back() == '}';
+        // The widest counters still make whole lines
+        ftagmgr::MetricsSnapshot widest = snapshot;
+        widest.rowsRead = widest.rowsWritten = widest.lockWaits = widest.lockWaitNs = UINT64_MAX;
+        widest.lockTimeouts = widest.cacheHits = widest.cacheMisses = widest.otherErrors = UINT64_MAX;
+        json.clear();
+        ftagmgr::formatJson(widest, &json);
+        std::string tail = "\"other_errors\": " + std::to_string(UINT64_MAX) + "}";
+        formatted = formatted && json.size() > tail.size() && json.compare(json.size() - tail.size(), tail.size(), tail) == 0;
+        if (counted && locked && formatted) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl << counted << locked << formatted << std::endl;
+    }
+
+    // Open a database made before schema versions, with no indexes, a duplicate file and a directory stored twice
+    {
+        std::remove("./old.db");
+        sqlite3* old = nullptr;
+        sqlite3_open("./old.db", &old);
+        sqlite3_exec(old, "CREATE TABLE dir(id INTEGER PRIMARY KEY AUTOINCREMENT, path VARCHAR(256) UNIQUE NOT NULL);"
+                          "CREATE TABLE file(id INTEGER PRIMARY KEY AUTOINCREMENT, dir INTEGER NOT NULL, name VARCHAR(64) NOT NULL, FOREIGN KEY (dir) REFERENCES dir(id));"
+                          "CREATE TABLE tag(id INTEGER PRIMARY KEY AUTOINCREMENT, tag VARCHAR(64) UNIQUE NOT NULL);"
+                          "CREATE TABLE filetag(file INTEGER NOT NULL, tag INTEGER NOT NULL, PRIMARY KEY (file, tag), "
+                          "FOREIGN KEY (file) REFERENCES file(id), FOREIGN KEY (tag) REFERENCES tag(id)) WITHOUT ROWID;"
+                          "INSERT INTO dir(path) VALUES('/old'), ('/older/deep/'), ('/old/');"
+                          "INSERT INTO file(dir, name) VALUES(1, 'a'), (1, 'b'), (1, 'a'), (3, 'a'), (3, 'c');"
+                          "INSERT INTO tag(tag) VALUES('kept'), ('legacy/sub'), ('merged'), ('duplicate');"
+                          "INSERT INTO filetag(file, tag) VALUES(4, 3), (3, 4);", nullptr, nullptr, nullptr);
+        sqlite3_close(old);
+        ftagmgr::Database db;
+        std::cout << "Schema migration ";
+        if (!db.open("./old.db", &err)) {
+            std::cout << "failed." << std::endl << err << std::endl;
+            sqlite3_free(err);
+            err = nullptr;
+        } else {
+            std::string plan;
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(db.handle(), "EXPLAIN QUERY PLAN SELECT id FROM file WHERE dir = 1 AND name = 'b';", -1, &stmt, nullptr) == SQLITE_OK) {
+                while (sqlite3_step(stmt) == SQLITE_ROW) plan += (const char*)sqlite3_column_text(stmt, 3);
+            }
+            sqlite3_finalize(stmt);
+            int file = db.getFile(1, "a", nullptr);
+            bool tagged = db.tagFile(file, db.getTag("kept", nullptr), nullptr);
+            // The duplicate "a" gives its tag to the oldest one
+            int duplicate = db.getTag("duplicate", nullptr);
+            tagged = tagged && db.fileHasTag(file, duplicate, nullptr) == 1 && db.getTagFileCount(duplicate, nullptr) == 1;
+            // Flat paths keep their IDs, their ancestors are implicit
+            std::string deep;
+            bool tree = db.getDir("/older/deep", nullptr) == 2 && db.getDirPath(2, &deep, nullptr) && deep == "/older/deep"
+                        && db.dirExists("/older", nullptr) == 0 && db.getDir("/old", nullptr) == 1;
+            // "/old/" joins "/old", its "a" gives its tag to the "a" already there
+            int merged = db.getTag("merged", nullptr);
+            tree = tree && db.getFile(1, "c", nullptr) == 5 && db.fileHasTag(1, merged, nullptr) == 1 && db.getTagFileCount(merged, nullptr) == 1;
+            // Slashed tag names get their parents
+            tree = tree && db.getTagParent(db.getTag("legacy/sub", nullptr), nullptr) == db.getTag("legacy", nullptr);
+            if (tree && db.getSchemaVersion(nullptr) == ftagmgr::schemaVersion && plan.find("file_dir_name") != std::string::npos
+                && file == 1 && tagged && db.getTagFileCount(db.getTag("kept", nullptr), nullptr) == 1 && !db.addFile(1, "b", nullptr)) {
+                std::cout << "OK." << std::endl;
+            } else std::cout << "failed." << std::endl << "Plan: " << plan << std::endl;
+        }
+    }
     return 0;
 }
@@ -0,0 +1,260 @@
+/**
+ * @file bench.cpp
+ * @brief FTagMgr server benchmark utility source code
+ *
+ * Builds a synthetic database of N directories with M files each and K tags,
+ * serves it and times requests against opening the database per lookup, as
+ * a short-lived command line call would. Every result gets ops/s and p50/p99
+ * latency, printed as a table and written as JSON so runs can be compared.
+ *
+ * Usage: bench [--dirs N] [--files M] [--tags K] [--calls C] [--seed X] [--out FILE]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sqlite3.h>
+#include "ftagmgrclient.h"
+#include "ftagmgrserver.h"
+#include "../lib/ftagmgrquery.h"
+
+/**
+ * @brief Benchmark settings, set from the command line
+ */
+struct Config {
+    int dirs = 100;
+    int files = 1000;
+    int tags = 1000;
+    int calls = 20000;
+    unsigned int seed = 1;
+    std::string out = "bench.json";
+};
+
+/**
+ * @brief Timings of one benchmark
+ */
+struct Result {
+    std::string group;
+    std::string name;
+    size_t calls;
+    // Operations per call, more than 1 for batches
+    size_t items;
+    double seconds;
+    double p50Us;
+    double p99Us;
+};
+
+/**
+ * @brief Runs and records the benchmarks
+ */
+class Suite {
+public:
+    /**
+     * @brief Time a function call by call
+     * @param group Benchmark group, e.g. cold or served
+     * @param name Benchmark name
+     * @param calls How many times to call the function
+     * @param items Operations done by one call
+     * @param fn The function to time, gets the call index
+     */
+    template<typename F>
+    void measure(const char* group, const std::string& name, int calls, size_t items, F fn) {
+        std::vector<double> latencies(calls);
+        auto start = std::chrono::steady_clock::now();
+        auto last = start;
+        for (int i = 0; i < calls; i++) {
+            fn(i);
+            auto now = std::chrono::steady_clock::now();
+            latencies[i] = std::chrono::duration<double, std::micro>(now - last).count();
+            last = now;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        Result result{group, name, latencies.size(), items, std::chrono::duration<double>(last - start).count(), percentile(latencies, 0.5), percentile(latencies, 0.99)};
+        std::printf("%-8s %-36s %8zu calls %12.0f ops/s   p50 %10.2f us   p99 %10.2f us\n", group, name.c_str(),
+                    result.calls, result.calls * result.items / result.seconds, result.p50Us, result.p99Us);
+        std::fflush(stdout);
+        results.push_back(std::move(result));
+    }
+
+    /**
+     * @brief Write every result as JSON
+     * @param config The settings the results were measured with
+     * @retval true File written
+     * @retval false File couldn't be written
+     */
+    bool writeJson(const Config& config) const {
+        FILE* file = std::fopen(config.out.c_str(), "w");
+        if (!file) return false;
+        std::fprintf(file, "{\n  \"config\": {\"dirs\": %d, \"files\": %d, \"tags\": %d, \"calls\": %d, \"seed\": %u},\n",
+                     config.dirs, config.files, config.tags, config.calls, config.seed);
+        std::fprintf(file, "  \"results\": [\n");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            std::fprintf(file, "    {\"group\": \"%s\", \"name\": \"%s\", \"calls\": %zu, \"items\": %zu, \"seconds\": %.6f, "
+                               "\"opsPerSec\": %.1f, \"p50Us\": %.3f, \"p99Us\": %.3f}%s\n",
+                         r.group.c_str(), r.name.c_str(), r.calls, r.items, r.seconds,
+                         r.calls * r.items / r.seconds, r.p50Us, r.p99Us, i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        return std::fclose(file) == 0;
+    }
+
+private:
+    static double percentile(const std::vector<double>& sorted, double p) {
+        if (sorted.empty()) return 0;
+        return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    }
+
+    std::vector<Result> results;
+};
+
+/**
+ * @brief Parse the command line
+ * @param argc Argument count
+ * @param argv Arguments
+ * @param config Pointer to the return settings
+ * @retval true Parsed
+ * @retval false Unknown option or missing value
+ */
+bool parseArgs(int argc, char** argv, Config* config) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) return false;
+        const char* value = argv[++i];
+        if (!std::strcmp(argv[i - 1], "--dirs")) config->dirs = std::atoi(value);
+        else if (!std::strcmp(argv[i - 1], "--files")) config->files = std::atoi(value);
+        else if (!std::strcmp(argv[i - 1], "--tags")) config->tags = std::atoi(value);
+        else if (!std::strcmp(argv[i - 1], "--calls")) config->calls = std::atoi(value);
+        else if (!std::strcmp(argv[i - 1], "--seed")) config->seed = (unsigned int)std::strtoul(value, nullptr, 10);
+        else if (!std::strcmp(argv[i - 1], "--out")) config->out = value;
+        else return false;
+    }
+    return config->dirs > 0 && config->files > 0 && config->tags > 0 && config->calls > 0;
+}
+
+/**
+ * @brief The main function
+ * @return int Exit code
+ */
+int main(int argc, char** argv) {
+    Config config;
+    if (!parseArgs(argc, argv, &config)) {
+        std::cout << "Usage: " << argv[0] << " [--dirs N] [--files M] [--tags K] [--calls C] [--seed X] [--out FILE]" << std::endl;
+        return 1;
+    }
+    const char* path = "./bench.db";
+    const char* socketPath = "./bench.sock";
+    std::remove(path);
+    std::remove("./bench.db-wal");
+    std::remove("./bench.db-shm");
+    ftagmgr::setDatabasePath(path);
+    std::vector<int> dirIds, tagIds, fileIds, ids;
+    {
+        ftagmgr::Database db(path);
+        if (!db.isOpen() || !db.createDatabase(nullptr)) {
+            std::cout << "Couldn't create benchmark database." << std::endl;
+            return 1;
+        }
+        std::vector<std::string> dirs, files, tags;
+        for (int i = 0; i < config.dirs; i++) dirs.push_back("/bench/projects/p" + std::to_string(i / 32) + "/src/d" + std::to_string(i));
+        for (int i = 0; i < config.files; i++) files.push_back("f" + std::to_string(i) + ".dat");
+        for (int i = 0; i < config.tags; i++) tags.push_back("t" + std::to_string(i));
+        db.addDirs(std::vector<std::string_view>(dirs.begin(), dirs.end()), &dirIds, nullptr);
+        db.addTags(std::vector<std::string_view>(tags.begin(), tags.end()), &tagIds, nullptr);
+        for (int dir : dirIds) {
+            db.addFiles(dir, std::vector<std::string_view>(files.begin(), files.end()), &ids, nullptr);
+            fileIds.insert(fileIds.end(), ids.begin(), ids.end());
+        }
+        std::mt19937 rng(config.seed);
+        std::vector<ftagmgr::FileTag> links;
+        for (int file : fileIds) {
+            for (int i = 0; i < 4; i++) links.push_back({(unsigned int)file, (unsigned int)tagIds[rng() % tagIds.size()]});
+        }
+        db.tagFiles(links, nullptr);
+    }
+    Suite suite;
+    std::mt19937 rng(config.seed);
+    auto randomFile = [&]() { return (unsigned int)fileIds[rng() % fileIds.size()]; };
+    auto randomTag = [&]() { return (unsigned int)tagIds[rng() % tagIds.size()]; };
+    std::string text;
+
+    // What every short-lived process pays
+    suite.measure("cold", "open + getFilePath", std::max(1, config.calls / 20), 1, [&](int) {
+        ftagmgr::Database db(path);
+        db.getFilePath(randomFile(), &text, nullptr);
+    });
+    suite.measure("cold", "open + runQuery", std::max(1, config.calls / 20), 1, [&](int) {
+        ftagmgr::Database db(path);
+        ftagmgr::QueryResult result;
+        int id;
+        std::string tag = "t" + std::to_string(rng() % config.tags);
+        if (ftagmgr::runQuery(db, tag.c_str(), &result, nullptr)) while (result.next(&id, nullptr) == 1) {}
+    });
+
+    // The same against the server
+    ftagmgr::Server server;
+    char* err = nullptr;
+    if (!server.open(path, socketPath, ftagmgr::ServerOptions(), &err)) {
+        std::cout << "Couldn't start the server." << std::endl << (err ? err : "") << std::endl;
+        sqlite3_free(err);
+        return 1;
+    }
+    std::thread loop([&server]() { server.run(nullptr); });
+    ftagmgr::Client client;
+    if (!client.connect(socketPath, nullptr)) {
+        std::cout << "Couldn't connect to the server." << std::endl;
+        server.stop();
+        loop.join();
+        return 1;
+    }
+    ftagmgr::Reply reply;
+    suite.measure("served", "ping", config.calls, 1, [&](int) {
+        client.send(ftagmgr::CMD_PING);
+        client.receive(&reply, nullptr);
+    });
+    suite.measure("served", "getFilePath", config.calls, 1, [&](int) {
+        client.send(ftagmgr::CMD_GET_FILE_PATH, randomFile());
+        client.receive(&reply, nullptr);
+    });
+    suite.measure("served", "getTag", config.calls, 1, [&](int i) {
+        client.call(ftagmgr::CMD_GET_TAG, "t" + std::to_string(i % config.tags), nullptr);
+    });
+    suite.measure("served", "fileHasTag", config.calls, 1, [&](int) { client.call(ftagmgr::CMD_FILE_HAS_TAG, randomFile(), randomTag(), nullptr); });
+    std::vector<unsigned int> files;
+    suite.measure("served", "query one tag", config.calls / 10, 1, [&](int i) {
+        client.query("t" + std::to_string(i % config.tags), &files, nullptr);
+    });
+    suite.measure("served", "query a & b", config.calls / 10, 1, [&](int i) {
+        client.query("t" + std::to_string(i % 10) + " & t" + std::to_string(i % 10 + 1), &files, nullptr);
+    });
+    suite.measure("served", "tagFile, one commit each", config.calls / 10, 1, [&](int) { client.call(ftagmgr::CMD_TAG_FILE, randomFile(), randomTag(), nullptr); });
+
+    // Many requests per round trip
+    const int pipeline = 100;
+    suite.measure("pipeline", "getFilePath x100", config.calls / pipeline, pipeline, [&](int) {
+        for (int i = 0; i < pipeline; i++) client.send(ftagmgr::CMD_GET_FILE_PATH, randomFile());
+        for (int i = 0; i < pipeline; i++) client.receive(&reply, nullptr);
+    });
+    suite.measure("pipeline", "tagFile x100", config.calls / pipeline, pipeline, [&](int) {
+        for (int i = 0; i < pipeline; i++) client.send(ftagmgr::CMD_TAG_FILE, randomFile(), randomTag());
+        for (int i = 0; i < pipeline; i++) client.receive(&reply, nullptr);
+    });
+
+    client.close();
+    server.stop();
+    loop.join();
+    server.close();
+    if (!suite.writeJson(config)) {
+        std::cout << "Couldn't write " << config.out << std::endl;
+        return 1;
+    }
+    std::cout << "Results written to " << config.out << std::endl;
+    return 0;
+}
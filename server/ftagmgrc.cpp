@@ -0,0 +1,129 @@
+/**
+ * @file ftagmgrc.cpp
+ * @brief FTagMgr server command line client
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include "ftagmgrclient.h"
+
+namespace {
+    void usage(const char* program) {
+        std::printf("Usage: %s [--socket PATH] COMMAND [ARGS]\n", program);
+        std::printf("  ping\n");
+        std::printf("  add-dir PATH | get-dir PATH | dir-path ID\n");
+        std::printf("  add-file DIR NAME | get-file DIR NAME | file-path ID\n");
+        std::printf("  add-tag NAME | get-tag NAME | tag-name ID\n");
+        std::printf("  tag FILE TAG | untag FILE TAG | has-tag FILE TAG\n");
+        std::printf("  file-tags FILE | tag-files TAG\n");
+        std::printf("  query EXPRESSION    prints the paths of matching files\n");
+        std::printf("  metrics\n");
+    }
+
+    /**
+     * @brief Command line name of a command and the arguments it takes
+     */
+    struct CommandName {
+        const char* name;
+        ftagmgr::Command command;
+        // 's' string, 'i' ID
+        const char* args;
+    };
+
+    const CommandName commandNames[] = {
+        {"ping", ftagmgr::CMD_PING, ""},
+        {"add-dir", ftagmgr::CMD_ADD_DIR, "s"},
+        {"get-dir", ftagmgr::CMD_GET_DIR, "s"},
+        {"dir-path", ftagmgr::CMD_GET_DIR_PATH, "i"},
+        {"add-file", ftagmgr::CMD_ADD_FILE, "is"},
+        {"get-file", ftagmgr::CMD_GET_FILE, "is"},
+        {"file-path", ftagmgr::CMD_GET_FILE_PATH, "i"},
+        {"add-tag", ftagmgr::CMD_ADD_TAG, "s"},
+        {"get-tag", ftagmgr::CMD_GET_TAG, "s"},
+        {"tag-name", ftagmgr::CMD_GET_TAG_VALUE, "i"},
+        {"tag", ftagmgr::CMD_TAG_FILE, "ii"},
+        {"untag", ftagmgr::CMD_UNTAG_FILE, "ii"},
+        {"has-tag", ftagmgr::CMD_FILE_HAS_TAG, "ii"},
+        {"file-tags", ftagmgr::CMD_LIST_FILE_TAGS, "i"},
+        {"tag-files", ftagmgr::CMD_LIST_TAG_FILES, "i"},
+        {"query", ftagmgr::CMD_QUERY, "s"},
+        {"metrics", ftagmgr::CMD_METRICS, ""}
+    };
+
+    int fail(char* errmsg) {
+        std::fprintf(stderr, "%s\n", errmsg ? errmsg : "request failed");
+        sqlite3_free(errmsg);
+        return 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string socketPath = ftagmgr::defaultSocketPath();
+    int first = 1;
+    if (argc > 2 && !std::strcmp(argv[1], "--socket")) {
+        socketPath = argv[2];
+        first = 3;
+    }
+    const CommandName* command = nullptr;
+    if (first < argc) {
+        for (const CommandName& name : commandNames) if (!std::strcmp(argv[first], name.name)) command = &name;
+    }
+    if (!command || argc - first - 1 != (int)std::strlen(command->args)) {
+        usage(argv[0]);
+        return 1;
+    }
+    char* errmsg = nullptr;
+    ftagmgr::Client client;
+    if (!client.connect(socketPath.c_str(), &errmsg)) return fail(errmsg);
+    const char* const* args = argv + first + 1;
+    auto id = [&](int i) { return (unsigned int)std::strtoul(args[i], nullptr, 10); };
+    if (!std::strcmp(command->args, "")) client.send(command->command);
+    else if (!std::strcmp(command->args, "s")) client.send(command->command, args[0]);
+    else if (!std::strcmp(command->args, "i")) client.send(command->command, id(0));
+    else if (!std::strcmp(command->args, "is")) client.send(command->command, id(0), args[1]);
+    else client.send(command->command, id(0), id(1));
+    ftagmgr::Reply reply;
+    if (!client.receive(&reply, &errmsg)) return fail(errmsg);
+    if (reply.status != ftagmgr::STATUS_OK) {
+        std::string message(reply.error());
+        std::fprintf(stderr, "%s\n", message.c_str());
+        return 1;
+    }
+    std::string text;
+    std::vector<unsigned int> ids;
+    switch (command->command) {
+    case ftagmgr::CMD_GET_DIR_PATH:
+    case ftagmgr::CMD_GET_FILE_PATH:
+    case ftagmgr::CMD_GET_TAG_VALUE:
+    case ftagmgr::CMD_METRICS:
+        if (!reply.text(&text)) {
+            std::fprintf(stderr, "Not found\n");
+            return 1;
+        }
+        std::printf("%s%s", text.c_str(), command->command == ftagmgr::CMD_METRICS ? "" : "\n");
+        return 0;
+    case ftagmgr::CMD_LIST_FILE_TAGS:
+    case ftagmgr::CMD_LIST_TAG_FILES:
+        reply.ids(&ids);
+        for (unsigned int id : ids) std::printf("%u\n", id);
+        return 0;
+    case ftagmgr::CMD_QUERY: {
+        reply.ids(&ids);
+        // Every path in one round trip
+        for (unsigned int id : ids) client.send(ftagmgr::CMD_GET_FILE_PATH, id);
+        for (unsigned int id : ids) {
+            if (!client.receive(&reply, &errmsg)) return fail(errmsg);
+            if (reply.text(&text)) std::printf("%s\n", text.c_str());
+            else std::printf("#%u\n", id);
+        }
+        return 0;
+    }
+    default:
+        std::printf("%d\n", reply.value());
+        return reply.value() < 0 ? 1 : 0;
+    }
+}
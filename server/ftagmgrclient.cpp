@@ -0,0 +1,336 @@
+/**
+ * @file ftagmgrclient.cpp
+ * @brief FTagMgr server client source code
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sqlite3.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ftagmgrclient.h"
+
+namespace ftagmgr {
+    namespace {
+        // Bytes read from the server per recv()
+        const size_t readSize = 64 * 1024;
+    }
+
+    /**
+     * @brief Get the value that starts most results
+     * @return The value, -1 for an error reply
+     */
+    int Reply::value() const {
+        int32_t result = -1;
+        if (status != STATUS_OK) return -1;
+        FrameReader reader(body);
+        if (!reader.getI32(&result)) return -1;
+        return result;
+    }
+
+    /**
+     * @brief Get the string after the value, of replies with one
+     * @param text Pointer to the return std::string
+     * @retval true String returned
+     * @retval false No string, the value is 0 or the reply is an error
+     */
+    bool Reply::text(std::string* text) const {
+        if (status != STATUS_OK) return false;
+        FrameReader reader(body);
+        int32_t found = 0;
+        std::string_view view;
+        if (!reader.getI32(&found) || found != 1 || !reader.getString(&view)) return false;
+        text->assign(view);
+        return true;
+    }
+
+    /**
+     * @brief Get the IDs of a listing or query reply
+     * @param ids Pointer to the return vector
+     * @retval true IDs returned
+     * @retval false Error reply
+     */
+    bool Reply::ids(std::vector<unsigned int>* ids) const {
+        if (status != STATUS_OK) return false;
+        FrameReader reader(body);
+        return reader.getIds(ids);
+    }
+
+    /**
+     * @brief Get the message of an error reply
+     * @return The message, empty for a successful reply
+     */
+    std::string_view Reply::error() const {
+        if (status == STATUS_OK) return std::string_view();
+        FrameReader reader(body);
+        std::string_view message;
+        return reader.getString(&message) ? message : std::string_view("malformed error reply");
+    }
+
+    Client::Client() : fd(-1), nextId(0), used(0), outstanding(0) {}
+
+    Client::~Client() {
+        close();
+    }
+
+    /**
+     * @brief Connect to a server
+     * @param socketPath Path of the server's socket
+     * @param errmsg SQLite3 error message char**
+     * @retval true Connected
+     * @retval false No server listens there
+     */
+    bool Client::connect(const char* socketPath, char** errmsg) {
+        close();
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (std::strlen(socketPath) >= sizeof(address.sun_path)) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot connect to %s: %s", socketPath, strerror(ENAMETOOLONG));
+            return false;
+        }
+        std::strcpy(address.sun_path, socketPath);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || ::connect(fd, (const sockaddr*)&address, sizeof(address)) != 0) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot connect to %s: %s", socketPath, strerror(errno));
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Disconnect, replies not read yet are dropped
+     */
+    void Client::close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        out.clear();
+        in.clear();
+        used = 0;
+        outstanding = 0;
+    }
+
+    /**
+     * @brief Queue a request without arguments
+     * @param command The command
+     * @return Request ID
+     */
+    uint32_t Client::send(Command command) {
+        FrameWriter writer(&out);
+        writer.begin(++nextId, command);
+        writer.end();
+        outstanding++;
+        return nextId;
+    }
+
+    /**
+     * @brief Queue a request taking a string
+     * @param command The command
+     * @param text The string, e.g. a path or a tag name
+     * @return Request ID
+     */
+    uint32_t Client::send(Command command, std::string_view text) {
+        FrameWriter writer(&out);
+        writer.begin(++nextId, command);
+        writer.putString(text);
+        writer.end();
+        outstanding++;
+        return nextId;
+    }
+
+    /**
+     * @brief Queue a request taking an ID
+     * @param command The command
+     * @param id The ID
+     * @return Request ID
+     */
+    uint32_t Client::send(Command command, unsigned int id) {
+        FrameWriter writer(&out);
+        writer.begin(++nextId, command);
+        writer.putU32(id);
+        writer.end();
+        outstanding++;
+        return nextId;
+    }
+
+    /**
+     * @brief Queue a request taking an ID and a string
+     * @param command The command
+     * @param id The ID, e.g. of a directory
+     * @param text The string, e.g. a file name
+     * @return Request ID
+     */
+    uint32_t Client::send(Command command, unsigned int id, std::string_view text) {
+        FrameWriter writer(&out);
+        writer.begin(++nextId, command);
+        writer.putU32(id);
+        writer.putString(text);
+        writer.end();
+        outstanding++;
+        return nextId;
+    }
+
+    /**
+     * @brief Queue a request taking two IDs
+     * @param command The command
+     * @param first The first ID, e.g. of a file
+     * @param second The second ID, e.g. of a tag
+     * @return Request ID
+     */
+    uint32_t Client::send(Command command, unsigned int first, unsigned int second) {
+        FrameWriter writer(&out);
+        writer.begin(++nextId, command);
+        writer.putU32(first);
+        writer.putU32(second);
+        writer.end();
+        outstanding++;
+        return nextId;
+    }
+
+    /**
+     * @brief Send every queued request
+     * @param errmsg SQLite3 error message char**
+     * @retval true Sent
+     * @retval false The connection broke
+     */
+    bool Client::flush(char** errmsg) {
+        size_t sent = 0;
+        while (sent < out.size()) {
+            ssize_t bytes = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) {
+                if (errmsg) *errmsg = sqlite3_mprintf("cannot send to the server: %s", fd < 0 ? "not connected" : strerror(errno));
+                return false;
+            }
+            sent += (size_t)bytes;
+        }
+        out.clear();
+        return true;
+    }
+
+    /**
+     * @brief Read the next reply, sending the queued requests first
+     * @param reply Pointer to the return Reply
+     * @param errmsg SQLite3 error message char**
+     * @retval true Reply returned, it may be an error reply
+     * @retval false The connection broke
+     */
+    bool Client::receive(Reply* reply, char** errmsg) {
+        if (!out.empty() && !flush(errmsg)) return false;
+        if (outstanding == 0) {
+            if (errmsg) *errmsg = sqlite3_mprintf("no request is waiting for a reply");
+            return false;
+        }
+        uint32_t id = 0;
+        uint8_t status = 0;
+        std::string_view body;
+        size_t size = 0;
+        while (true) {
+            short split = splitFrame(std::string_view(in).substr(used), &id, &status, &body, &size);
+            if (split < 0) {
+                if (errmsg) *errmsg = sqlite3_mprintf("malformed reply from the server");
+                return false;
+            }
+            if (split == 1) break;
+            // Everything returned already is dropped before reading more
+            in.erase(0, used);
+            used = 0;
+            size_t length = in.size();
+            in.resize(length + readSize);
+            ssize_t bytes = recv(fd, &in[length], readSize, 0);
+            in.resize(length + (bytes > 0 ? (size_t)bytes : 0));
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) {
+                if (errmsg) *errmsg = sqlite3_mprintf("connection to the server lost%s%s", bytes < 0 ? ": " : "", bytes < 0 ? strerror(errno) : "");
+                return false;
+            }
+        }
+        reply->id = id;
+        reply->status = (Status)status;
+        reply->body.assign(body);
+        used += size;
+        outstanding--;
+        return true;
+    }
+
+    /**
+     * @brief Send a request and wait for its value, as the Database function would return it
+     * @param command The command
+     * @param text String argument
+     * @param errmsg SQLite3 error message char**, gets the server's error message too
+     * @return The value, -1 on error
+     */
+    int Client::call(Command command, std::string_view text, char** errmsg) {
+        send(command, text);
+        Reply reply;
+        return wait(&reply, errmsg) ? reply.value() : -1;
+    }
+
+    /**
+     * @brief Send a request taking an ID and a string and wait for its value
+     * @param command The command
+     * @param id The ID
+     * @param text The string
+     * @param errmsg SQLite3 error message char**, gets the server's error message too
+     * @return The value, -1 on error
+     */
+    int Client::call(Command command, unsigned int id, std::string_view text, char** errmsg) {
+        send(command, id, text);
+        Reply reply;
+        return wait(&reply, errmsg) ? reply.value() : -1;
+    }
+
+    /**
+     * @brief Send a request taking two IDs and wait for its value
+     * @param command The command
+     * @param first The first ID
+     * @param second The second ID
+     * @param errmsg SQLite3 error message char**, gets the server's error message too
+     * @return The value, -1 on error
+     */
+    int Client::call(Command command, unsigned int first, unsigned int second, char** errmsg) {
+        send(command, first, second);
+        Reply reply;
+        return wait(&reply, errmsg) ? reply.value() : -1;
+    }
+
+    /**
+     * @brief Run a tag query on the server
+     * @param expression The query, as for runQuery()
+     * @param files Pointer to the return vector of file IDs, in ascending order
+     * @param errmsg SQLite3 error message char**, gets the server's error message too
+     * @retval true Query run
+     * @retval false Syntax error, server error or the connection broke
+     */
+    bool Client::query(std::string_view expression, std::vector<unsigned int>* files, char** errmsg) {
+        send(CMD_QUERY, expression);
+        Reply reply;
+        return wait(&reply, errmsg) && reply.ids(files);
+    }
+
+    /**
+     * @brief Wait for the reply to the last request sent
+     * @param reply Pointer to the return Reply
+     * @param errmsg SQLite3 error message char**, gets the server's error message too
+     * @retval true Successful reply
+     * @retval false Error reply or the connection broke
+     */
+    bool Client::wait(Reply* reply, char** errmsg) {
+        do {
+            if (!receive(reply, errmsg)) return false;
+        } while (reply->id != nextId);
+        if (reply->status != STATUS_OK) {
+            if (errmsg) {
+                std::string message(reply->error());
+                *errmsg = sqlite3_mprintf("%s", message.c_str());
+            }
+            return false;
+        }
+        return true;
+    }
+}
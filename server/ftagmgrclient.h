@@ -0,0 +1,206 @@
+/**
+ * @file ftagmgrclient.h
+ * @brief FTagMgr server client header file
+ */
+
+#ifndef FTAGMGRCLIENT_H
+#define FTAGMGRCLIENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ftagmgrprotocol.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Reply to one request
+     */
+    struct Reply {
+        uint32_t id = 0;
+        Status status = STATUS_ERROR;
+        // Results, or the error message, as the server sent them
+        std::string body;
+
+        /**
+         * @brief Get the value that starts most results
+         * @return The value, -1 for an error reply
+         */
+        int value() const;
+
+        /**
+         * @brief Get the string after the value, of replies with one
+         * @param text Pointer to the return std::string
+         * @retval true String returned
+         * @retval false No string, the value is 0 or the reply is an error
+         */
+        bool text(std::string* text) const;
+
+        /**
+         * @brief Get the IDs of a listing or query reply
+         * @param ids Pointer to the return vector
+         * @retval true IDs returned
+         * @retval false Error reply
+         */
+        bool ids(std::vector<unsigned int>* ids) const;
+
+        /**
+         * @brief Get the message of an error reply
+         * @return The message, empty for a successful reply
+         */
+        std::string_view error() const;
+    };
+
+    /**
+     * @brief Connection to an ftagmgr server
+     *
+     * Requests are pipelined: send() only queues a request, the queue goes
+     * out in one write when a reply is read or flush() is called, and
+     * replies are read in request order. The call functions send one
+     * request and wait for its reply, dropping the replies to requests
+     * sent before it that weren't read yet.
+     *
+     * A connection must not be used by two threads at once.
+     */
+    class Client {
+    public:
+        Client();
+        ~Client();
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        /**
+         * @brief Connect to a server
+         * @param socketPath Path of the server's socket
+         * @param errmsg SQLite3 error message char**
+         * @retval true Connected
+         * @retval false No server listens there
+         */
+        bool connect(const char* socketPath, char** errmsg);
+
+        /**
+         * @brief Disconnect, replies not read yet are dropped
+         */
+        void close();
+
+        /**
+         * @brief Queue a request without arguments
+         * @param command The command
+         * @return Request ID
+         */
+        uint32_t send(Command command);
+
+        /**
+         * @brief Queue a request taking a string
+         * @param command The command
+         * @param text The string, e.g. a path or a tag name
+         * @return Request ID
+         */
+        uint32_t send(Command command, std::string_view text);
+
+        /**
+         * @brief Queue a request taking an ID
+         * @param command The command
+         * @param id The ID
+         * @return Request ID
+         */
+        uint32_t send(Command command, unsigned int id);
+
+        /**
+         * @brief Queue a request taking an ID and a string
+         * @param command The command
+         * @param id The ID, e.g. of a directory
+         * @param text The string, e.g. a file name
+         * @return Request ID
+         */
+        uint32_t send(Command command, unsigned int id, std::string_view text);
+
+        /**
+         * @brief Queue a request taking two IDs
+         * @param command The command
+         * @param first The first ID, e.g. of a file
+         * @param second The second ID, e.g. of a tag
+         * @return Request ID
+         */
+        uint32_t send(Command command, unsigned int first, unsigned int second);
+
+        /**
+         * @brief Send every queued request
+         * @param errmsg SQLite3 error message char**
+         * @retval true Sent
+         * @retval false The connection broke
+         */
+        bool flush(char** errmsg);
+
+        /**
+         * @brief Read the next reply, sending the queued requests first
+         * @param reply Pointer to the return Reply
+         * @param errmsg SQLite3 error message char**
+         * @retval true Reply returned, it may be an error reply
+         * @retval false The connection broke
+         */
+        bool receive(Reply* reply, char** errmsg);
+
+        /**
+         * @brief Send a request and wait for its value, as the Database function would return it
+         * @param command The command
+         * @param text String argument
+         * @param errmsg SQLite3 error message char**, gets the server's error message too
+         * @return The value, -1 on error
+         */
+        int call(Command command, std::string_view text, char** errmsg);
+
+        /**
+         * @brief Send a request taking an ID and a string and wait for its value
+         * @param command The command
+         * @param id The ID
+         * @param text The string
+         * @param errmsg SQLite3 error message char**, gets the server's error message too
+         * @return The value, -1 on error
+         */
+        int call(Command command, unsigned int id, std::string_view text, char** errmsg);
+
+        /**
+         * @brief Send a request taking two IDs and wait for its value
+         * @param command The command
+         * @param first The first ID
+         * @param second The second ID
+         * @param errmsg SQLite3 error message char**, gets the server's error message too
+         * @return The value, -1 on error
+         */
+        int call(Command command, unsigned int first, unsigned int second, char** errmsg);
+
+        /**
+         * @brief Run a tag query on the server
+         * @param expression The query, as for runQuery()
+         * @param files Pointer to the return vector of file IDs, in ascending order
+         * @param errmsg SQLite3 error message char**, gets the server's error message too
+         * @retval true Query run
+         * @retval false Syntax error, server error or the connection broke
+         */
+        bool query(std::string_view expression, std::vector<unsigned int>* files, char** errmsg);
+
+    private:
+        /**
+         * @brief Wait for the reply to the last request sent
+         * @param reply Pointer to the return Reply
+         * @param errmsg SQLite3 error message char**, gets the server's error message too
+         * @retval true Successful reply
+         * @retval false Error reply or the connection broke
+         */
+        bool wait(Reply* reply, char** errmsg);
+
+        int fd;
+        uint32_t nextId;
+        // Requests not sent yet
+        std::string out;
+        // Received bytes not returned as replies yet, in[0..used) have been returned
+        std::string in;
+        size_t used;
+        // Replies still to come
+        size_t outstanding;
+    };
+}
+
+#endif
@@ -0,0 +1,70 @@
+/**
+ * @file ftagmgrd.cpp
+ * @brief FTagMgr server daemon
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sqlite3.h>
+#include "ftagmgrserver.h"
+
+namespace {
+    ftagmgr::Server server;
+
+    void onSignal(int) {
+        server.stop();
+    }
+
+    void usage(const char* program) {
+        std::printf("Usage: %s --db PATH [--socket PATH] [--cache MIB] [--no-index] [--metrics]\n", program);
+        std::printf("  --db PATH      Database to serve\n");
+        std::printf("  --socket PATH  Socket to listen on, $XDG_RUNTIME_DIR/ftagmgr.sock or /tmp/ftagmgr-UID.sock by default\n");
+        std::printf("  --cache MIB    Name cache budget, 0 for no cache (default 16)\n");
+        std::printf("  --no-index     Run queries in SQLite instead of an in-memory tag index\n");
+        std::printf("  --metrics      Count calls, read them with ftagmgrc metrics\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* dbPath = nullptr;
+    std::string socketPath = ftagmgr::defaultSocketPath();
+    ftagmgr::ServerOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--db") && i + 1 < argc) dbPath = argv[++i];
+        else if (!std::strcmp(argv[i], "--socket") && i + 1 < argc) socketPath = argv[++i];
+        else if (!std::strcmp(argv[i], "--cache") && i + 1 < argc) options.cacheBytes = std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        else if (!std::strcmp(argv[i], "--no-index")) options.tagIndex = false;
+        else if (!std::strcmp(argv[i], "--metrics")) options.metrics = true;
+        else {
+            usage(argv[0]);
+            return std::strcmp(argv[i], "--help") ? 1 : 0;
+        }
+    }
+    if (!dbPath) {
+        usage(argv[0]);
+        return 1;
+    }
+    char* errmsg = nullptr;
+    if (!server.open(dbPath, socketPath.c_str(), options, &errmsg)) {
+        std::fprintf(stderr, "%s\n", errmsg ? errmsg : "cannot start the server");
+        sqlite3_free(errmsg);
+        return 1;
+    }
+    struct sigaction action{};
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    std::printf("Serving %s on %s\n", dbPath, socketPath.c_str());
+    std::fflush(stdout);
+    bool ok = server.run(&errmsg);
+    server.close();
+    if (!ok) {
+        std::fprintf(stderr, "%s\n", errmsg ? errmsg : "the server failed");
+        sqlite3_free(errmsg);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,234 @@
+/**
+ * @file ftagmgrprotocol.h
+ * @brief FTagMgr server protocol header file
+ *
+ * Every message is a frame: the length of the rest of the frame, a
+ * request ID, a command (requests) or status (replies) byte and the
+ * arguments or results. Numbers are 32 bit in host byte order, both ends
+ * run on the same machine. Strings are a length and the bytes. Replies
+ * come back in request order with the ID of their request, so a client
+ * can send many requests before reading any reply.
+ */
+
+#ifndef FTAGMGRPROTOCOL_H
+#define FTAGMGRPROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+
+namespace ftagmgr {
+    // Length, ID and command or status
+    const size_t frameHeaderSize = 9;
+    // Largest frame either end accepts
+    const uint32_t maxFrameSize = 16 * 1024 * 1024;
+
+    /**
+     * @brief Requests, named after the Database functions they run, with their arguments and results
+     */
+    enum Command : uint8_t {
+        // No arguments, value 1
+        CMD_PING,
+        // Path, value of dirExists()
+        CMD_DIR_EXISTS,
+        // Path, value 1 if added, 0 if it already existed
+        CMD_ADD_DIR,
+        // Path, value of getDir()
+        CMD_GET_DIR,
+        // Directory ID, value 1 and the path, or value 0
+        CMD_GET_DIR_PATH,
+        // Directory ID and name, value of fileExists()
+        CMD_FILE_EXISTS,
+        // Directory ID and name, value 1 if added, 0 if it already existed
+        CMD_ADD_FILE,
+        // Directory ID and name, value of getFile()
+        CMD_GET_FILE,
+        // File ID, value 1 and the name, or value 0
+        CMD_GET_FILE_NAME,
+        // File ID, value 1 and the path, or value 0
+        CMD_GET_FILE_PATH,
+        // Name, value of tagExists()
+        CMD_TAG_EXISTS,
+        // Name, value 1 if added, 0 if it already existed
+        CMD_ADD_TAG,
+        // Name, value of getTag()
+        CMD_GET_TAG,
+        // Tag ID, value 1 and the name, or value 0
+        CMD_GET_TAG_VALUE,
+        // File ID and tag ID, value 1 if tagged, 0 if it already was
+        CMD_TAG_FILE,
+        // File ID and tag ID, value 1 if untagged, 0 if it wasn't tagged
+        CMD_UNTAG_FILE,
+        // File ID and tag ID, value of fileHasTag()
+        CMD_FILE_HAS_TAG,
+        // File ID, the tag IDs
+        CMD_LIST_FILE_TAGS,
+        // Tag ID, the file IDs
+        CMD_LIST_TAG_FILES,
+        // Query expression as for runQuery(), the matching file IDs
+        CMD_QUERY,
+        // No arguments, value 1 and the server's metrics in the Prometheus text format
+        CMD_METRICS,
+        CMD_COUNT
+    };
+
+    /**
+     * @brief Reply status
+     */
+    enum Status : uint8_t {
+        // Results follow
+        STATUS_OK,
+        // The error message follows
+        STATUS_ERROR
+    };
+
+    /**
+     * @brief Appends frames to a buffer
+     */
+    class FrameWriter {
+    public:
+        explicit FrameWriter(std::string* out) : out(out), start(0) {}
+
+        /**
+         * @brief Start a frame, finish it with end()
+         * @param id Request ID
+         * @param code Command or status
+         */
+        void begin(uint32_t id, uint8_t code) {
+            start = out->size();
+            putU32(0);
+            putU32(id);
+            out->push_back((char)code);
+        }
+
+        void putU32(uint32_t value) {
+            out->append((const char*)&value, sizeof(value));
+        }
+
+        void putI32(int32_t value) {
+            out->append((const char*)&value, sizeof(value));
+        }
+
+        void putString(std::string_view value) {
+            putU32((uint32_t)value.size());
+            out->append(value.data(), value.size());
+        }
+
+        void putIds(const std::vector<unsigned int>& ids) {
+            putU32((uint32_t)ids.size());
+            out->append((const char*)ids.data(), ids.size() * sizeof(uint32_t));
+        }
+
+        /**
+         * @brief Finish the frame, filling in its length
+         */
+        void end() {
+            uint32_t length = (uint32_t)(out->size() - start - sizeof(uint32_t));
+            std::memcpy(&(*out)[start], &length, sizeof(length));
+        }
+
+    private:
+        std::string* out;
+        size_t start;
+    };
+
+    /**
+     * @brief Reads the arguments or results of a frame, each getter fails once the data runs out
+     */
+    class FrameReader {
+    public:
+        explicit FrameReader(std::string_view data) : data(data) {}
+
+        bool getU32(uint32_t* value) {
+            if (data.size() < sizeof(*value)) return false;
+            std::memcpy(value, data.data(), sizeof(*value));
+            data.remove_prefix(sizeof(*value));
+            return true;
+        }
+
+        bool getI32(int32_t* value) {
+            if (data.size() < sizeof(*value)) return false;
+            std::memcpy(value, data.data(), sizeof(*value));
+            data.remove_prefix(sizeof(*value));
+            return true;
+        }
+
+        /**
+         * @brief Read a string
+         * @param value Pointer to the return view, into the frame
+         * @retval true String read
+         * @retval false Data ran out
+         */
+        bool getString(std::string_view* value) {
+            uint32_t length = 0;
+            if (!getU32(&length) || data.size() < length) return false;
+            *value = data.substr(0, length);
+            data.remove_prefix(length);
+            return true;
+        }
+
+        /**
+         * @brief Read a list of IDs
+         * @param ids Pointer to the return vector
+         * @retval true IDs read
+         * @retval false Data ran out
+         */
+        bool getIds(std::vector<unsigned int>* ids) {
+            uint32_t count = 0;
+            if (!getU32(&count) || data.size() / sizeof(uint32_t) < count) return false;
+            ids->resize(count);
+            if (count) std::memcpy(ids->data(), data.data(), count * sizeof(uint32_t));
+            data.remove_prefix(count * sizeof(uint32_t));
+            return true;
+        }
+
+        // Bytes not read yet
+        std::string_view rest() const {
+            return data;
+        }
+
+    private:
+        std::string_view data;
+    };
+
+    /**
+     * @brief Get the socket path the server and clients use when none is given
+     * @return $XDG_RUNTIME_DIR/ftagmgr.sock, or /tmp/ftagmgr-UID.sock without a runtime directory
+     */
+    inline std::string defaultSocketPath() {
+        const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+        if (runtime && *runtime) return std::string(runtime) + "/ftagmgr.sock";
+        return "/tmp/ftagmgr-" + std::to_string(getuid()) + ".sock";
+    }
+
+    /**
+     * @brief Split the next frame off a buffer
+     * @param buffer Received bytes
+     * @param id Pointer to the return request ID
+     * @param code Pointer to the return command or status
+     * @param body Pointer to the return arguments or results, into buffer
+     * @param size Pointer to the return size of the whole frame
+     * @retval -1 The frame is larger than maxFrameSize
+     * @retval 0 The frame isn't complete yet
+     * @retval 1 Frame returned
+     */
+    inline short splitFrame(std::string_view buffer, uint32_t* id, uint8_t* code, std::string_view* body, size_t* size) {
+        if (buffer.size() < frameHeaderSize) return 0;
+        uint32_t length = 0;
+        std::memcpy(&length, buffer.data(), sizeof(length));
+        if (length > maxFrameSize || length < frameHeaderSize - sizeof(length)) return -1;
+        if (buffer.size() - sizeof(length) < length) return 0;
+        std::memcpy(id, buffer.data() + sizeof(length), sizeof(*id));
+        *code = (uint8_t)buffer[frameHeaderSize - 1];
+        *body = buffer.substr(frameHeaderSize, length - (frameHeaderSize - sizeof(length)));
+        *size = sizeof(length) + length;
+        return 1;
+    }
+}
+
+#endif
@@ -0,0 +1,604 @@
+/**
+ * @file ftagmgrserver.cpp
+ * @brief FTagMgr server source code
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ftagmgrserver.h"
+#include "../lib/ftagmgrquery.h"
+
+namespace ftagmgr {
+    /**
+     * @brief A connected client
+     */
+    struct Server::Connection {
+        int fd;
+        // Received bytes not answered yet
+        std::string in;
+        // Replies, out[0..sent) have been sent
+        std::string out;
+        size_t sent = 0;
+        // epoll events it's registered for
+        uint32_t events = 0;
+        // Sent a write this turn, its replies wait for the commit
+        bool wrote = false;
+        // In replied this turn
+        bool queued = false;
+        // The client closed its end, it goes once its replies are out
+        bool hangup = false;
+        bool closed = false;
+    };
+
+    namespace {
+        // Bytes read from a client per recv()
+        const size_t readSize = 64 * 1024;
+        // Events taken per epoll_wait()
+        const int maxEvents = 64;
+        // epoll data of the listening socket and of the stop eventfd, clients have their fd
+        const uint64_t listenTag = UINT64_MAX;
+        const uint64_t wakeTag = UINT64_MAX - 1;
+
+        /**
+         * @brief Check if a client's received bytes start with a request to answer
+         * @param in The received bytes
+         * @retval true A complete or a malformed frame
+         * @retval false Nothing, or a frame still arriving
+         */
+        bool holdsRequest(std::string_view in) {
+            uint32_t id = 0;
+            uint8_t command = 0;
+            std::string_view args;
+            size_t size = 0;
+            return splitFrame(in, &id, &command, &args, &size) != 0;
+        }
+
+        /**
+         * @brief Check if a command changes the database
+         * @param command The command
+         * @retval true A write
+         * @retval false A read
+         */
+        bool isWrite(uint8_t command) {
+            return command == CMD_ADD_DIR || command == CMD_ADD_FILE || command == CMD_ADD_TAG || command == CMD_TAG_FILE || command == CMD_UNTAG_FILE;
+        }
+
+        /**
+         * @brief Read every ID a cursor returns
+         * @param cursor The cursor
+         * @param ids Pointer to the return vector
+         * @param errmsg SQLite3 error message char**
+         * @retval true IDs read
+         * @retval false An error has occurred
+         */
+        bool readIds(IdCursor& cursor, std::vector<unsigned int>* ids, char** errmsg) {
+            ids->clear();
+            int id = 0;
+            short step;
+            while ((step = cursor.next(&id, errmsg)) == 1) ids->push_back((unsigned int)id);
+            cursor.close();
+            return step == 0;
+        }
+    }
+
+    Server::Server() : dataVersion(nullptr), lastDataVersion(0), listenFd(-1), epollFd(-1), wakeFd(-1), writing(false), stopping(false) {}
+
+    Server::~Server() {
+        close();
+    }
+
+    /**
+     * @brief Open the database and listen on the socket
+     * @param dbPath Path to the database file, must have been created with createDatabase()
+     * @param socketPath Path of the socket, a stale socket file there is replaced
+     * @param options Settings
+     * @param errmsg SQLite3 error message char**
+     * @retval true Listening
+     * @retval false The database or the socket could not be opened
+     */
+    bool Server::open(const char* dbPath, const char* socketPath, const ServerOptions& options, char** errmsg) {
+        close();
+        this->options = options;
+        Tunables tunables = options.tunables;
+        tunables.readOnly = false;
+        if (!db.open(dbPath, tunables, errmsg)) return false;
+        if (options.metrics) {
+            metrics.reset(new Metrics());
+            db.setMetrics(metrics.get());
+        }
+        if (options.cacheBytes) {
+            cache.reset(new NameCache(options.cacheBytes));
+            db.setCache(cache.get());
+        }
+        if (sqlite3_prepare_v2(db.handle(), "PRAGMA data_version;", -1, &dataVersion, nullptr) != SQLITE_OK) {
+            if (errmsg) *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db.handle()));
+            close();
+            return false;
+        }
+        checkExternalChanges();
+        if (options.tagIndex) {
+            index.reset(new TagIndex());
+            if (!index->build(db, errmsg)) {
+                close();
+                return false;
+            }
+            db.addObserver(index.get());
+        }
+
+        auto fail = [&](const char* what) {
+            if (errmsg) *errmsg = sqlite3_mprintf("cannot %s %s: %s", what, socketPath, strerror(errno));
+            close();
+            return false;
+        };
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (std::strlen(socketPath) >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return fail("listen on");
+        }
+        std::strcpy(address.sun_path, socketPath);
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return fail("listen on");
+        if (bind(listenFd, (const sockaddr*)&address, sizeof(address)) != 0) {
+            if (errno != EADDRINUSE) return fail("listen on");
+            // Left behind by a server that didn't shut down, unless one still answers there
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool live = probe >= 0 && connect(probe, (const sockaddr*)&address, sizeof(address)) == 0;
+            if (probe >= 0) ::close(probe);
+            if (live) {
+                errno = EADDRINUSE;
+                return fail("listen on");
+            }
+            unlink(socketPath);
+            if (bind(listenFd, (const sockaddr*)&address, sizeof(address)) != 0) return fail("listen on");
+        }
+        this->socketPath = socketPath;
+        // The database is the user's own, so is the socket
+        if (chmod(socketPath, S_IRUSR | S_IWUSR) != 0 || listen(listenFd, SOMAXCONN) != 0) return fail("listen on");
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) return fail("set up the event loop for");
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = listenTag;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0) return fail("set up the event loop for");
+        event.data.u64 = wakeTag;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) != 0) return fail("set up the event loop for");
+        stopping = false;
+        return true;
+    }
+
+    /**
+     * @brief Serve clients until stop() is called
+     * @param errmsg SQLite3 error message char**
+     * @retval true Stopped
+     * @retval false The event loop failed
+     */
+    bool Server::run(char** errmsg) {
+        if (epollFd < 0) {
+            if (errmsg) *errmsg = sqlite3_mprintf("server is not open");
+            return false;
+        }
+        epoll_event events[maxEvents];
+        while (!stopping) {
+            int count = epoll_wait(epollFd, events, maxEvents, -1);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                if (errmsg) *errmsg = sqlite3_mprintf("epoll_wait failed: %s", strerror(errno));
+                return false;
+            }
+            checkExternalChanges();
+            for (int i = 0; i < count; i++) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == listenTag) {
+                    acceptClients();
+                    continue;
+                }
+                if (tag == wakeTag) {
+                    uint64_t value;
+                    while (read(wakeFd, &value, sizeof(value)) > 0) {}
+                    stopping = true;
+                    continue;
+                }
+                auto found = connections.find((int)tag);
+                if (found == connections.end()) continue;
+                Connection* connection = found->second.get();
+                if (connection->closed) continue;
+                if (events[i].events & EPOLLOUT) {
+                    sendReplies(connection);
+                    // Room again, answer what was held back
+                    if (!connection->closed && connection->out.size() - connection->sent < options.maxPendingReply) handleRequests(connection);
+                }
+                if (!connection->closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) readRequests(connection);
+            }
+            finishTurn();
+        }
+        return true;
+    }
+
+    /**
+     * @brief Make run() return, async-signal-safe so a signal handler may call it
+     */
+    void Server::stop() {
+        uint64_t one = 1;
+        if (wakeFd >= 0) {
+            ssize_t written = write(wakeFd, &one, sizeof(one));
+            (void)written;
+        }
+    }
+
+    /**
+     * @brief Disconnect every client, close the socket and the database
+     */
+    void Server::close() {
+        if (writing) db.rollback(nullptr);
+        writing = false;
+        for (auto& [fd, connection] : connections) ::close(fd);
+        connections.clear();
+        replied.clear();
+        closed.clear();
+        if (listenFd >= 0) ::close(listenFd);
+        if (epollFd >= 0) ::close(epollFd);
+        if (wakeFd >= 0) ::close(wakeFd);
+        listenFd = epollFd = wakeFd = -1;
+        if (!socketPath.empty()) unlink(socketPath.c_str());
+        socketPath.clear();
+        sqlite3_finalize(dataVersion);
+        dataVersion = nullptr;
+        if (index) db.removeObserver(index.get());
+        db.close();
+        index.reset();
+        cache.reset();
+        metrics.reset();
+    }
+
+    /**
+     * @brief Accept every pending client
+     */
+    void Server::acceptClients() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            std::unique_ptr<Connection> connection(new Connection());
+            connection->fd = fd;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = (uint64_t)fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                ::close(fd);
+                continue;
+            }
+            connection->events = EPOLLIN;
+            connections[fd] = std::move(connection);
+        }
+    }
+
+    /**
+     * @brief Read what a client sent and answer every complete request
+     * @param connection The client
+     */
+    void Server::readRequests(Connection* connection) {
+        // A client that doesn't read its replies isn't read from either
+        while (!connection->hangup && connection->out.size() - connection->sent < options.maxPendingReply) {
+            size_t used = connection->in.size();
+            connection->in.resize(used + readSize);
+            ssize_t bytes = recv(connection->fd, &connection->in[used], readSize, 0);
+            connection->in.resize(used + (bytes > 0 ? (size_t)bytes : 0));
+            if (bytes > 0) {
+                handleRequests(connection);
+                if (connection->closed) return;
+                continue;
+            }
+            if (bytes == 0) connection->hangup = true;
+            else if (errno == EINTR) continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                disconnect(connection);
+                return;
+            }
+            break;
+        }
+        if (!connection->queued) {
+            connection->queued = true;
+            replied.push_back(connection);
+        }
+    }
+
+    /**
+     * @brief Answer the complete requests received from a client, until its replies back up
+     * @param connection The client
+     */
+    void Server::handleRequests(Connection* connection) {
+        std::string_view buffer(connection->in);
+        size_t used = 0;
+        uint32_t id = 0;
+        uint8_t command = 0;
+        std::string_view args;
+        size_t size = 0;
+        while (connection->out.size() - connection->sent < options.maxPendingReply) {
+            short split = splitFrame(buffer.substr(used), &id, &command, &args, &size);
+            if (split < 0) {
+                // Not speaking the protocol, there's no telling where the next frame starts
+                disconnect(connection);
+                return;
+            }
+            if (split == 0) break;
+            handle(connection, id, command, args);
+            used += size;
+        }
+        connection->in.erase(0, used);
+        if (used && !connection->queued) {
+            connection->queued = true;
+            replied.push_back(connection);
+        }
+    }
+
+    /**
+     * @brief Answer one request
+     * @param connection The client, gets the reply
+     * @param id Request ID
+     * @param command The command
+     * @param args Its arguments
+     */
+    void Server::handle(Connection* connection, uint32_t id, uint8_t command, std::string_view args) {
+        char* errmsg = nullptr;
+        bool write = isWrite(command);
+        if (write && !writing) {
+            if (!db.begin(&errmsg)) {
+                FrameWriter out(&connection->out);
+                out.begin(id, STATUS_ERROR);
+                out.putString(errmsg ? errmsg : "cannot start a transaction");
+                out.end();
+                sqlite3_free(errmsg);
+                return;
+            }
+            writing = true;
+        }
+        // A savepoint per write, so a failing one takes nothing else down with it
+        bool savepoint = write && db.begin(&errmsg);
+        size_t start = connection->out.size();
+        FrameWriter out(&connection->out);
+        out.begin(id, STATUS_OK);
+        FrameReader reader(args);
+        bool ok = (!write || savepoint) && execute(&out, command, reader, &errmsg);
+        if (savepoint) {
+            if (ok) ok = db.commit(&errmsg);
+            if (!ok) db.rollback(nullptr);
+        }
+        if (!ok) {
+            connection->out.resize(start);
+            out.begin(id, STATUS_ERROR);
+            out.putString(errmsg ? errmsg : "malformed request");
+        }
+        out.end();
+        sqlite3_free(errmsg);
+        if (write) connection->wrote = true;
+    }
+
+    /**
+     * @brief Run a request, with its results written into the reply
+     * @param out Reply being written, after the header
+     * @param command The command
+     * @param args Its arguments
+     * @param errmsg SQLite3 error message char**
+     * @retval true Results written
+     * @retval false An error has occurred or the arguments are malformed
+     */
+    bool Server::execute(FrameWriter* out, uint8_t command, FrameReader& args, char** errmsg) {
+        std::string_view text;
+        uint32_t first = 0;
+        uint32_t second = 0;
+        std::string value;
+        std::vector<unsigned int> ids;
+        IdCursor cursor;
+        // Strings come without a terminator, the library takes C strings
+        auto getString = [&]() {
+            if (!args.getString(&text)) return false;
+            value.assign(text);
+            return true;
+        };
+        // Functions returning -1 for both errors and missing rows tell them apart by errmsg
+        auto putValue = [&](int result) {
+            if (*errmsg) return false;
+            out->putI32(result);
+            return true;
+        };
+        // Lookups by ID succeed with nothing written when the row is missing
+        auto putFound = [&](bool ok) {
+            if (!ok) return false;
+            bool found = !value.empty();
+            out->putI32(found ? 1 : 0);
+            if (found) out->putString(value);
+            return true;
+        };
+        switch (command) {
+        case CMD_PING:
+            out->putI32(1);
+            return true;
+        case CMD_DIR_EXISTS:
+            return getString() && putValue(db.dirExists(value.c_str(), errmsg));
+        case CMD_ADD_DIR:
+            return getString() && putValue(db.addDir(value.c_str(), errmsg));
+        case CMD_GET_DIR:
+            return getString() && putValue(db.getDir(value.c_str(), errmsg));
+        case CMD_GET_DIR_PATH:
+            return args.getU32(&first) && putFound(db.getDirPath(first, &value, errmsg));
+        case CMD_FILE_EXISTS:
+            return args.getU32(&first) && getString() && putValue(db.fileExists(first, value.c_str(), errmsg));
+        case CMD_ADD_FILE:
+            return args.getU32(&first) && getString() && putValue(db.addFile(first, value.c_str(), errmsg));
+        case CMD_GET_FILE:
+            return args.getU32(&first) && getString() && putValue(db.getFile(first, value.c_str(), errmsg));
+        case CMD_GET_FILE_NAME:
+            return args.getU32(&first) && putFound(db.getFileName(first, &value, errmsg));
+        case CMD_GET_FILE_PATH:
+            return args.getU32(&first) && putFound(db.getFilePath(first, &value, errmsg));
+        case CMD_TAG_EXISTS:
+            return getString() && putValue(db.tagExists(value.c_str(), errmsg));
+        case CMD_ADD_TAG:
+            return getString() && putValue(db.addTag(value.c_str(), errmsg));
+        case CMD_GET_TAG:
+            return getString() && putValue(db.getTag(value.c_str(), errmsg));
+        case CMD_GET_TAG_VALUE:
+            return args.getU32(&first) && putFound(db.getTagValue(first, &value, errmsg));
+        case CMD_TAG_FILE:
+            return args.getU32(&first) && args.getU32(&second) && putValue(db.tagFile(first, second, errmsg));
+        case CMD_UNTAG_FILE:
+            return args.getU32(&first) && args.getU32(&second) && putValue(db.untagFile(first, second, errmsg));
+        case CMD_FILE_HAS_TAG:
+            return args.getU32(&first) && args.getU32(&second) && putValue(db.fileHasTag(first, second, errmsg));
+        case CMD_LIST_FILE_TAGS:
+        case CMD_LIST_TAG_FILES:
+            if (!args.getU32(&first)) return false;
+            if (!(command == CMD_LIST_FILE_TAGS ? db.listFileTags(first, &cursor, errmsg) : db.listTagFiles(first, &cursor, errmsg))) return false;
+            if (!readIds(cursor, &ids, errmsg)) return false;
+            out->putIds(ids);
+            return true;
+        case CMD_QUERY: {
+            if (!getString()) return false;
+            QueryResult result;
+            bool ok = index ? runQuery(db, *index, value.c_str(), &result, errmsg) : runQuery(db, value.c_str(), &result, errmsg);
+            if (!ok) return false;
+            int id = 0;
+            short step;
+            while ((step = result.next(&id, errmsg)) == 1) ids.push_back((unsigned int)id);
+            if (step < 0) return false;
+            out->putIds(ids);
+            return true;
+        }
+        case CMD_METRICS: {
+            if (!metrics) {
+                *errmsg = sqlite3_mprintf("metrics are off, start the server with them");
+                return false;
+            }
+            MetricsSnapshot snapshot;
+            metrics->snapshot(&snapshot);
+            formatPrometheus(snapshot, &value);
+            return putFound(true);
+        }
+        default:
+            *errmsg = sqlite3_mprintf("unknown command %d", (int)command);
+            return false;
+        }
+    }
+
+    /**
+     * @brief Send what's waiting for a client, and watch for room if it doesn't all fit
+     * @param connection The client
+     */
+    void Server::sendReplies(Connection* connection) {
+        while (connection->sent < connection->out.size()) {
+            ssize_t bytes = send(connection->fd, connection->out.data() + connection->sent, connection->out.size() - connection->sent, MSG_NOSIGNAL);
+            if (bytes > 0) {
+                connection->sent += (size_t)bytes;
+                continue;
+            }
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            disconnect(connection);
+            return;
+        }
+        if (connection->sent == connection->out.size()) {
+            connection->out.clear();
+            connection->sent = 0;
+            // Unless it still has requests held back
+            if (connection->hangup && !holdsRequest(connection->in)) {
+                disconnect(connection);
+                return;
+            }
+        }
+        watch(connection);
+    }
+
+    /**
+     * @brief Commit the loop turn's writes, send every reply and answer the requests held back by them
+     */
+    void Server::finishTurn() {
+        std::vector<Connection*> sending;
+        while (!replied.empty()) {
+            if (writing) {
+                writing = false;
+                if (!db.commit(nullptr)) {
+                    db.rollback(nullptr);
+                    // Their writes are lost but the replies say otherwise, only a broken connection tells the truth
+                    for (Connection* connection : replied) if (connection->wrote) disconnect(connection);
+                    // Changes were reported to the index as they were made
+                    if (index) index->build(db, nullptr);
+                }
+            }
+            sending.swap(replied);
+            for (Connection* connection : sending) {
+                connection->queued = false;
+                connection->wrote = false;
+                if (!connection->closed) sendReplies(connection);
+            }
+            // Requests held back while the replies backed up have room now, nothing else would wake them
+            for (Connection* connection : sending) {
+                if (!connection->closed && connection->out.empty() && holdsRequest(connection->in)) handleRequests(connection);
+            }
+            sending.clear();
+        }
+        for (int fd : closed) {
+            connections.erase(fd);
+            ::close(fd);
+        }
+        closed.clear();
+    }
+
+    /**
+     * @brief Rebuild the tag index if another process has changed the database
+     */
+    void Server::checkExternalChanges() {
+        if (!dataVersion) return;
+        // Only changes committed by other connections move the version
+        if (sqlite3_step(dataVersion) == SQLITE_ROW) {
+            int version = sqlite3_column_int(dataVersion, 0);
+            if (version != lastDataVersion && index) index->build(db, nullptr);
+            lastDataVersion = version;
+        }
+        sqlite3_reset(dataVersion);
+    }
+
+    /**
+     * @brief Set the epoll events of a client from its state
+     * @param connection The client
+     */
+    void Server::watch(Connection* connection) {
+        size_t pending = connection->out.size() - connection->sent;
+        uint32_t events = 0;
+        if (!connection->hangup && pending < options.maxPendingReply) events |= EPOLLIN;
+        if (pending > 0) events |= EPOLLOUT;
+        if (events == connection->events) return;
+        epoll_event event{};
+        event.events = events;
+        event.data.u64 = (uint64_t)connection->fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event) != 0) {
+            disconnect(connection);
+            return;
+        }
+        connection->events = events;
+    }
+
+    /**
+     * @brief Disconnect a client, freed at the end of the loop turn
+     * @param connection The client
+     */
+    void Server::disconnect(Connection* connection) {
+        if (connection->closed) return;
+        connection->closed = true;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+        closed.push_back(connection->fd);
+    }
+}
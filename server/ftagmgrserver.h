@@ -0,0 +1,177 @@
+/**
+ * @file ftagmgrserver.h
+ * @brief FTagMgr server header file
+ */
+
+#ifndef FTAGMGRSERVER_H
+#define FTAGMGRSERVER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sqlite3.h>
+#include "../lib/ftagmgrbitmap.h"
+#include "../lib/ftagmgrcache.h"
+#include "../lib/ftagmgrlib.h"
+#include "../lib/ftagmgrmetrics.h"
+#include "ftagmgrprotocol.h"
+
+namespace ftagmgr {
+    /**
+     * @brief Server settings
+     */
+    struct ServerOptions {
+        // Connection settings of the session
+        Tunables tunables;
+        // Name cache budget, 0 for no cache
+        size_t cacheBytes = 16 * 1024 * 1024;
+        // Answer queries from an in-memory tag index instead of SQLite
+        bool tagIndex = true;
+        // Count calls for CMD_METRICS, costs a little on every request
+        bool metrics = false;
+        // Stop reading from a client while this many reply bytes wait for it
+        size_t maxPendingReply = 4 * 1024 * 1024;
+    };
+
+    /**
+     * @brief Serves one database to local clients over a Unix domain socket
+     *
+     * A long-running process keeps the session, its statement and name
+     * caches and the tag index warm, so a client's request costs a round
+     * trip and a lookup instead of opening the database. One thread runs
+     * an epoll loop over every client. A client may pipeline requests:
+     * everything it sent is read and answered in one go, with one write
+     * for all the replies. Writes of all clients served in one loop turn
+     * share a transaction, every write in its own savepoint, and their
+     * replies leave only after it has committed. Changes other processes
+     * make to the database are picked up before the next request.
+     */
+    class Server {
+    public:
+        Server();
+        ~Server();
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+
+        /**
+         * @brief Open the database and listen on the socket
+         * @param dbPath Path to the database file, must have been created with createDatabase()
+         * @param socketPath Path of the socket, a stale socket file there is replaced
+         * @param options Settings
+         * @param errmsg SQLite3 error message char**
+         * @retval true Listening
+         * @retval false The database or the socket could not be opened
+         */
+        bool open(const char* dbPath, const char* socketPath, const ServerOptions& options, char** errmsg);
+
+        /**
+         * @brief Serve clients until stop() is called
+         * @param errmsg SQLite3 error message char**
+         * @retval true Stopped
+         * @retval false The event loop failed
+         */
+        bool run(char** errmsg);
+
+        /**
+         * @brief Make run() return, async-signal-safe so a signal handler may call it
+         */
+        void stop();
+
+        /**
+         * @brief Disconnect every client, close the socket and the database
+         */
+        void close();
+
+    private:
+        struct Connection;
+
+        /**
+         * @brief Accept every pending client
+         */
+        void acceptClients();
+
+        /**
+         * @brief Read what a client sent and answer every complete request
+         * @param connection The client
+         */
+        void readRequests(Connection* connection);
+
+        /**
+         * @brief Answer the complete requests received from a client, until its replies back up
+         * @param connection The client
+         */
+        void handleRequests(Connection* connection);
+
+        /**
+         * @brief Answer one request
+         * @param connection The client, gets the reply
+         * @param id Request ID
+         * @param command The command
+         * @param args Its arguments
+         */
+        void handle(Connection* connection, uint32_t id, uint8_t command, std::string_view args);
+
+        /**
+         * @brief Run a request, with its results written into the reply
+         * @param out Reply being written, after the header
+         * @param command The command
+         * @param args Its arguments
+         * @param errmsg SQLite3 error message char**
+         * @retval true Results written
+         * @retval false An error has occurred or the arguments are malformed
+         */
+        bool execute(FrameWriter* out, uint8_t command, FrameReader& args, char** errmsg);
+
+        /**
+         * @brief Send what's waiting for a client, and watch for room if it doesn't all fit
+         * @param connection The client
+         */
+        void sendReplies(Connection* connection);
+
+        /**
+         * @brief Commit the loop turn's writes, send every reply and answer the requests held back by them
+         */
+        void finishTurn();
+
+        /**
+         * @brief Rebuild the tag index if another process has changed the database
+         */
+        void checkExternalChanges();
+
+        /**
+         * @brief Set the epoll events of a client from its state
+         * @param connection The client
+         */
+        void watch(Connection* connection);
+
+        /**
+         * @brief Disconnect a client, freed at the end of the loop turn
+         * @param connection The client
+         */
+        void disconnect(Connection* connection);
+
+        ServerOptions options;
+        Database db;
+        std::unique_ptr<NameCache> cache;
+        std::unique_ptr<TagIndex> index;
+        std::unique_ptr<Metrics> metrics;
+        sqlite3_stmt* dataVersion;
+        int lastDataVersion;
+        std::string socketPath;
+        int listenFd;
+        int epollFd;
+        // Written by stop()
+        int wakeFd;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        // Clients with replies written this turn, and those disconnected this turn
+        std::vector<Connection*> replied;
+        std::vector<int> closed;
+        // Whether this turn's writes are in an open transaction
+        bool writing;
+        bool stopping;
+    };
+}
+
+#endif
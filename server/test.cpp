@@ -0,0 +1,202 @@
+/**
+ * @file test.cpp
+ * @brief FTagMgr server test utility source code
+ */
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sqlite3.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ftagmgrclient.h"
+#include "ftagmgrserver.h"
+
+/**
+ * @brief The main function
+ * @return int Exit code
+ */
+int main() {
+    // Setup
+    char* err = nullptr;
+    const char* socketPath = "./test.sock";
+    unlink("./test.db");
+    ftagmgr::setDatabasePath("./test.db");
+    if (!ftagmgr::createDatabase(&err)) {
+        std::cout << "Database creation failed." << std::endl << (err ? err : "") << std::endl;
+        sqlite3_free(err);
+        return 1;
+    }
+    ftagmgr::Server server;
+    ftagmgr::ServerOptions options;
+    options.metrics = true;
+    if (!server.open("./test.db", socketPath, options, &err)) {
+        std::cout << "Server start failed." << std::endl << (err ? err : "") << std::endl;
+        sqlite3_free(err);
+        return 1;
+    }
+    std::cout << "Server start OK." << std::endl;
+    std::thread loop([&server]() { server.run(nullptr); });
+
+    ftagmgr::Client client;
+    if (client.connect(socketPath, &err)) std::cout << "Client connection OK." << std::endl;
+    else {
+        std::cout << "Client connection failed." << std::endl << err << std::endl;
+        sqlite3_free(err);
+        err = nullptr;
+    }
+
+    // Lookups and additions
+    {
+        ftagmgr::Reply reply;
+        client.send(ftagmgr::CMD_PING);
+        bool ping = client.receive(&reply, nullptr) && reply.value() == 1;
+        bool added = client.call(ftagmgr::CMD_ADD_DIR, "/tmp/served", nullptr) == 1 && client.call(ftagmgr::CMD_ADD_DIR, "/tmp/served", nullptr) == 0;
+        int dir = client.call(ftagmgr::CMD_GET_DIR, "/tmp/served", nullptr);
+        bool missing = client.call(ftagmgr::CMD_GET_DIR, "/tmp/nowhere", nullptr) == -1;
+        added = added && client.call(ftagmgr::CMD_ADD_FILE, dir, "a.txt", nullptr) == 1;
+        int file = client.call(ftagmgr::CMD_GET_FILE, dir, "a.txt", nullptr);
+        added = added && client.call(ftagmgr::CMD_ADD_TAG, "served", nullptr) == 1;
+        int tag = client.call(ftagmgr::CMD_GET_TAG, "served", nullptr);
+        bool tagged = client.call(ftagmgr::CMD_TAG_FILE, file, tag, nullptr) == 1 && client.call(ftagmgr::CMD_FILE_HAS_TAG, file, tag, nullptr) == 1;
+        std::string path;
+        std::string name;
+        client.send(ftagmgr::CMD_GET_FILE_PATH, file);
+        bool found = client.receive(&reply, nullptr) && reply.text(&path);
+        client.send(ftagmgr::CMD_GET_TAG_VALUE, tag);
+        found = found && client.receive(&reply, nullptr) && reply.text(&name);
+        client.send(ftagmgr::CMD_GET_FILE_PATH, 9999);
+        bool absent = client.receive(&reply, nullptr) && reply.value() == 0 && !reply.text(&name);
+        std::vector<unsigned int> files;
+        bool queried = client.query("served", &files, nullptr) && files == std::vector<unsigned int>{(unsigned int)file};
+        client.send(ftagmgr::CMD_LIST_FILE_TAGS, file);
+        std::vector<unsigned int> tags;
+        bool listed = client.receive(&reply, nullptr) && reply.ids(&tags) && tags == std::vector<unsigned int>{(unsigned int)tag};
+        // The server's writes are in the database
+        ftagmgr::Database reader;
+        bool stored = reader.open("./test.db", nullptr) && reader.fileHasTag(file, tag, nullptr) == 1;
+        std::cout << "Served lookups ";
+        if (ping && added && dir > 0 && missing && file > 0 && tag > 0 && tagged && found && path == "/tmp/served/a.txt" && name == "served" && absent
+            && queried && listed && stored) {
+            std::cout << "OK." << std::endl;
+        } else std::cout << "failed." << std::endl;
+    }
+
+    // Pipelined requests come back in order
+    {
+        int dir = client.call(ftagmgr::CMD_GET_DIR, "/tmp/served", nullptr);
+        int tag = client.call(ftagmgr::CMD_GET_TAG, "served", nullptr);
+        const unsigned int count = 1000;
+        std::vector<uint32_t> ids;
+        for (unsigned int i = 0; i < count; i++) ids.push_back(client.send(ftagmgr::CMD_ADD_FILE, dir, "p" + std::to_string(i)));
+        bool ordered = true;
+        ftagmgr::Reply reply;
+        for (unsigned int i = 0; i < count; i++) ordered = ordered && client.receive(&reply, nullptr) && reply.id == ids[i] && reply.value() == 1;
+        for (unsigned int i = 0; i < count; i++) client.send(ftagmgr::CMD_GET_FILE, dir, "p" + std::to_string(i));
+        std::vector<int> files;
+        for (unsigned int i = 0; i < count; i++) {
+            if (client.receive(&reply, nullptr)) files.push_back(reply.value());
+        }
+        for (int file : files) client.send(ftagmgr::CMD_TAG_FILE, (unsigned int)file, (unsigned int)tag);
+        for (unsigned int i = 0; i < count; i++) ordered = ordered && client.receive(&reply, nullptr) && reply.value() == 1;
+        std::vector<unsigned int> tagged;
+        std::cout << "Pipelined requests ";
+        if (ordered && files.size() == count && client.query("served", &tagged, nullptr) && tagged.size() == count + 1) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl;
+    }
+
+    // Errors are replies, the connection carries on
+    {
+        ftagmgr::Reply reply;
+        client.send((ftagmgr::Command)200);
+        bool unknown = client.receive(&reply, nullptr) && reply.status == ftagmgr::STATUS_ERROR && !reply.error().empty();
+        // A string argument cut short
+        client.send(ftagmgr::CMD_GET_FILE, 1);
+        bool malformed = client.receive(&reply, nullptr) && reply.status == ftagmgr::STATUS_ERROR && reply.error() == "malformed request";
+        bool syntax = !client.query("(served", nullptr, &err) && err;
+        sqlite3_free(err);
+        err = nullptr;
+        // A failing write is rolled back alone, the rest of its turn commits
+        client.send(ftagmgr::CMD_ADD_TAG, "before");
+        client.send(ftagmgr::CMD_ADD_FILE, 1);
+        client.send(ftagmgr::CMD_ADD_TAG, "after");
+        bool isolated = client.receive(&reply, nullptr) && reply.value() == 1 && client.receive(&reply, nullptr) && reply.status == ftagmgr::STATUS_ERROR
+                        && client.receive(&reply, nullptr) && reply.value() == 1;
+        isolated = isolated && ftagmgr::tagExists("before", nullptr) == 1 && ftagmgr::tagExists("after", nullptr) == 1;
+        std::string text;
+        client.send(ftagmgr::CMD_METRICS);
+        bool metrics = client.receive(&reply, nullptr) && reply.text(&text) && text.find("ftagmgr_") != std::string::npos;
+        std::cout << "Error replies ";
+        if (unknown && malformed && syntax && isolated && metrics && client.call(ftagmgr::CMD_TAG_EXISTS, "after", nullptr) == 1) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl;
+    }
+
+    // A client that doesn't speak the protocol is dropped, others carry on
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, socketPath);
+        bool dropped = false;
+        if (fd >= 0 && connect(fd, (const sockaddr*)&address, sizeof(address)) == 0) {
+            uint32_t huge[3] = {0xFFFFFFFF, 1, 0};
+            ssize_t written = write(fd, huge, sizeof(huge));
+            char byte;
+            dropped = written == (ssize_t)sizeof(huge) && read(fd, &byte, 1) == 0;
+        }
+        if (fd >= 0) close(fd);
+        std::cout << "Malformed client ";
+        if (dropped && client.call(ftagmgr::CMD_TAG_EXISTS, "served", nullptr) == 1) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl;
+    }
+
+    // Changes made by other processes show in queries
+    {
+        ftagmgr::Database other;
+        bool ok = other.open("./test.db", nullptr);
+        int file = ok ? other.getFile(other.getDir("/tmp/served", nullptr), "p0", nullptr) : -1;
+        ok = ok && other.addTag("external", nullptr) && other.tagFile(file, other.getTag("external", nullptr), nullptr);
+        std::vector<unsigned int> files;
+        std::cout << "External changes ";
+        if (ok && client.query("external", &files, nullptr) && files == std::vector<unsigned int>{(unsigned int)file}) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl;
+    }
+
+    // Requests held back while replies back up are still answered
+    {
+        ftagmgr::Server slow;
+        ftagmgr::ServerOptions slowOptions;
+        slowOptions.maxPendingReply = 32;
+        bool ok = slow.open("./test.db", "./slow.sock", slowOptions, nullptr);
+        std::thread slowLoop([&slow]() { slow.run(nullptr); });
+        ftagmgr::Client pipelined;
+        ok = ok && pipelined.connect("./slow.sock", nullptr);
+        const unsigned int count = 100;
+        for (unsigned int i = 0; i < count && ok; i++) pipelined.send(ftagmgr::CMD_PING);
+        ok = ok && pipelined.flush(nullptr);
+        ftagmgr::Reply reply;
+        unsigned int answered = 0;
+        while (ok && answered < count && pipelined.receive(&reply, nullptr) && reply.value() == 1) answered++;
+        pipelined.close();
+        slow.stop();
+        slowLoop.join();
+        slow.close();
+        std::cout << "Reply backpressure ";
+        if (ok && answered == count) std::cout << "OK." << std::endl;
+        else std::cout << "failed." << std::endl;
+    }
+
+    // Cleanup
+    client.close();
+    server.stop();
+    loop.join();
+    server.close();
+    std::cout << "Server stop ";
+    if (access(socketPath, F_OK) != 0) std::cout << "OK." << std::endl;
+    else std::cout << "failed." << std::endl;
+    unlink("./test.db");
+    return 0;
+}